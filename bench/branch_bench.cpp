@@ -0,0 +1,172 @@
+// Branch bench: n continuations of one prompt. "independent" runs n plain sequences one
+// after the other (n prefills, n contiguous caches); "shared" prefills once, forks the KV
+// and decodes all branches as one batch; "beam" is beam search of the same width. Reports
+// wall time, generated tokens/s and peak KV held.
+// Runs on a synthetic checkpoint unless --model points at a real one.
+//
+//   ./build/gptoss_branch_bench --n 8 --prompt 512 --tokens 32
+//   ./build/gptoss_branch_bench --modes shared,beam --block-tokens 32 --json branch.json
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "branch_decoder.h"
+#include "kernels.h"
+#include "kv_cache.h"
+#include "model.h"
+#include "model_config.h"
+#include "synthetic.h"
+
+namespace {
+
+struct Options {
+    std::string model_path;
+    std::string config_path;
+    std::string json_path;
+    std::vector<std::string> modes{"independent", "shared", "beam"};
+    std::size_t n{8};
+    std::size_t prompt{256};
+    std::size_t tokens{32};
+    std::size_t block_tokens{16};
+    std::size_t prefill_chunk{512};
+};
+
+struct Result {
+    std::string mode;
+    double seconds{0.0};
+    std::size_t generated{0};
+    std::size_t peak_kv_bytes{0};
+};
+
+Result run_one(const GPTOSSModel& model, const std::string& mode, const std::vector<std::int32_t>& prompt,
+               const Options& options) {
+    const ModelConfig& c = model.config();
+    const std::size_t token_bytes = 2 * c.num_hidden_layers * c.num_key_value_heads * c.head_dim * sizeof(float);
+    Result r;
+    r.mode = mode;
+    const auto start = std::chrono::steady_clock::now();
+    if (mode == "independent") {
+        // greedy, so every sequence does the same work as a branch would
+        ForwardBuffers buf;
+        std::vector<float> logits(c.vocab_size);
+        for (std::size_t s = 0; s < options.n; ++s) {
+            KVCache cache(c.num_hidden_layers);
+            ChunkedPrefill chunked(model, prompt, cache, buf, options.prefill_chunk);
+            while (!chunked.step(logits)) {
+            }
+            for (std::size_t t = 0; t < options.tokens; ++t) {
+                const std::int32_t token = argmax(logits);
+                r.generated++;
+                if (t + 1 < options.tokens) model.forward(std::span<const std::int32_t>(&token, 1), logits, cache, buf);
+            }
+        }
+        // they run one at a time; held all at once (as a server would) they'd need n of these
+        r.peak_kv_bytes = options.n * (prompt.size() + options.tokens - 1) * token_bytes;
+    } else if (mode == "shared" || mode == "beam") {
+        BranchDecoder decoder(model, options.block_tokens, options.prefill_chunk);
+        const std::vector<Completion> out =
+            mode == "shared" ? decoder.sample(prompt, options.n, options.tokens, {.temperature = 1.0f, .seed = 1})
+                             : decoder.beam_search(prompt, options.n, options.tokens);
+        for (const Completion& completion : out) r.generated += completion.tokens.size();
+        r.peak_kv_bytes = decoder.stats().peak_blocks * (decoder.pool().block_tokens() * token_bytes);
+    } else {
+        throw std::runtime_error("unknown mode " + mode + " (independent, shared, beam)");
+    }
+    r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return r;
+}
+
+void write_json(const std::string& path, const Options& options, const std::vector<Result>& results) {
+    std::ofstream out(path);
+    if (!out) throw std::runtime_error("failed to open " + path);
+    out << std::setprecision(6) << "{\n  \"model\": \"" << options.model_path << "\",\n  \"n\": " << options.n
+        << ",\n  \"prompt\": " << options.prompt << ",\n  \"tokens\": " << options.tokens << ",\n  \"results\": [\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        out << "    {\"mode\": \"" << r.mode << "\", \"seconds\": " << r.seconds << ", \"generated\": " << r.generated
+            << ", \"tokens_per_s\": " << r.generated / r.seconds << ", \"peak_kv_bytes\": " << r.peak_kv_bytes << "}"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+std::vector<std::string> parse_names(const std::string& s) {
+    std::vector<std::string> out;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) out.push_back(item);
+    }
+    if (out.empty()) throw std::runtime_error("empty list: " + s);
+    return out;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "usage: gptoss_branch_bench [--model path] [--config path]"
+                         " [--modes independent,shared,beam] [--n n] [--prompt n] [--tokens n]"
+                         " [--block-tokens n] [--prefill-chunk n] [--json out.json]\n";
+            return 2;
+        }
+        const std::string value = argv[++i];
+        if (arg == "--model") {
+            options.model_path = value;
+        } else if (arg == "--config") {
+            options.config_path = value;
+        } else if (arg == "--modes") {
+            options.modes = parse_names(value);
+        } else if (arg == "--n") {
+            options.n = std::max<std::size_t>(std::stoul(value), 1);
+        } else if (arg == "--prompt") {
+            options.prompt = std::max<std::size_t>(std::stoul(value), 1);
+        } else if (arg == "--tokens") {
+            options.tokens = std::max<std::size_t>(std::stoul(value), 1);
+        } else if (arg == "--block-tokens") {
+            options.block_tokens = std::stoul(value);
+        } else if (arg == "--prefill-chunk") {
+            options.prefill_chunk = std::stoul(value);
+        } else if (arg == "--json") {
+            options.json_path = value;
+        } else {
+            std::cerr << "unknown flag " << arg << "\n";
+            return 2;
+        }
+    }
+
+    try {
+        const auto loaded =
+            open_model_or_synthetic(options.model_path, options.config_path, "gptoss_branch_bench_model");
+        const GPTOSSModel& model = loaded.model();
+        const ModelConfig& config = loaded.config();
+        const std::vector<std::int32_t> prompt = synthetic_tokens(options.prompt, config.vocab_size);
+        std::cout << (loaded.synthetic() ? "synthetic model " : "model ") << loaded.path() << ": n="
+                  << options.n << ", prompt " << options.prompt << ", " << options.tokens << " new tokens each\n";
+        std::cout << "mode            seconds    tok/s   peak_kv_mb\n";
+
+        std::vector<Result> results;
+        for (const std::string& mode : options.modes) {
+            const Result r = run_one(model, mode, prompt, options);
+            std::cout << std::left << std::setw(14) << r.mode << std::right << std::fixed << std::setprecision(3)
+                      << std::setw(9) << r.seconds << std::setprecision(1) << std::setw(9) << r.generated / r.seconds
+                      << std::setprecision(2) << std::setw(13) << r.peak_kv_bytes / 1048576.0 << std::endl;
+            results.push_back(r);
+        }
+        if (!options.json_path.empty()) write_json(options.json_path, options, results);
+    } catch (const std::exception& e) {
+        std::cerr << "branch bench failed: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
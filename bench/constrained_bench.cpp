@@ -0,0 +1,302 @@
+// Constrained decoding bench. For a few grammars (a tool-call schema, open JSON, a regex):
+// compile time, automaton states, the cost of building every state's token mask and how
+// many distinct masks that leaves. Then a greedy decode under the tool-call schema, split
+// into time spent in the model and time spent masking + advancing the constraint.
+// Uses a synthetic checkpoint with a full-size vocabulary (and made-up token strings unless
+// --tokenizer points at the real one) so the masks are as wide as gpt-oss's.
+//
+//   ./build/gptoss_constrained_bench
+//   ./build/gptoss_constrained_bench --tokenizer gpt-oss-20b-model/o200k_base.tiktoken --steps 64
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "constrained.h"
+#include "kernels.h"
+#include "kv_cache.h"
+#include "model.h"
+#include "model_config.h"
+#include "synthetic.h"
+#include "tokenizer.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string model_path;
+    std::string config_path;
+    std::string tokenizer_path;
+    std::string json_path;
+    std::string schema_path;
+    std::size_t vocab{201088};
+    std::size_t steps{48};
+    std::size_t apply_iters{2000};
+};
+
+struct GrammarResult {
+    std::string name;
+    std::size_t states{0};
+    std::size_t distinct{0};
+    double compile_ms{0.0};
+    double masks_ms{0.0};
+    double mask_mb{0.0};
+};
+
+struct DecodeResult {
+    std::size_t steps{0};
+    double model_ms{0.0};            // per step
+    double constraint_us{0.0};       // per step: mask lookup + apply + accept, masks precomputed
+    double constraint_cold_us{0.0};  // same with masks built on first use
+    double apply_us{0.0};            // apply_token_mask alone
+    bool complete{false};
+};
+
+double ms_since(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+const char* kToolCallSchema = R"({
+  "type": "object",
+  "properties": {
+    "name": {"enum": ["get_weather", "search", "send_email"]},
+    "arguments": {
+      "type": "object",
+      "properties": {
+        "location": {"type": "string", "maxLength": 24},
+        "unit": {"enum": ["celsius", "fahrenheit"]},
+        "days": {"type": "integer"},
+        "detailed": {"type": "boolean"}
+      },
+      "required": ["location"]
+    }
+  },
+  "required": ["name", "arguments"]
+})";
+
+// BPE-ish strings: the 256 bytes, then words, with and without a leading space, and
+// punctuation runs, the way o200k looks
+std::vector<std::string> synthetic_vocab(std::size_t count) {
+    std::vector<std::string> tokens;
+    for (int b = 0; b < 256; ++b) tokens.emplace_back(1, static_cast<char>(b));
+    std::mt19937 rng(11);
+    const std::string letters = "etaoinshrdlcumwfgypbvkjxqz";
+    const std::string punct = "{}[]\":,.-_()'!?;/\\";
+    while (tokens.size() < count) {
+        std::string t;
+        const unsigned kind = rng() % 10;
+        if (kind < 6) {
+            if (rng() % 2) t += ' ';
+            const std::size_t len = 2 + rng() % 8;
+            for (std::size_t i = 0; i < len; ++i) t += letters[std::min<std::size_t>(rng() % 26, rng() % 26)];
+            if (rng() % 5 == 0) t[t[0] == ' ' ? 1 : 0] -= 32;
+        } else if (kind < 8) {
+            const std::size_t len = 1 + rng() % 3;
+            for (std::size_t i = 0; i < len; ++i) t += punct[rng() % punct.size()];
+        } else {
+            const std::size_t len = 1 + rng() % 3;
+            for (std::size_t i = 0; i < len; ++i) t += static_cast<char>('0' + rng() % 10);
+        }
+        tokens.push_back(std::move(t));
+    }
+    return tokens;
+}
+
+GrammarResult run_grammar(const std::string& name, const std::string& regex,
+                          const std::shared_ptr<const TokenTrie>& trie, std::size_t vocab, std::int32_t end) {
+    GrammarResult r;
+    r.name = name;
+    auto start = Clock::now();
+    ByteAutomaton automaton = ByteAutomaton::from_regex(regex);
+    r.compile_ms = ms_since(start);
+    r.states = automaton.num_states();
+    TokenMasks masks(std::move(automaton), trie, vocab, {end});
+    start = Clock::now();
+    masks.precompute();
+    r.masks_ms = ms_since(start);
+    r.distinct = masks.distinct_masks();
+    r.mask_mb = masks.bytes() / 1048576.0;
+    return r;
+}
+
+DecodeResult decode_once(const GPTOSSModel& model, TokenMasks& masks, std::int32_t end, const Options& options) {
+    const std::size_t vocab = model.config().vocab_size;
+    TokenConstraint constraint(masks);
+    KVCache cache(model.config().num_hidden_layers);
+    ForwardBuffers buf;
+    std::vector<float> logits(vocab);
+    const std::vector<std::int32_t> prompt{1, 2, 3, 4, 5, 6, 7, 8};
+    model.forward(prompt, logits, cache, buf);
+
+    DecodeResult r;
+    double model_ms = 0.0, constraint_ms = 0.0;
+    for (std::size_t step = 0; step < options.steps && !constraint.done(); ++step) {
+        // argmax is sampling's cost either way, only the constraint's own work is timed
+        auto start = Clock::now();
+        constraint.apply(logits);
+        constraint_ms += ms_since(start);
+        const std::int32_t token = argmax(logits);
+        start = Clock::now();
+        constraint.accept(token);
+        constraint_ms += ms_since(start);
+        ++r.steps;
+        if (token == end) break;
+        start = Clock::now();
+        model.forward(std::span<const std::int32_t>(&token, 1), logits, cache, buf);
+        model_ms += ms_since(start);
+    }
+    r.complete = constraint.complete();
+    r.model_ms = model_ms / static_cast<double>(std::max<std::size_t>(r.steps - (r.complete ? 1 : 0), 1));
+    r.constraint_us = 1000.0 * constraint_ms / static_cast<double>(std::max<std::size_t>(r.steps, 1));
+
+    const auto mask = masks.mask(constraint.state());
+    const auto start = Clock::now();
+    for (std::size_t i = 0; i < options.apply_iters; ++i) apply_token_mask(logits, mask);
+    r.apply_us = 1000.0 * ms_since(start) / static_cast<double>(options.apply_iters);
+    return r;
+}
+
+// the same (deterministic) decode twice: masks built as states are reached, then with
+// every mask built up front as a server would when a schema is registered
+DecodeResult run_decode(const GPTOSSModel& model, const std::string& regex,
+                        const std::shared_ptr<const TokenTrie>& trie, std::int32_t end, const Options& options) {
+    const std::size_t vocab = model.config().vocab_size;
+    TokenMasks cold(ByteAutomaton::from_regex(regex), trie, vocab, {end});
+    const double cold_us = decode_once(model, cold, end, options).constraint_us;
+    TokenMasks warm(ByteAutomaton::from_regex(regex), trie, vocab, {end});
+    warm.precompute();
+    DecodeResult r = decode_once(model, warm, end, options);
+    r.constraint_cold_us = cold_us;
+    return r;
+}
+
+void write_json(const std::string& path, const Options& options, const std::vector<GrammarResult>& grammars,
+                const DecodeResult& d) {
+    std::ofstream out(path);
+    if (!out) throw std::runtime_error("failed to open " + path);
+    out << std::setprecision(6) << "{\n  \"vocab\": " << options.vocab << ",\n  \"grammars\": [\n";
+    for (std::size_t i = 0; i < grammars.size(); ++i) {
+        const GrammarResult& g = grammars[i];
+        out << "    {\"name\": \"" << g.name << "\", \"states\": " << g.states << ", \"distinct_masks\": " << g.distinct
+            << ", \"compile_ms\": " << g.compile_ms << ", \"masks_ms\": " << g.masks_ms << ", \"mask_mb\": "
+            << g.mask_mb << "}" << (i + 1 < grammars.size() ? ",\n" : "\n");
+    }
+    out << "  ],\n  \"decode\": {\"steps\": " << d.steps << ", \"model_ms\": " << d.model_ms
+        << ", \"constraint_us\": " << d.constraint_us << ", \"constraint_cold_us\": " << d.constraint_cold_us
+        << ", \"apply_us\": " << d.apply_us
+        << ", \"complete\": " << (d.complete ? "true" : "false") << "}\n}\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "usage: gptoss_constrained_bench [--model path] [--config path] [--tokenizer path]"
+                         " [--schema file.json] [--vocab n] [--steps n] [--apply-iters n] [--json out.json]\n";
+            return 2;
+        }
+        const std::string value = argv[++i];
+        if (arg == "--model") {
+            options.model_path = value;
+        } else if (arg == "--config") {
+            options.config_path = value;
+        } else if (arg == "--tokenizer") {
+            options.tokenizer_path = value;
+        } else if (arg == "--schema") {
+            options.schema_path = value;
+        } else if (arg == "--vocab") {
+            options.vocab = std::max<std::size_t>(std::stoul(value), 512);
+        } else if (arg == "--steps") {
+            options.steps = std::stoul(value);
+        } else if (arg == "--apply-iters") {
+            options.apply_iters = std::max<std::size_t>(std::stoul(value), 1);
+        } else if (arg == "--json") {
+            options.json_path = value;
+        } else {
+            std::cerr << "unknown flag " << arg << "\n";
+            return 2;
+        }
+    }
+
+    try {
+        ModelConfig shape = synthetic_config();
+        shape.vocab_size = options.vocab;
+        const auto loaded =
+            open_model_or_synthetic(options.model_path, options.config_path, "gptoss_constrained_bench_model", shape);
+        const GPTOSSModel& model = loaded.model();
+        const ModelConfig& config = loaded.config();
+        options.vocab = config.vocab_size;
+
+        // the model's last id stands in for EOS / <|return|>
+        const std::int32_t end = static_cast<std::int32_t>(options.vocab - 1);
+        std::vector<std::string> owned;
+        std::vector<std::string_view> pieces;
+        std::unique_ptr<Tokenizer> tokenizer;
+        if (!options.tokenizer_path.empty()) {
+            tokenizer = std::make_unique<Tokenizer>(options.tokenizer_path);
+            pieces = tokenizer->ordinary_tokens();
+        } else {
+            // leave the top ~1k ids without bytes, like the specials
+            owned = synthetic_vocab(options.vocab - std::min<std::size_t>(1090, options.vocab / 4));
+            pieces.assign(owned.begin(), owned.end());
+        }
+        if (pieces.size() > options.vocab - 1) pieces.resize(options.vocab - 1);
+        auto start = Clock::now();
+        const auto trie = std::make_shared<const TokenTrie>(pieces);
+        const double trie_ms = ms_since(start);
+
+        std::string schema = kToolCallSchema;
+        if (!options.schema_path.empty()) {
+            std::ifstream in(options.schema_path);
+            if (!in) throw std::runtime_error("failed to open " + options.schema_path);
+            schema.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+        const std::string tool_call = json_schema_to_regex(schema);
+
+        std::cout << (loaded.synthetic() ? "synthetic model " : "model ") << loaded.path() << ", vocab "
+                  << options.vocab << " (" << pieces.size() << " with bytes"
+                  << (tokenizer ? "" : ", made up") << "), trie " << trie->num_nodes() << " nodes built in "
+                  << std::fixed << std::setprecision(1) << trie_ms << " ms\n";
+        std::cout << "grammar       states  distinct  compile_ms  masks_ms  per_state_ms  mask_mb\n";
+        std::vector<GrammarResult> grammars;
+        const std::pair<const char*, std::string> cases[] = {
+            {"tool_call", tool_call},
+            {"any_json", json_schema_to_regex("{}", {.max_depth = 2})},
+            {"regex", R"((\d{4}-\d{2}-\d{2}|[A-Z][a-z]+( [A-Z][a-z]+)*))"},
+        };
+        for (const auto& [name, regex] : cases) {
+            const GrammarResult g = run_grammar(name, regex, trie, options.vocab, end);
+            std::cout << std::left << std::setw(12) << g.name << std::right << std::setw(8) << g.states
+                      << std::setw(10) << g.distinct << std::setprecision(2) << std::setw(12) << g.compile_ms
+                      << std::setw(10) << g.masks_ms << std::setprecision(3) << std::setw(14)
+                      << g.masks_ms / static_cast<double>(g.states) << std::setprecision(1) << std::setw(9)
+                      << g.mask_mb << std::endl;
+            grammars.push_back(g);
+        }
+
+        const DecodeResult d = run_decode(model, tool_call, trie, end, options);
+        std::cout << "decode under tool_call: " << d.steps << " steps" << (d.complete ? " (complete)" : "")
+                  << ", model " << std::setprecision(2) << d.model_ms << " ms/step\n  constraint "
+                  << std::setprecision(1) << d.constraint_us << " us/step = " << std::setprecision(2)
+                  << 100.0 * d.constraint_us / (1000.0 * d.model_ms) << "% (masks precomputed), "
+                  << std::setprecision(1) << d.constraint_cold_us << " us/step = " << std::setprecision(2)
+                  << 100.0 * d.constraint_cold_us / (1000.0 * d.model_ms) << "% (built on first use)\n"
+                  << "  apply_token_mask alone " << d.apply_us << " us" << std::endl;
+        if (!options.json_path.empty()) write_json(options.json_path, options, grammars, d);
+    } catch (const std::exception& e) {
+        std::cerr << "constrained bench failed: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,293 @@
+// End-to-end prefill/decode benchmark: TTFT, prefill and decode tok/s and per-token latency
+// percentiles across prompt lengths, batch sizes and thread counts. Runs on a synthetic
+// checkpoint generated into a temp dir unless --model points at a real (or gptoss-synth)
+// one; prompts are random token ids, so no tokenizer is needed.
+//
+//   ./build/gptoss_e2e_bench --prompt-lengths 32,256 --batch-sizes 1,4 --threads 1,8
+//   ./build/gptoss_e2e_bench --model gpt-oss-20b-model/original --decode-tokens 16 --json e2e.json
+
+#include <omp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "checkpoint.h"
+#include "expert_parallel.h"
+#include "kernels.h"
+#include "kv_cache.h"
+#include "kv_handoff.h"
+#include "model.h"
+#include "model_config.h"
+#include "prefill_workers.h"
+#include "routing_stats.h"
+#include "synthetic.h"
+#include "trace.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+std::vector<std::size_t> parse_list(const std::string& s) {
+    std::vector<std::size_t> out;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) out.push_back(std::stoul(item));
+    }
+    if (out.empty()) throw std::runtime_error("empty list: " + s);
+    return out;
+}
+
+double percentile(std::vector<double> v, double p) {
+    if (v.empty()) return 0.0;
+    std::sort(v.begin(), v.end());
+    const std::size_t idx = std::min(v.size() - 1, static_cast<std::size_t>(p * static_cast<double>(v.size())));
+    return v[idx];
+}
+
+struct Options {
+    std::string model_path;
+    std::string config_path;
+    std::string json_path;
+    // Chrome trace of every run (needs -DGPTOSS_TRACE=ON), summary goes to stderr
+    std::string trace_path;
+    // router telemetry over all runs
+    std::string routing_stats_path;
+    std::vector<std::size_t> prompt_lengths{32, 128};
+    std::vector<std::size_t> batch_sizes{1, 4};
+    std::vector<std::size_t> threads;
+    std::size_t decode_tokens{32};
+    std::size_t prefill_chunk{512};
+    ModelOptions model_options;
+    // experts in forked worker processes, 0 = in-process
+    ExpertParallelOptions expert_parallel{.num_workers = 0};
+    // prompts run in forked prefill processes and hand their KV over, 0 = in-process
+    PrefillWorkerOptions prefill_workers{.num_workers = 0};
+};
+
+struct RunResult {
+    std::size_t threads, prompt_len, batch;
+    // mean over the batch; sequences prefill one after another, so later ones wait longer
+    double ttft_s;
+    double prefill_tok_s;
+    double decode_tok_s;
+    double p50_ms, p90_ms, p99_ms;
+};
+
+RunResult run_one(const GPTOSSModel& model, PrefillWorkers* prefill_workers, std::size_t threads,
+                  std::size_t prompt_len, std::size_t batch, const Options& options) {
+    omp_set_num_threads(static_cast<int>(threads));
+    const ModelConfig& config = model.config();
+    std::mt19937 rng(static_cast<std::uint32_t>(prompt_len * 131 + batch));
+    std::uniform_int_distribution<std::int32_t> token(0, static_cast<std::int32_t>(config.vocab_size) - 1);
+
+    std::vector<std::vector<std::int32_t>> prompts(batch, std::vector<std::int32_t>(prompt_len));
+    for (auto& p : prompts) {
+        for (auto& t : p) t = token(rng);
+    }
+    std::vector<KVCache> caches(batch, KVCache(config.num_hidden_layers));
+    ForwardBuffers buf;
+    std::vector<float> logits(config.vocab_size);
+    std::vector<std::int32_t> next(batch);
+
+    RunResult r{threads, prompt_len, batch, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    const auto prefill_start = Clock::now();
+    if (prefill_workers) {
+        // Everything is queued up front. Rather than block on one prompt at a time, every
+        // handoff is polled so each layer is copied over as it lands, while the workers are
+        // still computing later layers and later prompts.
+        std::vector<std::unique_ptr<KVHandoff>> handoffs;
+        for (std::size_t s = 0; s < batch; ++s) {
+            handoffs.push_back(prefill_workers->submit(prompts[s]));
+            handoffs[s]->attach_reader(caches[s]);
+        }
+        std::vector<bool> done(batch, false);
+        for (std::size_t remaining = batch; remaining > 0;) {
+            bool progress = false;
+            for (std::size_t s = 0; s < batch; ++s) {
+                if (done[s]) continue;
+                progress |= handoffs[s]->poll(caches[s]) > 0;
+                if (!handoffs[s]->first_token_ready()) continue;
+                handoffs[s]->finish(caches[s]);
+                next[s] = handoffs[s]->wait_first_token();
+                r.ttft_s += seconds_since(prefill_start);
+                done[s] = true;
+                remaining--;
+                progress = true;
+            }
+            // don't take a core away from the workers just to spin
+            if (!progress) std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    } else {
+        for (std::size_t s = 0; s < batch; ++s) {
+            ChunkedPrefill prefill(model, prompts[s], caches[s], buf, options.prefill_chunk);
+            while (!prefill.step(logits)) {
+            }
+            next[s] = argmax(logits);
+            r.ttft_s += seconds_since(prefill_start);
+        }
+    }
+    const double prefill_s = seconds_since(prefill_start);
+    r.ttft_s /= static_cast<double>(batch);
+    r.prefill_tok_s = static_cast<double>(batch * prompt_len) / prefill_s;
+
+    // one decode step advances every sequence by a token
+    std::vector<double> latencies_ms;
+    latencies_ms.reserve(batch * options.decode_tokens);
+    const auto decode_start = Clock::now();
+    for (std::size_t step = 0; step < options.decode_tokens; ++step) {
+        for (std::size_t s = 0; s < batch; ++s) {
+            const auto t0 = Clock::now();
+            model.forward(std::span<const std::int32_t>(&next[s], 1), logits, caches[s], buf);
+            next[s] = argmax(logits);
+            latencies_ms.push_back(seconds_since(t0) * 1e3);
+        }
+    }
+    const double decode_s = seconds_since(decode_start);
+    r.decode_tok_s = options.decode_tokens ? static_cast<double>(batch * options.decode_tokens) / decode_s : 0.0;
+    r.p50_ms = percentile(latencies_ms, 0.50);
+    r.p90_ms = percentile(latencies_ms, 0.90);
+    r.p99_ms = percentile(latencies_ms, 0.99);
+    return r;
+}
+
+void write_json(const std::string& path, const std::string& model, const std::vector<RunResult>& results) {
+    std::ofstream out(path);
+    if (!out) throw std::runtime_error("failed to open " + path);
+    out << std::setprecision(6) << "{\n  \"model\": \"" << model << "\",\n  \"results\": [\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const RunResult& r = results[i];
+        out << "    {\"threads\": " << r.threads << ", \"prompt_len\": " << r.prompt_len << ", \"batch\": " << r.batch
+            << ", \"ttft_s\": " << r.ttft_s << ", \"prefill_tok_s\": " << r.prefill_tok_s
+            << ", \"decode_tok_s\": " << r.decode_tok_s << ", \"p50_ms\": " << r.p50_ms << ", \"p90_ms\": " << r.p90_ms
+            << ", \"p99_ms\": " << r.p99_ms << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--int8") {
+            options.model_options.int8_weights = true;
+            continue;
+        }
+        if (arg == "--int8-experts") {
+            options.model_options.int8_experts = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "usage: gptoss_e2e_bench [--model path] [--config path] [--prompt-lengths a,b]"
+                         " [--batch-sizes a,b] [--threads a,b] [--decode-tokens n] [--prefill-chunk n]"
+                         " [--int8] [--int8-experts] [--json out.json] [--trace out.json]"
+                         " [--routing-stats out.json] [--expert-workers n] [--expert-transport shm|socket]"
+                         " [--prefill-workers n]\n";
+            return 2;
+        }
+        const std::string value = argv[++i];
+        if (arg == "--model") {
+            options.model_path = value;
+        } else if (arg == "--config") {
+            options.config_path = value;
+        } else if (arg == "--prompt-lengths") {
+            options.prompt_lengths = parse_list(value);
+        } else if (arg == "--batch-sizes") {
+            options.batch_sizes = parse_list(value);
+        } else if (arg == "--threads") {
+            options.threads = parse_list(value);
+        } else if (arg == "--decode-tokens") {
+            options.decode_tokens = std::stoul(value);
+        } else if (arg == "--prefill-chunk") {
+            options.prefill_chunk = std::stoul(value);
+        } else if (arg == "--json") {
+            options.json_path = value;
+        } else if (arg == "--trace") {
+            options.trace_path = value;
+        } else if (arg == "--routing-stats") {
+            options.routing_stats_path = value;
+        } else if (arg == "--expert-workers") {
+            options.expert_parallel.num_workers = std::stoul(value);
+        } else if (arg == "--expert-transport") {
+            options.expert_parallel.transport = parse_transport_kind(value);
+        } else if (arg == "--prefill-workers") {
+            options.prefill_workers.num_workers = std::stoul(value);
+        } else {
+            std::cerr << "unknown flag " << arg << "\n";
+            return 2;
+        }
+    }
+    if (options.threads.empty()) options.threads = {static_cast<std::size_t>(omp_get_max_threads())};
+
+    try {
+        const auto loaded = open_model_or_synthetic(options.model_path, options.config_path, "gptoss_e2e_bench_model",
+                                                    synthetic_config(), options.model_options);
+        GPTOSSModel& model = loaded.model();
+        Checkpoint& checkpoint = loaded.checkpoint();
+        const ModelConfig& config = loaded.config();
+        std::unique_ptr<ExpertParallel> expert_workers;
+        if (options.expert_parallel.num_workers > 0) {
+            expert_workers = std::make_unique<ExpertParallel>(model, options.expert_parallel);
+            model.set_expert_backend(expert_workers.get());
+        }
+        std::unique_ptr<PrefillWorkers> prefill_workers;
+        if (options.prefill_workers.num_workers > 0) {
+            options.prefill_workers.prefill_chunk = options.prefill_chunk;
+            prefill_workers =
+                std::make_unique<PrefillWorkers>(checkpoint, config, options.model_options, options.prefill_workers);
+        }
+        std::cout << (loaded.synthetic() ? "synthetic model " : "model ") << loaded.path() << ": "
+                  << config.num_hidden_layers << " layers, " << config.num_experts << " experts, hidden "
+                  << config.hidden_size
+                  << (expert_workers ? ", experts on " + std::to_string(expert_workers->num_workers()) + " workers" : "")
+                  << (prefill_workers ? ", prefill on " + std::to_string(prefill_workers->num_workers()) + " workers"
+                                      : "")
+                  << "\n";
+        std::cout << "threads prompt batch    ttft_s  prefill_tok/s  decode_tok/s    p50_ms    p90_ms    p99_ms\n";
+
+        RoutingStats routing_stats(config.num_hidden_layers, config.num_experts, config.experts_per_token);
+        if (!options.routing_stats_path.empty()) model.set_routing_stats(&routing_stats);
+        std::vector<RunResult> results;
+        if (!options.trace_path.empty()) trace::start();
+        for (std::size_t threads : options.threads) {
+            for (std::size_t prompt_len : options.prompt_lengths) {
+                for (std::size_t batch : options.batch_sizes) {
+                    const RunResult r = run_one(model, prefill_workers.get(), threads, prompt_len, batch, options);
+                    std::cout << std::fixed << std::setw(7) << r.threads << std::setw(7) << r.prompt_len
+                              << std::setw(6) << r.batch << std::setprecision(4) << std::setw(10) << r.ttft_s
+                              << std::setprecision(1) << std::setw(15) << r.prefill_tok_s << std::setw(14)
+                              << r.decode_tok_s << std::setprecision(2) << std::setw(10) << r.p50_ms
+                              << std::setw(10) << r.p90_ms << std::setw(10) << r.p99_ms << std::endl;
+                    results.push_back(r);
+                }
+            }
+        }
+        if (!options.trace_path.empty()) {
+            trace::stop();
+            trace::write_chrome_json(options.trace_path);
+            trace::write_summary(std::cerr);
+        }
+        if (!options.routing_stats_path.empty()) routing_stats.write_json(options.routing_stats_path);
+        if (!options.json_path.empty()) write_json(options.json_path, loaded.path(), results);
+    } catch (const std::exception& e) {
+        std::cerr << "e2e bench failed: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,295 @@
+// Per-kernel microbenchmarks on random weights at the gpt-oss-20b shapes, no checkpoint
+// needed. Reports ns/call, GFLOP/s and effective GB/s next to a measured STREAM triad
+// bandwidth; --json writes the same numbers for comparing runs.
+//
+//   ./build/gptoss_bench [--json out.json] [--filter substr] [--min-time 0.25] [--vocab 201088]
+
+#include <omp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "kernels.h"
+#include "model_config.h"
+#include "quant.h"
+#include "synthetic.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+SyntheticRng rng;
+
+struct Result {
+    std::string name;
+    double ns_per_call{0.0};
+    double flops{0.0};
+    double bytes{0.0};
+    std::size_t calls{0};
+
+    double gflops() const { return flops / ns_per_call; }
+    double gbps() const { return bytes / ns_per_call; }
+};
+
+struct Options {
+    std::string json_path;
+    std::string filter;
+    double min_time{0.25};
+    std::size_t vocab{0};
+};
+
+// STREAM triad a = b + s*c over arrays far larger than the LLC, best of a few passes
+double stream_triad_gbps() {
+    const std::size_t n = std::size_t{1} << 25;
+    std::vector<float> a(n), b(n, 1.0f), c(n, 2.0f);
+#pragma omp parallel for schedule(static)
+    for (std::size_t i = 0; i < n; ++i) a[i] = 0.0f;
+    double best = 0.0;
+    for (int pass = 0; pass < 5; ++pass) {
+        const auto start = Clock::now();
+#pragma omp parallel for schedule(static)
+        for (std::size_t i = 0; i < n; ++i) a[i] = b[i] + 3.0f * c[i];
+        const double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        best = std::max(best, 3.0 * n * sizeof(float) / ns);
+    }
+    // keep the loop from being dropped
+    if (a[n / 2] != 7.0f) std::cerr << "stream: unexpected result\n";
+    return best;
+}
+
+class Runner {
+public:
+    explicit Runner(const Options& options) : options_(options) {}
+
+    // flops and bytes are per call; bytes counts every operand read or written once
+    void run(const std::string& name, double flops, double bytes, const std::function<void()>& fn) {
+        if (!options_.filter.empty() && name.find(options_.filter) == std::string::npos) return;
+        fn();  // warm caches, thread pool and thread_local scratch
+        std::size_t calls = 0;
+        const auto start = Clock::now();
+        double elapsed = 0.0;
+        while (elapsed < options_.min_time || calls < 3) {
+            fn();
+            calls++;
+            elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        }
+        Result r{name, elapsed * 1e9 / static_cast<double>(calls), flops, bytes, calls};
+        std::cout << std::left << std::setw(44) << r.name << std::right << std::fixed << std::setprecision(0)
+                  << std::setw(14) << r.ns_per_call << " ns" << std::setprecision(2) << std::setw(10)
+                  << r.gflops() << " GFLOP/s" << std::setw(10) << r.gbps() << " GB/s" << std::setw(8)
+                  << std::setprecision(0) << 100.0 * r.gbps() / stream_ << "%\n";
+        results_.push_back(std::move(r));
+    }
+
+    void set_stream(double gbps) { stream_ = gbps; }
+    double stream() const { return stream_; }
+    const std::vector<Result>& results() const { return results_; }
+
+private:
+    const Options& options_;
+    double stream_{1.0};
+    std::vector<Result> results_;
+};
+
+void bench_rmsnorm(Runner& r, const ModelConfig& c) {
+    const std::size_t hidden = c.hidden_size;
+    const auto scale = random_bf16(rng, hidden, 1.0f);
+    for (std::size_t tokens : {1, 128}) {
+        const auto x = random_floats(rng, tokens * hidden);
+        std::vector<float> out(tokens * hidden);
+        r.run("rmsnorm/tokens=" + std::to_string(tokens), 4.0 * tokens * hidden,
+              8.0 * tokens * hidden + 2.0 * hidden, [&] { rmsnorm(x, scale, 1e-5f, hidden, out); });
+    }
+}
+
+void bench_linear(Runner& r, const ModelConfig& c) {
+    const std::size_t q_dim = c.num_attention_heads * c.head_dim;
+    const std::size_t qkv_dim = q_dim + 2 * c.num_key_value_heads * c.head_dim;
+    struct Shape {
+        const char* name;
+        std::size_t in, out;
+    };
+    const Shape shapes[] = {{"qkv", c.hidden_size, qkv_dim}, {"attn_out", q_dim, c.hidden_size},
+                            {"gate", c.hidden_size, c.num_experts}};
+    for (const Shape& s : shapes) {
+        const auto w = random_bf16(rng, s.in * s.out, 0.05f);
+        const auto bias = random_bf16(rng, s.out, 0.05f);
+        const Int8Matrix w8 = quantize_int8_rows(w.data(), s.out, s.in);
+        for (std::size_t tokens : {1, 32}) {
+            const auto x = random_floats(rng, tokens * s.in);
+            std::vector<float> out(tokens * s.out);
+            const double flops = 2.0 * tokens * s.in * s.out;
+            const double io = 4.0 * tokens * (s.in + s.out) + 2.0 * s.out;
+            const std::string suffix = std::string("/") + s.name + "/tokens=" + std::to_string(tokens);
+            r.run("linear_bf16" + suffix, flops, 2.0 * s.in * s.out + io,
+                  [&] { linear_bf16(w.data(), bias.data(), s.in, s.out, x, out); });
+            r.run("linear_int8" + suffix, flops, 1.0 * s.in * s.out + io,
+                  [&] { linear_int8(w8, bias.data(), x, out); });
+        }
+    }
+}
+
+// one expert's mlp1 (hidden -> 2 * intermediate) and mlp2 (intermediate -> hidden)
+void bench_mxfp4(Runner& r, const ModelConfig& c) {
+    struct Shape {
+        const char* name;
+        std::size_t in, out;
+    };
+    const Shape shapes[] = {{"mlp1", c.hidden_size, 2 * c.intermediate_size},
+                            {"mlp2", c.intermediate_size, c.hidden_size}};
+    for (const Shape& s : shapes) {
+        const auto blocks = random_bytes(rng, s.out * s.in / 2);
+        const auto scales = random_bytes(rng, s.out * s.in / 32, 118, 126);
+        const auto x = random_floats(rng, s.in);
+        std::vector<float> out(s.out);
+        const double flops = 2.0 * s.in * s.out;
+        const double bytes = s.out * s.in / 2.0 + s.out * s.in / 32.0 + 4.0 * (s.in + s.out);
+        r.run(std::string("mxfp4_gemm/") + s.name, flops, bytes,
+              [&] { mxfp4_gemm(blocks.data(), scales.data(), s.out, s.in, x, out); });
+        r.run(std::string("mxfp4_gemm_int8/") + s.name, flops, bytes,
+              [&] { mxfp4_gemm_int8(blocks.data(), scales.data(), s.out, s.in, x, out); });
+    }
+}
+
+void bench_sdpa(Runner& r, const ModelConfig& c) {
+    const std::size_t heads = c.num_attention_heads, kv_heads = c.num_key_value_heads, d = c.head_dim;
+    const float sm_scale = 1.0f / std::sqrt(static_cast<float>(d));
+    const auto sinks = random_bf16(rng, heads, 1.0f);
+    const std::size_t max_ctx = 16384;
+    const auto k = random_floats(rng, max_ctx * kv_heads * d);
+    const auto v = random_floats(rng, max_ctx * kv_heads * d);
+    for (std::size_t window : {std::size_t{0}, c.sliding_window}) {
+        for (std::size_t ctx : {128, 1024, 4096, 16384}) {
+            // decode: one query against ctx cached positions
+            const auto q = random_floats(rng, heads * d);
+            std::vector<float> out(heads * d);
+            const std::size_t attended = window ? std::min(window, ctx) : ctx;
+            const double flops = 4.0 * heads * attended * d;
+            const double bytes = 8.0 * attended * kv_heads * d + 8.0 * heads * d;
+            r.run("sdpa_with_sinks/decode/ctx=" + std::to_string(ctx) + "/window=" + std::to_string(window), flops,
+                  bytes, [&] {
+                      sdpa_with_sinks(q, std::span<const float>(k.data(), ctx * kv_heads * d),
+                                      std::span<const float>(v.data(), ctx * kv_heads * d), sinks, 1, ctx, heads,
+                                      kv_heads, d, sm_scale, window, out);
+                  });
+        }
+    }
+    // prefill: 128 new queries on top of the cache
+    const std::size_t q_len = 128, ctx = 1024;
+    const auto q = random_floats(rng, q_len * heads * d);
+    std::vector<float> out(q_len * heads * d);
+    r.run("sdpa_with_sinks/prefill/q=128/ctx=1024", 4.0 * q_len * heads * ctx * d,
+          8.0 * ctx * kv_heads * d + 8.0 * q_len * heads * d, [&] {
+              sdpa_with_sinks(q, std::span<const float>(k.data(), ctx * kv_heads * d),
+                              std::span<const float>(v.data(), ctx * kv_heads * d), sinks, q_len, ctx, heads,
+                              kv_heads, d, sm_scale, 0, out);
+          });
+}
+
+void bench_rope(Runner& r, const ModelConfig& c) {
+    const std::size_t heads = c.num_attention_heads, kv_heads = c.num_key_value_heads, d = c.head_dim;
+    for (std::size_t tokens : {1, 128}) {
+        auto q = random_floats(rng, tokens * heads * d);
+        auto k = random_floats(rng, tokens * kv_heads * d);
+        const double values = static_cast<double>(tokens) * (heads + kv_heads) * d;
+        r.run("apply_rope/tokens=" + std::to_string(tokens), 3.0 * values, 8.0 * values, [&] {
+            apply_rope(q, k, tokens, heads, kv_heads, d, c.initial_context_length, c.rope_theta,
+                       c.rope_scaling_factor, c.rope_ntk_alpha, c.rope_ntk_beta, 1000);
+        });
+    }
+}
+
+void bench_unembedding(Runner& r, const ModelConfig& c, std::size_t vocab) {
+    const std::size_t hidden = c.hidden_size;
+    const auto w = random_bf16(rng, vocab * hidden, 0.05f);
+    const auto x = random_floats(rng, hidden);
+    std::vector<float> out(vocab);
+    const double flops = 2.0 * vocab * hidden;
+    r.run("unembedding_logits/vocab=" + std::to_string(vocab), flops, 2.0 * vocab * hidden + 4.0 * (vocab + hidden),
+          [&] { unembedding_logits(w.data(), vocab, hidden, x, out); });
+    const Int8Matrix w8 = quantize_int8_rows(w.data(), vocab, hidden);
+    r.run("unembedding_int8/vocab=" + std::to_string(vocab), flops, 1.0 * vocab * hidden + 4.0 * (vocab + hidden),
+          [&] { linear_int8(w8, nullptr, x, out); });
+}
+
+void bench_moe(Runner& r, const ModelConfig& c) {
+    const auto logits = random_floats(rng, c.num_experts, 4.0f);
+    std::vector<std::int32_t> idx(c.experts_per_token);
+    std::vector<float> weights(c.experts_per_token);
+    r.run("moe_topk_gating/experts=" + std::to_string(c.num_experts), 0.0,
+          4.0 * c.num_experts + 8.0 * c.experts_per_token,
+          [&] { moe_topk_gating(logits, c.num_experts, c.experts_per_token, idx, weights); });
+
+    const auto x = random_floats(rng, 2 * c.intermediate_size, 4.0f);
+    std::vector<float> out(c.intermediate_size);
+    r.run("swiglu/intermediate=" + std::to_string(c.intermediate_size), 6.0 * c.intermediate_size,
+          12.0 * c.intermediate_size, [&] { swiglu(x, 1.702f, c.swiglu_limit, out); });
+}
+
+void write_json(const std::string& path, const Runner& r, const ModelConfig& c) {
+    std::ofstream out(path);
+    if (!out) throw std::runtime_error("failed to open " + path);
+    out << std::setprecision(6);
+    out << "{\n  \"threads\": " << omp_get_max_threads() << ",\n  \"hidden_size\": " << c.hidden_size
+        << ",\n  \"stream_triad_gbps\": " << r.stream() << ",\n  \"results\": [\n";
+    for (std::size_t i = 0; i < r.results().size(); ++i) {
+        const Result& res = r.results()[i];
+        out << "    {\"name\": \"" << res.name << "\", \"ns_per_call\": " << res.ns_per_call
+            << ", \"gflops\": " << res.gflops() << ", \"gbps\": " << res.gbps()
+            << ", \"stream_fraction\": " << res.gbps() / r.stream() << ", \"calls\": " << res.calls << "}"
+            << (i + 1 < r.results().size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--json" && i + 1 < argc) {
+            options.json_path = argv[++i];
+        } else if (arg == "--filter" && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else if (arg == "--min-time" && i + 1 < argc) {
+            options.min_time = std::stod(argv[++i]);
+        } else if (arg == "--vocab" && i + 1 < argc) {
+            options.vocab = std::stoul(argv[++i]);
+        } else {
+            std::cerr << "usage: gptoss_bench [--json out.json] [--filter substr] [--min-time s] [--vocab n]\n";
+            return 2;
+        }
+    }
+
+    try {
+        const ModelConfig config = ModelConfig::gpt_oss_20b();
+        Runner runner(options);
+        runner.set_stream(stream_triad_gbps());
+        std::cout << "threads=" << omp_get_max_threads() << " stream triad " << std::fixed << std::setprecision(2)
+                  << runner.stream() << " GB/s (last column is GB/s as a fraction of it)\n";
+
+        bench_rmsnorm(runner, config);
+        bench_linear(runner, config);
+        bench_mxfp4(runner, config);
+        bench_sdpa(runner, config);
+        bench_rope(runner, config);
+        bench_moe(runner, config);
+        bench_unembedding(runner, config, options.vocab ? options.vocab : config.vocab_size);
+
+        if (!options.json_path.empty()) write_json(options.json_path, runner, config);
+    } catch (const std::exception& e) {
+        std::cerr << "bench failed: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,174 @@
+// Pipeline-parallel bench: splits the layers over 1..N processes and streams micro-batches
+// (one sequence's chunk each) through them, reporting throughput, the measured bubble
+// fraction next to the ideal (S - 1) / (M + S - 1), and each stage's resident set.
+// Runs on a synthetic checkpoint unless --model points at a real one.
+//
+//   ./build/gptoss_pipeline_bench --stages 1,2,4 --micro-batches 1,4,8 --tokens 32
+//   ./build/gptoss_pipeline_bench --model gpt-oss-120b-model/original --stages 4 --tokens 1
+
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "checkpoint.h"
+#include "model_config.h"
+#include "pipeline.h"
+#include "synthetic.h"
+
+namespace {
+
+std::vector<std::size_t> parse_list(const std::string& s) {
+    std::vector<std::size_t> out;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) out.push_back(std::stoul(item));
+    }
+    if (out.empty()) throw std::runtime_error("empty list: " + s);
+    return out;
+}
+
+struct Options {
+    std::string model_path;
+    std::string config_path;
+    std::string json_path;
+    std::vector<std::size_t> stages{1, 2, 4};
+    std::vector<std::size_t> micro_batches{1, 2, 4, 8};
+    // tokens per micro-batch: a prefill chunk, or 1 for decode
+    std::size_t tokens{32};
+    // forward() calls per configuration after a warmup one
+    std::size_t rounds{4};
+    // layers of the synthetic model
+    std::size_t layers{8};
+    PipelineOptions pipeline;
+};
+
+struct Result {
+    std::size_t stages, micro_batches;
+    double tok_s;
+    double bubble;
+    double ideal_bubble;
+    std::vector<std::size_t> rss;
+};
+
+Result run_one(Checkpoint& checkpoint, const ModelConfig& config, std::size_t stages, std::size_t micro_batches,
+               const Options& options) {
+    PipelineOptions pipeline_options = options.pipeline;
+    pipeline_options.num_stages = stages;
+    PipelineParallel pipeline(checkpoint, config, {}, pipeline_options);
+
+    std::vector<std::vector<std::int32_t>> tokens;
+    for (std::size_t m = 0; m < micro_batches; ++m) {
+        tokens.push_back(synthetic_tokens(options.tokens, config.vocab_size, m));
+    }
+    std::vector<std::vector<float>> logits(micro_batches, std::vector<float>(config.vocab_size));
+    std::vector<PipelineParallel::MicroBatch> batches;
+    for (std::size_t m = 0; m < micro_batches; ++m) {
+        batches.push_back({static_cast<std::uint32_t>(m), tokens[m], logits[m]});
+    }
+
+    pipeline.forward(batches);  // warmup: faults the stage weights in
+    pipeline.reset_stats();
+    for (std::size_t r = 0; r < options.rounds; ++r) pipeline.forward(batches);
+
+    const PipelineStats& stats = pipeline.stats();
+    Result result;
+    result.stages = stages;
+    result.micro_batches = micro_batches;
+    result.tok_s = static_cast<double>(options.rounds * micro_batches * options.tokens) /
+                   (static_cast<double>(stats.wall_ns) / 1e9);
+    result.bubble = stats.bubble_fraction();
+    result.ideal_bubble = static_cast<double>(stages - 1) / static_cast<double>(micro_batches + stages - 1);
+    result.rss = pipeline.stage_rss_bytes();
+    return result;
+}
+
+void write_json(const std::string& path, const std::string& model, const std::vector<Result>& results) {
+    std::ofstream out(path);
+    if (!out) throw std::runtime_error("failed to open " + path);
+    out << std::setprecision(6) << "{\n  \"model\": \"" << model << "\",\n  \"results\": [\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        out << "    {\"stages\": " << r.stages << ", \"micro_batches\": " << r.micro_batches
+            << ", \"tok_s\": " << r.tok_s << ", \"bubble\": " << r.bubble << ", \"ideal_bubble\": " << r.ideal_bubble
+            << ", \"rss_bytes\": [";
+        for (std::size_t s = 0; s < r.rss.size(); ++s) out << (s ? ", " : "") << r.rss[s];
+        out << "]}" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "usage: gptoss_pipeline_bench [--model path] [--config path] [--stages a,b]"
+                         " [--micro-batches a,b] [--tokens n] [--rounds n] [--layers n]"
+                         " [--transport shm|socket] [--threads-per-stage n] [--json out.json]\n";
+            return 2;
+        }
+        const std::string value = argv[++i];
+        if (arg == "--model") {
+            options.model_path = value;
+        } else if (arg == "--config") {
+            options.config_path = value;
+        } else if (arg == "--stages") {
+            options.stages = parse_list(value);
+        } else if (arg == "--micro-batches") {
+            options.micro_batches = parse_list(value);
+        } else if (arg == "--tokens") {
+            options.tokens = std::stoul(value);
+        } else if (arg == "--rounds") {
+            options.rounds = std::stoul(value);
+        } else if (arg == "--layers") {
+            options.layers = std::stoul(value);
+        } else if (arg == "--transport") {
+            options.pipeline.transport = parse_transport_kind(value);
+        } else if (arg == "--threads-per-stage") {
+            options.pipeline.threads_per_stage = std::stoul(value);
+        } else if (arg == "--json") {
+            options.json_path = value;
+        } else {
+            std::cerr << "unknown flag " << arg << "\n";
+            return 2;
+        }
+    }
+
+    try {
+        ModelConfig shape = synthetic_config();
+        shape.num_hidden_layers = options.layers;
+        const auto loaded =
+            open_model_or_synthetic(options.model_path, options.config_path, "gptoss_pipeline_bench_model", shape);
+        Checkpoint& checkpoint = loaded.checkpoint();
+        const ModelConfig& config = loaded.config();
+        std::cout << (loaded.synthetic() ? "synthetic model " : "model ") << loaded.path() << ": "
+                  << config.num_hidden_layers << " layers, " << options.tokens << " tokens per micro-batch\n";
+        // measured bubble on a box with fewer cores than stages is mostly time-slicing
+        std::cout << "stages micro   tok/s  bubble   ideal  rss_mb per stage\n";
+
+        std::vector<Result> results;
+        for (std::size_t stages : options.stages) {
+            for (std::size_t micro_batches : options.micro_batches) {
+                const Result r = run_one(checkpoint, config, stages, micro_batches, options);
+                std::cout << std::fixed << std::setw(6) << r.stages << std::setw(6) << r.micro_batches
+                          << std::setprecision(1) << std::setw(8) << r.tok_s << std::setprecision(3) << std::setw(8)
+                          << r.bubble << std::setw(8) << r.ideal_bubble << " ";
+                for (std::size_t rss : r.rss) std::cout << std::setprecision(1) << " " << rss / 1048576.0;
+                std::cout << std::endl;
+                results.push_back(r);
+            }
+        }
+        if (!options.json_path.empty()) write_json(options.json_path, loaded.path(), results);
+    } catch (const std::exception& e) {
+        std::cerr << "pipeline bench failed: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,229 @@
+// Scheduler bench: more sessions than the KV budget holds. A batch of long low-priority
+// sequences is queued up front and short high-priority ones arrive every few steps; the
+// scheduler has to preempt to keep the latter moving. Reports TTFT and per-token latency
+// for each class, preemptions, and peak resident KV against the budget, for every eviction
+// policy plus a run where everything has the same priority (no protection).
+// Runs on a synthetic checkpoint unless --model points at a real one.
+//
+//   ./build/gptoss_scheduler_bench --budget-tokens 440 --low 8 --high 16
+//   ./build/gptoss_scheduler_bench --policies swap,recompute --json sched.json
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "model.h"
+#include "model_config.h"
+#include "scheduler.h"
+#include "synthetic.h"
+
+namespace {
+
+struct Options {
+    std::string model_path;
+    std::string config_path;
+    std::string json_path;
+    std::vector<std::string> policies{"flat", "auto", "swap", "recompute"};
+    std::size_t budget_tokens{440};
+    std::size_t low{8};
+    std::size_t low_prompt{96};
+    std::size_t low_tokens{48};
+    std::size_t high{16};
+    std::size_t high_prompt{16};
+    std::size_t high_tokens{8};
+    // steps between high-priority arrivals
+    std::size_t arrival_every{12};
+    std::size_t max_running{8};
+    std::size_t prefill_chunk{64};
+    // 0 = no cap on tokens per step
+    std::size_t step_tokens{0};
+};
+
+struct ClassResult {
+    double ttft_ms{0.0};
+    double p50_ms{0.0}, p99_ms{0.0};
+};
+
+struct Result {
+    std::string policy;
+    ClassResult low, high;
+    SchedulerStats stats;
+    double seconds{0.0};
+};
+
+double percentile(std::vector<double> v, double q) {
+    if (v.empty()) return 0.0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, static_cast<std::size_t>(q * static_cast<double>(v.size())))];
+}
+
+ClassResult summarize(const Scheduler& scheduler, const std::vector<std::uint64_t>& ids) {
+    ClassResult r;
+    std::vector<double> gaps;
+    for (std::uint64_t id : ids) {
+        const Scheduler::Sequence& seq = scheduler.sequence(id);
+        if (seq.token_times.empty()) continue;
+        r.ttft_ms += std::chrono::duration<double, std::milli>(seq.token_times.front() - seq.arrival).count();
+        for (std::size_t i = 1; i < seq.token_times.size(); ++i) {
+            gaps.push_back(std::chrono::duration<double, std::milli>(seq.token_times[i] - seq.token_times[i - 1]).count());
+        }
+    }
+    if (!ids.empty()) r.ttft_ms /= static_cast<double>(ids.size());
+    r.p50_ms = percentile(gaps, 0.50);
+    r.p99_ms = percentile(gaps, 0.99);
+    return r;
+}
+
+Result run_one(const GPTOSSModel& model, const std::string& policy, std::size_t budget_bytes,
+               const Options& options) {
+    // "flat" gives everyone the same priority, so nothing protects the short sequences
+    const bool flat = policy == "flat";
+    Scheduler sched(model, {.kv_budget_bytes = budget_bytes,
+                            .max_running = options.max_running,
+                            .prefill_chunk = options.prefill_chunk,
+                            .max_step_tokens = options.step_tokens,
+                            .eviction = flat ? EvictionPolicy::Auto : parse_eviction_policy(policy)});
+
+    const std::size_t vocab = model.config().vocab_size;
+    std::vector<std::uint64_t> low_ids, high_ids;
+    for (std::size_t i = 0; i < options.low; ++i) {
+        low_ids.push_back(sched.submit({.prompt = synthetic_tokens(options.low_prompt, vocab, i),
+                                        .max_new_tokens = options.low_tokens}));
+    }
+    const auto start = Scheduler::Clock::now();
+    std::size_t step = 0;
+    while (true) {
+        if (high_ids.size() < options.high && (step + 1) % options.arrival_every == 0) {
+            high_ids.push_back(sched.submit({.prompt = synthetic_tokens(options.high_prompt, vocab, 1000 + step),
+                                             .max_new_tokens = options.high_tokens,
+                                             .priority = flat ? 0 : 1}));
+        }
+        const bool busy = sched.step();
+        ++step;
+        if (!busy && high_ids.size() >= options.high) break;
+    }
+
+    Result r;
+    r.policy = policy;
+    r.seconds = std::chrono::duration<double>(Scheduler::Clock::now() - start).count();
+    r.low = summarize(sched, low_ids);
+    r.high = summarize(sched, high_ids);
+    r.stats = sched.stats();
+    return r;
+}
+
+void write_json(const std::string& path, const Options& options, std::size_t budget_bytes,
+                const std::vector<Result>& results) {
+    std::ofstream out(path);
+    if (!out) throw std::runtime_error("failed to open " + path);
+    out << std::setprecision(6) << "{\n  \"model\": \"" << options.model_path << "\",\n  \"budget_bytes\": "
+        << budget_bytes << ",\n  \"results\": [\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        out << "    {\"policy\": \"" << r.policy << "\", \"seconds\": " << r.seconds
+            << ", \"high_ttft_ms\": " << r.high.ttft_ms << ", \"high_p50_ms\": " << r.high.p50_ms
+            << ", \"high_p99_ms\": " << r.high.p99_ms << ", \"low_ttft_ms\": " << r.low.ttft_ms
+            << ", \"low_p50_ms\": " << r.low.p50_ms << ", \"low_p99_ms\": " << r.low.p99_ms
+            << ", \"swap_outs\": " << r.stats.swap_outs << ", \"recomputes\": " << r.stats.recomputes
+            << ", \"swap_bytes\": " << r.stats.swap_bytes << ", \"peak_resident_bytes\": "
+            << r.stats.peak_resident_bytes << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+std::vector<std::string> parse_names(const std::string& s) {
+    std::vector<std::string> out;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) out.push_back(item);
+    }
+    if (out.empty()) throw std::runtime_error("empty list: " + s);
+    return out;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "usage: gptoss_scheduler_bench [--model path] [--config path]"
+                         " [--policies flat,auto,swap,recompute] [--budget-tokens n] [--low n] [--low-prompt n]"
+                         " [--low-tokens n] [--high n] [--high-prompt n] [--high-tokens n] [--arrival-every n]"
+                         " [--max-running n] [--prefill-chunk n] [--step-tokens n] [--json out.json]\n";
+            return 2;
+        }
+        const std::string value = argv[++i];
+        if (arg == "--model") {
+            options.model_path = value;
+        } else if (arg == "--config") {
+            options.config_path = value;
+        } else if (arg == "--policies") {
+            options.policies = parse_names(value);
+        } else if (arg == "--budget-tokens") {
+            options.budget_tokens = std::stoul(value);
+        } else if (arg == "--low") {
+            options.low = std::stoul(value);
+        } else if (arg == "--low-prompt") {
+            options.low_prompt = std::stoul(value);
+        } else if (arg == "--low-tokens") {
+            options.low_tokens = std::stoul(value);
+        } else if (arg == "--high") {
+            options.high = std::stoul(value);
+        } else if (arg == "--high-prompt") {
+            options.high_prompt = std::stoul(value);
+        } else if (arg == "--high-tokens") {
+            options.high_tokens = std::stoul(value);
+        } else if (arg == "--arrival-every") {
+            options.arrival_every = std::max<std::size_t>(std::stoul(value), 1);
+        } else if (arg == "--max-running") {
+            options.max_running = std::stoul(value);
+        } else if (arg == "--prefill-chunk") {
+            options.prefill_chunk = std::stoul(value);
+        } else if (arg == "--step-tokens") {
+            options.step_tokens = std::stoul(value);
+        } else if (arg == "--json") {
+            options.json_path = value;
+        } else {
+            std::cerr << "unknown flag " << arg << "\n";
+            return 2;
+        }
+    }
+
+    try {
+        const auto loaded =
+            open_model_or_synthetic(options.model_path, options.config_path, "gptoss_scheduler_bench_model");
+        const GPTOSSModel& model = loaded.model();
+        const std::size_t budget_bytes = Scheduler(model).kv_bytes(options.budget_tokens);
+        std::cout << (loaded.synthetic() ? "synthetic model " : "model ") << loaded.path() << ": "
+                  << options.low << " low x " << options.low_prompt << "+" << options.low_tokens << ", " << options.high
+                  << " high x " << options.high_prompt << "+" << options.high_tokens << ", budget "
+                  << options.budget_tokens << " tokens (" << std::fixed << std::setprecision(1)
+                  << budget_bytes / 1048576.0 << " MB)\n";
+        std::cout << "policy     high_ttft  high_p50  high_p99  low_ttft   low_p50   low_p99  swaps  recomp  peak_mb\n";
+
+        std::vector<Result> results;
+        for (const std::string& policy : options.policies) {
+            const Result r = run_one(model, policy, budget_bytes, options);
+            std::cout << std::left << std::setw(10) << r.policy << std::right << std::setprecision(2) << std::setw(10)
+                      << r.high.ttft_ms << std::setw(10) << r.high.p50_ms << std::setw(10) << r.high.p99_ms
+                      << std::setw(10) << r.low.ttft_ms << std::setw(10) << r.low.p50_ms << std::setw(10)
+                      << r.low.p99_ms << std::setw(7) << r.stats.swap_outs << std::setw(8) << r.stats.recomputes
+                      << std::setprecision(1) << std::setw(9) << r.stats.peak_resident_bytes / 1048576.0 << std::endl;
+            results.push_back(r);
+        }
+        if (!options.json_path.empty()) write_json(options.json_path, options, budget_bytes, results);
+    } catch (const std::exception& e) {
+        std::cerr << "scheduler bench failed: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
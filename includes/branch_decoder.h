@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "model.h"
+#include "paged_kv.h"
+
+struct SamplingOptions {
+    // 0 = greedy
+    float temperature{1.0f};
+    // only the k most likely tokens, 0 = all of them
+    std::size_t top_k{0};
+    std::uint64_t seed{0};
+};
+
+struct Completion {
+    // generated tokens only, the prompt isn't repeated
+    std::vector<std::int32_t> tokens;
+    // sum of the model's log-probabilities of tokens (at temperature 1)
+    double logprob{0.0};
+};
+
+struct BranchStats {
+    std::size_t prefill_tokens = 0;
+    std::size_t decode_steps = 0;   // forward_batch calls
+    std::size_t decode_rows = 0;    // sequences summed over those calls
+    std::size_t peak_blocks = 0;    // most KV blocks held at once
+};
+
+// Several continuations of one prompt. The prompt is prefilled once; every branch starts as
+// a fork of its KV, so the branches share the prompt's blocks and only ever own what they
+// generated themselves, and each step decodes all live branches as one batch.
+class BranchDecoder {
+public:
+    explicit BranchDecoder(const GPTOSSModel& model, std::size_t block_tokens = 16, std::size_t prefill_chunk = 512);
+
+    // n independent samples (n = 8 for an n=8 request)
+    std::vector<Completion> sample(std::span<const std::int32_t> prompt,
+                                   std::size_t n,
+                                   std::size_t max_new_tokens,
+                                   const SamplingOptions& options = {},
+                                   std::int32_t stop_token = -1);
+    // The beam_width highest scoring continuations, best first. Each step the survivors are
+    // forks of their parents, so pruning and reassigning beams never copies their KV.
+    std::vector<Completion> beam_search(std::span<const std::int32_t> prompt,
+                                        std::size_t beam_width,
+                                        std::size_t max_new_tokens,
+                                        std::int32_t stop_token = -1);
+
+    const KVBlockPool& pool() const { return pool_; }
+    const BranchStats& stats() const { return stats_; }
+
+private:
+    // the prompt's KV; logits_ gets the next-token row
+    PagedKVCache prefill(std::span<const std::int32_t> prompt);
+    void decode(std::span<const std::int32_t> tokens, std::span<PagedKVCache* const> caches);
+
+    const GPTOSSModel& model_;
+    KVBlockPool pool_;
+    std::size_t prefill_chunk_;
+    ForwardBuffers buf_;
+    std::vector<float> logits_;
+    BranchStats stats_;
+};
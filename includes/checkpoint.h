@@ -13,6 +13,68 @@ enum DType {
     U8
 };
 
+// Every tensor GPTOSSModel reads, addressed by (kind, layer) rather than by name. The
+// first kNumGlobalTensorKinds kinds are model-wide (layer -1), the rest exist per block.
+enum class TensorKind : std::uint32_t {
+    Embedding,
+    Norm,
+    Unembedding,
+    AttnNorm,
+    AttnQkvWeight,
+    AttnQkvBias,
+    AttnOutWeight,
+    AttnOutBias,
+    AttnSinks,
+    MlpNorm,
+    MlpGateWeight,
+    MlpGateBias,
+    Mlp1Blocks,
+    Mlp1Scales,
+    Mlp1Bias,
+    Mlp2Blocks,
+    Mlp2Scales,
+    Mlp2Bias,
+    Count,
+};
+
+constexpr std::size_t kNumGlobalTensorKinds = 3;
+constexpr std::size_t kNumLayerTensorKinds = static_cast<std::size_t>(TensorKind::Count) - kNumGlobalTensorKinds;
+
+// safetensors name of a tensor, e.g. "block.3.attn.qkv.weight"
+std::string tensor_name(TensorKind kind, int layer);
+
+// Packed model file (gptoss-pack): PackedHeader, then one PackedEntry per (kind, layer) slot
+// in directory order (globals, then layer-major), then tensor data. Offsets are absolute.
+// Tensors of at least kPackedHugeAlign bytes start on a 2 MB boundary so they can sit on
+// huge pages; the small ones (norms, biases, sinks) are only cache-line aligned.
+constexpr char kPackedMagic[8] = {'G', 'P', 'T', 'O', 'S', 'S', 'P', 'K'};
+constexpr std::uint32_t kPackedVersion = 1;
+constexpr std::uint64_t kPackedHugeAlign = 2ull << 20;
+constexpr std::uint64_t kPackedSmallAlign = 64;
+constexpr std::size_t kPackedMaxRank = 4;
+
+struct PackedHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t num_layers;
+    std::uint32_t num_entries;
+    std::uint32_t reserved;
+    std::uint64_t file_size;
+};
+
+struct PackedEntry {
+    std::uint32_t kind;
+    std::int32_t layer;
+    std::uint32_t dtype;
+    std::uint32_t rank;
+    std::uint64_t shape[kPackedMaxRank];
+    std::uint64_t offset;
+    std::uint64_t byte_size;
+};
+
+static_assert(sizeof(PackedHeader) == 32);
+static_assert(sizeof(PackedEntry) == 64);
+
 struct TensorMeta_ {
     std::string name;
     DType dtype;
@@ -20,13 +82,65 @@ struct TensorMeta_ {
     std::vector<std::uint64_t> offset;
     const std::byte* data{nullptr};
     std::size_t byte_size{0};
+    // which file of a sharded checkpoint the bytes live in
+    std::uint32_t shard{0};
 };
 
+struct ResidencyOptions {
+    // back the hot tensors with 1 GB pages instead of 2 MB ones
+    bool gigantic_pages{false};
+    // also fault in the expert weights, which stay in the file mapping
+    bool prefault_experts{true};
+    // print load progress to stderr
+    bool progress{true};
+};
+
+struct ResidencyReport {
+    std::size_t resident_bytes{0};
+    std::size_t prefaulted_bytes{0};
+    // true if the copy landed on reserved hugetlb pages, false if we fell back to THP
+    bool hugetlb{false};
+    double seconds{0.0};
+};
+
+// Model weights mmap'd from a safetensors file, a sharded safetensors checkpoint (a
+// directory, or its model.safetensors.index.json), or a packed file written by gptoss-pack
+// (detected by magic). Shards are parsed and mapped in parallel and merged into one
+// directory; tensor pointers go straight into each shard's mapping. Packed files carry a
+// fixed binary directory indexed by (layer, kind), so opening one does no parsing at all.
 class Checkpoint {
 public:
     explicit Checkpoint(const std::string& path);
     ~Checkpoint();
 
+    const std::string& path() const { return path_; }
+    std::size_t num_shards() const { return shards_.size(); }
+    const std::string& shard_path(std::size_t shard) const { return shards_[shard].path; }
+    std::size_t num_layers() const { return num_layers_; }
+    // where a tensor's bytes live in its shard, or kNotInFile once make_resident moved it
+    static constexpr std::uint64_t kNotInFile = ~0ull;
+    std::uint64_t file_offset(const TensorMeta_& meta) const;
+    bool is_packed() const { return packed_; }
+    // slot of (kind, layer) in the directory: globals first, then layer-major
+    static std::size_t directory_index(TensorKind kind, int layer);
+
+    const TensorMeta_& get(TensorKind kind, int layer = -1) const;
+    // like get() but null when the checkpoint doesn't have the tensor
+    const TensorMeta_* find(TensorKind kind, int layer = -1) const;
+    const std::uint16_t* get_bf16_ptr(TensorKind kind, int layer = -1) const;
+    std::size_t get_bf16_count(TensorKind kind, int layer = -1) const;
+    const std::uint8_t* get_u8_ptr(TensorKind kind, int layer = -1) const;
+    std::size_t get_u8_count(TensorKind kind, int layer = -1) const;
+
+    // Copies the tensors every decode step touches (embeddings, attention, router, norms,
+    // unembedding) into hugepage-backed memory and prefaults the rest, all in parallel.
+    // Layer constructors cache tensor pointers, so call this before building the model.
+    ResidencyReport make_resident(const ResidencyOptions& options = {});
+    // Drops this process's pages of a tensor it won't read again (a pipeline stage shedding
+    // the layers it doesn't run). File pages fault back in if it is read anyway, a
+    // make_resident copy comes back zeroed. Pages shared with a neighbour are kept.
+    void drop_pages(TensorKind kind, int layer = -1);
+
     const TensorMeta_& get(const std::string& name) const;
     const std::uint16_t* get_bf16_ptr(const std::string& name) const;
     std::size_t get_bf16_count(const std::string& name) const;
@@ -47,25 +161,35 @@ public:
         std::size_t expected_scales_rank) const;
 
 private:
-    std::uint64_t header_len{};
-    std::string header;
+    struct Shard {
+        std::string path;
+        int fd{-1};
+        void* map_base{nullptr};
+        std::size_t map_length{0};
+        // file offset of map_base
+        std::uint64_t map_file_offset{0};
+    };
+
     std::unordered_map<std::string, TensorMeta_> meta_;
-    std::byte* weights{nullptr};
     std::string path_;
-    int file_descriptor_{-1};
-    void* map_base_{nullptr};
-    std::size_t map_length_{0};
+    std::vector<Shard> shards_;
+    bool packed_{false};
+    std::size_t num_layers_{0};
+    std::vector<TensorMeta_*> directory_;
+    // packed files: one entry per directory slot, unnamed
+    std::vector<TensorMeta_> packed_meta_;
+    void* resident_base_{nullptr};
+    std::size_t resident_length_{0};
 
-    void mmap_weights();
-    void finalizeTensorData();
+    void loadPacked();
+    void loadSafetensors(const std::vector<std::string>& files);
+    static std::vector<TensorMeta_> mapShard(Shard& shard);
+    void buildDirectory();
+    void release();
     void debugPrintCheckpoint();
-    void processHeader();
-    void skipWhitespace(std::uint64_t& i);
-    void expectChar(std::uint64_t& i, char expected);
-    std::string parseJSONString(std::uint64_t& i);
-    std::uint64_t parseUInt64(std::uint64_t& i);
-    std::vector<std::uint64_t> parseUInt64Array(std::uint64_t& i);
-    DType parseDTypeString(const std::string& dtype);
-    void parseTensorMeta(std::uint64_t& i, TensorMeta_& meta_instance);
-    void skipJSONValue(std::uint64_t& i);
 };
+
+// Writes every tensor the model reads from `checkpoint` into a packed model file. Used by
+// gptoss-pack; the data is copied byte for byte since the kernels consume the checkpoint
+// layouts directly.
+void pack_checkpoint(const Checkpoint& checkpoint, const std::string& out_path);
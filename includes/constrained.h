@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Constrained decoding: a grammar is compiled to a DFA over bytes, the vocabulary to a byte
+// trie, and walking the trie through the DFA once per state gives that state's allowed
+// tokens as a bitset. The bitsets are cached, so a decode step only does a lookup plus one
+// masked store over the logits (apply_token_mask in kernels.h).
+
+// Deterministic automaton over bytes, trimmed so every state can still reach an accepting
+// one: a byte string is a valid prefix of the language iff it never hits a dead transition.
+class ByteAutomaton {
+public:
+    static constexpr std::int32_t kDead = -1;
+
+    // Regex subset, always matching the whole output: literals, escapes (\d \w \s \xHH, \n,
+    // \t, ... and escaped metacharacters), . (any byte but \n), [...] and [^...] classes,
+    // groups ( ) and (?: ), |, * + ? and {n} {n,} {n,m}. Works on bytes, not codepoints.
+    static ByteAutomaton from_regex(std::string_view pattern, std::size_t max_states = 1 << 16);
+
+    std::int32_t start() const { return 0; }
+    std::int32_t next(std::int32_t state, std::uint8_t byte) const { return next_[state * 256 + byte]; }
+    // kDead as soon as a byte doesn't fit
+    std::int32_t advance(std::int32_t state, std::string_view bytes) const;
+    bool accepting(std::int32_t state) const { return accepting_[state] != 0; }
+    // false when the output can't grow anymore (accepting, nothing may follow)
+    bool has_exits(std::int32_t state) const { return has_exits_[state] != 0; }
+    bool matches(std::string_view text) const;
+    std::size_t num_states() const { return accepting_.size(); }
+
+private:
+    std::vector<std::int32_t> next_;  // num_states x 256
+    std::vector<std::uint8_t> accepting_;
+    std::vector<std::uint8_t> has_exits_;
+};
+
+struct JsonSchemaOptions {
+    // regex allowed wherever JSON allows whitespace; the default takes `{"a": 1, "b": [1, 2]}`
+    // style output but not pretty-printing, which mostly just burns tokens
+    std::string whitespace{" ?"};
+    // nesting depth for values the schema leaves open ({} or a bare "object"/"array"),
+    // and for how deep $refs are inlined
+    std::size_t max_depth{3};
+};
+
+// Regex for the JSON documents a schema accepts. Handles type (also lists), enum, const,
+// properties/required (properties come out in schema order), items/minItems/maxItems,
+// minLength/maxLength/pattern on strings, anyOf/oneOf, single-entry allOf and local $refs;
+// other keywords (format, minimum, additionalProperties, ...) aren't enforced. A pattern is
+// matched against the string's characters (^ and $ only at its ends) and always yields a
+// valid JSON string; a bad type is an error rather than an empty match.
+std::string json_schema_to_regex(std::string_view schema, const JsonSchemaOptions& options = {});
+
+// The vocabulary as a byte trie laid out in preorder: a node's children follow it directly,
+// each child's subtree ends where the next sibling begins, so walking it is a flat loop over
+// arrays. Tokens with no bytes (specials, unused ids) just aren't in it.
+class TokenTrie {
+public:
+    // tokens[id] = that token's bytes
+    explicit TokenTrie(std::span<const std::string_view> tokens);
+
+    std::size_t num_tokens() const { return offsets_.size() - 1; }
+    std::size_t num_nodes() const { return byte_.size(); }
+    std::string_view token(std::int32_t id) const {
+        return std::string_view(arena_).substr(offsets_[id], offsets_[id + 1] - offsets_[id]);
+    }
+
+    // Sets the bit of every token whose bytes the automaton accepts from state as a prefix.
+    void allowed_tokens(const ByteAutomaton& automaton, std::int32_t state, std::span<std::uint64_t> bits) const;
+
+private:
+    std::string arena_;
+    std::vector<std::uint32_t> offsets_;
+    std::vector<std::uint8_t> byte_;        // edge into the node (root: unused)
+    std::vector<std::uint32_t> end_;        // one past the node's subtree
+    std::vector<std::uint32_t> tok_begin_;  // node i ends tokens ids_[tok_begin_[i], tok_begin_[i + 1])
+    std::vector<std::int32_t> ids_;
+};
+
+// Allowed-token bitsets of one grammar, per automaton state, built on first use (or all at
+// once with precompute) and shared by every sequence decoding under that grammar. States
+// with identical sets share one copy. end_tokens (EOS, harmony's <|return|>/<|call|>, ...)
+// are allowed exactly in accepting states.
+class TokenMasks {
+public:
+    TokenMasks(ByteAutomaton automaton,
+               std::shared_ptr<const TokenTrie> trie,
+               std::size_t vocab_size,
+               std::vector<std::int32_t> end_tokens);
+
+    // vocab_size bits, bit t of word t / 64
+    std::span<const std::uint64_t> mask(std::int32_t state);
+    void precompute();
+
+    // next state after token, kDead if it isn't allowed; end tokens leave the state alone
+    std::int32_t next(std::int32_t state, std::int32_t token) const;
+    bool is_end_token(std::int32_t token) const;
+
+    const ByteAutomaton& automaton() const { return automaton_; }
+    std::size_t vocab_size() const { return vocab_size_; }
+    std::size_t words() const { return (vocab_size_ + 63) / 64; }
+    std::size_t states_computed() const;
+    std::size_t distinct_masks() const;
+    std::size_t bytes() const;
+
+private:
+    std::vector<std::uint64_t> build(std::int32_t state) const;
+    std::span<const std::uint64_t> store(std::int32_t state, std::vector<std::uint64_t> bits);
+
+    ByteAutomaton automaton_;
+    std::shared_ptr<const TokenTrie> trie_;
+    std::size_t vocab_size_;
+    std::vector<std::int32_t> end_tokens_;
+    // per state index into masks_, -1 until built
+    std::vector<std::int32_t> slot_;
+    std::vector<std::vector<std::uint64_t>> masks_;
+    std::unordered_multimap<std::uint64_t, std::int32_t> by_hash_;
+    mutable std::mutex mutex_;
+};
+
+// One sequence's position in its grammar.
+class TokenConstraint {
+public:
+    explicit TokenConstraint(TokenMasks& masks) : masks_(&masks), state_(masks.automaton().start()) {}
+
+    // -inf on every logit the grammar doesn't allow here
+    void apply(std::span<float> logits);
+    // throws when token isn't allowed
+    void accept(std::int32_t token);
+    // an end token was taken, or the output is complete and nothing may follow
+    bool done() const { return ended_ || !masks_->automaton().has_exits(state_); }
+    bool complete() const { return masks_->automaton().accepting(state_); }
+    std::int32_t state() const { return state_; }
+
+private:
+    TokenMasks* masks_;
+    std::int32_t state_;
+    bool ended_{false};
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "model.h"
+#include "transport.h"
+
+struct ExpertParallelOptions {
+    // worker processes; every layer's experts are split into this many contiguous ranges
+    std::size_t num_workers{2};
+    TransportKind transport{TransportKind::SharedMemory};
+    // per direction, per worker; bigger batches just stream through
+    std::size_t ring_bytes{std::size_t{8} << 20};
+    // OpenMP threads inside each worker
+    std::size_t threads_per_worker{1};
+};
+
+// Expert parallelism across local processes. The constructor forks the workers off the
+// calling process, so they share the model's checkpoint mapping but each only ever reads
+// the expert slices it owns (worker w owns experts [first_expert(w), first_expert(w + 1))
+// of every layer), which is what spreads the expert bandwidth over more memory channels.
+// For each layer run() sends a worker the normed rows of the tokens routed to its experts
+// and sums the weighted partial outputs that come back.
+//
+// Attach with GPTOSSModel::set_expert_backend(); destroying this shuts the workers down.
+// Going across hosts means handing the workers a socket_transport() over TCP instead of
+// forking them. Once a run() fails partway, replies can be left queued on the other
+// workers' transports, so every later run() throws instead of reading a stale reply.
+class ExpertParallel final : public ExpertBackend {
+public:
+    explicit ExpertParallel(const GPTOSSModel& model, const ExpertParallelOptions& options = {});
+    ~ExpertParallel() override;
+    ExpertParallel(const ExpertParallel&) = delete;
+    ExpertParallel& operator=(const ExpertParallel&) = delete;
+
+    void run(std::size_t layer,
+             std::span<const float> x,
+             std::span<const std::int32_t> experts,
+             std::span<const float> weights,
+             std::size_t num_tokens,
+             std::span<float> out) override;
+
+    std::size_t num_workers() const { return workers_.size(); }
+    std::size_t first_expert(std::size_t worker) const;
+    std::size_t owner(std::size_t expert) const { return owner_[expert]; }
+
+private:
+    struct Item {
+        std::uint32_t slot;  // row in the worker's batch
+        std::uint32_t expert;
+        float weight;
+    };
+    struct Worker {
+        pid_t pid{-1};
+        std::unique_ptr<Transport> transport;
+        // per-run scratch: which of the caller's tokens each batch row is, the rows, the work
+        std::vector<std::uint32_t> rows;
+        std::vector<float> x;
+        std::vector<Item> items;
+        std::vector<std::int32_t> slot_of;
+    };
+
+    void shutdown();
+    // sends every worker its batch, then sums the replies into out
+    void send_and_collect(std::size_t layer, std::span<float> out);
+
+    std::size_t hidden_size_;
+    std::size_t num_experts_;
+    std::size_t num_workers_;
+    std::vector<std::size_t> owner_;
+    std::vector<Worker> workers_;
+    std::vector<std::byte> reply_;
+    // a run() failed between sending and collecting, the transports are out of step
+    bool broken_{false};
+    std::mutex mutex_;
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class Tokenizer;
+
+// Special tokens of the o200k_harmony encoding gpt-oss was trained with. Ids
+// 200013..201087 (and the unnamed gaps below) are <|reserved_N|>.
+namespace harmony {
+
+constexpr std::int32_t kStartOfText = 199998;
+constexpr std::int32_t kEndOfText = 199999;
+constexpr std::int32_t kReturn = 200002;
+constexpr std::int32_t kConstrain = 200003;
+constexpr std::int32_t kChannel = 200005;
+constexpr std::int32_t kStart = 200006;
+constexpr std::int32_t kEnd = 200007;
+constexpr std::int32_t kMessage = 200008;
+constexpr std::int32_t kCall = 200012;
+
+constexpr std::int32_t kFirstSpecial = 199998;
+constexpr std::int32_t kLastSpecial = 201087;
+
+// Name of a special token id ("<|start|>", "<|reserved_200013|>", ...).
+std::string special_token_name(std::int32_t id);
+
+// Tokens that end an assistant turn during generation.
+inline bool is_stop_token(std::int32_t id) {
+    return id == kReturn || id == kCall || id == kEnd;
+}
+
+}  // namespace harmony
+
+// Builds Harmony chat prompts directly as token ids:
+//   <|start|>{role}[<|channel|>{channel}[ to={recipient}][ <|constrain|>{type}]]<|message|>{content}<|end|>
+// The scaffolding is emitted as special ids, never re-tokenized, and the short header
+// strings between them (roles, channel names, recipients) are encoded once and cached.
+// Message content is encoded with special tokens disallowed so it can't inject turns.
+class HarmonyPrompt {
+public:
+    struct MessageOptions {
+        std::string_view channel;       // e.g. "analysis", "commentary", "final"
+        std::string_view recipient;     // tool call target, e.g. "functions.get_weather"
+        std::string_view content_type;  // constrain type, e.g. "json"
+    };
+
+    explicit HarmonyPrompt(const Tokenizer& tokenizer);
+
+    HarmonyPrompt& message(std::string_view role, std::string_view content, const MessageOptions& options);
+    HarmonyPrompt& message(std::string_view role, std::string_view content) {
+        return message(role, content, MessageOptions{});
+    }
+    HarmonyPrompt& system(std::string_view content) { return message("system", content); }
+    HarmonyPrompt& developer(std::string_view content) { return message("developer", content); }
+    HarmonyPrompt& user(std::string_view content) { return message("user", content); }
+
+    // Opens the assistant turn generation continues from: <|start|>assistant[<|channel|>{channel}]
+    HarmonyPrompt& start_assistant(std::string_view channel = {});
+
+    const std::vector<std::int32_t>& tokens() const { return tokens_; }
+    void clear() { tokens_.clear(); }
+
+private:
+    const Tokenizer& tokenizer_;
+    std::vector<std::int32_t> tokens_;
+    std::unordered_map<std::string, std::vector<std::int32_t>> header_cache_;
+
+    void append_header_text(std::string_view text);
+};
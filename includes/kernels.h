@@ -62,6 +62,21 @@ void sdpa_with_sinks(std::span<const float> q,
                      std::size_t sliding_window,
                      std::span<float> out);
 
+// sdpa_with_sinks for a single query token (decode) against a paged KV cache: row r of
+// k/v lives at k_blocks[r / block_tokens] + (r % block_tokens) * num_kv_heads * head_dim.
+void sdpa_paged(std::span<const float> q,
+                std::span<const float* const> k_blocks,
+                std::span<const float* const> v_blocks,
+                std::size_t block_tokens,
+                std::span<const std::uint16_t> sinks_bf16,
+                std::size_t kv_len,
+                std::size_t num_q_heads,
+                std::size_t num_kv_heads,
+                std::size_t head_dim,
+                float sm_scale,
+                std::size_t sliding_window,
+                std::span<float> out);
+
 // MoE gating and top-k selection.
 void moe_topk_gating(std::span<const float> gate_logits,
                      std::size_t num_experts,
@@ -89,3 +104,41 @@ void moe_combine(std::span<const float> expert_outputs,
                  std::size_t experts_per_token,
                  std::size_t hidden_size,
                  std::span<float> out);
+
+// Index of the largest logit (greedy sampling).
+std::int32_t argmax(std::span<const float> logits);
+
+// Sets logits[i] to -inf wherever bit i of allowed (word i / 64) is clear.
+void apply_token_mask(std::span<float> logits, std::span<const std::uint64_t> allowed);
+
+// Shape-specialized kernels. The hot loops are instantiated with the dimensions as template
+// constants (hidden 2880, head_dim 64, GQA ratio 8, MXFP4 rows of 2880 = 90 blocks of 32)
+// so they unroll and vectorize fully; select_kernels picks them once at model construction
+// and hands back the generic kernels above for any other shape. Signatures match the
+// generic versions, the size arguments are still passed but must equal the constants.
+struct KernelTable {
+    void (*rmsnorm)(std::span<const float>, std::span<const std::uint16_t>, float, std::size_t,
+                    std::span<float>);
+    // in_features == hidden (qkv, router)
+    void (*linear_hidden)(const std::uint16_t*, const std::uint16_t*, std::size_t, std::size_t,
+                          std::span<const float>, std::span<float>);
+    // in_features == num_heads * head_dim (attention out projection)
+    void (*linear_attn_out)(const std::uint16_t*, const std::uint16_t*, std::size_t, std::size_t,
+                            std::span<const float>, std::span<float>);
+    void (*sdpa)(std::span<const float>, std::span<const float>, std::span<const float>,
+                 std::span<const std::uint16_t>, std::size_t, std::size_t, std::size_t, std::size_t,
+                 std::size_t, float, std::size_t, std::span<float>);
+    // in_features == hidden / intermediate
+    void (*mxfp4_mlp1)(const std::uint8_t*, const std::uint8_t*, std::size_t, std::size_t,
+                       std::span<const float>, std::span<float>);
+    void (*mxfp4_mlp2)(const std::uint8_t*, const std::uint8_t*, std::size_t, std::size_t,
+                       std::span<const float>, std::span<float>);
+    // how many of the above are specialized, for logging
+    int specialized;
+};
+
+KernelTable select_kernels(std::size_t hidden_size,
+                           std::size_t intermediate_size,
+                           std::size_t head_dim,
+                           std::size_t num_q_heads,
+                           std::size_t num_kv_heads);
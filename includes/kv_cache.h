@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstddef>
+#include <functional>
 #include <span>
 #include <vector>
 
@@ -12,8 +13,16 @@ public:
                 std::span<const float> k_new,
                 std::span<const float> v_new);
 
+    // Drop every cached position >= new_len in all layers (e.g. rejected draft tokens).
+    void truncate(std::size_t new_len);
+
     std::size_t seq_len = 0;
     // [layer][token_pos * num_kv_heads * head_dim + ...]  (flat)
     std::vector<std::vector<float>> k_cache;
     std::vector<std::vector<float>> v_cache;
+
+    // For moving a cache between processes layer by layer (KVHandoff): forward calls
+    // before_layer ahead of a layer's attention and after_layer once the layer is done.
+    std::function<void(std::size_t layer)> before_layer;
+    std::function<void(std::size_t layer)> after_layer;
 };
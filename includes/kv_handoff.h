@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <string>
+#include <vector>
+
+class KVCache;
+
+// One prompt's KV cache on its way from a prefill process to a decode process. It lives in
+// a file (tmpfs by default) that both sides map, so nothing is serialized or sent: the
+// prefill side writes each layer straight into the mapping the moment its forward is done
+// with it and flips that layer's ready flag, and the decode side copies layers out as they
+// turn ready while later layers are still being computed. The first generated token is
+// published last.
+//
+// The copy-in is on purpose: the decode cache keeps growing a row per token, which a
+// mapping sized for the prompt can't, and it's one memcpy per layer per prompt, far below
+// the prefill that produced it. poll() between decode steps hides it entirely.
+//
+// The creator owns the file name and unlinks it when destroyed; open() maps an existing one.
+class KVHandoff {
+public:
+    static KVHandoff create(const std::string& path,
+                            std::size_t num_layers,
+                            std::size_t row_floats,
+                            std::size_t seq_len);
+    static KVHandoff open(const std::string& path);
+    ~KVHandoff();
+    KVHandoff(KVHandoff&& other) noexcept;
+    KVHandoff& operator=(KVHandoff&& other) noexcept;
+    KVHandoff(const KVHandoff&) = delete;
+    KVHandoff& operator=(const KVHandoff&) = delete;
+
+    const std::string& path() const { return path_; }
+    std::size_t num_layers() const;
+    std::size_t seq_len() const;
+
+    // prefill side
+    void publish_layer(std::size_t layer, std::span<const float> k, std::span<const float> v);
+    void publish_first_token(std::int32_t token);
+    // wakes every waiter with an error, for a prefill that won't finish
+    void fail();
+    // Publishes each layer of cache as soon as a forward leaves it holding the full prompt,
+    // so chunked prefill only ships on its last chunk. cache must outlive the forward.
+    void attach_writer(KVCache& cache);
+
+    // decode side
+    bool layer_ready(std::size_t layer) const;
+    bool first_token_ready() const;
+    std::int32_t wait_first_token() const;
+    // Makes cache (fresh, same layer count) stand for the whole prompt right away; each layer
+    // is copied in before the first forward that reads it, waiting if it hasn't landed yet.
+    void attach_reader(KVCache& cache);
+    // copies in whatever landed since, without blocking; returns the number of layers
+    std::size_t poll(KVCache& cache);
+    // copies in the rest and unhooks cache, which no longer needs this object afterwards
+    void finish(KVCache& cache);
+    // polled while waiting; false fails the wait (a prefill process that died)
+    void set_peer_check(std::function<bool()> alive) { peer_alive_ = std::move(alive); }
+
+private:
+    struct Header;
+    KVHandoff() = default;
+    void map(int fd, std::size_t bytes);
+    const float* layer_data(std::size_t layer, bool v) const;
+    void wait_flag(std::uint32_t* flag) const;
+    void import_layer(KVCache& cache, std::size_t layer);
+    void reset();
+
+    std::string path_;
+    bool owner_{false};
+    void* base_{nullptr};
+    std::size_t bytes_{0};
+    Header* header_{nullptr};
+    std::vector<bool> imported_;
+    std::function<bool()> peer_alive_;
+};
@@ -2,16 +2,80 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <optional>
 #include <span>
 #include <vector>
 
+#include "kernels.h"
 #include "kv_cache.h"
+#include "model_config.h"
+#include "quant.h"
 
 class Checkpoint;
+class PagedKVCache;
+class RoutingStats;
+class WeightStreamer;
+
+// Scratch activations for one forward pass. Buffers grow to the largest token count
+// seen and are reused across calls, so chunked prefill and decode steps don't allocate
+// per block and peak activation memory is bounded by the chunk size.
+struct ForwardBuffers {
+    // residual stream
+    std::vector<float> x;
+    std::vector<float> tmp;
+    std::vector<float> attn_out;
+    // attention
+    std::vector<float> norm_out;
+    std::vector<float> qkv;
+    std::vector<float> q;
+    std::vector<float> k;
+    std::vector<float> v;
+    std::vector<float> attn;
+    std::vector<float> projected;
+    // per-block K/V pointers of the paged cache being read (forward_batch)
+    std::vector<const float*> k_blocks;
+    std::vector<const float*> v_blocks;
+    // mlp
+    std::vector<float> gate_logits;
+    std::vector<std::int32_t> topk_indices;
+    std::vector<float> topk_weights;
+    std::vector<std::uint32_t> expert_load;
+    std::vector<float> expert_outputs;
+    std::vector<float> mlp1_out;
+    std::vector<float> swiglu_out;
+};
+
+// Load-time choices that trade accuracy for speed. Defaults reproduce the checkpoint exactly.
+struct ModelOptions {
+    // quantize qkv/out/gate/unembedding to int8 with per-row scales (about half the decode
+    // bandwidth of those matrices); the MXFP4 experts are untouched
+    bool int8_weights{false};
+    // run the MXFP4 experts against int8 activations (mxfp4_gemm_int8) instead of float
+    bool int8_experts{false};
+    // build only blocks [layer_begin, layer_end) (0 = through the last one), e.g. for a
+    // pipeline stage: the embedding comes with layer 0 and the final norm + unembedding with
+    // the last layer, nothing else of the checkpoint gets touched
+    std::size_t layer_begin{0};
+    std::size_t layer_end{0};
+};
+
+// Runs a layer's routed experts somewhere other than MLPBlock's own loop (ExpertParallel
+// hands them to worker processes). x is the normed MLP input, experts/weights the top-k
+// choice per token; out gets each token's weighted sum of expert outputs, no residual.
+class ExpertBackend {
+public:
+    virtual ~ExpertBackend() = default;
+    virtual void run(std::size_t layer,
+                     std::span<const float> x,
+                     std::span<const std::int32_t> experts,
+                     std::span<const float> weights,
+                     std::size_t num_tokens,
+                     std::span<float> out) = 0;
+};
 
 class Embedding {
 public:
-    explicit Embedding(Checkpoint& checkpoint);
+    Embedding(Checkpoint& checkpoint, const ModelConfig& config);
     void forward(std::span<const std::int32_t> token_id,
                  std::span<float> out,
                  std::size_t num_tokens) const;
@@ -20,18 +84,36 @@ private:
     const std::uint16_t* weight{nullptr};
     std::size_t weight_count{0};
     std::size_t hidden_size{0};
+    std::size_t vocab_size{0};
 };
 
 class AttentionBlock {
 public:
-    AttentionBlock(Checkpoint& checkpoint, int layer_idx);
+    AttentionBlock(Checkpoint& checkpoint,
+                   int layer_idx,
+                   const ModelConfig& config,
+                   const KernelTable& kernels,
+                   const ModelOptions& options);
 
     void forward(std::span<const float> x,
                  std::span<float> out,
                  std::size_t num_tokens,
-                 KVCache& kv_cache) const;
+                 KVCache& kv_cache,
+                 ForwardBuffers& buf) const;
+    // row i of x is the next token of caches[i]; the caches have room reserved for it
+    void forward_batch(std::span<const float> x,
+                       std::span<float> out,
+                       std::span<PagedKVCache* const> caches,
+                       ForwardBuffers& buf) const;
 
 private:
+    // norm + qkv projection of x into buf.q / buf.k / buf.v
+    void project_qkv(std::span<const float> x, std::size_t num_tokens, ForwardBuffers& buf) const;
+    // out = x + out_proj(buf.attn)
+    void project_out(std::span<const float> x, std::span<float> out, std::size_t num_tokens,
+                     ForwardBuffers& buf) const;
+    void rope(std::span<float> q, std::span<float> k, std::size_t num_tokens, std::size_t position) const;
+
     int layer_idx{0};
     const std::uint16_t* norm_scale{nullptr};
     std::size_t norm_scale_count{0};
@@ -47,16 +129,37 @@ private:
     std::size_t sinks_count{0};
     std::size_t hidden_size{0};
     std::size_t sliding_window{0};
+    // empty unless ModelOptions::int8_weights
+    Int8Matrix qkv_int8;
+    Int8Matrix out_int8;
+    ModelConfig config;
+    KernelTable kernels;
 };
 
 class MLPBlock {
 public:
-    MLPBlock(Checkpoint& checkpoint, int layer_idx);
+    MLPBlock(Checkpoint& checkpoint,
+             int layer_idx,
+             const ModelConfig& config,
+             const KernelTable& kernels,
+             const ModelOptions& options);
 
     void forward(std::span<const float> x,
                  std::span<float> out,
-                 std::size_t num_tokens) const;
+                 std::size_t num_tokens,
+                 ForwardBuffers& buf) const;
+    // mlp1 + bias, swiglu, mlp2 + bias for one token through one expert (out is hidden wide)
+    void expert_forward(std::size_t expert,
+                        std::span<const float> x,
+                        std::span<float> out,
+                        ForwardBuffers& buf) const;
+    void set_routing_stats(RoutingStats* stats) { routing_stats = stats; }
+    void set_expert_backend(ExpertBackend* backend) { expert_backend = backend; }
+
 private:
+    int layer_idx{0};
+    RoutingStats* routing_stats{nullptr};
+    ExpertBackend* expert_backend{nullptr};
     const std::uint16_t* norm_scale{nullptr};
     std::size_t norm_scale_count{0};
     const std::uint16_t* gate_weight{nullptr};
@@ -76,16 +179,32 @@ private:
     const std::uint8_t* mlp2_weight_scales{nullptr};
     std::size_t mlp2_weight_scales_count{0};
     std::size_t hidden_size{0};
+    Int8Matrix gate_int8;
+    ModelConfig config;
+    KernelTable kernels;
 };
 
 class TransformerBlock {
 public:
-    TransformerBlock(Checkpoint& checkpoint, int layer_idx);
+    TransformerBlock(Checkpoint& checkpoint,
+                     int layer_idx,
+                     const ModelConfig& config,
+                     const KernelTable& kernels,
+                     const ModelOptions& options);
 
     void forward(std::span<const float> x,
                 std::span<float> out,
                 std::size_t num_tokens,
-                KVCache& kv_cache) const;
+                KVCache& kv_cache,
+                ForwardBuffers& buf) const;
+    void forward_batch(std::span<const float> x,
+                       std::span<float> out,
+                       std::span<PagedKVCache* const> caches,
+                       ForwardBuffers& buf) const;
+    void set_routing_stats(RoutingStats* stats) { mlp.set_routing_stats(stats); }
+    void set_expert_backend(ExpertBackend* backend) { mlp.set_expert_backend(backend); }
+    const MLPBlock& mlp_block() const { return mlp; }
+
 private:
     AttentionBlock attn;
     MLPBlock mlp;
@@ -94,7 +213,7 @@ private:
 
 class UnEmbedding {
 public:
-    explicit UnEmbedding(Checkpoint& checkpoint);
+    UnEmbedding(Checkpoint& checkpoint, const ModelConfig& config, const ModelOptions& options);
 
     void forward(std::span<const float> x,
                  std::span<float> out,
@@ -105,20 +224,107 @@ private:
     std::size_t weight_count{0};
     std::size_t hidden_size{0};
     std::size_t vocab_size{0};
+    Int8Matrix weight_int8;
 };
 
 class GPTOSSModel {
 public:
+    // config defaults to the published preset matching the checkpoint's layer count
     explicit GPTOSSModel(Checkpoint& checkpoint);
+    GPTOSSModel(Checkpoint& checkpoint, const ModelConfig& config, const ModelOptions& options = {});
     ~GPTOSSModel();
+
+    const ModelConfig& config() const { return config_; }
+    const KernelTable& kernels() const { return kernels_; }
+    const ModelOptions& options() const { return options_; }
+    std::size_t layer_begin() const { return layer_begin_; }
+    std::size_t layer_end() const { return layer_begin_ + blocks.size(); }
+    bool has_embedding() const { return embedding.has_value(); }
+    bool has_unembedding() const { return unembedding.has_value(); }
+
+    // logits holds either one row per token, a single row that receives only the last
+    // token's logits (prefill), or is empty to skip the unembedding entirely. Needs the
+    // whole model; a layer range runs the three steps below instead.
     void forward(std::span<const std::int32_t> token_ids,
                  std::span<float> logits,
                  KVCache& kv_cache) const;
+    void forward(std::span<const std::int32_t> token_ids,
+                 std::span<float> logits,
+                 KVCache& kv_cache,
+                 ForwardBuffers& buf) const;
+
+    // One decode step for several sequences at once: tokens[i] goes on after caches[i] and
+    // its logits land in row i. Everything but attention runs on the whole batch, so the
+    // weights are read once per step rather than once per sequence.
+    void forward_batch(std::span<const std::int32_t> tokens,
+                       std::span<float> logits,
+                       std::span<PagedKVCache* const> caches,
+                       ForwardBuffers& buf) const;
+
+    // token ids -> hidden rows (num_tokens x hidden)
+    void embed(std::span<const std::int32_t> token_ids, std::span<float> hidden) const;
+    // Runs this model's layers over hidden in place and advances kv_cache.seq_len.
+    void forward_layers(std::span<float> hidden,
+                        std::size_t num_tokens,
+                        KVCache& kv_cache,
+                        ForwardBuffers& buf) const;
+    // final norm + unembedding of the last logits.size() / vocab rows of hidden; throws unless
+    // logits is a whole number of rows, at most num_tokens of them
+    void unembed(std::span<const float> hidden,
+                 std::size_t num_tokens,
+                 std::span<float> logits,
+                 ForwardBuffers& buf) const;
+
+    // With a streamer attached, forward() waits for each layer's weights right before
+    // running it instead of faulting them in. Detach (nullptr) once it reports ready.
+    void set_weight_streamer(const WeightStreamer* streamer) { streamer_ = streamer; }
+    // Records every router decision into stats (sized for this model) until detached with nullptr.
+    void set_routing_stats(RoutingStats* stats);
+    // Sends every layer's routed experts to backend instead of running them in-process;
+    // nullptr goes back to local experts.
+    void set_expert_backend(ExpertBackend* backend);
+    // one expert of one layer (global index) on one token, for whatever process owns it
+    void expert_forward(std::size_t layer,
+                        std::size_t expert,
+                        std::span<const float> x,
+                        std::span<float> out,
+                        ForwardBuffers& buf) const;
 
 private:
-    Embedding embedding;
-    UnEmbedding unembedding;
+    ModelConfig config_;
+    KernelTable kernels_;
+    ModelOptions options_;
+    std::size_t layer_begin_{0};
+    std::optional<Embedding> embedding;
+    std::optional<UnEmbedding> unembedding;
     std::vector<TransformerBlock> blocks;
     const std::uint16_t* norm_scale{nullptr};
     std::size_t norm_scale_count{0};
+    const WeightStreamer* streamer_{nullptr};
+};
+
+// Prefill split into fixed-size chunks that extend the KV cache incrementally. Each
+// step() runs one chunk through the model, so a scheduler can interleave chunks with
+// other sequences' decode steps while activations stay bounded by chunk_size.
+class ChunkedPrefill {
+public:
+    ChunkedPrefill(const GPTOSSModel& model,
+                   std::span<const std::int32_t> tokens,
+                   KVCache& kv_cache,
+                   ForwardBuffers& buf,
+                   std::size_t chunk_size = 512);
+
+    // Processes the next chunk. last_logits (one vocab row) is written when the final
+    // chunk completes. Returns true once the whole prompt is in the cache.
+    bool step(std::span<float> last_logits);
+    bool done() const { return next_ >= tokens_.size(); }
+    std::size_t processed() const { return next_; }
+
+private:
+    const GPTOSSModel& model_;
+    std::span<const std::int32_t> tokens_;
+    KVCache& kv_cache_;
+    ForwardBuffers& buf_;
+    std::size_t chunk_size_;
+    std::size_t next_{0};
 };
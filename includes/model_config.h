@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Model shape, read from the checkpoint's config.json. Understands both the original
+// gpt-oss config (num_experts, rope_scaling_factor, ...) and the HF one (num_local_experts,
+// nested rope_scaling, ...).
+struct ModelConfig {
+    std::size_t num_hidden_layers{0};
+    std::size_t num_experts{0};
+    std::size_t experts_per_token{0};
+    std::size_t vocab_size{0};
+    std::size_t hidden_size{0};
+    std::size_t intermediate_size{0};
+    float swiglu_limit{0.0f};
+    std::size_t head_dim{0};
+    std::size_t num_attention_heads{0};
+    std::size_t num_key_value_heads{0};
+    std::size_t sliding_window{0};
+    std::size_t initial_context_length{0};
+    float rope_theta{0.0f};
+    float rope_scaling_factor{0.0f};
+    float rope_ntk_alpha{0.0f};
+    float rope_ntk_beta{0.0f};
+
+    static ModelConfig load(const std::string& path);
+    // writes the original gpt-oss spelling, which load() reads back
+    void save(const std::string& path) const;
+    static ModelConfig gpt_oss_20b();
+    static ModelConfig gpt_oss_120b();
+    // the published config with this many layers, for checkpoints without a config.json
+    static ModelConfig preset(std::size_t num_layers);
+    // config_path if given, else the config.json next to the weights at model_path, else
+    // the preset for num_layers
+    static ModelConfig locate(const std::string& config_path, const std::string& model_path, std::size_t num_layers);
+};
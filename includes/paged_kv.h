@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+class KVCache;
+
+// Fixed-size KV blocks (block_tokens rows of every layer's K and V) handed out by id and
+// shared by refcount. Freed blocks are kept for reuse.
+class KVBlockPool {
+public:
+    KVBlockPool(std::size_t num_layers, std::size_t row_floats, std::size_t block_tokens = 16);
+
+    std::uint32_t allocate();
+    void retain(std::uint32_t block) { refs_[block]++; }
+    void release(std::uint32_t block);
+    std::uint32_t refcount(std::uint32_t block) const { return refs_[block]; }
+
+    // block_tokens rows of row_floats each
+    float* k(std::uint32_t block, std::size_t layer) { return data(block) + 2 * layer * layer_floats(); }
+    float* v(std::uint32_t block, std::size_t layer) { return k(block, layer) + layer_floats(); }
+    const float* k(std::uint32_t block, std::size_t layer) const {
+        return const_cast<KVBlockPool*>(this)->k(block, layer);
+    }
+    const float* v(std::uint32_t block, std::size_t layer) const {
+        return const_cast<KVBlockPool*>(this)->v(block, layer);
+    }
+
+    std::size_t num_layers() const { return num_layers_; }
+    std::size_t row_floats() const { return row_floats_; }
+    std::size_t block_tokens() const { return block_tokens_; }
+    std::size_t blocks_in_use() const { return blocks_.size() - free_.size(); }
+    std::size_t bytes_in_use() const { return blocks_in_use() * block_floats() * sizeof(float); }
+    // blocks copied because a shared one was about to be written
+    std::size_t copies() const { return copies_; }
+
+private:
+    friend class PagedKVCache;
+
+    std::size_t layer_floats() const { return block_tokens_ * row_floats_; }
+    std::size_t block_floats() const { return 2 * num_layers_ * layer_floats(); }
+    float* data(std::uint32_t block) { return blocks_[block].get(); }
+
+    std::size_t num_layers_;
+    std::size_t row_floats_;
+    std::size_t block_tokens_;
+    std::vector<std::unique_ptr<float[]>> blocks_;
+    std::vector<std::uint32_t> refs_;
+    std::vector<std::uint32_t> free_;
+    std::size_t copies_{0};
+};
+
+// One sequence's KV as a list of pool blocks. fork() copies nothing, the two caches share
+// every block; whichever appends first into a block the other still holds gets its own copy
+// of just that block (only ever the partly filled last one, since full blocks are never
+// written again). GPTOSSModel::forward_batch() decodes any number of these as one batch.
+class PagedKVCache {
+public:
+    explicit PagedKVCache(KVBlockPool& pool) : pool_(&pool) {}
+    ~PagedKVCache() { clear(); }
+    PagedKVCache(PagedKVCache&& other) noexcept;
+    PagedKVCache& operator=(PagedKVCache&& other) noexcept;
+    PagedKVCache(const PagedKVCache&) = delete;
+    PagedKVCache& operator=(const PagedKVCache&) = delete;
+
+    PagedKVCache fork() const;
+    // replaces the contents with a contiguous cache's, e.g. a prompt prefilled the usual way
+    void assign(const KVCache& cache);
+    void clear();
+
+    // Makes rows [seq_len, seq_len + n) writable, allocating blocks and copying shared ones;
+    // the forward writes them and then advances seq_len.
+    void reserve_append(std::size_t n);
+    float* k_row(std::size_t layer, std::size_t pos);
+    float* v_row(std::size_t layer, std::size_t pos);
+
+    // per-block base pointers of one layer, for sdpa_paged
+    void layer_blocks(std::size_t layer, std::vector<const float*>& k, std::vector<const float*>& v) const;
+    std::span<const std::uint32_t> blocks() const { return blocks_; }
+    KVBlockPool& pool() const { return *pool_; }
+
+    std::size_t seq_len = 0;
+
+private:
+    KVBlockPool* pool_;
+    std::vector<std::uint32_t> blocks_;
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "kv_cache.h"
+#include "model.h"
+#include "model_config.h"
+#include "transport.h"
+
+class Checkpoint;
+
+struct PipelineOptions {
+    // processes, including the calling one (which runs the first stage)
+    std::size_t num_stages{2};
+    TransportKind transport{TransportKind::SharedMemory};
+    // per link
+    std::size_t ring_bytes{std::size_t{16} << 20};
+    // OpenMP threads per forked stage, 0 = an even share of omp_get_max_threads()
+    std::size_t threads_per_stage{0};
+};
+
+// Busy time per stage over the micro-batches run so far. bubble_fraction() is the share of
+// stage-time spent idle: 1 - sum(busy) / (stages * wall).
+struct PipelineStats {
+    std::uint64_t wall_ns{0};
+    std::uint64_t micro_batches{0};
+    std::vector<std::uint64_t> busy_ns;
+
+    double bubble_fraction() const;
+};
+
+// Pipeline parallelism over local processes. The layers are cut into num_stages contiguous
+// ranges; the calling process keeps the first (with the embedding) and forks one process
+// per remaining range, each building a GPTOSSModel over just its layers, so only that
+// slice of the checkpoint is ever read in and each stage's resident set is about
+// 1/num_stages of the model. Every stage keeps the KV caches of its own layers.
+//
+// forward() takes a list of micro-batches (a chunk of tokens for some sequence each) and
+// streams their hidden states through the stages back to back, so with M micro-batches
+// and S equal stages all but (S - 1) / (M + S - 1) of the stage-time is spent working.
+// Micro-batches of the same sequence run in order. Stages talk over `transport`; the last
+// one sends logits back to the caller.
+class PipelineParallel {
+public:
+    struct MicroBatch {
+        // caller-chosen sequence id; a stage creates its caches on first sight
+        std::uint32_t seq;
+        std::span<const std::int32_t> tokens;
+        // as in GPTOSSModel::forward: one row per token, one row (last token) or empty
+        std::span<float> logits;
+    };
+
+    PipelineParallel(Checkpoint& checkpoint,
+                     const ModelConfig& config,
+                     const ModelOptions& model_options = {},
+                     const PipelineOptions& options = {});
+    ~PipelineParallel();
+    PipelineParallel(const PipelineParallel&) = delete;
+    PipelineParallel& operator=(const PipelineParallel&) = delete;
+
+    void forward(std::span<const MicroBatch> batches);
+    // drops the sequence's KV caches on every stage
+    void release(std::uint32_t seq);
+
+    std::size_t num_stages() const { return ranges_.size(); }
+    // [first, end) layers of stage s
+    std::pair<std::size_t, std::size_t> stage_layers(std::size_t stage) const { return ranges_[stage]; }
+    const PipelineStats& stats() const { return stats_; }
+    void reset_stats();
+    // VmRSS of every stage process, bytes
+    std::vector<std::size_t> stage_rss_bytes();
+
+private:
+    // graceful: pass a shutdown message down the chain; otherwise kill the stages
+    void shutdown(bool graceful);
+
+    ModelConfig config_;
+    std::vector<std::pair<std::size_t, std::size_t>> ranges_;
+    std::unique_ptr<GPTOSSModel> first_stage_;
+    // the first stage's caches, by sequence
+    std::unordered_map<std::uint32_t, KVCache> caches_;
+    ForwardBuffers buf_;
+    std::vector<float> hidden_;
+    std::vector<pid_t> pids_;
+    // to stage 1, and back from the last stage
+    std::unique_ptr<Transport> downstream_;
+    std::unique_ptr<Transport> upstream_;
+    PipelineStats stats_;
+};
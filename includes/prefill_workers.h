@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "checkpoint.h"
+#include "kv_handoff.h"
+#include "model.h"
+#include "model_config.h"
+#include "transport.h"
+
+struct PrefillWorkerOptions {
+    std::size_t num_workers{1};
+    TransportKind transport{TransportKind::SharedMemory};
+    // where the handoff files go; tmpfs keeps them out of the page cache writeback
+    std::string handoff_dir{"/dev/shm"};
+    std::size_t prefill_chunk{512};
+    // OpenMP threads inside each worker, 0 = whatever the parent had
+    std::size_t threads_per_worker{0};
+};
+
+// The prefill half of a disaggregated setup: forked processes that only ever run prompts,
+// so a long prefill never stalls the decode steps of the process that owns them. Each
+// submitted prompt gets a KVHandoff file that the worker fills layer by layer; the caller
+// attaches it to a fresh KVCache and decodes from there once the first token lands.
+//
+// Requests only carry the handoff path and the tokens, the KV itself never goes through
+// the transport. Destroying this shuts the workers down.
+class PrefillWorkers {
+public:
+    PrefillWorkers(Checkpoint& checkpoint,
+                   const ModelConfig& config,
+                   const ModelOptions& model_options = {},
+                   const PrefillWorkerOptions& options = {});
+    ~PrefillWorkers();
+    PrefillWorkers(const PrefillWorkers&) = delete;
+    PrefillWorkers& operator=(const PrefillWorkers&) = delete;
+
+    // Hands prompt to the next worker (round robin) and returns the handoff its KV goes
+    // into; keep it alive until finish() has been called on it.
+    std::unique_ptr<KVHandoff> submit(std::span<const std::int32_t> prompt);
+
+    std::size_t num_workers() const { return workers_.size(); }
+
+private:
+    struct Worker {
+        pid_t pid{-1};
+        std::unique_ptr<Transport> transport;
+    };
+
+    void shutdown();
+
+    ModelConfig config_;
+    PrefillWorkerOptions options_;
+    std::vector<Worker> workers_;
+    std::size_t next_worker_{0};
+    std::size_t next_id_{0};
+    std::mutex mutex_;
+};
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// o200k pre-tokenization: splits text into the pieces BPE runs on, following the
+// tiktoken o200k pattern (kO200kPattern) directly over UTF-8 bytes. The returned views
+// point into text. Invalid UTF-8 bytes are kept verbatim and classed like punctuation.
+std::vector<std::string_view> o200k_pretokenize(std::string_view text);
+void o200k_pretokenize(std::string_view text, std::vector<std::string_view>& out);
+
+// First offset >= from at which every o200k split of text is guaranteed to start a new
+// piece (text.size() if there is none), so text can be split there and the halves
+// pre-tokenized independently. Boundaries are taken right after a newline, or before a
+// space that prefixes an ASCII word, when the neighbours are plain ASCII.
+std::size_t o200k_next_boundary(std::string_view text, std::size_t from);
+
+// this is taken from the tiktoken repo
+extern const char* const kO200kPattern;
+
+#ifdef GPTOSS_HAVE_ICU
+// Reference splitter: runs pattern through the ICU regex engine.
+std::vector<std::string> icu_regex_split(const std::string& text, const std::string& pattern);
+#endif
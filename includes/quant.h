@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <span>
+#include <vector>
+
+// BF16 matrix quantized at load time to int8 with one scale per row (w ≈ values * scale).
+// Rows are zero-padded to `stride` (a multiple of 64) so the dot products never need a
+// tail loop.
+struct Int8Matrix {
+    std::size_t rows{0};
+    std::size_t cols{0};
+    std::size_t stride{0};
+    std::vector<std::int8_t> values;
+    std::vector<float> scales;
+    // sum of each row's values, cancels the +128 offset of the u8 activations
+    std::vector<std::int32_t> row_sums;
+
+    bool empty() const { return values.empty(); }
+};
+
+Int8Matrix quantize_int8_rows(const std::uint16_t* weight_bf16, std::size_t rows, std::size_t cols);
+
+// Same contract as linear_bf16: x is [tokens × w.cols], out is [tokens × w.rows]. Each token's
+// activations are quantized to int8 on the fly (one scale per token) and shifted to u8 so
+// the inner loop is a single vpdpbusd (AVX512-VNNI or AVX-VNNI, scalar otherwise).
+void linear_int8(const Int8Matrix& w,
+                 const std::uint16_t* bias_bf16,
+                 std::span<const float> x,
+                 std::span<float> out);
+
+// Drop-in for mxfp4_gemm (same signature, fits KernelTable::mxfp4_mlp1/2) that stays in
+// integers: x is quantized to int8 with one scale per 32-value block, FP4 nibbles map to
+// int8 through a 16-entry shuffle table of the doubled FP4 values (0..12, all exact), and
+// each block is one vpdpbusd (vpmaddubsw on plain AVX2). The E8M0 scale, the activation
+// scale and the 1/2 for the doubling are applied once per block.
+void mxfp4_gemm_int8(const std::uint8_t* blocks,
+                     const std::uint8_t* scales,
+                     std::size_t out_features,
+                     std::size_t in_features,
+                     std::span<const float> x,
+                     std::span<float> out);
+
+// How far a quantized path's logits are from the reference ones.
+struct LogitParity {
+    float max_abs_diff{0.0f};
+    float rms_diff{0.0f};
+    float cosine{0.0f};
+    // KL(softmax(reference) || softmax(test)) in nats
+    float kl{0.0f};
+    bool top1_match{false};
+    std::size_t topk_overlap{0};
+    std::size_t top_k{0};
+};
+
+LogitParity logit_parity(std::span<const float> reference, std::span<const float> test, std::size_t top_k = 5);
+std::ostream& operator<<(std::ostream& os, const LogitParity& p);
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Aggregated view of the MoE router decisions recorded so far.
+struct RoutingSnapshot {
+    std::size_t num_layers{0};
+    std::size_t num_experts{0};
+    std::size_t experts_per_token{0};
+    // routed tokens per layer (every layer sees the same tokens, so this is tokens / forward)
+    std::uint64_t tokens{0};
+    // [layer][expert]
+    std::vector<std::uint64_t> hits;
+    // [layer][bin], top-k routing weights bucketed into kWeightBins equal bins over [0, 1]
+    std::vector<std::uint64_t> weight_histogram;
+    // [layer][a][b] with a < b, times both experts were picked for the same token
+    std::vector<std::uint64_t> coactivation;
+    // one batch = one MLP forward over a group of tokens; imbalance = busiest expert's
+    // load / the load a perfectly even router would give
+    std::uint64_t batches{0};
+    double mean_imbalance{0.0};
+    double max_imbalance{0.0};
+
+    std::uint64_t hit(std::size_t layer, std::size_t expert) const { return hits[layer * num_experts + expert]; }
+    std::uint64_t pair(std::size_t layer, std::size_t a, std::size_t b) const;
+};
+
+// Router telemetry: expert hit counts, routing-weight distributions, co-activated expert
+// pairs and per-batch load imbalance. Every recording thread gets its own shard of relaxed
+// atomics that only it writes, so record() never locks or contends; snapshot() sums the
+// shards. Attach with GPTOSSModel::set_routing_stats().
+class RoutingStats {
+public:
+    static constexpr std::size_t kWeightBins = 10;
+
+    RoutingStats(std::size_t num_layers, std::size_t num_experts, std::size_t experts_per_token);
+    ~RoutingStats();
+    RoutingStats(const RoutingStats&) = delete;
+    RoutingStats& operator=(const RoutingStats&) = delete;
+
+    // One token's top-k choice at one layer.
+    void record(std::size_t layer, std::span<const std::int32_t> experts, std::span<const float> weights);
+    // After a layer has routed a batch of tokens: per-expert token counts for that batch.
+    void record_batch(std::span<const std::uint32_t> expert_load, std::size_t num_tokens);
+    // A model starting at `layer` got attached. Tokens are counted at the lowest such layer,
+    // so a pipeline stage without layer 0 still counts them, and stages sharing one instance
+    // don't count them twice.
+    void add_first_layer(std::size_t layer);
+
+    RoutingSnapshot snapshot() const;
+    void reset();
+
+    void write_json(const std::string& path) const;
+    // Prometheus text exposition, for whatever ends up serving metrics
+    void write_prometheus(std::ostream& os) const;
+
+    // Rewrites `path` with a fresh snapshot every `interval` from a background thread
+    // (write to a temp file + rename, so readers never see a partial file).
+    void start_periodic_dump(const std::string& path, std::chrono::milliseconds interval);
+    void stop_periodic_dump();
+
+    std::size_t num_layers() const { return num_layers_; }
+    std::size_t num_experts() const { return num_experts_; }
+
+private:
+    struct Shard;
+    Shard& local_shard();
+
+    std::size_t num_layers_;
+    std::size_t num_experts_;
+    std::size_t experts_per_token_;
+    // distinguishes instances in the thread-local shard cache
+    std::uint64_t id_;
+    // layer whose records count tokens; 0 until a model attaches
+    std::atomic<std::size_t> token_layer_;
+    bool attached_{false};
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+
+    std::thread dump_thread_;
+    std::mutex dump_mutex_;
+    std::condition_variable dump_cv_;
+    bool dump_stop_{false};
+};
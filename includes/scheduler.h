@@ -0,0 +1,170 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "kv_cache.h"
+#include "model.h"
+
+// what happens to a preempted sequence's KV
+enum class EvictionPolicy {
+    // whichever the cost model says is cheaper for that sequence
+    Auto,
+    // written to the swap file, read back on resume
+    Swap,
+    // dropped, the tokens are run through prefill again on resume
+    Recompute,
+};
+
+EvictionPolicy parse_eviction_policy(const std::string& name);
+
+struct SchedulerOptions {
+    // KV bytes all resident sequences may hold together
+    std::size_t kv_budget_bytes{std::size_t{1} << 30};
+    // sequences advanced per step
+    std::size_t max_running{8};
+    std::size_t prefill_chunk{512};
+    // Tokens fed per step across the running set, 0 = no cap. Chunks of less urgent
+    // sequences shrink to fit, so their prefill can't stretch everyone's decode step.
+    std::size_t max_step_tokens{0};
+    // where swapped-out KV goes, created fresh (it must not exist yet) and unlinked right
+    // away; empty = an anonymous file in the temp directory
+    std::string swap_path{};
+    EvictionPolicy eviction{EvictionPolicy::Auto};
+    // starting points of the cost model, refined from measured swaps and prefill chunks
+    double swap_bytes_per_s{1e9};
+    double prefill_tokens_per_s{1e3};
+};
+
+struct SequenceRequest {
+    std::vector<std::int32_t> prompt;
+    std::size_t max_new_tokens{16};
+    // higher runs first and gets preempted last
+    int priority{0};
+    // when the first token is due; submit() turns down what can't make it
+    std::chrono::steady_clock::time_point deadline{std::chrono::steady_clock::time_point::max()};
+    // generation also ends on this one (-1 = none)
+    std::int32_t stop_token{-1};
+};
+
+enum class SequenceState {
+    // no KV anywhere: not started yet, or preempted by dropping it
+    Waiting,
+    Running,
+    Swapped,
+    Finished,
+    Rejected,
+};
+
+struct SchedulerStats {
+    std::size_t admitted = 0;
+    std::size_t rejected = 0;
+    std::size_t finished = 0;
+    std::size_t swap_outs = 0;
+    std::size_t swap_ins = 0;
+    std::size_t recomputes = 0;          // preemptions that dropped the KV
+    std::size_t recomputed_tokens = 0;   // tokens run through prefill a second time
+    std::uint64_t swap_bytes = 0;        // written to the swap file
+    std::size_t peak_resident_bytes = 0;
+    std::size_t deadline_misses = 0;     // first token later than requested
+};
+
+// Runs many sequences over one model within a fixed KV memory budget. Each step() picks
+// the max_running most urgent live sequences (priority, then earliest deadline, then
+// arrival) and advances each by a prefill chunk or a decode token. A running sequence's
+// KV is reserved for its whole request, and that's what the budget counts. When the
+// picked ones wouldn't fit, the least urgent resident sequences are preempted (lowest
+// priority first, then the one idle longest) and either swapped out to a file or dropped
+// to be recomputed, whichever the cost model says is cheaper, then resumed transparently
+// later. Decoding is greedy.
+//
+// Not thread safe: one thread submits and steps.
+class Scheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Sequence {
+        std::uint64_t id{0};
+        SequenceRequest request;
+        SequenceState state{SequenceState::Waiting};
+        // prompt then everything generated; the last one isn't in the KV yet
+        std::vector<std::int32_t> tokens;
+        std::size_t generated{0};
+        Clock::time_point arrival;
+        std::vector<Clock::time_point> token_times;
+        std::size_t preemptions{0};
+
+        // resident KV when Running, reserved for prompt + max_new_tokens when it starts
+        // running so appends never reallocate; kv.seq_len tokens of it are filled
+        KVCache kv{0};
+        Clock::time_point last_run;
+        // where the KV sits while Swapped
+        std::uint64_t swap_offset{0};
+        std::uint64_t swap_bytes{0};
+        std::size_t swapped_len{0};
+    };
+
+    explicit Scheduler(const GPTOSSModel& model, const SchedulerOptions& options = {});
+    ~Scheduler();
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // Queues the request and returns its id. It comes back Rejected right away if its full
+    // KV could never fit the budget, or if the prefill queued ahead of it would already
+    // blow its deadline.
+    std::uint64_t submit(SequenceRequest request);
+    // Advances the running set by one chunk or token each; false once nothing is left.
+    bool step();
+    void run_until_idle();
+
+    const Sequence& sequence(std::uint64_t id) const;
+    // forgets a finished or rejected sequence
+    void release(std::uint64_t id);
+
+    // KV memory the running sequences actually hold, vector capacity included
+    std::size_t resident_bytes() const;
+    std::size_t kv_bytes(std::size_t tokens) const { return tokens * bytes_per_token_; }
+    const SchedulerStats& stats() const { return stats_; }
+    // current cost model estimates
+    double swap_bytes_per_s() const { return swap_bytes_per_s_; }
+    double prefill_tokens_per_s() const { return prefill_tokens_per_s_; }
+
+private:
+    bool more_urgent(const Sequence& a, const Sequence& b) const;
+    std::size_t pending(const Sequence& seq) const;
+    // what a sequence holds while running: its whole request, reserved up front
+    std::size_t reserved_bytes(const Sequence& seq) const {
+        return kv_bytes(seq.request.prompt.size() + seq.request.max_new_tokens);
+    }
+    void reserve_kv(Sequence& seq) const;
+    void preempt(Sequence& seq);
+    void swap_out(Sequence& seq);
+    void swap_in(Sequence& seq);
+    void advance(Sequence& seq, std::size_t feed);
+    std::uint64_t allocate_swap(std::uint64_t bytes);
+    void free_swap(std::uint64_t offset, std::uint64_t bytes);
+
+    const GPTOSSModel& model_;
+    SchedulerOptions options_;
+    std::size_t num_layers_;
+    std::size_t row_floats_;
+    std::size_t bytes_per_token_;
+    std::map<std::uint64_t, Sequence> sequences_;
+    std::uint64_t next_id_{0};
+    SchedulerStats stats_;
+    double swap_bytes_per_s_;
+    double prefill_tokens_per_s_;
+
+    int swap_fd_{-1};
+    std::uint64_t swap_end_{0};
+    // offset -> length of the holes in the swap file
+    std::map<std::uint64_t, std::uint64_t> swap_free_;
+
+    ForwardBuffers buf_;
+    std::vector<float> logits_;
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "model.h"
+
+class KVCache;
+
+// Prompt-lookup (n-gram) drafting: find the most recent earlier occurrence of the
+// context's trailing n-gram (longest first, down to min_ngram) and propose the tokens
+// that followed it. Returns at most num_draft tokens, empty when nothing matches.
+std::vector<std::int32_t> prompt_lookup_draft(std::span<const std::int32_t> context,
+                                              std::size_t max_ngram,
+                                              std::size_t min_ngram,
+                                              std::size_t num_draft);
+
+struct SpeculativeStats {
+    std::size_t forwards = 0;   // verification forwards run
+    std::size_t drafted = 0;    // draft tokens proposed
+    std::size_t accepted = 0;   // draft tokens that matched the model
+    std::size_t generated = 0;  // tokens emitted (accepted + one bonus per forward)
+
+    double acceptance_rate() const;
+    double tokens_per_forward() const;
+};
+
+// Greedy decoding that verifies prompt-lookup drafts in one multi-token forward.
+// The caller owns the context (prompt + everything generated so far); its last token
+// is the one not yet written to the KV cache, as in a plain decode loop.
+class PromptLookupDecoder {
+public:
+    struct Options {
+        std::size_t num_draft = 8;
+        std::size_t max_ngram = 3;
+        std::size_t min_ngram = 1;
+    };
+
+    PromptLookupDecoder(const GPTOSSModel& model, KVCache& kv_cache, std::size_t vocab_size,
+                        Options options);
+
+    // Runs one forward over [last, draft...] and returns the accepted draft tokens
+    // followed by the model's own next token (always at least one token). Rejected
+    // positions are rolled back out of the KV cache.
+    std::vector<std::int32_t> step(std::span<const std::int32_t> context);
+
+    const SpeculativeStats& stats() const { return stats_; }
+
+private:
+    const GPTOSSModel& model_;
+    KVCache& kv_cache_;
+    std::size_t vocab_size_;
+    Options options_;
+    SpeculativeStats stats_;
+    std::vector<std::int32_t> input_;
+    std::vector<float> logits_;
+    ForwardBuffers buf_;
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "model.h"
+#include "model_config.h"
+
+class Checkpoint;
+
+// splitmix64: seeded, and fast enough to fill a 1.1 GB unembedding in well under a second.
+// Drives the synthetic checkpoints and the random inputs of the kernel tests and benches.
+struct SyntheticRng {
+    using result_type = std::uint64_t;
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return ~result_type{0}; }
+
+    std::uint64_t state{1};
+    std::uint64_t next() {
+        std::uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+    result_type operator()() { return next(); }
+    // uniform in [-1, 1)
+    float uniform() { return static_cast<float>(next() >> 40) / static_cast<float>(1ull << 23) - 1.0f; }
+};
+
+// uniform in [-scale, scale)
+std::vector<float> random_floats(SyntheticRng& rng, std::size_t n, float scale = 1.0f);
+// the same, truncated to bf16
+std::vector<std::uint16_t> random_bf16(SyntheticRng& rng, std::size_t n, float scale = 1.0f);
+// uniform in [lo, hi]
+std::vector<std::uint8_t> random_bytes(SyntheticRng& rng, std::size_t n, int lo = 0, int hi = 255);
+
+// A deterministic stand-in prompt of n token ids below vocab; different seeds give different
+// sequences.
+std::vector<std::int32_t> synthetic_tokens(std::size_t n, std::size_t vocab, std::size_t seed = 0);
+
+// A small gpt-oss shape (2 layers, 4 experts, hidden 256, vocab 4096) that builds in
+// milliseconds; every size satisfies the model's divisibility rules.
+ModelConfig synthetic_config();
+
+// Writes <dir>/model.safetensors with every tensor GPTOSSModel loads, under the real names
+// and shapes for `config`, filled with seeded random values scaled so activations stay
+// finite through all layers, plus a matching <dir>/config.json. Tensors are generated and
+// written one at a time, so large shapes don't need the whole model in memory.
+void write_synthetic_checkpoint(const std::string& dir, const ModelConfig& config, std::uint64_t seed = 1);
+
+// A checkpoint with its config and a model over it, the setup every test and bench starts
+// from. If it wrote a synthetic checkpoint, the directory goes away with it.
+class SyntheticModel {
+public:
+    SyntheticModel(const std::string& model_path, const std::string& config_path, std::string owned_dir,
+                   const ModelOptions& options = {});
+    ~SyntheticModel();
+    SyntheticModel(const SyntheticModel&) = delete;
+    SyntheticModel& operator=(const SyntheticModel&) = delete;
+
+    bool synthetic() const { return !owned_dir_.empty(); }
+    const std::string& path() const { return path_; }
+    const ModelConfig& config() const { return config_; }
+    Checkpoint& checkpoint() const { return *checkpoint_; }
+    GPTOSSModel& model() const { return *model_; }
+
+private:
+    std::string path_;
+    std::string owned_dir_;
+    std::unique_ptr<Checkpoint> checkpoint_;
+    ModelConfig config_;
+    std::unique_ptr<GPTOSSModel> model_;
+};
+
+// synthetic_config() with `layers` layers, written to <tmp>/<name> and loaded back
+SyntheticModel make_synthetic_model(const std::string& name, std::size_t layers = 2, std::uint64_t seed = 1);
+
+// For benches: the checkpoint at model_path (config from config_path, else ModelConfig::locate),
+// or when that's empty a synthetic one of `shape` written to <tmp>/<name>.
+SyntheticModel open_model_or_synthetic(const std::string& model_path, const std::string& config_path,
+                                       const std::string& name, const ModelConfig& shape = synthetic_config(),
+                                       const ModelOptions& options = {});
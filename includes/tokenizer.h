@@ -1,26 +1,129 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <span>
 #include <string>
 #include <string_view>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "vocab.h"
+
+// Small LRU of piece -> token ids for words that recur across a corpus. Split into
+// independently locked shards so batch encoding threads rarely contend.
+class BpeCache {
+public:
+    explicit BpeCache(std::size_t capacity) : shard_capacity_(capacity / kShards) {}
+
+    bool lookup(std::string_view piece, std::vector<std::int32_t>& out);
+    void insert(std::string_view piece, const std::int32_t* ids, std::size_t count);
+
+private:
+    static constexpr std::size_t kShards = 16;
+    using Entry = std::pair<std::string, std::vector<std::int32_t>>;
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> lru;
+        std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+    };
+    std::size_t shard_capacity_;
+    std::array<Shard, kShards> shards_;
+
+    Shard& shard_for(std::string_view piece) {
+        return shards_[std::hash<std::string_view>{}(piece) % kShards];
+    }
+};
+
 class Tokenizer {
 public:
+    // path is either a .tiktoken file or a binary vocab from gptoss-vocab (mmap'd).
     explicit Tokenizer(const std::string& path);
     ~Tokenizer();
 
-    std::vector<std::int32_t> encode(std::string text) const;
+    // Special tokens (<|start|>, <|message|>, ... see harmony.h) are only recognized
+    // when allow_special is set, otherwise text containing one is rejected.
+    std::vector<std::int32_t> encode(std::string_view text, bool allow_special = false) const;
+
+    // Encodes independent documents in parallel, one result per input.
+    std::vector<std::vector<std::int32_t>> encode_batch(std::span<const std::string_view> texts,
+                                                        bool allow_special = false) const;
+
+    // Large-document mode: splits text at boundaries where a pre-token is guaranteed to
+    // start, encodes the chunks in parallel and stitches them. Matches encode(text).
+    std::vector<std::int32_t> encode_large(std::string_view text,
+                                           std::size_t chunk_bytes = kLargeChunkBytes,
+                                           bool allow_special = false) const;
+
+    // Token counts without materializing the id vectors (large inputs are chunked).
+    std::size_t count_tokens(std::string_view text, bool allow_special = false) const;
+    std::vector<std::size_t> count_tokens_batch(std::span<const std::string_view> texts,
+                                                bool allow_special = false) const;
+
     std::string decode(std::int32_t token) const;
+    std::string decode(std::span<const std::int32_t> tokens) const;
+    // Zero-copy view of a token's bytes (special tokens give their name).
+    std::string_view token_bytes(std::int32_t token) const;
+    // Bytes of every ordinary token indexed by id, specials excluded (for TokenTrie).
+    std::vector<std::string_view> ordinary_tokens() const;
+#ifdef GPTOSS_HAVE_ICU
+    // ICU reference for the native pre-tokenizer, kept for parity checks.
     std::vector<std::string> regex_split(
         const std::string& text,
         const std::string& pattern) const;
+#endif
+
+    static constexpr std::size_t kLargeChunkBytes = 1 << 20;
 
 private:
     std::string path_;
-    std::vector<std::string> id_to_token_;
-    std::unordered_map<std::string, std::int32_t> token_to_id_;
+    Vocab vocab_;
+    std::vector<std::string> special_names_;  // indexed by id - harmony::kFirstSpecial
+    std::unordered_map<std::string_view, std::int32_t> special_to_id_;
+    // longest special name, bounds how far segment() looks for a closing "|>"
+    std::size_t max_special_len_{0};
+    mutable BpeCache cache_{1 << 14};
+
+    // A run of ordinary text (special < 0) or a single special token.
+    struct Segment {
+        std::string_view text;
+        std::int32_t special;
+    };
+    // One pass over text splitting special tokens from ordinary runs; with
+    // split_chunk_bytes > 0 long ordinary runs are further cut for parallel encoding.
+    std::vector<Segment> segment(std::string_view text, bool allow_special,
+                                 std::size_t split_chunk_bytes = 0) const;
+
+    void encode_ordinary(std::string_view text, std::vector<std::int32_t>& out) const;
+    std::size_t count_ordinary(std::string_view text) const;
+
+    // Runs the merges for one piece, leaving the result in thread-local symbol links.
+    void bpe_merge(std::string_view piece) const;
+    // Appends the ids for one pre-tokenized piece to out.
+    void bpe_encode_piece(std::string_view piece, std::vector<std::int32_t>& out) const;
+    std::size_t bpe_count_piece(std::string_view piece) const;
+};
+
+// Per-stream incremental detokenizer. Token bytes are appended to a reusable buffer and
+// only complete UTF-8 sequences are released, so a codepoint split across tokens is
+// never streamed half-written. Once the buffer has grown, push() does not allocate.
+class DetokenizerState {
+public:
+    explicit DetokenizerState(const Tokenizer& tokenizer) : tokenizer_(tokenizer) {}
 
-    std::vector<std::int32_t> bpe_encode_piece(const std::string& piece) const;
+    // Appends one token and returns the newly completed text (valid until the next call).
+    std::string_view push(std::int32_t token);
+    // Releases whatever is still pending at end of stream, complete or not.
+    std::string_view flush();
+    void reset();
+
+private:
+    const Tokenizer& tokenizer_;
+    std::string buffer_;
+    std::size_t emitted_{0};
 };
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+// Scoped trace zones for the hot path. GPTOSS_TRACE_SCOPE("name") times the rest of the
+// enclosing scope into a per-thread ring buffer (no locks, no allocation after the ring
+// exists) and, if asked, samples cycles/instructions/LLC misses via perf_event_open at
+// both ends. Zones compile to nothing unless the build defines GPTOSS_TRACE (cmake
+// -DGPTOSS_TRACE=ON), and record nothing until trace::start().
+namespace trace {
+
+struct Options {
+    // perf_event_open counters per thread; silently off where the kernel refuses them
+    bool hardware_counters{false};
+    // events kept per thread, oldest are overwritten
+    std::size_t ring_capacity{std::size_t{1} << 16};
+};
+
+#if defined(GPTOSS_TRACE)
+constexpr bool kCompiledIn = true;
+#else
+constexpr bool kCompiledIn = false;
+#endif
+
+void start(const Options& options = {});
+void stop();
+bool active();
+// true once a thread actually got its counters open
+bool hardware_counters_active();
+// drops every recorded event
+void clear();
+std::size_t event_count();
+
+// The dump functions read every thread's ring, call them after stop() once the traced
+// work has finished.
+// Chrome trace-event JSON, loads in chrome://tracing and ui.perfetto.dev
+void write_chrome_json(const std::string& path);
+// per-zone calls, total/mean/max time, share of the traced wall time and, with counters,
+// IPC and LLC misses per call
+void write_summary(std::ostream& os);
+
+class Zone {
+public:
+    // name must outlive the trace (string literals)
+    explicit Zone(const char* name);
+    ~Zone();
+    Zone(const Zone&) = delete;
+    Zone& operator=(const Zone&) = delete;
+
+private:
+    const char* name_;
+    std::uint64_t start_ns_{0};
+    std::uint64_t start_counters_[3]{};
+    bool recording_{false};
+};
+
+}  // namespace trace
+
+#if defined(GPTOSS_TRACE)
+#define GPTOSS_TRACE_CONCAT_(a, b) a##b
+#define GPTOSS_TRACE_CONCAT(a, b) GPTOSS_TRACE_CONCAT_(a, b)
+#define GPTOSS_TRACE_SCOPE(name) ::trace::Zone GPTOSS_TRACE_CONCAT(trace_zone_, __LINE__)(name)
+#else
+#define GPTOSS_TRACE_SCOPE(name) \
+    do {                         \
+    } while (0)
+#endif
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+
+// One end of a duplex message channel between two processes. Messages arrive whole and
+// in order; there is no size limit, big ones are streamed through the underlying buffer.
+// Both calls block and throw std::runtime_error once the other end is gone.
+class Transport {
+public:
+    virtual ~Transport() = default;
+
+    // the parts go out back to back as a single message (saves gluing a header onto a payload)
+    virtual void sendv(std::span<const std::span<const std::byte>> parts) = 0;
+    void send(std::span<const std::byte> msg) { sendv(std::span<const std::span<const std::byte>>(&msg, 1)); }
+    // replaces msg with the next message
+    virtual void recv(std::vector<std::byte>& msg) = 0;
+
+    // Polled while blocked; returning false fails the call instead of waiting forever on a
+    // peer that crashed without closing its end. Sockets see EOF and don't need it.
+    void set_peer_check(std::function<bool()> alive) { peer_alive_ = std::move(alive); }
+
+protected:
+    std::function<bool()> peer_alive_;
+};
+
+enum class TransportKind {
+    // pair of single-producer/single-consumer rings in a MAP_SHARED mapping, futex wakeups
+    SharedMemory,
+    // AF_UNIX socketpair, same framing as any stream socket (TCP across hosts)
+    Socket,
+};
+
+// Both ends of a fresh channel, to be created before fork(): one process keeps .first and
+// drops .second, the other the opposite. ring_bytes is per direction (shared memory only).
+std::pair<std::unique_ptr<Transport>, std::unique_ptr<Transport>> make_transport_pair(
+    TransportKind kind, std::size_t ring_bytes = std::size_t{8} << 20);
+
+// Wraps a connected stream socket (socketpair, AF_UNIX or TCP); takes ownership of fd.
+std::unique_ptr<Transport> socket_transport(int fd);
+
+TransportKind parse_transport_kind(const std::string& name);
+
+// fork() for a peer that goes on computing: flushes stdio so nothing buffered gets printed
+// twice, and releases the OpenMP thread pool first, since libgomp's doesn't survive fork()
+// (the child would hang in its first parallel region). Call it outside parallel regions.
+pid_t fork_peer();
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+
+// Character class bits used by the o200k pre-tokenizer. The "sets" mirror the two
+// bracket expressions of the tiktoken pattern:
+//   upper set = [\p{Lu}\p{Lt}\p{Lm}\p{Lo}\p{M}]
+//   lower set = [\p{Ll}\p{Lm}\p{Lo}\p{M}]
+enum UnicodeClassBits : std::uint8_t {
+    kUcLetter = 1 << 0,    // \p{L}
+    kUcNumber = 1 << 1,    // \p{N}
+    kUcSpace = 1 << 2,     // \s (White_Space)
+    kUcNewline = 1 << 3,   // \r or \n
+    kUcUpperSet = 1 << 4,
+    kUcLowerSet = 1 << 5,
+};
+
+struct UnicodeRange {
+    std::uint32_t first;
+    std::uint32_t last;
+    std::uint8_t bits;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Token byte strings indexed both ways: id -> bytes through an offset table into one
+// contiguous arena, bytes -> id through an open-addressing hash index. The same layout
+// is built in memory from a .tiktoken file or mmap'd read-only from a binary vocab
+// written by save() (see gptoss-vocab), in which case processes share its pages.
+//
+// binary layout (little endian):
+//   VocabFileHeader
+//   u32 offsets[count + 1]   byte range of token i is [offsets[i], offsets[i + 1])
+//   u32 slots[num_slots]     id + 1, or 0 for an empty slot (num_slots is a power of 2)
+//   u8  arena[arena_bytes]
+class Vocab {
+public:
+    // Detects the format from the file's magic.
+    explicit Vocab(const std::string& path);
+    ~Vocab();
+
+    Vocab(const Vocab&) = delete;
+    Vocab& operator=(const Vocab&) = delete;
+
+    std::size_t size() const { return count_; }
+    std::string_view token(std::int32_t id) const {
+        return std::string_view(arena_ + offsets_[id], offsets_[id + 1] - offsets_[id]);
+    }
+    // Rank (= id) of a byte string, -1 when it is not a token.
+    std::int32_t rank(std::string_view bytes) const;
+
+    void save(const std::string& path) const;
+    bool is_mapped() const { return map_base_ != nullptr; }
+
+private:
+    std::uint32_t count_{0};
+    std::uint32_t slot_mask_{0};
+    const std::uint32_t* offsets_{nullptr};
+    const std::uint32_t* slots_{nullptr};
+    const char* arena_{nullptr};
+    std::uint64_t arena_bytes_{0};
+
+    std::vector<std::byte> owned_;
+    void* map_base_{nullptr};
+    std::size_t map_length_{0};
+
+    void load_tiktoken(const std::string& path);
+    void map_binary(const std::string& path);
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Checkpoint;
+
+// Reads a checkpoint's weights in layer-execution order in the background so a cold
+// start doesn't page-fault through the file 4 KB at a time. Stage 0 is the embedding,
+// stage i + 1 is block i and the last stage is the final norm + unembedding; the model
+// waits on a stage right before it needs it, so layer 0 runs while later layers are
+// still in flight.
+//
+// Uses io_uring (large buffered reads that fill the page cache) when the kernel allows
+// it, otherwise a few threads doing MADV_POPULATE_READ over the mapping.
+class WeightStreamer {
+public:
+    struct Options {
+        std::size_t read_bytes = 2u << 20;
+        unsigned queue_depth = 16;
+        unsigned fallback_threads = 4;
+        bool force_fallback = false;
+    };
+
+    // starts streaming immediately; the checkpoint must outlive the streamer
+    explicit WeightStreamer(const Checkpoint& checkpoint);
+    WeightStreamer(const Checkpoint& checkpoint, Options options);
+    ~WeightStreamer();
+
+    WeightStreamer(const WeightStreamer&) = delete;
+    WeightStreamer& operator=(const WeightStreamer&) = delete;
+
+    std::size_t num_stages() const { return num_stages_; }
+    void wait_stage(std::size_t stage) const;
+    void wait_embedding() const { wait_stage(0); }
+    void wait_layer(std::size_t layer) const { wait_stage(layer + 1); }
+    void wait_unembedding() const { wait_stage(num_stages_ - 1); }
+    void wait_all() const;
+
+    bool using_io_uring() const { return using_io_uring_; }
+    std::uint64_t total_bytes() const { return total_bytes_; }
+    // time from construction until every stage was in, blocks until then
+    double seconds_to_ready() const;
+
+private:
+    struct Range {
+        std::uint64_t offset;
+        std::uint64_t bytes;
+        const std::byte* addr;
+        std::size_t stage;
+        std::uint32_t shard;
+    };
+
+    struct Ring;
+
+    const Checkpoint& checkpoint_;
+    Options options_;
+    std::vector<Range> ranges_;
+    std::size_t num_stages_{0};
+    std::uint64_t total_bytes_{0};
+    std::unique_ptr<std::atomic<std::size_t>[]> remaining_;
+    std::atomic<std::size_t> next_range_{0};
+    std::atomic<bool> stop_{false};
+    std::unique_ptr<Ring> ring_;
+    bool using_io_uring_{false};
+    std::size_t stages_done_{0};
+    std::chrono::steady_clock::time_point start_;
+    std::chrono::steady_clock::time_point ready_;
+    mutable std::mutex mutex_;
+    mutable std::condition_variable cv_;
+    std::vector<std::thread> threads_;
+
+    void plan();
+    void complete(const Range& range);
+    void populate(const Range& range) const;
+    void run_fallback();
+    void run_io_uring();
+};
@@ -0,0 +1,238 @@
+#include "branch_decoder.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <utility>
+
+#include "kernels.h"
+#include "kv_cache.h"
+
+namespace {
+
+double log_sum_exp(std::span<const float> logits) {
+    const float max_val = *std::max_element(logits.begin(), logits.end());
+    double sum = 0.0;
+    for (float l : logits) sum += std::exp(static_cast<double>(l - max_val));
+    return max_val + std::log(sum);
+}
+
+// indices of the k largest logits, largest first
+void top_tokens(std::span<const float> logits, std::size_t k, std::vector<std::int32_t>& out) {
+    out.resize(logits.size());
+    std::iota(out.begin(), out.end(), 0);
+    k = std::min(k, out.size());
+    const auto greater = [&](std::int32_t a, std::int32_t b) { return logits[a] > logits[b]; };
+    std::nth_element(out.begin(), out.begin() + static_cast<std::ptrdiff_t>(k - 1), out.end(), greater);
+    out.resize(k);
+    std::sort(out.begin(), out.end(), greater);
+}
+
+std::int32_t pick(std::span<const float> logits, const SamplingOptions& options, std::mt19937_64& rng,
+                  std::vector<std::int32_t>& candidates, std::vector<double>& probs) {
+    if (options.temperature <= 0.0f) return argmax(logits);
+    if (options.top_k > 0) {
+        top_tokens(logits, options.top_k, candidates);
+    } else {
+        candidates.resize(logits.size());
+        std::iota(candidates.begin(), candidates.end(), 0);
+    }
+    float max_val = logits[candidates[0]];
+    for (std::int32_t t : candidates) max_val = std::max(max_val, logits[t]);
+    probs.resize(candidates.size());
+    double sum = 0.0;
+    for (std::size_t i = 0; i < candidates.size(); ++i) {
+        probs[i] = std::exp(static_cast<double>(logits[candidates[i]] - max_val) / options.temperature);
+        sum += probs[i];
+    }
+    double r = std::uniform_real_distribution<double>(0.0, sum)(rng);
+    for (std::size_t i = 0; i < candidates.size(); ++i) {
+        r -= probs[i];
+        if (r <= 0.0) return candidates[i];
+    }
+    return candidates.back();
+}
+
+}  // namespace
+
+BranchDecoder::BranchDecoder(const GPTOSSModel& model, std::size_t block_tokens, std::size_t prefill_chunk)
+    : model_(model),
+      pool_(model.config().num_hidden_layers, model.config().num_key_value_heads * model.config().head_dim,
+            block_tokens),
+      prefill_chunk_(prefill_chunk),
+      logits_(model.config().vocab_size) {}
+
+PagedKVCache BranchDecoder::prefill(std::span<const std::int32_t> prompt) {
+    if (prompt.empty()) throw std::runtime_error("branch decoder needs a prompt");
+    KVCache cache(model_.config().num_hidden_layers);
+    logits_.resize(model_.config().vocab_size);
+    ChunkedPrefill chunked(model_, prompt, cache, buf_, prefill_chunk_);
+    while (!chunked.step(logits_)) {
+    }
+    stats_.prefill_tokens += prompt.size();
+    PagedKVCache paged(pool_);
+    paged.assign(cache);
+    return paged;
+}
+
+void BranchDecoder::decode(std::span<const std::int32_t> tokens, std::span<PagedKVCache* const> caches) {
+    logits_.resize(tokens.size() * model_.config().vocab_size);
+    model_.forward_batch(tokens, logits_, caches, buf_);
+    stats_.decode_steps++;
+    stats_.decode_rows += tokens.size();
+    stats_.peak_blocks = std::max(stats_.peak_blocks, pool_.blocks_in_use());
+}
+
+std::vector<Completion> BranchDecoder::sample(std::span<const std::int32_t> prompt,
+                                              std::size_t n,
+                                              std::size_t max_new_tokens,
+                                              const SamplingOptions& options,
+                                              std::int32_t stop_token) {
+    std::vector<Completion> out(n);
+    if (n == 0 || max_new_tokens == 0) return out;
+    const std::size_t vocab = model_.config().vocab_size;
+    std::mt19937_64 rng(options.seed);
+    std::vector<std::int32_t> candidates;
+    std::vector<double> probs;
+
+    PagedKVCache root = prefill(prompt);
+    std::vector<PagedKVCache> kv;
+    std::vector<bool> done(n, false);
+    {
+        const std::span<const float> row(logits_.data(), vocab);
+        const double lse = log_sum_exp(row);
+        for (std::size_t i = 0; i < n; ++i) {
+            kv.push_back(i + 1 < n ? root.fork() : std::move(root));
+            const std::int32_t token = pick(row, options, rng, candidates, probs);
+            out[i].tokens.push_back(token);
+            out[i].logprob += row[token] - lse;
+            done[i] = token == stop_token || max_new_tokens == 1;
+            if (done[i]) kv[i].clear();
+        }
+    }
+
+    std::vector<std::size_t> live;
+    std::vector<std::int32_t> tokens;
+    std::vector<PagedKVCache*> caches;
+    while (true) {
+        live.clear();
+        tokens.clear();
+        caches.clear();
+        for (std::size_t i = 0; i < n; ++i) {
+            if (done[i]) continue;
+            live.push_back(i);
+            tokens.push_back(out[i].tokens.back());
+            caches.push_back(&kv[i]);
+        }
+        if (live.empty()) break;
+        decode(tokens, caches);
+        for (std::size_t r = 0; r < live.size(); ++r) {
+            const std::size_t i = live[r];
+            const std::span<const float> row(logits_.data() + r * vocab, vocab);
+            const std::int32_t token = pick(row, options, rng, candidates, probs);
+            out[i].tokens.push_back(token);
+            out[i].logprob += row[token] - log_sum_exp(row);
+            done[i] = token == stop_token || out[i].tokens.size() >= max_new_tokens;
+            // its blocks go back right away rather than when the slowest branch is done
+            if (done[i]) kv[i].clear();
+        }
+    }
+    return out;
+}
+
+std::vector<Completion> BranchDecoder::beam_search(std::span<const std::int32_t> prompt,
+                                                   std::size_t beam_width,
+                                                   std::size_t max_new_tokens,
+                                                   std::int32_t stop_token) {
+    struct Beam {
+        PagedKVCache kv;
+        Completion completion;
+    };
+    struct Candidate {
+        std::size_t parent;
+        std::int32_t token;
+        double score;
+    };
+    if (beam_width == 0 || max_new_tokens == 0) return {};
+    const std::size_t vocab = model_.config().vocab_size;
+    std::vector<Completion> finished;
+    std::vector<Beam> beams;
+    std::vector<Candidate> candidates;
+    std::vector<std::int32_t> top;
+
+    const auto is_done = [&](const Completion& c) {
+        return c.tokens.back() == stop_token || c.tokens.size() >= max_new_tokens;
+    };
+    // Keeps the beam_width best candidates. Parents picked more than once are forked,
+    // their last pick takes the original.
+    const auto advance = [&](std::vector<Beam>& parents) {
+        const std::size_t keep = std::min(beam_width, candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin() + static_cast<std::ptrdiff_t>(keep),
+                          candidates.end(), [](const Candidate& a, const Candidate& b) { return a.score > b.score; });
+        candidates.resize(keep);
+        std::vector<std::size_t> uses(parents.size(), 0);
+        for (const Candidate& c : candidates) uses[c.parent]++;
+        std::vector<Beam> next;
+        for (const Candidate& c : candidates) {
+            Beam& parent = parents[c.parent];
+            Beam child{--uses[c.parent] == 0 ? std::move(parent.kv) : parent.kv.fork(), parent.completion};
+            child.completion.tokens.push_back(c.token);
+            child.completion.logprob = c.score;
+            if (is_done(child.completion)) {
+                finished.push_back(std::move(child.completion));
+            } else {
+                next.push_back(std::move(child));
+            }
+        }
+        parents = std::move(next);
+    };
+
+    {
+        std::vector<Beam> root;
+        root.push_back({prefill(prompt), {}});
+        const std::span<const float> row(logits_.data(), vocab);
+        const double lse = log_sum_exp(row);
+        top_tokens(row, beam_width, top);
+        for (std::int32_t t : top) candidates.push_back({0, t, row[t] - lse});
+        advance(root);
+        beams = std::move(root);
+    }
+
+    std::vector<std::int32_t> tokens;
+    std::vector<PagedKVCache*> caches;
+    while (!beams.empty()) {
+        // log-probabilities only add up negative, so no live beam can pass these anymore
+        if (finished.size() >= beam_width) {
+            std::vector<double> scores;
+            for (const Completion& c : finished) scores.push_back(c.logprob);
+            std::nth_element(scores.begin(), scores.begin() + static_cast<std::ptrdiff_t>(beam_width - 1),
+                             scores.end(), std::greater<>());
+            double best_live = beams[0].completion.logprob;
+            for (const Beam& b : beams) best_live = std::max(best_live, b.completion.logprob);
+            if (scores[beam_width - 1] >= best_live) break;
+        }
+        tokens.clear();
+        caches.clear();
+        for (Beam& b : beams) {
+            tokens.push_back(b.completion.tokens.back());
+            caches.push_back(&b.kv);
+        }
+        decode(tokens, caches);
+        candidates.clear();
+        for (std::size_t b = 0; b < beams.size(); ++b) {
+            const std::span<const float> row(logits_.data() + b * vocab, vocab);
+            const double lse = log_sum_exp(row);
+            top_tokens(row, beam_width, top);
+            for (std::int32_t t : top) candidates.push_back({b, t, beams[b].completion.logprob + row[t] - lse});
+        }
+        advance(beams);
+    }
+
+    std::sort(finished.begin(), finished.end(),
+              [](const Completion& a, const Completion& b) { return a.logprob > b.logprob; });
+    if (finished.size() > beam_width) finished.resize(beam_width);
+    return finished;
+}
@@ -22,8 +22,11 @@ saftensor file format (predictably in this order)
 #include <cctype>
 #include <cstddef>
 #include <cstring>
+#include <exception>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <stdexcept>
 
 #include <fcntl.h>
@@ -32,153 +35,33 @@ saftensor file format (predictably in this order)
 #include <unistd.h>
 
 
-Checkpoint::Checkpoint(const std::string& path) {
-    path_ = path;
-    std::ifstream file_stream(path, std::ios::binary);
-    if (!file_stream) throw std::runtime_error("wrong path or file DNE");
-
-    try {
-        file_stream.read(reinterpret_cast<char*>(&header_len), 8);
-        header.resize(header_len);
-        file_stream.read(&header[0], header_len);
-    } catch (const std::exception& e) {
-        std::cerr << e.what() << std::endl;
-    }
-    processHeader();
-    file_stream.close();
-    // debugPrintCheckpoint();
-
-    // memory map the file
-    mmap_weights();
-    finalizeTensorData();
-}
-
-Checkpoint::~Checkpoint() {
-    if (map_base_ && map_base_ != MAP_FAILED) {
-        munmap(map_base_, map_length_);
-    }
-    if (file_descriptor_ >= 0) {
-        close(file_descriptor_);
-    }
-}
-
-const TensorMeta_& Checkpoint::get(const std::string& name) const {
-    auto it = meta_.find(name);
-    if (it == meta_.end()) {
-        throw std::runtime_error("tensor not found in checkpoint: " + name);
-    }
-    return it->second;
-}
-
-const std::uint16_t* Checkpoint::get_bf16_ptr(const std::string& name) const {
-    const auto& meta = get(name);
-    if (meta.dtype != DType::BF16) {
-        throw std::runtime_error("tensor dtype is not BF16: " + name);
-    }
-    return reinterpret_cast<const std::uint16_t*>(meta.data);
-}
-
-std::size_t Checkpoint::get_bf16_count(const std::string& name) const {
-    const auto& meta = get(name);
-    if (meta.dtype != DType::BF16) {
-        throw std::runtime_error("tensor dtype is not BF16: " + name);
-    }
-    return meta.byte_size / sizeof(std::uint16_t);
-}
-
-const std::uint8_t* Checkpoint::get_u8_ptr(const std::string& name) const {
-    const auto& meta = get(name);
-    if (meta.dtype != DType::U8) {
-        throw std::runtime_error("tensor dtype is not U8: " + name);
-    }
-    return reinterpret_cast<const std::uint8_t*>(meta.data);
-}
+namespace {
 
-std::size_t Checkpoint::get_u8_count(const std::string& name) const {
-    const auto& meta = get(name);
-    if (meta.dtype != DType::U8) {
-        throw std::runtime_error("tensor dtype is not U8: " + name);
-    }
-    return meta.byte_size;
-}
+// Hand-rolled parser for one safetensors JSON header (also good enough for the shard
+// index.json). Shards parse their headers independently, so this holds no Checkpoint state.
+class SafetensorsHeader {
+public:
+    explicit SafetensorsHeader(const std::string& header) : header(header) {}
 
-Checkpoint::MXFP4Pair Checkpoint::get_mxfp4_pair(
-    const std::string& base_name,
-    std::initializer_list<std::uint64_t> expected_prefix,
-    std::size_t expected_blocks_rank,
-    std::size_t expected_scales_rank) const {
-    const std::string blocks_name = base_name + ".blocks";
-    const std::string scales_name = base_name + ".scales";
-    const auto& blocks_meta = get(blocks_name);
-    const auto& scales_meta = get(scales_name);
-    assert(blocks_meta.shape.size() == expected_blocks_rank);
-    assert(scales_meta.shape.size() == expected_scales_rank);
-    std::size_t i = 0;
-    for (auto expected_dim : expected_prefix) {
-        assert(i < blocks_meta.shape.size());
-        assert(i < scales_meta.shape.size());
-        assert(blocks_meta.shape[i] == expected_dim);
-        assert(scales_meta.shape[i] == expected_dim);
-        i++;
-    }
-    return MXFP4Pair{
-        get_u8_ptr(blocks_name),
-        get_u8_count(blocks_name),
-        get_u8_ptr(scales_name),
-        get_u8_count(scales_name),
-    };
-}
+    std::vector<TensorMeta_> parse();
+    // shard file names from an index.json "weight_map", in first-seen order
+    std::vector<std::string> parseWeightMapFiles();
 
-void Checkpoint::mmap_weights() {
-    file_descriptor_ = ::open(path_.c_str(), O_RDONLY);
-    struct stat st {};
-    fstat(file_descriptor_, &st);
+private:
+    const std::string& header;
 
-    std::uint64_t data_offset = 8 + header_len;
-    if (st.st_size < static_cast<off_t>(data_offset)) {
-        close(file_descriptor_);
-        file_descriptor_ = -1;
-        throw std::runtime_error("invalid safetensor file");
-    }
+    void skipWhitespace(std::uint64_t& i);
+    void expectChar(std::uint64_t& i, char expected);
+    std::string parseJSONString(std::uint64_t& i);
+    std::uint64_t parseUInt64(std::uint64_t& i);
+    std::vector<std::uint64_t> parseUInt64Array(std::uint64_t& i);
+    DType parseDTypeString(const std::string& dtype);
+    void parseTensorMeta(std::uint64_t& i, TensorMeta_& meta_instance);
+    void skipJSONValue(std::uint64_t& i);
+};
 
-    size_t page_size = sysconf(_SC_PAGE_SIZE);
-    std::uint64_t page_offset = data_offset % static_cast<std::uint64_t>(page_size);
-    const off_t map_offset = static_cast<off_t>(data_offset - page_offset);
-    map_length_ = static_cast<std::size_t>(st.st_size - map_offset);
-
-    map_base_ = mmap(nullptr, map_length_, PROT_READ, MAP_PRIVATE, file_descriptor_, map_offset);
-    if (map_base_ == MAP_FAILED) {
-        close(file_descriptor_);
-        file_descriptor_ = -1;
-        throw std::runtime_error("mmap failed for safetensor weights");
-    }
-    // Later used in finalizeTensorData to 
-    weights = reinterpret_cast<std::byte*>(map_base_) + page_offset;
-}
-
-void Checkpoint::finalizeTensorData() {
-    for (auto& it : meta_) {
-        auto& meta = it.second;
-        if (meta.offset.size() != 2) {
-            throw std::runtime_error("invalid data_offsets for tensor: " + meta.name);
-        }
-        const std::uint64_t begin = meta.offset[0];
-        const std::uint64_t end = meta.offset[1];
-        if (end < begin) {
-            throw std::runtime_error("invalid data_offsets range for tensor: " + meta.name);
-        }
-        meta.byte_size = static_cast<std::size_t>(end - begin);
-        meta.data = weights + begin;
-    }
-}
-
-void Checkpoint::debugPrintCheckpoint() {
-    for (const auto& it : meta_) {
-        std::cout << it.second;
-    }
-}
-
-void Checkpoint::processHeader() {
+std::vector<TensorMeta_> SafetensorsHeader::parse() {
+    std::vector<TensorMeta_> tensors;
     std::uint64_t i = 0;
     skipWhitespace(i);
     if (header[i] == '{')
@@ -200,7 +83,7 @@ void Checkpoint::processHeader() {
         } else {
             meta_instance.name = entry_name;
             parseTensorMeta(i, meta_instance);
-            meta_.emplace(meta_instance.name, std::move(meta_instance));
+            tensors.push_back(std::move(meta_instance));
         }
 
         skipWhitespace(i);
@@ -211,20 +94,21 @@ void Checkpoint::processHeader() {
         if (header[i] == '}') break;
         throw std::runtime_error("safetensor header unable to parse");
     }
+    return tensors;
 }
 
-void Checkpoint::skipWhitespace(std::uint64_t& i) {
+void SafetensorsHeader::skipWhitespace(std::uint64_t& i) {
     while (i < header.size() && std::isspace(static_cast<unsigned char>(header[i]))) i++;
 }
 
-void Checkpoint::expectChar(std::uint64_t& i, char expected) {
+void SafetensorsHeader::expectChar(std::uint64_t& i, char expected) {
     if (i >= header.size() || header[i] != expected) {
         throw std::runtime_error("safetensor header unable to parse");
     }
     i++;
 }
 
-std::string Checkpoint::parseJSONString(std::uint64_t& i) {
+std::string SafetensorsHeader::parseJSONString(std::uint64_t& i) {
     if (header[i] == '"')
         i++;
     else
@@ -233,9 +117,9 @@ std::string Checkpoint::parseJSONString(std::uint64_t& i) {
     std::string parsed_string;
     while (i < header.size()) {
         char c = header[i++];
-        // assume no escape characters (who would put escape chars in a safetensor nani)
-        if (c == '\\') {
-            throw std::runtime_error("not implemented");
+        // escapes only show up in index.json metadata, keep the escaped char and move on
+        if (c == '\\' && i < header.size()) {
+            parsed_string.push_back(header[i++]);
         } else if (c == '"') {
             break;
         } else {
@@ -245,7 +129,7 @@ std::string Checkpoint::parseJSONString(std::uint64_t& i) {
     return parsed_string;
 }
 
-std::uint64_t Checkpoint::parseUInt64(std::uint64_t& i) {
+std::uint64_t SafetensorsHeader::parseUInt64(std::uint64_t& i) {
     skipWhitespace(i);
     if (i >= header.size() || !std::isdigit(static_cast<unsigned char>(header[i]))) {
         throw std::runtime_error("safetensor header unable to parse");
@@ -258,7 +142,7 @@ std::uint64_t Checkpoint::parseUInt64(std::uint64_t& i) {
     return value;
 }
 
-std::vector<std::uint64_t> Checkpoint::parseUInt64Array(std::uint64_t& i) {
+std::vector<std::uint64_t> SafetensorsHeader::parseUInt64Array(std::uint64_t& i) {
     std::vector<std::uint64_t> values;
     expectChar(i, '[');
     skipWhitespace(i);
@@ -282,13 +166,13 @@ std::vector<std::uint64_t> Checkpoint::parseUInt64Array(std::uint64_t& i) {
     return values;
 }
 
-DType Checkpoint::parseDTypeString(const std::string& dtype) {
+DType SafetensorsHeader::parseDTypeString(const std::string& dtype) {
     if (dtype == "BF16") return DType::BF16;
     if (dtype == "U8") return DType::U8;
     throw std::runtime_error("unexpected dtype here");
 }
 
-void Checkpoint::parseTensorMeta(std::uint64_t& i, TensorMeta_& meta_instance) {
+void SafetensorsHeader::parseTensorMeta(std::uint64_t& i, TensorMeta_& meta_instance) {
     expectChar(i, '{');
     while (i < header.size()) {
         skipWhitespace(i);
@@ -324,7 +208,7 @@ void Checkpoint::parseTensorMeta(std::uint64_t& i, TensorMeta_& meta_instance) {
     }
 }
 
-void Checkpoint::skipJSONValue(std::uint64_t& i) {
+void SafetensorsHeader::skipJSONValue(std::uint64_t& i) {
     skipWhitespace(i);
     if (i >= header.size()) throw std::runtime_error("safetensor header unable to parse");
 
@@ -405,3 +289,498 @@ void Checkpoint::skipJSONValue(std::uint64_t& i) {
 
     throw std::runtime_error("safetensor header unable to parse");
 }
+
+std::vector<std::string> SafetensorsHeader::parseWeightMapFiles() {
+    std::vector<std::string> files;
+    std::uint64_t i = 0;
+    skipWhitespace(i);
+    expectChar(i, '{');
+    while (i < header.size()) {
+        skipWhitespace(i);
+        if (header[i] == '}') break;
+        const std::string key = parseJSONString(i);
+        skipWhitespace(i);
+        expectChar(i, ':');
+        skipWhitespace(i);
+        if (key != "weight_map") {
+            skipJSONValue(i);
+        } else {
+            expectChar(i, '{');
+            while (i < header.size()) {
+                skipWhitespace(i);
+                if (header[i] == '}') {
+                    i++;
+                    break;
+                }
+                parseJSONString(i);
+                skipWhitespace(i);
+                expectChar(i, ':');
+                skipWhitespace(i);
+                std::string file = parseJSONString(i);
+                if (std::find(files.begin(), files.end(), file) == files.end()) files.push_back(std::move(file));
+                skipWhitespace(i);
+                if (header[i] == ',') i++;
+            }
+        }
+        skipWhitespace(i);
+        if (header[i] == ',') {
+            i++;
+            continue;
+        }
+        if (header[i] == '}') break;
+        throw std::runtime_error("shard index unable to parse");
+    }
+    if (files.empty()) throw std::runtime_error("shard index has no weight_map");
+    return files;
+}
+
+std::string read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error("failed to open " + path);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// A directory (index.json inside, else every *.safetensors), an index.json, or one file.
+std::vector<std::string> resolve_shards(const std::string& path) {
+    namespace fs = std::filesystem;
+    fs::path index;
+    if (fs::is_directory(path)) {
+        index = fs::path(path) / "model.safetensors.index.json";
+        if (!fs::exists(index)) {
+            std::vector<std::string> files;
+            for (const auto& entry : fs::directory_iterator(path)) {
+                if (entry.path().extension() == ".safetensors") files.push_back(entry.path().string());
+            }
+            if (files.empty()) throw std::runtime_error("no .safetensors files in " + path);
+            std::sort(files.begin(), files.end());
+            return files;
+        }
+    } else if (fs::path(path).extension() == ".json") {
+        index = path;
+    } else {
+        return {path};
+    }
+    std::vector<std::string> files = SafetensorsHeader(read_file(index.string())).parseWeightMapFiles();
+    for (auto& file : files) file = (index.parent_path() / file).string();
+    return files;
+}
+
+}  // namespace
+
+
+Checkpoint::Checkpoint(const std::string& path) {
+    path_ = path;
+    try {
+        const std::vector<std::string> files = resolve_shards(path);
+        char magic[sizeof(kPackedMagic)] = {};
+        std::ifstream file_stream(files[0], std::ios::binary);
+        if (!file_stream) throw std::runtime_error("wrong path or file DNE");
+        file_stream.read(magic, sizeof(magic));
+        if (files.size() == 1 && file_stream && std::memcmp(magic, kPackedMagic, sizeof(magic)) == 0) {
+            shards_.push_back(Shard{files[0]});
+            loadPacked();
+        } else {
+            loadSafetensors(files);
+            buildDirectory();
+        }
+    } catch (...) {
+        release();
+        throw;
+    }
+    // debugPrintCheckpoint();
+}
+
+Checkpoint::~Checkpoint() { release(); }
+
+void Checkpoint::release() {
+    if (resident_base_) {
+        munmap(resident_base_, resident_length_);
+        resident_base_ = nullptr;
+    }
+    for (auto& shard : shards_) {
+        if (shard.map_base && shard.map_base != MAP_FAILED) {
+            munmap(shard.map_base, shard.map_length);
+        }
+        if (shard.fd >= 0) {
+            close(shard.fd);
+        }
+    }
+    shards_.clear();
+}
+
+std::string tensor_name(TensorKind kind, int layer) {
+    std::string block = "block." + std::to_string(layer) + ".";
+    switch (kind) {
+        case TensorKind::Embedding: return "embedding.weight";
+        case TensorKind::Norm: return "norm.scale";
+        case TensorKind::Unembedding: return "unembedding.weight";
+        case TensorKind::AttnNorm: return block + "attn.norm.scale";
+        case TensorKind::AttnQkvWeight: return block + "attn.qkv.weight";
+        case TensorKind::AttnQkvBias: return block + "attn.qkv.bias";
+        case TensorKind::AttnOutWeight: return block + "attn.out.weight";
+        case TensorKind::AttnOutBias: return block + "attn.out.bias";
+        case TensorKind::AttnSinks: return block + "attn.sinks";
+        case TensorKind::MlpNorm: return block + "mlp.norm.scale";
+        case TensorKind::MlpGateWeight: return block + "mlp.gate.weight";
+        case TensorKind::MlpGateBias: return block + "mlp.gate.bias";
+        case TensorKind::Mlp1Blocks: return block + "mlp.mlp1_weight.blocks";
+        case TensorKind::Mlp1Scales: return block + "mlp.mlp1_weight.scales";
+        case TensorKind::Mlp1Bias: return block + "mlp.mlp1_bias";
+        case TensorKind::Mlp2Blocks: return block + "mlp.mlp2_weight.blocks";
+        case TensorKind::Mlp2Scales: return block + "mlp.mlp2_weight.scales";
+        case TensorKind::Mlp2Bias: return block + "mlp.mlp2_bias";
+        case TensorKind::Count: break;
+    }
+    throw std::runtime_error("invalid tensor kind");
+}
+
+std::size_t Checkpoint::directory_index(TensorKind kind, int layer) {
+    const auto k = static_cast<std::size_t>(kind);
+    if (k < kNumGlobalTensorKinds) return k;
+    return kNumGlobalTensorKinds + static_cast<std::size_t>(layer) * kNumLayerTensorKinds +
+           (k - kNumGlobalTensorKinds);
+}
+
+const TensorMeta_* Checkpoint::find(TensorKind kind, int layer) const {
+    const bool global = static_cast<std::size_t>(kind) < kNumGlobalTensorKinds;
+    if (kind >= TensorKind::Count || (!global && (layer < 0 || static_cast<std::size_t>(layer) >= num_layers_))) {
+        throw std::runtime_error("tensor kind/layer out of range");
+    }
+    return directory_[directory_index(kind, global ? -1 : layer)];
+}
+
+const TensorMeta_& Checkpoint::get(TensorKind kind, int layer) const {
+    const TensorMeta_* meta = find(kind, layer);
+    if (!meta) {
+        throw std::runtime_error("tensor not found in checkpoint: " + tensor_name(kind, layer));
+    }
+    return *meta;
+}
+
+const std::uint16_t* Checkpoint::get_bf16_ptr(TensorKind kind, int layer) const {
+    const auto& meta = get(kind, layer);
+    if (meta.dtype != DType::BF16) {
+        throw std::runtime_error("tensor dtype is not BF16: " + tensor_name(kind, layer));
+    }
+    return reinterpret_cast<const std::uint16_t*>(meta.data);
+}
+
+std::size_t Checkpoint::get_bf16_count(TensorKind kind, int layer) const {
+    const auto& meta = get(kind, layer);
+    if (meta.dtype != DType::BF16) {
+        throw std::runtime_error("tensor dtype is not BF16: " + tensor_name(kind, layer));
+    }
+    return meta.byte_size / sizeof(std::uint16_t);
+}
+
+const std::uint8_t* Checkpoint::get_u8_ptr(TensorKind kind, int layer) const {
+    const auto& meta = get(kind, layer);
+    if (meta.dtype != DType::U8) {
+        throw std::runtime_error("tensor dtype is not U8: " + tensor_name(kind, layer));
+    }
+    return reinterpret_cast<const std::uint8_t*>(meta.data);
+}
+
+std::size_t Checkpoint::get_u8_count(TensorKind kind, int layer) const {
+    const auto& meta = get(kind, layer);
+    if (meta.dtype != DType::U8) {
+        throw std::runtime_error("tensor dtype is not U8: " + tensor_name(kind, layer));
+    }
+    return meta.byte_size;
+}
+
+std::uint64_t Checkpoint::file_offset(const TensorMeta_& meta) const {
+    const Shard& shard = shards_[meta.shard];
+    const auto* base = static_cast<const std::byte*>(shard.map_base);
+    if (meta.data < base || meta.data + meta.byte_size > base + shard.map_length) return kNotInFile;
+    return shard.map_file_offset + static_cast<std::uint64_t>(meta.data - base);
+}
+
+const TensorMeta_& Checkpoint::get(const std::string& name) const {
+    auto it = meta_.find(name);
+    if (it != meta_.end()) return it->second;
+    // packed files carry no names; nothing on the load path looks tensors up by name
+    if (packed_) {
+        for (std::size_t k = 0; k < static_cast<std::size_t>(TensorKind::Count); k++) {
+            const auto kind = static_cast<TensorKind>(k);
+            const int layers = k < kNumGlobalTensorKinds ? 1 : static_cast<int>(num_layers_);
+            for (int layer = 0; layer < layers; layer++) {
+                const int l = k < kNumGlobalTensorKinds ? -1 : layer;
+                const TensorMeta_* meta = directory_[directory_index(kind, l)];
+                if (meta && tensor_name(kind, l) == name) return *meta;
+            }
+        }
+    }
+    throw std::runtime_error("tensor not found in checkpoint: " + name);
+}
+
+const std::uint16_t* Checkpoint::get_bf16_ptr(const std::string& name) const {
+    const auto& meta = get(name);
+    if (meta.dtype != DType::BF16) {
+        throw std::runtime_error("tensor dtype is not BF16: " + name);
+    }
+    return reinterpret_cast<const std::uint16_t*>(meta.data);
+}
+
+std::size_t Checkpoint::get_bf16_count(const std::string& name) const {
+    const auto& meta = get(name);
+    if (meta.dtype != DType::BF16) {
+        throw std::runtime_error("tensor dtype is not BF16: " + name);
+    }
+    return meta.byte_size / sizeof(std::uint16_t);
+}
+
+const std::uint8_t* Checkpoint::get_u8_ptr(const std::string& name) const {
+    const auto& meta = get(name);
+    if (meta.dtype != DType::U8) {
+        throw std::runtime_error("tensor dtype is not U8: " + name);
+    }
+    return reinterpret_cast<const std::uint8_t*>(meta.data);
+}
+
+std::size_t Checkpoint::get_u8_count(const std::string& name) const {
+    const auto& meta = get(name);
+    if (meta.dtype != DType::U8) {
+        throw std::runtime_error("tensor dtype is not U8: " + name);
+    }
+    return meta.byte_size;
+}
+
+Checkpoint::MXFP4Pair Checkpoint::get_mxfp4_pair(
+    const std::string& base_name,
+    std::initializer_list<std::uint64_t> expected_prefix,
+    std::size_t expected_blocks_rank,
+    std::size_t expected_scales_rank) const {
+    const std::string blocks_name = base_name + ".blocks";
+    const std::string scales_name = base_name + ".scales";
+    const auto& blocks_meta = get(blocks_name);
+    const auto& scales_meta = get(scales_name);
+    assert(blocks_meta.shape.size() == expected_blocks_rank);
+    assert(scales_meta.shape.size() == expected_scales_rank);
+    std::size_t i = 0;
+    for (auto expected_dim : expected_prefix) {
+        assert(i < blocks_meta.shape.size());
+        assert(i < scales_meta.shape.size());
+        assert(blocks_meta.shape[i] == expected_dim);
+        assert(scales_meta.shape[i] == expected_dim);
+        i++;
+    }
+    return MXFP4Pair{
+        get_u8_ptr(blocks_name),
+        get_u8_count(blocks_name),
+        get_u8_ptr(scales_name),
+        get_u8_count(scales_name),
+    };
+}
+
+// safetensors: one name lookup per slot, done once at load instead of in every constructor
+void Checkpoint::buildDirectory() {
+    num_layers_ = 0;
+    for (const auto& it : meta_) {
+        if (it.first.rfind("block.", 0) != 0) continue;
+        const std::size_t layer = std::stoul(it.first.substr(6));
+        num_layers_ = std::max(num_layers_, layer + 1);
+    }
+    directory_.assign(kNumGlobalTensorKinds + num_layers_ * kNumLayerTensorKinds, nullptr);
+    for (std::size_t k = 0; k < static_cast<std::size_t>(TensorKind::Count); k++) {
+        const auto kind = static_cast<TensorKind>(k);
+        const int layers = k < kNumGlobalTensorKinds ? 1 : static_cast<int>(num_layers_);
+        for (int layer = 0; layer < layers; layer++) {
+            const int l = k < kNumGlobalTensorKinds ? -1 : layer;
+            auto it = meta_.find(tensor_name(kind, l));
+            if (it != meta_.end()) directory_[directory_index(kind, l)] = &it->second;
+        }
+    }
+}
+
+// packed: the whole file is mapped and the directory is read straight out of it
+void Checkpoint::loadPacked() {
+    packed_ = true;
+    Shard& shard = shards_[0];
+    shard.fd = ::open(shard.path.c_str(), O_RDONLY);
+    if (shard.fd < 0) throw std::runtime_error("failed to open packed model: " + shard.path);
+    struct stat st {};
+    fstat(shard.fd, &st);
+    shard.map_length = static_cast<std::size_t>(st.st_size);
+    if (shard.map_length < sizeof(PackedHeader)) throw std::runtime_error("truncated packed model: " + path_);
+
+    shard.map_base = mmap(nullptr, shard.map_length, PROT_READ, MAP_PRIVATE, shard.fd, 0);
+    if (shard.map_base == MAP_FAILED) throw std::runtime_error("mmap failed for packed model");
+    const auto* weights = static_cast<const std::byte*>(shard.map_base);
+
+    PackedHeader hdr;
+    std::memcpy(&hdr, weights, sizeof(hdr));
+    num_layers_ = hdr.num_layers;
+    const std::size_t expected = kNumGlobalTensorKinds + num_layers_ * kNumLayerTensorKinds;
+    if (hdr.version != kPackedVersion || hdr.num_entries != expected || hdr.file_size != shard.map_length ||
+        sizeof(PackedHeader) + expected * sizeof(PackedEntry) > shard.map_length) {
+        throw std::runtime_error("invalid packed model: " + path_);
+    }
+
+    // entries land straight in their (kind, layer) slot: no names are built or hashed
+    directory_.assign(expected, nullptr);
+    packed_meta_.assign(expected, TensorMeta_{});
+    const auto* entries = reinterpret_cast<const PackedEntry*>(weights + sizeof(PackedHeader));
+    for (std::size_t i = 0; i < expected; i++) {
+        const PackedEntry& e = entries[i];
+        if (e.byte_size == 0) continue;  // tensor absent from the source checkpoint
+        const bool global = e.kind < kNumGlobalTensorKinds;
+        const bool layer_ok = global ? e.layer == -1 : e.layer >= 0 && static_cast<std::size_t>(e.layer) < num_layers_;
+        if (e.kind >= static_cast<std::uint32_t>(TensorKind::Count) || !layer_ok ||
+            (e.dtype != DType::BF16 && e.dtype != DType::U8) || e.rank > kPackedMaxRank ||
+            e.offset > shard.map_length || e.byte_size > shard.map_length - e.offset ||
+            directory_index(static_cast<TensorKind>(e.kind), e.layer) != i) {
+            throw std::runtime_error("invalid packed model directory: " + path_);
+        }
+        std::uint64_t bytes = e.dtype == DType::BF16 ? 2 : 1;
+        for (std::uint32_t d = 0; d < e.rank; d++) bytes *= e.shape[d];
+        if (bytes != e.byte_size) throw std::runtime_error("invalid packed model directory: " + path_);
+
+        TensorMeta_& meta = packed_meta_[i];
+        meta.dtype = static_cast<DType>(e.dtype);
+        meta.shape.assign(e.shape, e.shape + e.rank);
+        meta.offset = {e.offset, e.offset + e.byte_size};
+        meta.data = weights + e.offset;
+        meta.byte_size = static_cast<std::size_t>(e.byte_size);
+        directory_[i] = &meta;
+    }
+}
+
+void pack_checkpoint(const Checkpoint& checkpoint, const std::string& out_path) {
+    const std::size_t num_entries = kNumGlobalTensorKinds + checkpoint.num_layers() * kNumLayerTensorKinds;
+    std::vector<PackedEntry> entries(num_entries);
+    std::vector<const TensorMeta_*> sources(num_entries, nullptr);
+
+    std::uint64_t cursor = sizeof(PackedHeader) + num_entries * sizeof(PackedEntry);
+    for (std::size_t k = 0; k < static_cast<std::size_t>(TensorKind::Count); k++) {
+        const bool global = k < kNumGlobalTensorKinds;
+        const int layers = global ? 1 : static_cast<int>(checkpoint.num_layers());
+        for (int layer = 0; layer < layers; layer++) {
+            const auto kind = static_cast<TensorKind>(k);
+            const int l = global ? -1 : layer;
+            const std::size_t idx = Checkpoint::directory_index(kind, l);
+            PackedEntry& e = entries[idx];
+            e = PackedEntry{};
+            e.kind = static_cast<std::uint32_t>(k);
+            e.layer = l;
+            const TensorMeta_* meta = checkpoint.find(kind, l);
+            if (!meta) continue;  // left as an empty slot
+            if (meta->shape.size() > kPackedMaxRank) {
+                throw std::runtime_error("tensor rank too large to pack: " + tensor_name(kind, l));
+            }
+            e.dtype = static_cast<std::uint32_t>(meta->dtype);
+            e.rank = static_cast<std::uint32_t>(meta->shape.size());
+            std::copy(meta->shape.begin(), meta->shape.end(), e.shape);
+            e.byte_size = meta->byte_size;
+            sources[idx] = meta;
+        }
+    }
+    // assign offsets in file order so each layer's tensors stay contiguous
+    for (std::size_t i = 0; i < num_entries; i++) {
+        if (!sources[i]) continue;
+        const std::uint64_t align = entries[i].byte_size >= kPackedHugeAlign ? kPackedHugeAlign : kPackedSmallAlign;
+        cursor = (cursor + align - 1) / align * align;
+        entries[i].offset = cursor;
+        cursor += entries[i].byte_size;
+    }
+
+    PackedHeader hdr{};
+    std::memcpy(hdr.magic, kPackedMagic, sizeof(hdr.magic));
+    hdr.version = kPackedVersion;
+    hdr.num_layers = static_cast<std::uint32_t>(checkpoint.num_layers());
+    hdr.num_entries = static_cast<std::uint32_t>(num_entries);
+    hdr.file_size = cursor;
+
+    std::ofstream out(out_path, std::ios::binary | std::ios::trunc);
+    if (!out) throw std::runtime_error("failed to open for writing: " + out_path);
+    out.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+    out.write(reinterpret_cast<const char*>(entries.data()), static_cast<std::streamsize>(num_entries * sizeof(PackedEntry)));
+    // alignment gaps are seeked over, so they end up as holes in the file
+    for (std::size_t i = 0; i < num_entries; i++) {
+        if (!sources[i]) continue;
+        out.seekp(static_cast<std::streamoff>(entries[i].offset));
+        out.write(reinterpret_cast<const char*>(sources[i]->data), static_cast<std::streamsize>(entries[i].byte_size));
+    }
+    out.close();
+    if (!out) throw std::runtime_error("failed to write packed model: " + out_path);
+    std::filesystem::resize_file(out_path, cursor);
+}
+
+// Shards are opened, parsed and mapped in parallel; each one only touches its own Shard
+// and returns its tensors, which are merged into one directory afterwards.
+void Checkpoint::loadSafetensors(const std::vector<std::string>& files) {
+    shards_.resize(files.size());
+    std::vector<std::vector<TensorMeta_>> parsed(files.size());
+    std::vector<std::exception_ptr> errors(files.size());
+#pragma omp parallel for schedule(dynamic)
+    for (std::size_t i = 0; i < files.size(); i++) {
+        try {
+            shards_[i].path = files[i];
+            parsed[i] = mapShard(shards_[i]);
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    }
+    for (auto& error : errors) {
+        if (error) std::rethrow_exception(error);
+    }
+
+    for (std::size_t i = 0; i < parsed.size(); i++) {
+        for (auto& meta : parsed[i]) {
+            meta.shard = static_cast<std::uint32_t>(i);
+            std::string name = meta.name;
+            if (meta_.contains(name)) {
+                throw std::runtime_error("tensor appears in more than one shard: " + name);
+            }
+            meta_.emplace(std::move(name), std::move(meta));
+        }
+    }
+}
+
+std::vector<TensorMeta_> Checkpoint::mapShard(Shard& shard) {
+    shard.fd = ::open(shard.path.c_str(), O_RDONLY);
+    if (shard.fd < 0) throw std::runtime_error("wrong path or file DNE: " + shard.path);
+    struct stat st {};
+    fstat(shard.fd, &st);
+
+    std::uint64_t header_len = 0;
+    if (pread(shard.fd, &header_len, 8, 0) != 8 || 8 + header_len > static_cast<std::uint64_t>(st.st_size)) {
+        throw std::runtime_error("invalid safetensor file: " + shard.path);
+    }
+    std::string header(header_len, '\0');
+    if (pread(shard.fd, header.data(), header_len, 8) != static_cast<ssize_t>(header_len)) {
+        throw std::runtime_error("failed to read safetensor header: " + shard.path);
+    }
+    std::vector<TensorMeta_> tensors = SafetensorsHeader(header).parse();
+
+    const std::uint64_t data_offset = 8 + header_len;
+    size_t page_size = sysconf(_SC_PAGE_SIZE);
+    std::uint64_t page_offset = data_offset % static_cast<std::uint64_t>(page_size);
+    const off_t map_offset = static_cast<off_t>(data_offset - page_offset);
+    shard.map_length = static_cast<std::size_t>(st.st_size - map_offset);
+    shard.map_file_offset = static_cast<std::uint64_t>(map_offset);
+    shard.map_base = mmap(nullptr, shard.map_length, PROT_READ, MAP_PRIVATE, shard.fd, map_offset);
+    if (shard.map_base == MAP_FAILED) throw std::runtime_error("mmap failed for safetensor weights: " + shard.path);
+    const std::byte* weights = static_cast<const std::byte*>(shard.map_base) + page_offset;
+    const std::uint64_t data_bytes = static_cast<std::uint64_t>(st.st_size) - data_offset;
+
+    for (auto& meta : tensors) {
+        if (meta.offset.size() != 2) {
+            throw std::runtime_error("invalid data_offsets for tensor: " + meta.name);
+        }
+        const std::uint64_t begin = meta.offset[0];
+        const std::uint64_t end = meta.offset[1];
+        if (end < begin || end > data_bytes) {
+            throw std::runtime_error("invalid data_offsets range for tensor: " + meta.name);
+        }
+        meta.byte_size = static_cast<std::size_t>(end - begin);
+        meta.data = weights + begin;
+    }
+    return tensors;
+}
+
+void Checkpoint::debugPrintCheckpoint() {
+    for (const auto& it : meta_) {
+        std::cout << it.second;
+    }
+}
@@ -0,0 +1,1161 @@
+#include "constrained.h"
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <utility>
+
+#include "kernels.h"
+
+namespace {
+
+// ---- regex -> AST
+
+struct RegexNode {
+    enum Kind { Bytes, Concat, Alt, Repeat };
+    static constexpr std::size_t kUnbounded = std::numeric_limits<std::size_t>::max();
+
+    RegexNode() = default;
+    explicit RegexNode(Kind kind) : kind(kind) {}
+
+    Kind kind{Concat};
+    std::bitset<256> bytes;
+    std::vector<RegexNode> children;  // Repeat has exactly one
+    std::size_t min{0}, max{0};
+};
+
+class RegexParser {
+public:
+    explicit RegexParser(std::string_view pattern) : p_(pattern) {}
+
+    RegexNode parse() {
+        RegexNode root = alternation();
+        if (pos_ < p_.size()) fail("unbalanced ')'");
+        return root;
+    }
+
+private:
+    [[noreturn]] void fail(const std::string& what) const {
+        throw std::runtime_error("regex: " + what + " at offset " + std::to_string(pos_));
+    }
+    bool at_end() const { return pos_ >= p_.size(); }
+    bool eat(char c) {
+        if (at_end() || p_[pos_] != c) return false;
+        ++pos_;
+        return true;
+    }
+
+    RegexNode alternation() {
+        RegexNode first = concat();
+        if (at_end() || p_[pos_] != '|') return first;
+        RegexNode alt{RegexNode::Alt};
+        alt.children.push_back(std::move(first));
+        while (eat('|')) alt.children.push_back(concat());
+        return alt;
+    }
+
+    RegexNode concat() {
+        RegexNode seq{RegexNode::Concat};
+        while (!at_end() && p_[pos_] != '|' && p_[pos_] != ')') seq.children.push_back(repeat());
+        return seq;
+    }
+
+    std::size_t number() {
+        const std::size_t begin = pos_;
+        std::size_t value = 0;
+        while (!at_end() && p_[pos_] >= '0' && p_[pos_] <= '9') value = value * 10 + (p_[pos_++] - '0');
+        if (pos_ == begin) fail("expected a count");
+        return value;
+    }
+
+    RegexNode repeat() {
+        RegexNode atom = this->atom();
+        while (!at_end()) {
+            std::size_t min = 0, max = 0;
+            const char c = p_[pos_];
+            if (c == '*') {
+                max = RegexNode::kUnbounded;
+            } else if (c == '+') {
+                min = 1;
+                max = RegexNode::kUnbounded;
+            } else if (c == '?') {
+                max = 1;
+            } else if (c == '{') {
+                ++pos_;
+                min = max = number();
+                if (eat(',')) max = !at_end() && p_[pos_] == '}' ? RegexNode::kUnbounded : number();
+                if (at_end() || p_[pos_] != '}') fail("unterminated {}");
+                if (max < min) fail("{n,m} with m < n");
+            } else {
+                break;
+            }
+            ++pos_;
+            RegexNode rep{RegexNode::Repeat};
+            rep.min = min;
+            rep.max = max;
+            rep.children.push_back(std::move(atom));
+            atom = std::move(rep);
+        }
+        return atom;
+    }
+
+    static int hex_digit(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    // \d \w \s
+    static std::bitset<256> named_class(char c) {
+        std::bitset<256> set;
+        const auto range = [&](int lo, int hi) {
+            for (int b = lo; b <= hi; ++b) set.set(b);
+        };
+        if (c == 'd' || c == 'w') range('0', '9');
+        if (c == 'w') {
+            range('a', 'z');
+            range('A', 'Z');
+            set.set('_');
+        }
+        if (c == 's') {
+            for (char s : {' ', '\t', '\n', '\r', '\f', '\v'}) set.set(static_cast<std::uint8_t>(s));
+        }
+        return set;
+    }
+
+    // after a backslash; returns the byte for single-byte escapes, -1 for classes
+    int escape(std::bitset<256>& set) {
+        if (at_end()) fail("trailing backslash");
+        const char c = p_[pos_++];
+        switch (c) {
+            case 'd': case 'w': case 's': set |= named_class(c); return -1;
+            case 'D': case 'W': case 'S': set |= ~named_class(static_cast<char>(c - 'A' + 'a')); return -1;
+            case 'n': set.set('\n'); return '\n';
+            case 't': set.set('\t'); return '\t';
+            case 'r': set.set('\r'); return '\r';
+            case 'f': set.set('\f'); return '\f';
+            case 'v': set.set('\v'); return '\v';
+            case '0': set.set(0); return 0;
+            case 'x': {
+                if (pos_ + 2 > p_.size() || hex_digit(p_[pos_]) < 0 || hex_digit(p_[pos_ + 1]) < 0) fail("bad \\x");
+                const int b = hex_digit(p_[pos_]) * 16 + hex_digit(p_[pos_ + 1]);
+                pos_ += 2;
+                set.set(b);
+                return b;
+            }
+            default: set.set(static_cast<std::uint8_t>(c)); return static_cast<std::uint8_t>(c);
+        }
+    }
+
+    RegexNode byte_class() {
+        RegexNode node{RegexNode::Bytes};
+        const bool negate = eat('^');
+        bool first = true;
+        while (true) {
+            if (at_end()) fail("unterminated [");
+            if (p_[pos_] == ']' && !first) break;
+            first = false;
+            std::bitset<256> item;
+            int lo = p_[pos_] == '\\' ? (++pos_, escape(item)) : static_cast<std::uint8_t>(p_[pos_++]);
+            if (lo >= 0 && pos_ + 1 < p_.size() && p_[pos_] == '-' && p_[pos_ + 1] != ']') {
+                ++pos_;
+                std::bitset<256> unused;
+                const int hi = p_[pos_] == '\\' ? (++pos_, escape(unused)) : static_cast<std::uint8_t>(p_[pos_++]);
+                if (hi < lo) fail("bad range in []");
+                for (int b = lo; b <= hi; ++b) item.set(b);
+            } else if (lo >= 0) {
+                item.set(lo);
+            }
+            node.bytes |= item;
+        }
+        ++pos_;
+        if (negate) node.bytes.flip();
+        return node;
+    }
+
+    RegexNode atom() {
+        const char c = p_[pos_++];
+        switch (c) {
+            case '(': {
+                if (p_.substr(pos_, 2) == "?:") pos_ += 2;
+                RegexNode inner = alternation();
+                if (!eat(')')) fail("unbalanced '('");
+                return inner;
+            }
+            case '[': return byte_class();
+            case '.': {
+                RegexNode node{RegexNode::Bytes};
+                node.bytes.set();
+                node.bytes.reset('\n');
+                return node;
+            }
+            case '\\': {
+                RegexNode node{RegexNode::Bytes};
+                escape(node.bytes);
+                return node;
+            }
+            case '*': case '+': case '?': case '{': --pos_; fail("nothing to repeat");
+            case '^': case '$': --pos_; fail("anchors aren't supported, the whole output always has to match");
+            default: {
+                RegexNode node{RegexNode::Bytes};
+                node.bytes.set(static_cast<std::uint8_t>(c));
+                return node;
+            }
+        }
+    }
+
+    std::string_view p_;
+    std::size_t pos_{0};
+};
+
+// ---- AST -> Thompson NFA
+
+struct Nfa {
+    static constexpr std::size_t kMaxStates = 1 << 22;
+
+    struct State {
+        std::bitset<256> bytes;
+        std::int32_t target{-1};  // on any byte in bytes
+        std::vector<std::int32_t> eps;
+    };
+    std::vector<State> states;
+
+    std::int32_t add() {
+        if (states.size() >= kMaxStates) throw std::runtime_error("regex: too large (repeat counts?)");
+        states.emplace_back();
+        return static_cast<std::int32_t>(states.size() - 1);
+    }
+    void link(std::int32_t from, std::int32_t to) { states[from].eps.push_back(to); }
+
+    // (start, end); end has no edges out yet
+    std::pair<std::int32_t, std::int32_t> build(const RegexNode& n) {
+        switch (n.kind) {
+            case RegexNode::Bytes: {
+                const std::int32_t s = add(), e = add();
+                states[s].bytes = n.bytes;
+                states[s].target = e;
+                return {s, e};
+            }
+            case RegexNode::Concat: {
+                const std::int32_t s = add();
+                std::int32_t cur = s;
+                for (const RegexNode& child : n.children) {
+                    const auto [cs, ce] = build(child);
+                    link(cur, cs);
+                    cur = ce;
+                }
+                return {s, cur};
+            }
+            case RegexNode::Alt: {
+                const std::int32_t s = add(), e = add();
+                for (const RegexNode& child : n.children) {
+                    const auto [cs, ce] = build(child);
+                    link(s, cs);
+                    link(ce, e);
+                }
+                return {s, e};
+            }
+            case RegexNode::Repeat: {
+                const RegexNode& child = n.children[0];
+                const std::int32_t s = add();
+                std::int32_t cur = s;
+                for (std::size_t i = 0; i < n.min; ++i) {
+                    const auto [cs, ce] = build(child);
+                    link(cur, cs);
+                    cur = ce;
+                }
+                const std::int32_t e = add();
+                if (n.max == RegexNode::kUnbounded) {
+                    const auto [cs, ce] = build(child);
+                    link(cur, cs);
+                    link(ce, cur);
+                    link(cur, e);
+                    return {s, e};
+                }
+                for (std::size_t i = n.min; i < n.max; ++i) {
+                    link(cur, e);
+                    const auto [cs, ce] = build(child);
+                    link(cur, cs);
+                    cur = ce;
+                }
+                link(cur, e);
+                return {s, e};
+            }
+        }
+        return {-1, -1};
+    }
+};
+
+// ---- JSON, just enough to read a schema
+
+struct Json {
+    enum Type { Null, Bool, Number, String, Array, Object };
+
+    Type type{Null};
+    bool boolean{false};
+    std::string str;  // String: decoded; Number: as written
+    std::vector<Json> items;
+    std::vector<std::pair<std::string, Json>> fields;
+
+    const Json* get(std::string_view key) const {
+        for (const auto& [k, v] : fields) {
+            if (k == key) return &v;
+        }
+        return nullptr;
+    }
+};
+
+class JsonParser {
+public:
+    explicit JsonParser(std::string_view text) : s_(text) {}
+
+    Json parse() {
+        Json v = value();
+        skip_ws();
+        if (pos_ != s_.size()) fail("trailing characters");
+        return v;
+    }
+
+private:
+    [[noreturn]] void fail(const std::string& what) const {
+        throw std::runtime_error("json schema: " + what + " at offset " + std::to_string(pos_));
+    }
+    void skip_ws() {
+        while (pos_ < s_.size() && (s_[pos_] == ' ' || s_[pos_] == '\t' || s_[pos_] == '\n' || s_[pos_] == '\r')) {
+            ++pos_;
+        }
+    }
+    void expect(char c) {
+        skip_ws();
+        if (pos_ >= s_.size() || s_[pos_] != c) fail(std::string("expected '") + c + "'");
+        ++pos_;
+    }
+
+    static void append_utf8(std::string& out, std::uint32_t cp) {
+        if (cp < 0x80) {
+            out += static_cast<char>(cp);
+        } else if (cp < 0x800) {
+            out += static_cast<char>(0xC0 | (cp >> 6));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            out += static_cast<char>(0xE0 | (cp >> 12));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        } else {
+            out += static_cast<char>(0xF0 | (cp >> 18));
+            out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+    }
+
+    std::uint32_t hex4() {
+        if (pos_ + 4 > s_.size()) fail("bad \\u escape");
+        std::uint32_t v = 0;
+        for (int i = 0; i < 4; ++i) {
+            const char c = s_[pos_++];
+            v <<= 4;
+            if (c >= '0' && c <= '9') v |= c - '0';
+            else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+            else fail("bad \\u escape");
+        }
+        return v;
+    }
+
+    std::string string() {
+        expect('"');
+        std::string out;
+        while (true) {
+            if (pos_ >= s_.size()) fail("unterminated string");
+            const char c = s_[pos_++];
+            if (c == '"') return out;
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos_ >= s_.size()) fail("unterminated string");
+            const char e = s_[pos_++];
+            switch (e) {
+                case 'n': out += '\n'; break;
+                case 't': out += '\t'; break;
+                case 'r': out += '\r'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'u': {
+                    std::uint32_t cp = hex4();
+                    if (cp >= 0xD800 && cp < 0xDC00 && s_.substr(pos_, 2) == "\\u") {
+                        pos_ += 2;
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (hex4() - 0xDC00);
+                    }
+                    append_utf8(out, cp);
+                    break;
+                }
+                default: out += e;
+            }
+        }
+    }
+
+    Json value() {
+        skip_ws();
+        if (pos_ >= s_.size()) fail("unexpected end");
+        Json v;
+        const char c = s_[pos_];
+        if (c == '{') {
+            v.type = Json::Object;
+            ++pos_;
+            skip_ws();
+            if (pos_ < s_.size() && s_[pos_] == '}') {
+                ++pos_;
+                return v;
+            }
+            do {
+                std::string key = string();
+                expect(':');
+                v.fields.emplace_back(std::move(key), value());
+                skip_ws();
+            } while (pos_ < s_.size() && s_[pos_] == ',' && ++pos_);
+            expect('}');
+        } else if (c == '[') {
+            v.type = Json::Array;
+            ++pos_;
+            skip_ws();
+            if (pos_ < s_.size() && s_[pos_] == ']') {
+                ++pos_;
+                return v;
+            }
+            do {
+                v.items.push_back(value());
+                skip_ws();
+            } while (pos_ < s_.size() && s_[pos_] == ',' && ++pos_);
+            expect(']');
+        } else if (c == '"') {
+            v.type = Json::String;
+            v.str = string();
+        } else if (s_.substr(pos_, 4) == "true" || s_.substr(pos_, 5) == "false") {
+            v.type = Json::Bool;
+            v.boolean = c == 't';
+            pos_ += v.boolean ? 4 : 5;
+        } else if (s_.substr(pos_, 4) == "null") {
+            pos_ += 4;
+        } else {
+            const std::size_t begin = pos_;
+            while (pos_ < s_.size() && s_[pos_] != '\0' && std::strchr("+-0123456789.eE", s_[pos_]) != nullptr) ++pos_;
+            if (pos_ == begin) fail("unexpected character");
+            v.type = Json::Number;
+            v.str = std::string(s_.substr(begin, pos_ - begin));
+        }
+        return v;
+    }
+
+    std::string_view s_;
+    std::size_t pos_{0};
+};
+
+std::string json_quote(std::string_view s) {
+    static const char* kHex = "0123456789abcdef";
+    std::string out = "\"";
+    for (char c : s) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            case '\r': out += "\\r"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            default:
+                if (static_cast<std::uint8_t>(c) < 0x20) {
+                    out += "\\u00";
+                    out += kHex[c >> 4];
+                    out += kHex[c & 0xF];
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out + "\"";
+}
+
+std::string json_compact(const Json& v) {
+    switch (v.type) {
+        case Json::Null: return "null";
+        case Json::Bool: return v.boolean ? "true" : "false";
+        case Json::Number: return v.str;
+        case Json::String: return json_quote(v.str);
+        case Json::Array: {
+            std::string out = "[";
+            for (std::size_t i = 0; i < v.items.size(); ++i) {
+                if (i) out += ',';
+                out += json_compact(v.items[i]);
+            }
+            return out + "]";
+        }
+        case Json::Object: {
+            std::string out = "{";
+            for (std::size_t i = 0; i < v.fields.size(); ++i) {
+                if (i) out += ',';
+                out += json_quote(v.fields[i].first) + ":" + json_compact(v.fields[i].second);
+            }
+            return out + "}";
+        }
+    }
+    return {};
+}
+
+// bytes as a regex that matches exactly them
+std::string regex_literal(std::string_view bytes) {
+    static const char* kHex = "0123456789abcdef";
+    std::string out;
+    for (char c : bytes) {
+        const auto b = static_cast<std::uint8_t>(c);
+        if ((b >= '0' && b <= '9') || (b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z') || b == ' ' || b == '_' ||
+            b == '"' || b == ':' || b == ',' || b == '-') {
+            out += c;
+        } else if (b > 0x20 && b < 0x7F) {
+            out += '\\';
+            out += c;
+        } else {
+            out += "\\x";
+            out += kHex[b >> 4];
+            out += kHex[b & 0xF];
+        }
+    }
+    return out;
+}
+
+// one character inside a JSON string, UTF-8 checked by lead byte
+constexpr std::string_view kStringChar =
+    R"((?:[\x20\x21\x23-\x5b\x5d-\x7f]|\\["\\/bfnrt]|\\u[0-9a-fA-F]{4}|[\xc2-\xdf][\x80-\xbf]|[\xe0-\xef][\x80-\xbf]{2}|[\xf0-\xf4][\x80-\xbf]{3}))";
+constexpr std::string_view kInteger = R"(-?(?:0|[1-9][0-9]*))";
+constexpr std::string_view kNumber = R"(-?(?:0|[1-9][0-9]*)(?:\.[0-9]+)?(?:[eE][+-]?[0-9]+)?)";
+
+// any multi-byte UTF-8 character, the part of kStringChar a "." or a negated class stands for
+constexpr std::string_view kUtf8MultiByte =
+    R"([\xc2-\xdf][\x80-\xbf]|[\xe0-\xef][\x80-\xbf]{2}|[\xf0-\xf4][\x80-\xbf]{3})";
+
+// Rewrites a parsed "pattern" (over the string's characters) into a regex over its JSON
+// encoding: bytes a string can't hold raw become their escapes, and a class that admits
+// every byte >= 0x80 (".", "[^x]") admits whole UTF-8 characters instead of stray bytes.
+// High bytes a class lists explicitly are left as written.
+void encode_string_pattern(const RegexNode& node, std::string& out) {
+    switch (node.kind) {
+        case RegexNode::Bytes: {
+            static const char* kHex = "0123456789abcdef";
+            const auto hex = [](int b) { return std::string("\\x") + kHex[b >> 4] + kHex[b & 0xF]; };
+            bool all_high = true;
+            for (int b = 0x80; b < 256; ++b) all_high = all_high && node.bytes[b];
+            std::bitset<256> raw;
+            std::vector<std::string> alts;
+            for (int b = 0; b < 256; ++b) {
+                if (!node.bytes[b] || (all_high && b >= 0x80)) continue;
+                if (b < 0x20 || b == '"' || b == '\\') {
+                    const std::string quoted = json_quote(std::string(1, static_cast<char>(b)));
+                    alts.push_back(regex_literal(std::string_view(quoted).substr(1, quoted.size() - 2)));
+                } else {
+                    raw.set(b);
+                }
+            }
+            if (raw.any()) {
+                std::string set = "[";
+                for (int b = 0; b < 256; ++b) {
+                    if (!raw[b]) continue;
+                    int e = b;
+                    while (e + 1 < 256 && raw[e + 1]) ++e;
+                    set += hex(b);
+                    if (e > b) set += "-" + hex(e);
+                    b = e;
+                }
+                alts.insert(alts.begin(), set + "]");
+            }
+            if (all_high) alts.emplace_back(kUtf8MultiByte);
+            // nothing left that a JSON string can carry: a class no byte matches
+            if (alts.empty()) alts.emplace_back("[^\\x00-\\xff]");
+            out += "(?:";
+            for (std::size_t i = 0; i < alts.size(); ++i) {
+                if (i) out += '|';
+                out += alts[i];
+            }
+            out += ')';
+            return;
+        }
+        case RegexNode::Concat:
+            out += "(?:";
+            for (const RegexNode& child : node.children) encode_string_pattern(child, out);
+            out += ')';
+            return;
+        case RegexNode::Alt:
+            out += "(?:";
+            for (std::size_t i = 0; i < node.children.size(); ++i) {
+                if (i) out += '|';
+                encode_string_pattern(node.children[i], out);
+            }
+            out += ')';
+            return;
+        case RegexNode::Repeat:
+            out += "(?:";
+            encode_string_pattern(node.children[0], out);
+            out += "){";
+            out += std::to_string(node.min);
+            out += ',';
+            if (node.max != RegexNode::kUnbounded) out += std::to_string(node.max);
+            out += '}';
+            return;
+    }
+}
+
+// A JSON Schema "pattern" as a whole string value. A leading ^ / trailing $ pins that
+// end; without them the pattern may sit anywhere inside the string.
+std::string string_pattern(std::string_view pattern) {
+    const bool head = pattern.starts_with('^');
+    if (head) pattern.remove_prefix(1);
+    bool tail = false;
+    if (pattern.ends_with('$')) {
+        std::size_t slashes = 0;
+        while (slashes + 1 < pattern.size() && pattern[pattern.size() - 2 - slashes] == '\\') ++slashes;
+        tail = slashes % 2 == 0;
+        if (tail) pattern.remove_suffix(1);
+    }
+    const RegexNode node = RegexParser(pattern).parse();
+    const std::string any = std::string(kStringChar) + "*";
+    std::string out = "\"";
+    if (!head) out += any;
+    encode_string_pattern(node, out);
+    if (!tail) out += any;
+    return out + "\"";
+}
+
+class SchemaCompiler {
+public:
+    SchemaCompiler(const Json& root, const JsonSchemaOptions& options)
+        : root_(root),
+          options_(options),
+          ws_(options.whitespace.empty() ? "" : "(?:" + options.whitespace + ")") {}
+
+    std::string value(const Json& schema, std::size_t depth) {
+        if (schema.type == Json::Bool) {
+            if (!schema.boolean) throw std::runtime_error("json schema: false matches nothing");
+            return any(depth);
+        }
+        if (schema.type != Json::Object) throw std::runtime_error("json schema: a schema has to be an object");
+        if (const Json* c = schema.get("const")) return regex_literal(json_compact(*c));
+        if (const Json* e = schema.get("enum")) {
+            if (e->type != Json::Array || e->items.empty()) throw std::runtime_error("json schema: empty enum");
+            std::string out = "(?:";
+            for (std::size_t i = 0; i < e->items.size(); ++i) {
+                if (i) out += '|';
+                out += regex_literal(json_compact(e->items[i]));
+            }
+            return out + ")";
+        }
+        if (const Json* ref = schema.get("$ref")) return reference(*ref, depth);
+        for (const char* key : {"anyOf", "oneOf"}) {
+            if (const Json* alts = schema.get(key)) {
+                if (alts->items.empty()) throw std::runtime_error(std::string("json schema: empty ") + key);
+                std::string out = "(?:";
+                for (std::size_t i = 0; i < alts->items.size(); ++i) out += (i ? "|" : "") + value(alts->items[i], depth);
+                return out + ")";
+            }
+        }
+        if (const Json* all = schema.get("allOf")) {
+            if (all->items.size() != 1) throw std::runtime_error("json schema: allOf only with a single entry");
+            return value(all->items[0], depth);
+        }
+        const Json* type = schema.get("type");
+        if (type == nullptr) {
+            if (schema.get("properties")) return typed(schema, "object", depth);
+            if (schema.get("items")) return typed(schema, "array", depth);
+            return any(depth);
+        }
+        if (type->type == Json::String) return typed(schema, type->str, depth);
+        if (type->type != Json::Array || type->items.empty()) {
+            throw std::runtime_error("json schema: type has to be a string or a non-empty array of strings");
+        }
+        std::string out = "(?:";
+        for (std::size_t i = 0; i < type->items.size(); ++i) {
+            if (type->items[i].type != Json::String) {
+                throw std::runtime_error("json schema: type list entries have to be strings");
+            }
+            if (i) out += '|';
+            out += typed(schema, type->items[i].str, depth);
+        }
+        return out + ")";
+    }
+
+private:
+    // minLength and friends: absent means fallback, anything but a plain non-negative
+    // integer is an error rather than a silently wrong bound
+    static std::size_t count(const Json& schema, const char* key, std::size_t fallback) {
+        const Json* v = schema.get(key);
+        if (v == nullptr) return fallback;
+        const bool digits = v->type == Json::Number && !v->str.empty() && v->str.size() <= 18 &&
+                            std::all_of(v->str.begin(), v->str.end(), [](char c) { return c >= '0' && c <= '9'; });
+        if (!digits) throw std::runtime_error(std::string("json schema: ") + key + " must be a non-negative integer");
+        return static_cast<std::size_t>(std::stoull(v->str));
+    }
+
+    static std::string bounds(std::size_t min, std::size_t max) {
+        if (max == RegexNode::kUnbounded && min == 0) return "*";
+        std::string out = "{";
+        out += std::to_string(min);
+        out += ',';
+        if (max != RegexNode::kUnbounded) out += std::to_string(max);
+        return out + "}";
+    }
+
+    std::string reference(const Json& ref, std::size_t depth) {
+        std::string_view path = ref.str;
+        const Json* target = nullptr;
+        if (path == "#") {
+            target = &root_;
+        } else {
+            for (const char* prefix : {"#/$defs/", "#/definitions/"}) {
+                if (!path.starts_with(prefix)) continue;
+                const Json* defs = root_.get(std::string_view(prefix).substr(2, std::strlen(prefix) - 3));
+                if (defs != nullptr) target = defs->get(path.substr(std::strlen(prefix)));
+            }
+        }
+        if (target == nullptr) throw std::runtime_error("json schema: can't resolve $ref " + ref.str);
+        if (refs_open_ >= options_.max_depth) {
+            throw std::runtime_error("json schema: $ref " + ref.str + " nests deeper than max_depth");
+        }
+        ++refs_open_;
+        std::string out = value(*target, depth);
+        --refs_open_;
+        return out;
+    }
+
+    std::string typed(const Json& schema, const std::string& type, std::size_t depth) {
+        if (type == "string") {
+            if (const Json* pattern = schema.get("pattern")) return string_pattern(pattern->str);
+            return "\"" + std::string(kStringChar) +
+                   bounds(count(schema, "minLength", 0), count(schema, "maxLength", RegexNode::kUnbounded)) + "\"";
+        }
+        if (type == "integer") return std::string(kInteger);
+        if (type == "number") return std::string(kNumber);
+        if (type == "boolean") return "(?:true|false)";
+        if (type == "null") return "null";
+        if (type == "array") {
+            const Json* items = schema.get("items");
+            const std::string item = items != nullptr ? value(*items, depth) : (depth > 0 ? any(depth - 1) : "");
+            const std::size_t min = count(schema, "minItems", 0);
+            const std::size_t max = count(schema, "maxItems", RegexNode::kUnbounded);
+            if (item.empty() || max == 0) return "\\[" + ws_ + "\\]";
+            const std::string rest = "(?:" + ws_ + "," + ws_ + item + ")";
+            const std::string body = item + rest + bounds(min > 0 ? min - 1 : 0,
+                                                          max == RegexNode::kUnbounded ? max : max - 1);
+            return "\\[" + ws_ + (min > 0 ? body : "(?:" + body + ")?") + ws_ + "\\]";
+        }
+        if (type == "object") {
+            const Json* props = schema.get("properties");
+            if (props != nullptr && !props->fields.empty()) return object(schema, *props, depth);
+            const Json* extra = schema.get("additionalProperties");
+            if (depth == 0 || (extra != nullptr && extra->type == Json::Bool && !extra->boolean)) {
+                return "\\{" + ws_ + "\\}";
+            }
+            return open_object(any(depth - 1));
+        }
+        throw std::runtime_error("json schema: unknown type " + type);
+    }
+
+    std::string object(const Json& schema, const Json& props, std::size_t depth) {
+        std::vector<std::string> prop;
+        std::vector<bool> required;
+        const Json* req = schema.get("required");
+        for (const auto& [name, sub] : props.fields) {
+            prop.push_back(regex_literal(json_quote(name)) + ws_ + ":" + ws_ + value(sub, depth));
+            bool is_required = false;
+            if (req != nullptr) {
+                for (const Json& r : req->items) is_required = is_required || r.str == name;
+            }
+            required.push_back(is_required);
+        }
+        // tail[i]: properties i.. once one has been written (each comma-led);
+        // head[i]: properties i.. when none has been written yet
+        const std::size_t n = prop.size();
+        std::vector<std::string> tail(n + 1), head(n + 1);
+        for (std::size_t i = n; i-- > 0;) {
+            tail[i] = "(?:" + ws_ + "," + ws_ + prop[i] + ")" + (required[i] ? "" : "?") + tail[i + 1];
+            head[i] = required[i] ? prop[i] + tail[i + 1] : "(?:" + prop[i] + tail[i + 1] + "|" + head[i + 1] + ")";
+        }
+        return "\\{" + ws_ + head[0] + ws_ + "\\}";
+    }
+
+    std::string open_object(const std::string& member) {
+        const std::string pair = "\"" + std::string(kStringChar) + "*\"" + ws_ + ":" + ws_ + member;
+        return "\\{" + ws_ + "(?:" + pair + "(?:" + ws_ + "," + ws_ + pair + ")*)?" + ws_ + "\\}";
+    }
+
+    // any JSON value, containers nested at most depth deep
+    std::string any(std::size_t depth) {
+        std::string out = "(?:null|true|false|" + std::string(kNumber) + "|\"" + std::string(kStringChar) + "*\"";
+        if (depth > 0) {
+            const std::string inner = any(depth - 1);
+            out += "|\\[" + ws_ + "(?:" + inner + "(?:" + ws_ + "," + ws_ + inner + ")*)?" + ws_ + "\\]";
+            out += '|';
+            out += open_object(inner);
+        }
+        return out + ")";
+    }
+
+    const Json& root_;
+    const JsonSchemaOptions& options_;
+    std::string ws_;
+    std::size_t refs_open_{0};
+};
+
+std::uint64_t hash_words(std::span<const std::uint64_t> words) {
+    std::uint64_t h = 0x9e3779b97f4a7c15ull;
+    for (std::uint64_t w : words) h = (h ^ w) * 0x100000001b3ull + (h >> 29);
+    return h;
+}
+
+}  // namespace
+
+ByteAutomaton ByteAutomaton::from_regex(std::string_view pattern, std::size_t max_states) {
+    Nfa nfa;
+    const auto [nfa_start, nfa_accept] = nfa.build(RegexParser(pattern).parse());
+
+    // subset construction
+    std::vector<std::uint32_t> mark(nfa.states.size(), 0);
+    std::uint32_t epoch = 0;
+    std::vector<std::int32_t> stack;
+    const auto closure = [&](std::vector<std::int32_t>& set) {
+        ++epoch;
+        stack.assign(set.begin(), set.end());
+        set.clear();
+        while (!stack.empty()) {
+            const std::int32_t s = stack.back();
+            stack.pop_back();
+            if (mark[s] == epoch) continue;
+            mark[s] = epoch;
+            set.push_back(s);
+            for (std::int32_t t : nfa.states[s].eps) stack.push_back(t);
+        }
+        std::sort(set.begin(), set.end());
+    };
+
+    std::map<std::vector<std::int32_t>, std::int32_t> ids;
+    std::vector<std::vector<std::int32_t>> sets;
+    std::vector<std::int32_t> next;
+    const auto intern = [&](std::vector<std::int32_t> set) {
+        closure(set);
+        const auto [it, inserted] = ids.emplace(set, static_cast<std::int32_t>(sets.size()));
+        if (inserted) {
+            if (sets.size() >= max_states) {
+                throw std::runtime_error("grammar needs more than " + std::to_string(max_states) + " automaton states");
+            }
+            sets.push_back(std::move(set));
+        }
+        return it->second;
+    };
+    intern({nfa_start});
+    std::array<std::vector<std::int32_t>, 256> moves;
+    for (std::size_t d = 0; d < sets.size(); ++d) {
+        for (auto& m : moves) m.clear();
+        for (std::int32_t s : sets[d]) {
+            const Nfa::State& st = nfa.states[s];
+            if (st.target < 0) continue;
+            for (int b = 0; b < 256; ++b) {
+                if (st.bytes[b]) moves[b].push_back(st.target);
+            }
+        }
+        next.resize(sets.size() * 256, kDead);
+        for (int b = 0; b < 256; ++b) {
+            if (moves[b].empty()) continue;
+            // neighbouring bytes mostly lead to the same set (ranges), skip the closure then
+            const std::int32_t to = b > 0 && moves[b] == moves[b - 1] ? next[d * 256 + b - 1] : intern(moves[b]);
+            next.resize(sets.size() * 256, kDead);
+            next[d * 256 + b] = to;
+        }
+    }
+    const std::size_t n = sets.size();
+    std::vector<std::uint8_t> accepting(n, 0);
+    for (std::size_t d = 0; d < n; ++d) {
+        accepting[d] = std::binary_search(sets[d].begin(), sets[d].end(), nfa_accept) ? 1 : 0;
+    }
+
+    // trim: drop states that can't reach an accepting one, so a dead transition is the
+    // only way to fail
+    std::vector<std::vector<std::int32_t>> reverse(n);
+    for (std::size_t d = 0; d < n; ++d) {
+        for (int b = 0; b < 256; ++b) {
+            const std::int32_t to = next[d * 256 + b];
+            if (to >= 0 && (reverse[to].empty() || reverse[to].back() != static_cast<std::int32_t>(d))) {
+                reverse[to].push_back(static_cast<std::int32_t>(d));
+            }
+        }
+    }
+    std::vector<std::uint8_t> live(accepting);
+    stack.clear();
+    for (std::size_t d = 0; d < n; ++d) {
+        if (live[d]) stack.push_back(static_cast<std::int32_t>(d));
+    }
+    while (!stack.empty()) {
+        const std::int32_t d = stack.back();
+        stack.pop_back();
+        for (std::int32_t from : reverse[d]) {
+            if (!live[from]) {
+                live[from] = 1;
+                stack.push_back(from);
+            }
+        }
+    }
+    if (!live[0]) throw std::runtime_error("grammar matches nothing");
+    for (std::int32_t& to : next) {
+        if (to >= 0 && !live[to]) to = kDead;
+    }
+
+    // minimize (Moore): split classes by accepting, then by where each byte leads, until stable
+    std::vector<std::int32_t> cls(n);
+    for (std::size_t d = 0; d < n; ++d) cls[d] = live[d] ? accepting[d] : -1;
+    std::size_t num_classes = 0;
+    std::vector<std::int32_t> signature(257);
+    while (true) {
+        std::map<std::vector<std::int32_t>, std::int32_t> split;
+        std::vector<std::int32_t> refined(n, -1);
+        for (std::size_t d = 0; d < n; ++d) {
+            if (!live[d]) continue;
+            signature[0] = cls[d];
+            for (int b = 0; b < 256; ++b) {
+                const std::int32_t to = next[d * 256 + b];
+                signature[b + 1] = to < 0 ? -1 : cls[to];
+            }
+            refined[d] = split.emplace(signature, static_cast<std::int32_t>(split.size())).first->second;
+        }
+        cls = std::move(refined);
+        if (split.size() == num_classes) break;
+        num_classes = split.size();
+    }
+
+    // number the classes in BFS order from the start so start() is 0
+    std::vector<std::int32_t> order(num_classes, -1), rep(num_classes, -1);
+    for (std::size_t d = 0; d < n; ++d) {
+        if (live[d] && rep[cls[d]] < 0) rep[cls[d]] = static_cast<std::int32_t>(d);
+    }
+    std::vector<std::int32_t> queue{cls[0]};
+    order[cls[0]] = 0;
+    for (std::size_t q = 0; q < queue.size(); ++q) {
+        const std::int32_t d = rep[queue[q]];
+        for (int b = 0; b < 256; ++b) {
+            const std::int32_t to = next[d * 256 + b];
+            if (to >= 0 && order[cls[to]] < 0) {
+                order[cls[to]] = static_cast<std::int32_t>(queue.size());
+                queue.push_back(cls[to]);
+            }
+        }
+    }
+
+    ByteAutomaton out;
+    out.next_.assign(queue.size() * 256, kDead);
+    out.accepting_.assign(queue.size(), 0);
+    out.has_exits_.assign(queue.size(), 0);
+    for (std::size_t q = 0; q < queue.size(); ++q) {
+        const std::int32_t d = rep[queue[q]];
+        out.accepting_[q] = accepting[d];
+        for (int b = 0; b < 256; ++b) {
+            const std::int32_t to = next[d * 256 + b];
+            if (to < 0) continue;
+            out.next_[q * 256 + b] = order[cls[to]];
+            out.has_exits_[q] = 1;
+        }
+    }
+    return out;
+}
+
+std::int32_t ByteAutomaton::advance(std::int32_t state, std::string_view bytes) const {
+    for (char c : bytes) {
+        if (state == kDead) break;
+        state = next(state, static_cast<std::uint8_t>(c));
+    }
+    return state;
+}
+
+bool ByteAutomaton::matches(std::string_view text) const {
+    const std::int32_t state = advance(start(), text);
+    return state != kDead && accepting(state);
+}
+
+std::string json_schema_to_regex(std::string_view schema, const JsonSchemaOptions& options) {
+    const Json root = JsonParser(schema).parse();
+    return SchemaCompiler(root, options).value(root, options.max_depth);
+}
+
+TokenTrie::TokenTrie(std::span<const std::string_view> tokens) {
+    offsets_.reserve(tokens.size() + 1);
+    offsets_.push_back(0);
+    std::vector<std::int32_t> order;
+    for (std::size_t id = 0; id < tokens.size(); ++id) {
+        arena_ += tokens[id];
+        offsets_.push_back(static_cast<std::uint32_t>(arena_.size()));
+        if (!tokens[id].empty()) order.push_back(static_cast<std::int32_t>(id));
+    }
+    // sorted, a token comes right after its longest prefix in the trie, so nodes can be
+    // appended in preorder while keeping only the current path
+    std::sort(order.begin(), order.end(), [&](std::int32_t a, std::int32_t b) {
+        const std::string_view ta = token(a), tb = token(b);
+        return ta != tb ? ta < tb : a < b;
+    });
+    byte_.push_back(0);
+    end_.push_back(0);
+    tok_begin_.push_back(0);
+    std::vector<std::uint32_t> path{0};
+    std::string_view prev;
+    for (std::int32_t id : order) {
+        const std::string_view t = token(id);
+        std::size_t common = 0;
+        while (common < prev.size() && common < t.size() && prev[common] == t[common]) ++common;
+        while (path.size() > common + 1) {
+            end_[path.back()] = static_cast<std::uint32_t>(byte_.size());
+            path.pop_back();
+        }
+        for (std::size_t d = common; d < t.size(); ++d) {
+            path.push_back(static_cast<std::uint32_t>(byte_.size()));
+            byte_.push_back(static_cast<std::uint8_t>(t[d]));
+            end_.push_back(0);
+            tok_begin_.push_back(static_cast<std::uint32_t>(ids_.size()));
+        }
+        ids_.push_back(id);
+        prev = t;
+    }
+    while (!path.empty()) {
+        end_[path.back()] = static_cast<std::uint32_t>(byte_.size());
+        path.pop_back();
+    }
+    tok_begin_.push_back(static_cast<std::uint32_t>(ids_.size()));
+}
+
+void TokenTrie::allowed_tokens(const ByteAutomaton& automaton, std::int32_t state,
+                               std::span<std::uint64_t> bits) const {
+    thread_local std::vector<std::pair<std::uint32_t, std::int32_t>> stack;
+    stack.clear();
+    // a dead byte prunes the whole subtree, so restrictive states touch only a few nodes
+    for (std::uint32_t c = 1; c < end_[0]; c = end_[c]) stack.emplace_back(c, state);
+    const std::size_t limit = bits.size() * 64;
+    while (!stack.empty()) {
+        const auto [node, from] = stack.back();
+        stack.pop_back();
+        const std::int32_t to = automaton.next(from, byte_[node]);
+        if (to == ByteAutomaton::kDead) continue;
+        for (std::uint32_t i = tok_begin_[node]; i < tok_begin_[node + 1]; ++i) {
+            const auto id = static_cast<std::size_t>(ids_[i]);
+            if (id < limit) bits[id / 64] |= 1ull << (id % 64);
+        }
+        for (std::uint32_t c = node + 1; c < end_[node]; c = end_[c]) stack.emplace_back(c, to);
+    }
+}
+
+TokenMasks::TokenMasks(ByteAutomaton automaton,
+                       std::shared_ptr<const TokenTrie> trie,
+                       std::size_t vocab_size,
+                       std::vector<std::int32_t> end_tokens)
+    : automaton_(std::move(automaton)),
+      trie_(std::move(trie)),
+      vocab_size_(vocab_size),
+      end_tokens_(std::move(end_tokens)),
+      slot_(automaton_.num_states(), -1) {
+    if (!trie_) throw std::runtime_error("token masks need a vocabulary trie");
+    for (std::int32_t t : end_tokens_) {
+        if (t < 0 || static_cast<std::size_t>(t) >= vocab_size_) {
+            throw std::runtime_error("end token " + std::to_string(t) + " is outside the vocabulary");
+        }
+    }
+}
+
+bool TokenMasks::is_end_token(std::int32_t token) const {
+    return std::find(end_tokens_.begin(), end_tokens_.end(), token) != end_tokens_.end();
+}
+
+std::vector<std::uint64_t> TokenMasks::build(std::int32_t state) const {
+    std::vector<std::uint64_t> bits(words(), 0);
+    trie_->allowed_tokens(automaton_, state, bits);
+    for (std::int32_t t : end_tokens_) {
+        const std::uint64_t bit = 1ull << (t % 64);
+        bits[t / 64] = automaton_.accepting(state) ? bits[t / 64] | bit : bits[t / 64] & ~bit;
+    }
+    return bits;
+}
+
+// mutex_ held
+std::span<const std::uint64_t> TokenMasks::store(std::int32_t state, std::vector<std::uint64_t> bits) {
+    const std::uint64_t h = hash_words(bits);
+    const auto [begin, end] = by_hash_.equal_range(h);
+    for (auto it = begin; it != end; ++it) {
+        if (masks_[it->second] == bits) {
+            slot_[state] = it->second;
+            return masks_[it->second];
+        }
+    }
+    slot_[state] = static_cast<std::int32_t>(masks_.size());
+    by_hash_.emplace(h, slot_[state]);
+    masks_.push_back(std::move(bits));
+    return masks_.back();
+}
+
+std::span<const std::uint64_t> TokenMasks::mask(std::int32_t state) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (slot_[state] >= 0) return masks_[slot_[state]];
+    return store(state, build(state));
+}
+
+void TokenMasks::precompute() {
+    std::vector<std::int32_t> todo;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (std::size_t s = 0; s < slot_.size(); ++s) {
+            if (slot_[s] < 0) todo.push_back(static_cast<std::int32_t>(s));
+        }
+    }
+    // states cost anywhere from a handful of trie nodes to all of them
+#pragma omp parallel for schedule(dynamic)
+    for (std::size_t i = 0; i < todo.size(); ++i) {
+        std::vector<std::uint64_t> bits = build(todo[i]);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (slot_[todo[i]] < 0) store(todo[i], std::move(bits));
+    }
+}
+
+std::int32_t TokenMasks::next(std::int32_t state, std::int32_t token) const {
+    if (is_end_token(token)) return automaton_.accepting(state) ? state : ByteAutomaton::kDead;
+    if (token < 0 || static_cast<std::size_t>(token) >= std::min(vocab_size_, trie_->num_tokens())) {
+        return ByteAutomaton::kDead;
+    }
+    const std::string_view bytes = trie_->token(token);
+    return bytes.empty() ? ByteAutomaton::kDead : automaton_.advance(state, bytes);
+}
+
+std::size_t TokenMasks::states_computed() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return static_cast<std::size_t>(std::count_if(slot_.begin(), slot_.end(), [](std::int32_t s) { return s >= 0; }));
+}
+
+std::size_t TokenMasks::distinct_masks() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return masks_.size();
+}
+
+std::size_t TokenMasks::bytes() const {
+    return distinct_masks() * words() * sizeof(std::uint64_t);
+}
+
+void TokenConstraint::apply(std::span<float> logits) {
+    if (logits.size() != masks_->vocab_size()) {
+        throw std::runtime_error("constraint: logits don't match the mask's vocabulary size");
+    }
+    apply_token_mask(logits, masks_->mask(state_));
+}
+
+void TokenConstraint::accept(std::int32_t token) {
+    if (ended_) throw std::runtime_error("constraint: token after the end of the output");
+    const std::int32_t next = masks_->next(state_, token);
+    if (next == ByteAutomaton::kDead) {
+        throw std::runtime_error("constraint: token " + std::to_string(token) + " isn't allowed here");
+    }
+    ended_ = masks_->is_end_token(token);
+    state_ = next;
+}
@@ -0,0 +1,208 @@
+#include "expert_parallel.h"
+
+#include <omp.h>
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+enum : std::uint32_t { kRun = 1, kShutdown = 2 };
+
+// slot, expert, weight
+constexpr std::size_t kItemBytes = 12;
+
+// Request: header, num_tokens rows of x, num_items items. Reply: num_tokens rows of
+// weighted sums, in request row order.
+struct RunHeader {
+    std::uint32_t op;
+    std::uint32_t layer;
+    std::uint32_t num_tokens;
+    std::uint32_t num_items;
+};
+
+template <typename T>
+std::span<const std::byte> bytes_of(std::span<const T> v) {
+    return std::as_bytes(v);
+}
+
+[[noreturn]] void worker_main(const GPTOSSModel& model, Transport& transport, std::size_t first_expert,
+                              std::size_t last_expert) {
+    const std::size_t hidden = model.config().hidden_size;
+    ForwardBuffers buf;
+    std::vector<std::byte> msg;
+    std::vector<float> partial;
+    std::vector<float> expert_out(hidden);
+    try {
+        while (true) {
+            transport.recv(msg);
+            RunHeader header{};
+            std::memcpy(&header, msg.data(), sizeof(header));
+            if (header.op == kShutdown) break;
+
+            const std::size_t num_tokens = header.num_tokens;
+            const auto* x = reinterpret_cast<const float*>(msg.data() + sizeof(header));
+            const std::byte* items = msg.data() + sizeof(header) + num_tokens * hidden * sizeof(float);
+            partial.assign(num_tokens * hidden, 0.0f);
+            for (std::size_t i = 0; i < header.num_items; ++i) {
+                std::uint32_t slot, expert;
+                float weight;
+                std::memcpy(&slot, items + i * kItemBytes, 4);
+                std::memcpy(&expert, items + i * kItemBytes + 4, 4);
+                std::memcpy(&weight, items + i * kItemBytes + 8, 4);
+                if (expert < first_expert || expert >= last_expert || slot >= num_tokens) {
+                    throw std::runtime_error("expert worker got expert " + std::to_string(expert) +
+                                             " outside its range");
+                }
+                model.expert_forward(header.layer, expert, std::span<const float>(x + slot * hidden, hidden),
+                                     expert_out, buf);
+                float* dst = partial.data() + slot * hidden;
+                for (std::size_t h = 0; h < hidden; ++h) dst[h] += weight * expert_out[h];
+            }
+            transport.send(bytes_of(std::span<const float>(partial)));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "expert worker " << getpid() << " failed: " << e.what() << std::endl;
+        _exit(1);
+    }
+    _exit(0);
+}
+
+}  // namespace
+
+ExpertParallel::ExpertParallel(const GPTOSSModel& model, const ExpertParallelOptions& options)
+    : hidden_size_(model.config().hidden_size),
+      num_experts_(model.config().num_experts),
+      num_workers_(options.num_workers) {
+    const std::size_t n = num_workers_;
+    if (n == 0 || n > num_experts_) {
+        throw std::runtime_error("expert parallel needs between 1 and " + std::to_string(num_experts_) +
+                                 " workers, got " + std::to_string(n));
+    }
+    owner_.resize(num_experts_);
+    workers_.reserve(n);
+    try {
+        for (std::size_t w = 0; w < n; ++w) {
+            auto [mine, theirs] = make_transport_pair(options.transport, options.ring_bytes);
+            const pid_t parent = getpid();
+            const pid_t pid = fork_peer();
+            if (pid == 0) {
+                // the other workers' channel ends are the coordinator's business
+                mine.reset();
+                workers_.clear();
+                omp_set_num_threads(static_cast<int>(std::max<std::size_t>(options.threads_per_worker, 1)));
+                theirs->set_peer_check([parent] { return getppid() == parent; });
+                worker_main(model, *theirs, first_expert(w), first_expert(w + 1));
+            }
+            theirs.reset();
+            mine->set_peer_check([pid] { return waitpid(pid, nullptr, WNOHANG) == 0; });
+            Worker worker;
+            worker.pid = pid;
+            worker.transport = std::move(mine);
+            workers_.push_back(std::move(worker));
+            for (std::size_t e = first_expert(w); e < first_expert(w + 1); ++e) owner_[e] = w;
+        }
+    } catch (...) {
+        shutdown();
+        throw;
+    }
+}
+
+ExpertParallel::~ExpertParallel() { shutdown(); }
+
+std::size_t ExpertParallel::first_expert(std::size_t worker) const { return worker * num_experts_ / num_workers_; }
+
+void ExpertParallel::shutdown() {
+    const RunHeader header{kShutdown, 0, 0, 0};
+    for (Worker& worker : workers_) {
+        try {
+            worker.transport->send(bytes_of(std::span<const RunHeader>(&header, 1)));
+        } catch (const std::exception&) {
+            // already gone, waitpid below still reaps it
+        }
+    }
+    for (Worker& worker : workers_) {
+        worker.transport.reset();
+        waitpid(worker.pid, nullptr, 0);
+    }
+    workers_.clear();
+}
+
+void ExpertParallel::run(std::size_t layer,
+                         std::span<const float> x,
+                         std::span<const std::int32_t> experts,
+                         std::span<const float> weights,
+                         std::size_t num_tokens,
+                         std::span<float> out) {
+    const std::size_t hidden = hidden_size_;
+    const std::size_t k = experts.size() / num_tokens;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (broken_) throw std::runtime_error("expert workers are out of step after an earlier failed run");
+
+    for (Worker& worker : workers_) {
+        worker.rows.clear();
+        worker.x.clear();
+        worker.items.clear();
+        worker.slot_of.assign(num_tokens, -1);
+    }
+    for (std::size_t t = 0; t < num_tokens; ++t) {
+        for (std::size_t j = 0; j < k; ++j) {
+            const auto expert = static_cast<std::size_t>(experts[t * k + j]);
+            Worker& worker = workers_[owner_[expert]];
+            if (worker.slot_of[t] < 0) {
+                worker.slot_of[t] = static_cast<std::int32_t>(worker.rows.size());
+                worker.rows.push_back(static_cast<std::uint32_t>(t));
+                worker.x.insert(worker.x.end(), x.begin() + t * hidden, x.begin() + (t + 1) * hidden);
+            }
+            worker.items.push_back({static_cast<std::uint32_t>(worker.slot_of[t]), static_cast<std::uint32_t>(expert),
+                                    weights[t * k + j]});
+        }
+    }
+
+    try {
+        send_and_collect(layer, out);
+    } catch (...) {
+        // some workers may have a reply queued that the next run would take for its own
+        broken_ = true;
+        throw;
+    }
+}
+
+void ExpertParallel::send_and_collect(std::size_t layer, std::span<float> out) {
+    const std::size_t hidden = hidden_size_;
+    // every worker gets its batch before we wait on any of them
+    for (Worker& worker : workers_) {
+        if (worker.items.empty()) continue;
+        const RunHeader header{kRun, static_cast<std::uint32_t>(layer), static_cast<std::uint32_t>(worker.rows.size()),
+                               static_cast<std::uint32_t>(worker.items.size())};
+        static_assert(sizeof(Item) == kItemBytes);
+        const std::span<const std::byte> parts[] = {
+            bytes_of(std::span<const RunHeader>(&header, 1)),
+            bytes_of(std::span<const float>(worker.x)),
+            bytes_of(std::span<const Item>(worker.items)),
+        };
+        worker.transport->sendv(parts);
+    }
+
+    std::fill(out.begin(), out.end(), 0.0f);
+    for (Worker& worker : workers_) {
+        if (worker.items.empty()) continue;
+        worker.transport->recv(reply_);
+        if (reply_.size() != worker.rows.size() * hidden * sizeof(float)) {
+            throw std::runtime_error("expert worker reply has the wrong size");
+        }
+        const auto* partial = reinterpret_cast<const float*>(reply_.data());
+        for (std::size_t s = 0; s < worker.rows.size(); ++s) {
+            float* dst = out.data() + worker.rows[s] * hidden;
+            const float* src = partial + s * hidden;
+            for (std::size_t h = 0; h < hidden; ++h) dst[h] += src[h];
+        }
+    }
+}
@@ -0,0 +1,80 @@
+#include "harmony.h"
+
+#include "tokenizer.h"
+
+#include <string>
+
+namespace harmony {
+
+std::string special_token_name(std::int32_t id) {
+    switch (id) {
+        case kStartOfText:
+            return "<|startoftext|>";
+        case kEndOfText:
+            return "<|endoftext|>";
+        case kReturn:
+            return "<|return|>";
+        case kConstrain:
+            return "<|constrain|>";
+        case kChannel:
+            return "<|channel|>";
+        case kStart:
+            return "<|start|>";
+        case kEnd:
+            return "<|end|>";
+        case kMessage:
+            return "<|message|>";
+        case kCall:
+            return "<|call|>";
+        default:
+            return "<|reserved_" + std::to_string(id) + "|>";
+    }
+}
+
+}  // namespace harmony
+
+HarmonyPrompt::HarmonyPrompt(const Tokenizer& tokenizer) : tokenizer_(tokenizer) {}
+
+void HarmonyPrompt::append_header_text(std::string_view text) {
+    auto it = header_cache_.find(std::string(text));
+    if (it == header_cache_.end()) {
+        it = header_cache_.emplace(std::string(text), tokenizer_.encode(text)).first;
+    }
+    tokens_.insert(tokens_.end(), it->second.begin(), it->second.end());
+}
+
+HarmonyPrompt& HarmonyPrompt::message(std::string_view role, std::string_view content,
+                                      const MessageOptions& options) {
+    tokens_.push_back(harmony::kStart);
+    append_header_text(role);
+    if (!options.channel.empty()) {
+        tokens_.push_back(harmony::kChannel);
+        std::string header(options.channel);
+        if (!options.recipient.empty()) {
+            header += " to=";
+            header += options.recipient;
+        }
+        if (!options.content_type.empty()) header += ' ';
+        append_header_text(header);
+        if (!options.content_type.empty()) {
+            tokens_.push_back(harmony::kConstrain);
+            append_header_text(options.content_type);
+        }
+    }
+    tokens_.push_back(harmony::kMessage);
+    const std::vector<std::int32_t> body = tokenizer_.encode(content);
+    tokens_.insert(tokens_.end(), body.begin(), body.end());
+    // assistant tool calls end with <|call|>, everything else with <|end|>
+    tokens_.push_back(!options.recipient.empty() && role == "assistant" ? harmony::kCall : harmony::kEnd);
+    return *this;
+}
+
+HarmonyPrompt& HarmonyPrompt::start_assistant(std::string_view channel) {
+    tokens_.push_back(harmony::kStart);
+    append_header_text("assistant");
+    if (!channel.empty()) {
+        tokens_.push_back(harmony::kChannel);
+        append_header_text(channel);
+    }
+    return *this;
+}
@@ -1,5 +1,7 @@
 #include "kernels.h"
 
+#include "trace.h"
+
 #include <algorithm>
 #include <cmath>
 #include <cstddef>
@@ -8,6 +10,10 @@
 #include <limits>
 #include <vector>
 
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
 namespace {
 
 constexpr std::size_t kMxFp4BytesPerBlock = 16;
@@ -52,6 +58,7 @@ void embedding_lookup(const std::uint16_t* weight_bf16,
                       std::size_t hidden_size,
                       std::span<const std::int32_t> token_ids,
                       std::span<float> out) {
+    GPTOSS_TRACE_SCOPE("embedding_lookup");
     const std::size_t seq_len = token_ids.size();
     for (std::size_t t = 0; t < seq_len; ++t) {
         const std::int32_t token_id = token_ids[t];
@@ -68,6 +75,7 @@ void unembedding_logits(const std::uint16_t* weight_bf16,
                         std::size_t hidden_size,
                         std::span<const float> x,
                         std::span<float> out) {
+    GPTOSS_TRACE_SCOPE("unembedding_logits");
     const std::size_t seq_len = x.size() / hidden_size;
     for (std::size_t t = 0; t < seq_len; ++t) {
         const float* x_row = x.data() + t * hidden_size;
@@ -89,6 +97,7 @@ void rmsnorm(std::span<const float> x,
              float eps,
              std::size_t hidden_size,
              std::span<float> out) {
+    GPTOSS_TRACE_SCOPE("rmsnorm");
     const std::size_t seq_len = x.size() / hidden_size;
     for (std::size_t t = 0; t < seq_len; ++t) {
         const float* x_row = x.data() + t * hidden_size;
@@ -111,6 +120,7 @@ void linear_bf16(const std::uint16_t* weight_bf16,
                  std::size_t out_features,
                  std::span<const float> x,
                  std::span<float> out) {
+    GPTOSS_TRACE_SCOPE("linear_bf16");
     const std::size_t seq_len = x.size() / in_features;
     for (std::size_t t = 0; t < seq_len; ++t) {
         const float* x_row = x.data() + t * in_features;
@@ -142,6 +152,7 @@ void apply_rope(std::span<float> q,
                 float rope_ntk_alpha,
                 float rope_ntk_beta,
                 std::size_t position_offset) {
+    GPTOSS_TRACE_SCOPE("apply_rope");
 
     const std::size_t half_dim = head_dim / 2;
     // _compute_concentration_and_inv_freq
@@ -237,6 +248,7 @@ void sdpa_with_sinks(std::span<const float> q,
                      float sm_scale,
                      std::size_t sliding_window,
                      std::span<float> out) {
+    GPTOSS_TRACE_SCOPE("sdpa_with_sinks");
     const std::size_t q_mult = num_q_heads / num_kv_heads;
     const std::size_t kv_offset = kv_len - q_len;
     for (std::size_t t = 0; t < q_len; ++t) {
@@ -276,11 +288,67 @@ void sdpa_with_sinks(std::span<const float> q,
     }
 }
 
+void sdpa_paged(std::span<const float> q,
+                std::span<const float* const> k_blocks,
+                std::span<const float* const> v_blocks,
+                std::size_t block_tokens,
+                std::span<const std::uint16_t> sinks_bf16,
+                std::size_t kv_len,
+                std::size_t num_q_heads,
+                std::size_t num_kv_heads,
+                std::size_t head_dim,
+                float sm_scale,
+                std::size_t sliding_window,
+                std::span<float> out) {
+    GPTOSS_TRACE_SCOPE("sdpa_paged");
+    const std::size_t q_mult = num_q_heads / num_kv_heads;
+    const std::size_t row = num_kv_heads * head_dim;
+    const std::size_t abs_pos = kv_len - 1;
+    const std::size_t min_k =
+        sliding_window > 0 ? (abs_pos + 1 > sliding_window ? abs_pos + 1 - sliding_window : 0) : 0;
+#pragma omp parallel for schedule(static)
+    for (std::size_t h = 0; h < num_q_heads; ++h) {
+        const std::size_t kv_head = h / q_mult;
+        const float* q_row = q.data() + h * head_dim;
+        thread_local std::vector<float> logits;
+        logits.resize(abs_pos - min_k + 1);
+        float max_val = bf16_to_float(sinks_bf16[h]);
+        for (std::size_t k_idx = min_k; k_idx <= abs_pos; ++k_idx) {
+            const float* k_row =
+                k_blocks[k_idx / block_tokens] + (k_idx % block_tokens) * row + kv_head * head_dim;
+            float acc = 0.0f;
+            for (std::size_t d = 0; d < head_dim; ++d) {
+                acc += q_row[d] * k_row[d];
+            }
+            logits[k_idx - min_k] = acc * sm_scale;
+            max_val = std::max(max_val, acc * sm_scale);
+        }
+        float sum = std::exp(bf16_to_float(sinks_bf16[h]) - max_val);
+        for (float& l : logits) {
+            l = std::exp(l - max_val);
+            sum += l;
+        }
+        const float inv_sum = 1.0f / sum;
+
+        float* out_row = out.data() + h * head_dim;
+        std::fill(out_row, out_row + head_dim, 0.0f);
+        for (std::size_t k_idx = min_k; k_idx <= abs_pos; ++k_idx) {
+            const float* v_row =
+                v_blocks[k_idx / block_tokens] + (k_idx % block_tokens) * row + kv_head * head_dim;
+            const float w = logits[k_idx - min_k] * inv_sum;
+            for (std::size_t d = 0; d < head_dim; ++d) {
+                out_row[d] += w * v_row[d];
+            }
+        }
+    }
+}
+
 void moe_topk_gating(std::span<const float> gate_logits,
                      std::size_t num_experts,
                      std::size_t experts_per_token,
                      std::span<std::int32_t> topk_indices,
                      std::span<float> topk_weights) {
+    GPTOSS_TRACE_SCOPE("moe_topk_gating");
     std::vector<std::pair<float, std::int32_t>> values;
     values.reserve(num_experts);
     for (std::size_t i = 0; i < num_experts; ++i) {
@@ -306,6 +374,7 @@ void mxfp4_gemm(const std::uint8_t* blocks,
                 std::size_t in_features,
                 std::span<const float> x,
                 std::span<float> out) {
+    GPTOSS_TRACE_SCOPE("mxfp4_gemm");
     const std::size_t blocks_per_row = in_features / kMxFp4ValuesPerBlock;
 #pragma omp parallel for schedule(static)
     for (std::size_t o = 0; o < out_features; ++o) {
@@ -334,6 +403,7 @@ void swiglu(std::span<const float> x,
             float alpha,
             float limit,
             std::span<float> out) {
+    GPTOSS_TRACE_SCOPE("swiglu");
     const std::size_t half = x.size() / 2;
     for (std::size_t i = 0; i < half; ++i) {
         float x_glu = std::min(x[2 * i], limit);
@@ -348,6 +418,7 @@ void moe_combine(std::span<const float> expert_outputs,
                  std::size_t experts_per_token,
                  std::size_t hidden_size,
                  std::span<float> out) {
+    GPTOSS_TRACE_SCOPE("moe_combine");
     std::fill(out.begin(), out.end(), 0.0f);
     for (std::size_t e = 0; e < experts_per_token; ++e) {
         const float w = expert_weights[e];
@@ -357,3 +428,250 @@ void moe_combine(std::span<const float> expert_outputs,
         }
     }
 }
+
+std::int32_t argmax(std::span<const float> logits) {
+    return static_cast<std::int32_t>(
+        std::distance(logits.begin(), std::max_element(logits.begin(), logits.end())));
+}
+
+void apply_token_mask(std::span<float> logits, std::span<const std::uint64_t> allowed) {
+    GPTOSS_TRACE_SCOPE("apply_token_mask");
+    constexpr float kNegInf = -std::numeric_limits<float>::infinity();
+    const std::size_t n = logits.size();
+    float* p = logits.data();
+    std::size_t i = 0;
+#if defined(__AVX512F__)
+    // one mask word covers 4 vectors; only the disallowed lanes get stored, the logits
+    // themselves are never loaded
+    const __m512 neg_inf = _mm512_set1_ps(kNegInf);
+    for (; i + 64 <= n; i += 64) {
+        const std::uint64_t bits = allowed[i / 64];
+        if (bits == ~0ull) continue;
+        const std::uint64_t blocked = ~bits;
+        _mm512_mask_storeu_ps(p + i, static_cast<__mmask16>(blocked), neg_inf);
+        _mm512_mask_storeu_ps(p + i + 16, static_cast<__mmask16>(blocked >> 16), neg_inf);
+        _mm512_mask_storeu_ps(p + i + 32, static_cast<__mmask16>(blocked >> 32), neg_inf);
+        _mm512_mask_storeu_ps(p + i + 48, static_cast<__mmask16>(blocked >> 48), neg_inf);
+    }
+#endif
+    for (; i < n; ++i) {
+        if (!((allowed[i / 64] >> (i % 64)) & 1)) p[i] = kNegInf;
+    }
+}
+
+namespace {
+
+#if defined(__AVX512F__)
+// in-register horizontal sum. The zero-masked forms keep gcc 12 from warning about the
+// undefined passthrough the unmasked ones (and _mm512_reduce_add_ps) use.
+inline float hsum(__m512 v) {
+    v = _mm512_add_ps(v, _mm512_maskz_shuffle_f32x4(0xFFFF, v, v, 0x4E));
+    v = _mm512_add_ps(v, _mm512_maskz_shuffle_f32x4(0xFFFF, v, v, 0xB1));
+    v = _mm512_add_ps(v, _mm512_maskz_permute_ps(0xFFFF, v, 0x4E));
+    v = _mm512_add_ps(v, _mm512_maskz_permute_ps(0xFFFF, v, 0xB1));
+    return _mm512_cvtss_f32(v);
+}
+#endif
+
+template <std::size_t Hidden>
+void rmsnorm_fixed(std::span<const float> x,
+                   std::span<const std::uint16_t> scale_bf16,
+                   float eps,
+                   std::size_t,
+                   std::span<float> out) {
+    GPTOSS_TRACE_SCOPE("rmsnorm_fixed");
+    const std::size_t seq_len = x.size() / Hidden;
+    for (std::size_t t = 0; t < seq_len; ++t) {
+        const float* x_row = x.data() + t * Hidden;
+        float* out_row = out.data() + t * Hidden;
+        float mean_sq = 0.0f;
+        for (std::size_t i = 0; i < Hidden; ++i) {
+            mean_sq += x_row[i] * x_row[i];
+        }
+        const float inv_rms = 1.0f / std::sqrt(mean_sq / static_cast<float>(Hidden) + eps);
+        for (std::size_t i = 0; i < Hidden; ++i) {
+            out_row[i] = x_row[i] * inv_rms * bf16_to_float(scale_bf16[i]);
+        }
+    }
+}
+
+template <std::size_t InFeatures>
+void linear_bf16_fixed(const std::uint16_t* weight_bf16,
+                       const std::uint16_t* bias_bf16,
+                       std::size_t,
+                       std::size_t out_features,
+                       std::span<const float> x,
+                       std::span<float> out) {
+    GPTOSS_TRACE_SCOPE("linear_bf16_fixed");
+    const std::size_t seq_len = x.size() / InFeatures;
+    for (std::size_t t = 0; t < seq_len; ++t) {
+        const float* x_row = x.data() + t * InFeatures;
+        float* out_row = out.data() + t * out_features;
+#pragma omp parallel for schedule(static)
+        for (std::size_t o = 0; o < out_features; ++o) {
+            const std::uint16_t* w_row = weight_bf16 + o * InFeatures;
+            float acc = 0.0f;
+            for (std::size_t i = 0; i < InFeatures; ++i) {
+                acc += x_row[i] * bf16_to_float(w_row[i]);
+            }
+            out_row[o] = bias_bf16 ? acc + bf16_to_float(bias_bf16[o]) : acc;
+        }
+    }
+}
+
+template <std::size_t HeadDim, std::size_t Gqa>
+void sdpa_with_sinks_fixed(std::span<const float> q,
+                           std::span<const float> k,
+                           std::span<const float> v,
+                           std::span<const std::uint16_t> sinks_bf16,
+                           std::size_t q_len,
+                           std::size_t kv_len,
+                           std::size_t num_q_heads,
+                           std::size_t,
+                           std::size_t,
+                           float sm_scale,
+                           std::size_t sliding_window,
+                           std::span<float> out) {
+    GPTOSS_TRACE_SCOPE("sdpa_with_sinks_fixed");
+    const std::size_t num_kv_heads = num_q_heads / Gqa;
+    const std::size_t kv_offset = kv_len - q_len;
+    for (std::size_t t = 0; t < q_len; ++t) {
+        const std::size_t abs_pos = kv_offset + t;
+        const std::size_t min_k = sliding_window > 0
+                                      ? (abs_pos + 1 > sliding_window ? abs_pos + 1 - sliding_window : 0)
+                                      : 0;
+#pragma omp parallel for schedule(static)
+        for (std::size_t h = 0; h < num_q_heads; ++h) {
+            const std::size_t kv_head = h / Gqa;
+            const float* q_row = q.data() + (t * num_q_heads + h) * HeadDim;
+            float* out_row = out.data() + (t * num_q_heads + h) * HeadDim;
+            // online softmax: one pass over K and V, nothing sized by kv_len. The sink
+            // starts off as the running max and only takes part in the normalizer.
+            float max_val = bf16_to_float(sinks_bf16[h]);
+            float sum = 1.0f;
+#if defined(__AVX512F__)
+            if constexpr (HeadDim % 16 == 0) {
+                constexpr std::size_t kVecs = HeadDim / 16;
+                const __m512 scale = _mm512_set1_ps(sm_scale);
+                __m512 qv[kVecs];
+                __m512 acc[kVecs];
+                for (std::size_t i = 0; i < kVecs; ++i) {
+                    qv[i] = _mm512_mul_ps(_mm512_loadu_ps(q_row + 16 * i), scale);
+                    acc[i] = _mm512_setzero_ps();
+                }
+                for (std::size_t k_idx = min_k; k_idx <= abs_pos; ++k_idx) {
+                    const std::size_t row = (k_idx * num_kv_heads + kv_head) * HeadDim;
+                    const float* k_row = k.data() + row;
+                    const float* v_row = v.data() + row;
+                    __m512 dot = _mm512_mul_ps(qv[0], _mm512_loadu_ps(k_row));
+                    for (std::size_t i = 1; i < kVecs; ++i) {
+                        dot = _mm512_fmadd_ps(qv[i], _mm512_loadu_ps(k_row + 16 * i), dot);
+                    }
+                    const float logit = hsum(dot);
+                    if (logit > max_val) {
+                        const float rescale = std::exp(max_val - logit);
+                        const __m512 r = _mm512_set1_ps(rescale);
+                        for (std::size_t i = 0; i < kVecs; ++i) acc[i] = _mm512_mul_ps(acc[i], r);
+                        sum *= rescale;
+                        max_val = logit;
+                    }
+                    const float w = std::exp(logit - max_val);
+                    sum += w;
+                    const __m512 wv = _mm512_set1_ps(w);
+                    for (std::size_t i = 0; i < kVecs; ++i) {
+                        acc[i] = _mm512_fmadd_ps(wv, _mm512_loadu_ps(v_row + 16 * i), acc[i]);
+                    }
+                }
+                const __m512 inv_sum = _mm512_set1_ps(1.0f / sum);
+                for (std::size_t i = 0; i < kVecs; ++i) {
+                    _mm512_storeu_ps(out_row + 16 * i, _mm512_mul_ps(acc[i], inv_sum));
+                }
+                continue;
+            }
+#endif
+            float qs[HeadDim];
+            float acc[HeadDim] = {};
+            for (std::size_t d = 0; d < HeadDim; ++d) qs[d] = q_row[d] * sm_scale;
+            for (std::size_t k_idx = min_k; k_idx <= abs_pos; ++k_idx) {
+                const std::size_t row = (k_idx * num_kv_heads + kv_head) * HeadDim;
+                const float* k_row = k.data() + row;
+                const float* v_row = v.data() + row;
+                float logit = 0.0f;
+                for (std::size_t d = 0; d < HeadDim; ++d) logit += qs[d] * k_row[d];
+                if (logit > max_val) {
+                    const float rescale = std::exp(max_val - logit);
+                    for (std::size_t d = 0; d < HeadDim; ++d) acc[d] *= rescale;
+                    sum *= rescale;
+                    max_val = logit;
+                }
+                const float w = std::exp(logit - max_val);
+                sum += w;
+                for (std::size_t d = 0; d < HeadDim; ++d) acc[d] += w * v_row[d];
+            }
+            const float inv_sum = 1.0f / sum;
+            for (std::size_t d = 0; d < HeadDim; ++d) out_row[d] = acc[d] * inv_sum;
+        }
+    }
+}
+
+template <std::size_t InFeatures>
+void mxfp4_gemm_fixed(const std::uint8_t* blocks,
+                      const std::uint8_t* scales,
+                      std::size_t out_features,
+                      std::size_t,
+                      std::span<const float> x,
+                      std::span<float> out) {
+    GPTOSS_TRACE_SCOPE("mxfp4_gemm_fixed");
+    static_assert(InFeatures % kMxFp4ValuesPerBlock == 0);
+    constexpr std::size_t blocks_per_row = InFeatures / kMxFp4ValuesPerBlock;
+    const float* x_data = x.data();
+#pragma omp parallel for schedule(static)
+    for (std::size_t o = 0; o < out_features; ++o) {
+        const std::uint8_t* row_blocks = blocks + o * blocks_per_row * kMxFp4BytesPerBlock;
+        const std::uint8_t* row_scales = scales + o * blocks_per_row;
+        float acc = 0.0f;
+        for (std::size_t b = 0; b < blocks_per_row; ++b) {
+            // one ldexp per block instead of per value
+            const float scale = std::ldexp(1.0f, static_cast<int>(row_scales[b]) - 127);
+            const std::uint8_t* blk = row_blocks + b * kMxFp4BytesPerBlock;
+            const float* xb = x_data + b * kMxFp4ValuesPerBlock;
+            float block_acc = 0.0f;
+            for (std::size_t i = 0; i < kMxFp4BytesPerBlock; ++i) {
+                block_acc += xb[2 * i] * kFp4Values[blk[i] & 0x0F];
+                block_acc += xb[2 * i + 1] * kFp4Values[blk[i] >> 4];
+            }
+            acc += block_acc * scale;
+        }
+        out[o] = acc;
+    }
+}
+
+}  // namespace
+
+KernelTable select_kernels(std::size_t hidden_size,
+                           std::size_t intermediate_size,
+                           std::size_t head_dim,
+                           std::size_t num_q_heads,
+                           std::size_t num_kv_heads) {
+    KernelTable table{rmsnorm, linear_bf16, linear_bf16, sdpa_with_sinks, mxfp4_gemm, mxfp4_gemm, 0};
+    // every published gpt-oss size (20b, 120b) shares these dims
+    if (hidden_size == 2880) {
+        table.rmsnorm = rmsnorm_fixed<2880>;
+        table.linear_hidden = linear_bf16_fixed<2880>;
+        table.mxfp4_mlp1 = mxfp4_gemm_fixed<2880>;
+        table.specialized += 3;
+    }
+    if (intermediate_size == 2880) {
+        table.mxfp4_mlp2 = mxfp4_gemm_fixed<2880>;
+        table.specialized++;
+    }
+    if (head_dim == 64 && num_q_heads == 64) {
+        table.linear_attn_out = linear_bf16_fixed<64 * 64>;
+        table.specialized++;
+    }
+    if (head_dim == 64 && num_kv_heads > 0 && num_q_heads == 8 * num_kv_heads) {
+        table.sdpa = sdpa_with_sinks_fixed<64, 8>;
+        table.specialized++;
+    }
+    return table;
+}
@@ -1,5 +1,7 @@
 #include "kv_cache.h"
 
+#include <stdexcept>
+
 KVCache::KVCache(std::size_t num_layers) : k_cache(num_layers), v_cache(num_layers) {}
 
 void KVCache::append(std::size_t layer,
@@ -8,3 +10,17 @@ void KVCache::append(std::size_t layer,
     k_cache[layer].insert(k_cache[layer].end(), k_new.begin(), k_new.end());
     v_cache[layer].insert(v_cache[layer].end(), v_new.begin(), v_new.end());
 }
+
+void KVCache::truncate(std::size_t new_len) {
+    if (new_len > seq_len) {
+        throw std::runtime_error("kv cache: cannot truncate past current length");
+    }
+    if (new_len == seq_len) return;
+    for (std::size_t layer = 0; layer < k_cache.size(); ++layer) {
+        // row width is not stored, recover it from the layer's current size
+        const std::size_t row = k_cache[layer].size() / seq_len;
+        k_cache[layer].resize(new_len * row);
+        v_cache[layer].resize(new_len * row);
+    }
+    seq_len = new_len;
+}
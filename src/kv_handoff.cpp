@@ -0,0 +1,243 @@
+#include "kv_handoff.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kv_cache.h"
+
+namespace {
+
+constexpr char kMagic[8] = {'G', 'P', 'T', 'O', 'S', 'S', 'K', 'V'};
+constexpr std::uint32_t kVersion = 1;
+constexpr std::size_t kPage = 4096;
+constexpr int kSpins = 1000;
+constexpr long kWaitTimeoutNs = 100'000'000;
+
+std::atomic<std::uint32_t>& as_atomic(std::uint32_t* flag) {
+    static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t));
+    return *reinterpret_cast<std::atomic<std::uint32_t>*>(flag);
+}
+
+void wake(std::uint32_t* flag) {
+    syscall(SYS_futex, flag, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+}  // namespace
+
+// At the start of the file; a ready flag per layer follows it, the layers' K then V rows
+// start at data_offset. Flags only ever go 0 -> 1, which is what the futex waits on.
+struct KVHandoff::Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t num_layers;
+    std::uint64_t seq_len;
+    std::uint64_t row_floats;
+    std::uint64_t data_offset;
+    std::uint32_t first_token_ready;
+    std::int32_t first_token;
+    std::uint32_t failed;
+    std::uint32_t reserved;
+
+    std::uint32_t* ready() { return reinterpret_cast<std::uint32_t*>(this + 1); }
+};
+
+KVHandoff KVHandoff::create(const std::string& path,
+                            std::size_t num_layers,
+                            std::size_t row_floats,
+                            std::size_t seq_len) {
+    const std::size_t data_offset =
+        (sizeof(Header) + num_layers * sizeof(std::uint32_t) + kPage - 1) / kPage * kPage;
+    const std::size_t bytes = data_offset + num_layers * 2 * seq_len * row_floats * sizeof(float);
+    const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) throw std::runtime_error("failed to create kv handoff " + path + ": " + std::strerror(errno));
+    KVHandoff handoff;
+    handoff.path_ = path;
+    handoff.owner_ = true;
+    if (ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+        const int err = errno;
+        close(fd);
+        throw std::runtime_error("failed to size kv handoff " + path + ": " + std::strerror(err));
+    }
+    handoff.map(fd, bytes);
+    // a fresh file is all zeros, so every flag already reads "not ready"
+    Header* h = handoff.header_;
+    std::memcpy(h->magic, kMagic, sizeof(kMagic));
+    h->version = kVersion;
+    h->num_layers = static_cast<std::uint32_t>(num_layers);
+    h->seq_len = seq_len;
+    h->row_floats = row_floats;
+    h->data_offset = data_offset;
+    return handoff;
+}
+
+KVHandoff KVHandoff::open(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("failed to open kv handoff " + path + ": " + std::strerror(errno));
+    struct stat st {};
+    if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(Header)) {
+        close(fd);
+        throw std::runtime_error("kv handoff too small: " + path);
+    }
+    KVHandoff handoff;
+    handoff.path_ = path;
+    handoff.map(fd, static_cast<std::size_t>(st.st_size));
+    const Header* h = handoff.header_;
+    if (std::memcmp(h->magic, kMagic, sizeof(kMagic)) != 0 || h->version != kVersion ||
+        h->data_offset + h->num_layers * 2 * h->seq_len * h->row_floats * sizeof(float) > handoff.bytes_) {
+        throw std::runtime_error("not a kv handoff file: " + path);
+    }
+    return handoff;
+}
+
+void KVHandoff::map(int fd, std::size_t bytes) {
+    void* base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const int err = errno;
+    close(fd);
+    if (base == MAP_FAILED) throw std::runtime_error("failed to map kv handoff " + path_ + ": " + std::strerror(err));
+    base_ = base;
+    bytes_ = bytes;
+    header_ = static_cast<Header*>(base);
+}
+
+KVHandoff::~KVHandoff() { reset(); }
+
+void KVHandoff::reset() {
+    if (base_) munmap(base_, bytes_);
+    if (owner_) unlink(path_.c_str());
+    base_ = nullptr;
+    header_ = nullptr;
+    owner_ = false;
+}
+
+KVHandoff::KVHandoff(KVHandoff&& other) noexcept { *this = std::move(other); }
+
+KVHandoff& KVHandoff::operator=(KVHandoff&& other) noexcept {
+    if (this == &other) return *this;
+    reset();
+    path_ = std::move(other.path_);
+    owner_ = std::exchange(other.owner_, false);
+    base_ = std::exchange(other.base_, nullptr);
+    bytes_ = std::exchange(other.bytes_, 0);
+    header_ = std::exchange(other.header_, nullptr);
+    imported_ = std::move(other.imported_);
+    peer_alive_ = std::move(other.peer_alive_);
+    return *this;
+}
+
+std::size_t KVHandoff::num_layers() const { return header_->num_layers; }
+
+std::size_t KVHandoff::seq_len() const { return header_->seq_len; }
+
+const float* KVHandoff::layer_data(std::size_t layer, bool v) const {
+    const std::size_t layer_floats = header_->seq_len * header_->row_floats;
+    return reinterpret_cast<const float*>(static_cast<const std::byte*>(base_) + header_->data_offset) +
+           (2 * layer + (v ? 1 : 0)) * layer_floats;
+}
+
+void KVHandoff::publish_layer(std::size_t layer, std::span<const float> k, std::span<const float> v) {
+    const std::size_t n = header_->seq_len * header_->row_floats;
+    if (layer >= num_layers() || k.size() != n || v.size() != n) {
+        throw std::runtime_error("kv handoff: layer " + std::to_string(layer) + " doesn't match the prompt");
+    }
+    std::memcpy(const_cast<float*>(layer_data(layer, false)), k.data(), n * sizeof(float));
+    std::memcpy(const_cast<float*>(layer_data(layer, true)), v.data(), n * sizeof(float));
+    as_atomic(&header_->ready()[layer]).store(1, std::memory_order_release);
+    wake(&header_->ready()[layer]);
+}
+
+void KVHandoff::publish_first_token(std::int32_t token) {
+    header_->first_token = token;
+    as_atomic(&header_->first_token_ready).store(1, std::memory_order_release);
+    wake(&header_->first_token_ready);
+}
+
+void KVHandoff::fail() {
+    as_atomic(&header_->failed).store(1);
+    for (std::size_t l = 0; l < num_layers(); ++l) wake(&header_->ready()[l]);
+    wake(&header_->first_token_ready);
+}
+
+void KVHandoff::attach_writer(KVCache& cache) {
+    cache.after_layer = [this, &cache](std::size_t layer) {
+        const std::size_t n = header_->seq_len * header_->row_floats;
+        if (!layer_ready(layer) && cache.k_cache[layer].size() == n) {
+            publish_layer(layer, cache.k_cache[layer], cache.v_cache[layer]);
+        }
+    };
+}
+
+bool KVHandoff::layer_ready(std::size_t layer) const {
+    return as_atomic(&header_->ready()[layer]).load(std::memory_order_acquire) != 0;
+}
+
+bool KVHandoff::first_token_ready() const {
+    return as_atomic(&header_->first_token_ready).load(std::memory_order_acquire) != 0;
+}
+
+void KVHandoff::wait_flag(std::uint32_t* flag) const {
+    auto& word = as_atomic(flag);
+    for (int i = 0; i < kSpins && !word.load(std::memory_order_acquire); ++i) {
+    }
+    while (!word.load(std::memory_order_acquire)) {
+        if (as_atomic(&header_->failed).load()) throw std::runtime_error("kv handoff: prefill failed");
+        if (peer_alive_ && !peer_alive_()) throw std::runtime_error("kv handoff: prefill process went away");
+        timespec timeout{0, kWaitTimeoutNs};
+        // shared mapping, so not FUTEX_PRIVATE
+        syscall(SYS_futex, flag, FUTEX_WAIT, 0, &timeout, nullptr, 0);
+    }
+}
+
+std::int32_t KVHandoff::wait_first_token() const {
+    wait_flag(&header_->first_token_ready);
+    return header_->first_token;
+}
+
+void KVHandoff::attach_reader(KVCache& cache) {
+    if (cache.k_cache.size() != num_layers() || cache.seq_len != 0) {
+        throw std::runtime_error("kv handoff: reader needs an empty cache with the same layer count");
+    }
+    cache.seq_len = seq_len();
+    imported_.assign(num_layers(), false);
+    cache.before_layer = [this, &cache](std::size_t layer) { import_layer(cache, layer); };
+}
+
+void KVHandoff::import_layer(KVCache& cache, std::size_t layer) {
+    if (imported_[layer]) return;
+    wait_flag(&header_->ready()[layer]);
+    const std::size_t n = header_->seq_len * header_->row_floats;
+    const float* k = layer_data(layer, false);
+    const float* v = layer_data(layer, true);
+    cache.k_cache[layer].assign(k, k + n);
+    cache.v_cache[layer].assign(v, v + n);
+    imported_[layer] = true;
+}
+
+std::size_t KVHandoff::poll(KVCache& cache) {
+    std::size_t n = 0;
+    for (std::size_t l = 0; l < imported_.size(); ++l) {
+        if (!imported_[l] && layer_ready(l)) {
+            import_layer(cache, l);
+            n++;
+        }
+    }
+    return n;
+}
+
+void KVHandoff::finish(KVCache& cache) {
+    for (std::size_t l = 0; l < imported_.size(); ++l) import_layer(cache, l);
+    cache.before_layer = nullptr;
+}
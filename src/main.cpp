@@ -1,33 +1,221 @@
 #include <algorithm>
+#include <chrono>
 #include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "checkpoint.h"
+#include "constrained.h"
+#include "expert_parallel.h"
+#include "harmony.h"
+#include "kernels.h"
 #include "kv_cache.h"
 #include "model.h"
+#include "model_config.h"
+#include "prefill_workers.h"
+#include "routing_stats.h"
+#include "speculative.h"
 #include "tokenizer.h"
+#include "trace.h"
 #include "util.h"
+#include "weight_streamer.h"
 
 int main(int argc, char* argv[]) {
-    const std::string model_path = "gpt-oss-20b-model/original/model.safetensors";
-    const std::string tokenizer_path = "gpt-oss-20b-model/o200k_base.tiktoken";
-    const std::size_t vocab_size = 201088;
-    const std::size_t num_layers = 24;
+    // safetensors (single file, shard directory or index.json) or a packed file from
+    // gptoss-pack, Checkpoint tells them apart
+    std::string model_path = "gpt-oss-20b-model/original/model.safetensors";
+    // .tiktoken or a binary vocab compiled with gptoss-vocab
+    std::string tokenizer_path = "gpt-oss-20b-model/o200k_base.tiktoken";
+    // defaults to config.json next to the weights, then to the preset for the layer count
+    std::string config_path;
 
     // inference params
-    const std::string prompt = (argc > 1) ? argv[1] : "hello my name is bob";
-    const std::size_t max_tokens = 16;
+    std::string prompt = "hello my name is bob";
+    std::size_t max_tokens = 16;
+    // draft length for prompt-lookup speculative decoding, 0 = plain decode
+    std::size_t prompt_lookup = 0;
+    // prompt tokens per prefill forward; bounds activation memory for long prompts
+    std::size_t prefill_chunk = 512;
+    // wrap the prompt in a Harmony user turn and stop at the end of the assistant turn
+    bool chat = false;
+    // copy the hot tensors onto hugepages and prefault the experts before building the model
+    bool resident = false;
+    ResidencyOptions residency;
+    // read the weights in layer order in the background and start prefill right away
+    bool stream_weights = false;
+    // print token ids instead of streaming the decoded text
+    bool verbose = false;
+    ModelOptions model_options;
+    // after prefill, compare the quantized model's logits against the unquantized ones
+    bool int8_parity = false;
+    // Chrome trace of the whole run plus a per-zone summary on stderr (needs -DGPTOSS_TRACE=ON)
+    std::string trace_path;
+    trace::Options trace_options;
+    // MoE router telemetry as JSON, rewritten every routing_stats_interval_ms if that's set
+    std::string routing_stats_path;
+    std::size_t routing_stats_interval_ms = 0;
+    // fork this many worker processes that own the MoE experts between them, 0 = in-process
+    ExpertParallelOptions expert_parallel{.num_workers = 0};
+    // prefill the prompt in this many forked processes and decode from the KV they hand back
+    PrefillWorkerOptions prefill_workers{.num_workers = 0};
+    // constrained decoding: output has to match a JSON schema (file or inline) or a regex
+    std::string json_schema;
+    std::string grammar;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--model" && i + 1 < argc) {
+            model_path = argv[++i];
+        } else if (arg == "--config" && i + 1 < argc) {
+            config_path = argv[++i];
+        } else if (arg == "--tokenizer" && i + 1 < argc) {
+            tokenizer_path = argv[++i];
+        } else if (arg == "--max-tokens" && i + 1 < argc) {
+            max_tokens = std::stoul(argv[++i]);
+        } else if (arg == "--prompt-lookup" && i + 1 < argc) {
+            prompt_lookup = std::stoul(argv[++i]);
+        } else if (arg == "--chat") {
+            chat = true;
+        } else if (arg == "--verbose") {
+            verbose = true;
+        } else if (arg == "--stream-weights") {
+            stream_weights = true;
+        } else if (arg == "--resident") {
+            resident = true;
+        } else if (arg == "--gigantic-pages") {
+            resident = true;
+            residency.gigantic_pages = true;
+        } else if (arg == "--int8") {
+            model_options.int8_weights = true;
+        } else if (arg == "--int8-experts") {
+            model_options.int8_experts = true;
+        } else if (arg == "--int8-parity") {
+            int8_parity = true;
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (arg == "--trace-counters") {
+            trace_options.hardware_counters = true;
+        } else if (arg == "--routing-stats" && i + 1 < argc) {
+            routing_stats_path = argv[++i];
+        } else if (arg == "--routing-stats-interval-ms" && i + 1 < argc) {
+            routing_stats_interval_ms = std::stoul(argv[++i]);
+        } else if (arg == "--expert-workers" && i + 1 < argc) {
+            expert_parallel.num_workers = std::stoul(argv[++i]);
+        } else if (arg == "--expert-transport" && i + 1 < argc) {
+            expert_parallel.transport = parse_transport_kind(argv[++i]);
+        } else if (arg == "--prefill-workers" && i + 1 < argc) {
+            prefill_workers.num_workers = std::stoul(argv[++i]);
+        } else if (arg == "--prefill-chunk" && i + 1 < argc) {
+            prefill_chunk = std::stoul(argv[++i]);
+        } else if (arg == "--json-schema" && i + 1 < argc) {
+            json_schema = argv[++i];
+        } else if (arg == "--grammar" && i + 1 < argc) {
+            grammar = argv[++i];
+        } else {
+            prompt = arg;
+        }
+    }
+
+    if ((!json_schema.empty() || !grammar.empty()) && prompt_lookup > 0) {
+        std::cerr << "--json-schema/--grammar can't be combined with --prompt-lookup" << std::endl;
+        return 2;
+    }
+
+    if (prefill_workers.num_workers > 0 &&
+        (int8_parity || stream_weights || !json_schema.empty() || !grammar.empty())) {
+        // the workers only hand back the KV and the first token, not the prompt's logits
+        std::cerr << "--prefill-workers can't be combined with --int8-parity, --stream-weights or a constraint"
+                  << std::endl;
+        return 2;
+    }
+
+    if (int8_parity && !model_options.int8_weights && !model_options.int8_experts) {
+        // nothing to compare otherwise
+        model_options.int8_weights = true;
+    }
 
     std::cout << "loading checkpoint" << std::endl;
     Checkpoint checkpoint(model_path);
+    if (resident) {
+        checkpoint.make_resident(residency);
+    }
     std::cout << "loading tokenizer" << std::endl;
     Tokenizer tokenizer(tokenizer_path);
     std::cout << "building model" << std::endl;
-    GPTOSSModel model(checkpoint);
+    const ModelConfig config = ModelConfig::locate(config_path, model_path, checkpoint.num_layers());
+    const std::size_t vocab_size = config.vocab_size;
+    const std::size_t num_layers = config.num_hidden_layers;
+    GPTOSSModel model(checkpoint, config, model_options);
+    std::cout << "model: " << num_layers << " layers, " << config.num_experts << " experts, "
+              << model.kernels().specialized << " specialized kernels"
+              << (model_options.int8_weights ? ", int8 weights" : "")
+              << (model_options.int8_experts ? ", int8 experts" : "") << std::endl;
+    std::unique_ptr<PrefillWorkers> prefill_pool;
+    if (prefill_workers.num_workers > 0) {
+        prefill_workers.prefill_chunk = prefill_chunk;
+        prefill_pool = std::make_unique<PrefillWorkers>(checkpoint, config, model_options, prefill_workers);
+        std::cout << "prefill on " << prefill_pool->num_workers() << " worker processes" << std::endl;
+    }
+    std::unique_ptr<ExpertParallel> expert_workers;
+    if (expert_parallel.num_workers > 0) {
+        expert_workers = std::make_unique<ExpertParallel>(model, expert_parallel);
+        model.set_expert_backend(expert_workers.get());
+        std::cout << "experts on " << expert_workers->num_workers() << " worker processes" << std::endl;
+    }
+    std::unique_ptr<WeightStreamer> streamer;
+    if (stream_weights) {
+        streamer = std::make_unique<WeightStreamer>(checkpoint);
+        model.set_weight_streamer(streamer.get());
+    }
+
+    std::unique_ptr<TokenMasks> masks;
+    std::unique_ptr<TokenConstraint> constraint;
+    if (!json_schema.empty() || !grammar.empty()) {
+        if (!json_schema.empty() && json_schema.front() != '{' && std::filesystem::exists(json_schema)) {
+            std::ifstream in(json_schema);
+            json_schema.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+        const auto start = std::chrono::steady_clock::now();
+        ByteAutomaton automaton = ByteAutomaton::from_regex(grammar.empty() ? json_schema_to_regex(json_schema) : grammar);
+        const std::vector<std::string_view> pieces = tokenizer.ordinary_tokens();
+        std::vector<std::int32_t> end_tokens;
+        for (std::int32_t t : chat ? std::vector<std::int32_t>{harmony::kReturn, harmony::kCall, harmony::kEnd}
+                                   : std::vector<std::int32_t>{harmony::kEndOfText}) {
+            if (static_cast<std::size_t>(t) < vocab_size) end_tokens.push_back(t);
+        }
+        masks = std::make_unique<TokenMasks>(std::move(automaton), std::make_shared<TokenTrie>(pieces), vocab_size,
+                                             std::move(end_tokens));
+        constraint = std::make_unique<TokenConstraint>(*masks);
+        std::cout << "constraint: " << masks->automaton().num_states() << " states, compiled in "
+                  << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+                  << " ms" << std::endl;
+    }
+    // greedy pick, restricted to what the constraint allows when there is one
+    auto pick = [&](std::span<float> step_logits) {
+        if (!constraint) return argmax(step_logits);
+        constraint->apply(step_logits);
+        const std::int32_t token = argmax(step_logits);
+        constraint->accept(token);
+        return token;
+    };
+    auto is_end = [&](std::int32_t token) {
+        return (chat && harmony::is_stop_token(token)) || (masks && masks->is_end_token(token));
+    };
 
-    std::vector<std::int32_t> tokens = tokenizer.encode(prompt);
+    std::vector<std::int32_t> tokens;
+    if (chat && constraint) {
+        // the constraint describes the answer itself, so the header the model would write
+        // first is given: the turn opens on the final channel right at its message body
+        tokens = HarmonyPrompt(tokenizer).user(prompt).start_assistant("final").tokens();
+        tokens.push_back(harmony::kMessage);
+    } else {
+        tokens = chat ? HarmonyPrompt(tokenizer).user(prompt).start_assistant().tokens() : tokenizer.encode(prompt);
+    }
 
     std::cout << "prompt tokens=" << tokens.size() << "\n";
     if (tokens.empty()) {
@@ -37,31 +225,115 @@ int main(int argc, char* argv[]) {
     std::cout << prompt << std::endl;
 
     KVCache kv_cache(num_layers);
+    ForwardBuffers buf;
 
-    // Prefill: process the whole prompt in one shot.
-    const std::size_t prefill_len = tokens.size();
-    std::vector<float> prefill_logits(prefill_len * vocab_size, 0.0f);
-    model.forward(tokens, prefill_logits, kv_cache);
+    if (!trace_path.empty()) {
+        if (!trace::kCompiledIn) std::cerr << "--trace: built without -DGPTOSS_TRACE=ON, nothing will be recorded\n";
+        trace::start(trace_options);
+    }
+    std::unique_ptr<RoutingStats> routing_stats;
+    if (!routing_stats_path.empty()) {
+        routing_stats = std::make_unique<RoutingStats>(num_layers, config.num_experts, config.experts_per_token);
+        model.set_routing_stats(routing_stats.get());
+        if (routing_stats_interval_ms > 0) {
+            routing_stats->start_periodic_dump(routing_stats_path,
+                                               std::chrono::milliseconds(routing_stats_interval_ms));
+        }
+    }
+    auto finish_run = [&] {
+        if (routing_stats) {
+            routing_stats->stop_periodic_dump();
+            routing_stats->write_json(routing_stats_path);
+        }
+        if (trace_path.empty()) return;
+        trace::stop();
+        trace::write_chrome_json(trace_path);
+        trace::write_summary(std::cerr);
+    };
 
-    auto argmax = [&](const float* p) {
-        return static_cast<int>(std::distance(p, std::max_element(p, p + vocab_size)));
+    DetokenizerState detok(tokenizer);
+    auto emit = [&](std::int32_t token) {
+        if (verbose) {
+            std::cout << "next token: " << token << ' ' << tokenizer.token_bytes(token) << '\n';
+        } else {
+            std::cout << detok.push(token);
+        }
+        std::cout.flush();
     };
 
+    // Prefill: chunk the prompt, only the last token's logits are materialized.
+    std::vector<float> logits(vocab_size, 0.0f);
+    std::int32_t first_token = -1;
+    if (prefill_pool) {
+        // a worker fills the handoff layer by layer and publishes the first token last
+        const std::unique_ptr<KVHandoff> handoff = prefill_pool->submit(tokens);
+        handoff->attach_reader(kv_cache);
+        first_token = handoff->wait_first_token();
+        handoff->finish(kv_cache);
+    } else {
+        ChunkedPrefill prefill(model, tokens, kv_cache, buf, prefill_chunk);
+        while (!prefill.step(logits)) {
+        }
+    }
+    if (streamer) {
+        // prefill touched every layer, so everything is in by now
+        std::cerr << "weights streamed in " << streamer->seconds_to_ready() << " s ("
+                  << (streamer->using_io_uring() ? "io_uring" : "populate") << ")" << std::endl;
+        model.set_weight_streamer(nullptr);
+    }
+    if (int8_parity) {
+        // the bf16 model only holds pointers into the checkpoint, building it is free
+        GPTOSSModel reference(checkpoint, config);
+        KVCache ref_cache(num_layers);
+        std::vector<float> ref_logits(vocab_size, 0.0f);
+        ChunkedPrefill ref_prefill(reference, tokens, ref_cache, buf, prefill_chunk);
+        while (!ref_prefill.step(ref_logits)) {
+        }
+        std::cout << "int8 parity vs reference: " << logit_parity(ref_logits, logits) << std::endl;
+    }
+
     // Argmax over the last prompt token's logits → first generated token.
-    int next_token = argmax(prefill_logits.data() + (prefill_len - 1) * vocab_size);
-    std::cout << "next token: " << next_token << ' ' << tokenizer.decode(next_token) << std::endl;
+    int next_token = prefill_pool ? first_token : pick(logits);
+    if (!masks || !masks->is_end_token(next_token)) emit(next_token);
+    tokens.push_back(next_token);
+
+    if (prompt_lookup > 0) {
+        // Speculative decode: verify n-gram drafts from the context in one forward.
+        PromptLookupDecoder decoder(model, kv_cache, vocab_size, {.num_draft = prompt_lookup});
+        std::size_t generated = 1;
+        while (generated < max_tokens) {
+            for (std::int32_t token : decoder.step(tokens)) {
+                if (generated++ >= max_tokens || (chat && harmony::is_stop_token(token))) {
+                    generated = max_tokens;
+                    break;
+                }
+                tokens.push_back(token);
+                emit(token);
+            }
+        }
+        std::cout << detok.flush() << "\n";
+        const SpeculativeStats& stats = decoder.stats();
+        std::cout << "prompt-lookup: forwards=" << stats.forwards
+                  << " drafted=" << stats.drafted
+                  << " accepted=" << stats.accepted
+                  << " acceptance_rate=" << stats.acceptance_rate()
+                  << " tokens_per_forward=" << stats.tokens_per_forward() << "\n";
+        finish_run();
+        return 0;
+    }
 
     // Decode: one token at a time, reading from the KV cache.
-    std::vector<float> decode_logits(vocab_size, 0.0f);
-    for (std::size_t step = 1; step < max_tokens; ++step) {
+    for (std::size_t step = 1; step < max_tokens && !(constraint && constraint->done()); ++step) {
         std::vector<std::int32_t> single = {next_token};
-        model.forward(single, decode_logits, kv_cache);
+        model.forward(single, logits, kv_cache, buf);
 
-        next_token = argmax(decode_logits.data());
-        std::cout << "next token: " << next_token << ' ' << tokenizer.decode(next_token) << std::endl;
-        std::cout.flush();
+        next_token = pick(logits);
+        if (is_end(next_token)) break;
+        emit(next_token);
     }
+    if (constraint && !constraint->complete()) std::cerr << "\nconstraint: stopped before the output was complete\n";
 
-    std::cout << "\n";
+    std::cout << detok.flush() << "\n";
+    finish_run();
     return 0;
 }
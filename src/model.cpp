@@ -3,6 +3,10 @@
 #include "checkpoint.h"
 #include "kernels.h"
 #include "kv_cache.h"
+#include "paged_kv.h"
+#include "routing_stats.h"
+#include "trace.h"
+#include "weight_streamer.h"
 
 #include <algorithm>
 #include <cmath>
@@ -16,46 +20,6 @@
 
 namespace {
 
-// icba parsing this from the json and its not like i can inferencing any other sizes anyways
-// ram is expensive these days ._.
-struct Config20B {
-    int num_hidden_layers;
-    int num_experts;
-    int experts_per_token;
-    int vocab_size;
-    int hidden_size;
-    int intermediate_size;
-    int swiglu_limit;
-    int head_dim;
-    int num_attention_heads;
-    int num_key_value_heads;
-    int sliding_window;
-    int initial_context_length;
-    int rope_theta;
-    int rope_scaling_factor;
-    int rope_ntk_alpha;
-    int rope_ntk_beta;
-};
-
-const Config20B kConfig20B = {
-    24,
-    32,
-    4,
-    201088,
-    2880,
-    2880,
-    7,
-    64,
-    64,
-    8,
-    128,
-    4096,
-    150000,
-    32,
-    1,
-    32,
-};
-
 inline float bf16_to_float(std::uint16_t v) {
     std::uint32_t tmp = static_cast<std::uint32_t>(v) << 16;
     float out = 0.0f;
@@ -63,6 +27,14 @@ inline float bf16_to_float(std::uint16_t v) {
     return out;
 }
 
+// Exact-size view of a scratch buffer, growing it if needed. Kernels derive the token
+// count from span sizes so the view must not include stale capacity.
+template <typename T>
+std::span<T> take(std::vector<T>& buf, std::size_t n) {
+    if (buf.size() < n) buf.resize(n);
+    return std::span<T>(buf.data(), n);
+}
+
 void require_count(const char* name, std::size_t actual, std::size_t expected) {
     if (actual != expected) {
         throw std::runtime_error(std::string("tensor size mismatch: ") + name +
@@ -71,70 +43,93 @@ void require_count(const char* name, std::size_t actual, std::size_t expected) {
     }
 }
 
+// logits for the last few of num_tokens rows: whole vocab rows, no more than there are tokens
+void require_logits_rows(std::size_t logits_size, std::size_t vocab, std::size_t num_tokens) {
+    if (logits_size % vocab != 0 || logits_size / vocab > num_tokens) {
+        throw std::runtime_error("logits of " + std::to_string(logits_size) + " floats aren't at most " +
+                                 std::to_string(num_tokens) + " rows of " + std::to_string(vocab));
+    }
+}
+
 }  // namespace
 
-Embedding::Embedding(Checkpoint& checkpoint) {
-    weight = checkpoint.get_bf16_ptr("embedding.weight");
-    weight_count = checkpoint.get_bf16_count("embedding.weight");
-    hidden_size = kConfig20B.hidden_size;
+Embedding::Embedding(Checkpoint& checkpoint, const ModelConfig& config) {
+    weight = checkpoint.get_bf16_ptr(TensorKind::Embedding);
+    weight_count = checkpoint.get_bf16_count(TensorKind::Embedding);
+    hidden_size = config.hidden_size;
+    vocab_size = config.vocab_size;
+    require_count("embedding.weight", weight_count, vocab_size * hidden_size);
 }
 
 void Embedding::forward(std::span<const std::int32_t> token_id,
                         std::span<float> out,
                         std::size_t num_tokens) const {
-    // // for debug:
-    // require_count("embedding.weight", weight_count, kConfig20B.vocab_size * kConfig20B.hidden_size);
-    embedding_lookup(weight, kConfig20B.vocab_size, hidden_size, token_id, out);
+    embedding_lookup(weight, vocab_size, hidden_size, token_id, out);
 }
 
 
-AttentionBlock::AttentionBlock(Checkpoint& checkpoint, int layer_idx) : layer_idx(layer_idx) {
-    std::string prefix = "block." + std::to_string(layer_idx) + ".attn.";
-    norm_scale = checkpoint.get_bf16_ptr(prefix + "norm.scale");
-    norm_scale_count = checkpoint.get_bf16_count(prefix + "norm.scale");
-    qkv_weight = checkpoint.get_bf16_ptr(prefix + "qkv.weight");
-    qkv_weight_count = checkpoint.get_bf16_count(prefix + "qkv.weight");
-    qkv_bias = checkpoint.get_bf16_ptr(prefix + "qkv.bias");
-    qkv_bias_count = checkpoint.get_bf16_count(prefix + "qkv.bias");
-    out_weight = checkpoint.get_bf16_ptr(prefix + "out.weight");
-    out_weight_count = checkpoint.get_bf16_count(prefix + "out.weight");
-    out_bias = checkpoint.get_bf16_ptr(prefix + "out.bias");
-    out_bias_count = checkpoint.get_bf16_count(prefix + "out.bias");
-    sinks = checkpoint.get_bf16_ptr(prefix + "sinks");
-    sinks_count = checkpoint.get_bf16_count(prefix + "sinks");
-    hidden_size = kConfig20B.hidden_size;
-    sliding_window = (layer_idx % 2 == 0) ? static_cast<std::size_t>(kConfig20B.sliding_window) : 0;
+AttentionBlock::AttentionBlock(Checkpoint& checkpoint,
+                               int layer_idx,
+                               const ModelConfig& config,
+                               const KernelTable& kernels,
+                               const ModelOptions& options)
+    : layer_idx(layer_idx), config(config), kernels(kernels) {
+    norm_scale = checkpoint.get_bf16_ptr(TensorKind::AttnNorm, layer_idx);
+    norm_scale_count = checkpoint.get_bf16_count(TensorKind::AttnNorm, layer_idx);
+    qkv_weight = checkpoint.get_bf16_ptr(TensorKind::AttnQkvWeight, layer_idx);
+    qkv_weight_count = checkpoint.get_bf16_count(TensorKind::AttnQkvWeight, layer_idx);
+    qkv_bias = checkpoint.get_bf16_ptr(TensorKind::AttnQkvBias, layer_idx);
+    qkv_bias_count = checkpoint.get_bf16_count(TensorKind::AttnQkvBias, layer_idx);
+    out_weight = checkpoint.get_bf16_ptr(TensorKind::AttnOutWeight, layer_idx);
+    out_weight_count = checkpoint.get_bf16_count(TensorKind::AttnOutWeight, layer_idx);
+    out_bias = checkpoint.get_bf16_ptr(TensorKind::AttnOutBias, layer_idx);
+    out_bias_count = checkpoint.get_bf16_count(TensorKind::AttnOutBias, layer_idx);
+    sinks = checkpoint.get_bf16_ptr(TensorKind::AttnSinks, layer_idx);
+    sinks_count = checkpoint.get_bf16_count(TensorKind::AttnSinks, layer_idx);
+    hidden_size = config.hidden_size;
+    sliding_window = (layer_idx % 2 == 0) ? config.sliding_window : 0;
+
+    // checked once here since the shapes now come from config.json
+    const std::size_t q_dim = config.num_attention_heads * config.head_dim;
+    const std::size_t qkv_dim = q_dim + 2 * config.num_key_value_heads * config.head_dim;
+    require_count("attn.norm.scale", norm_scale_count, hidden_size);
+    require_count("attn.qkv.weight", qkv_weight_count, qkv_dim * hidden_size);
+    require_count("attn.qkv.bias", qkv_bias_count, qkv_dim);
+    require_count("attn.out.weight", out_weight_count, hidden_size * q_dim);
+    require_count("attn.out.bias", out_bias_count, hidden_size);
+    require_count("attn.sinks", sinks_count, config.num_attention_heads);
+
+    if (options.int8_weights) {
+        qkv_int8 = quantize_int8_rows(qkv_weight, qkv_dim, hidden_size);
+        out_int8 = quantize_int8_rows(out_weight, hidden_size, q_dim);
+    }
 }
 
-void AttentionBlock::forward(std::span<const float> x,
-                             std::span<float> out,
-                             std::size_t num_tokens,
-                             KVCache& kv_cache) const {
+void AttentionBlock::project_qkv(std::span<const float> x, std::size_t num_tokens, ForwardBuffers& buf) const {
     const std::size_t hidden = hidden_size;
-    const std::size_t num_heads = kConfig20B.num_attention_heads;
-    const std::size_t num_kv_heads = kConfig20B.num_key_value_heads;
-    const std::size_t head_dim = kConfig20B.head_dim;
+    const std::size_t num_heads = config.num_attention_heads;
+    const std::size_t num_kv_heads = config.num_key_value_heads;
+    const std::size_t head_dim = config.head_dim;
     const std::size_t qkv_dim = head_dim * (num_heads + 2 * num_kv_heads);
     const float eps = 1e-5f;
-    const float sm_scale = 1.0f / std::sqrt(static_cast<float>(head_dim));
-
-    // require_count("attn.norm.scale", norm_scale_count, hidden);
-    // require_count("attn.qkv.weight", qkv_weight_count, qkv_dim * hidden);
-    // require_count("attn.qkv.bias", qkv_bias_count, qkv_dim);
-    // require_count("attn.out.weight", out_weight_count, hidden * (num_heads * head_dim));
-    // require_count("attn.out.bias", out_bias_count, hidden);
-    // require_count("attn.sinks", sinks_count, num_heads);
 
-    std::vector<float> norm_out(num_tokens * hidden, 0.0f);
-    rmsnorm(x, std::span<const std::uint16_t>(norm_scale, norm_scale_count), eps, hidden, norm_out);
+    std::span<float> norm_out = take(buf.norm_out, num_tokens * hidden);
+    kernels.rmsnorm(x, std::span<const std::uint16_t>(norm_scale, norm_scale_count), eps, hidden, norm_out);
 
-    std::vector<float> qkv(num_tokens * qkv_dim, 0.0f);
-    linear_bf16(qkv_weight, qkv_bias, hidden, qkv_dim, norm_out, qkv);
+    std::span<float> qkv = take(buf.qkv, num_tokens * qkv_dim);
+    {
+        GPTOSS_TRACE_SCOPE("attn.qkv");
+        if (qkv_int8.empty()) {
+            kernels.linear_hidden(qkv_weight, qkv_bias, hidden, qkv_dim, norm_out, qkv);
+        } else {
+            linear_int8(qkv_int8, qkv_bias, norm_out, qkv);
+        }
+    }
     
     // slicing output of linear
-    std::vector<float> q(num_tokens * num_heads * head_dim, 0.0f);
-    std::vector<float> k(num_tokens * num_kv_heads * head_dim, 0.0f);
-    std::vector<float> v(num_tokens * num_kv_heads * head_dim, 0.0f);
+    std::span<float> q = take(buf.q, num_tokens * num_heads * head_dim);
+    std::span<float> k = take(buf.k, num_tokens * num_kv_heads * head_dim);
+    std::span<float> v = take(buf.v, num_tokens * num_kv_heads * head_dim);
 
     for (std::size_t t = 0; t < num_tokens; ++t) {
         const float* row = qkv.data() + t * qkv_dim;
@@ -147,87 +142,237 @@ void AttentionBlock::forward(std::span<const float> x,
         std::copy(row + q_bytes, row + q_bytes + k_bytes, k_row);
         std::copy(row + q_bytes + k_bytes, row + q_bytes + 2 * k_bytes, v_row);
     }
+}
 
-    
+void AttentionBlock::rope(std::span<float> q, std::span<float> k, std::size_t num_tokens, std::size_t position) const {
+    apply_rope(q, k, num_tokens, config.num_attention_heads, config.num_key_value_heads, config.head_dim,
+               config.initial_context_length, config.rope_theta, config.rope_scaling_factor,
+               config.rope_ntk_alpha, config.rope_ntk_beta, position);
+}
+
+void AttentionBlock::project_out(std::span<const float> x,
+                                 std::span<float> out,
+                                 std::size_t num_tokens,
+                                 ForwardBuffers& buf) const {
+    const std::size_t hidden = hidden_size;
+    const std::size_t q_dim = config.num_attention_heads * config.head_dim;
+    std::span<float> attn = take(buf.attn, num_tokens * q_dim);
+    std::span<float> projected = take(buf.projected, num_tokens * hidden);
+    {
+        GPTOSS_TRACE_SCOPE("attn.out_proj");
+        if (out_int8.empty()) {
+            kernels.linear_attn_out(out_weight, out_bias, q_dim, hidden, attn, projected);
+        } else {
+            linear_int8(out_int8, out_bias, attn, projected);
+        }
+    }
+
+    for (std::size_t i = 0; i < out.size(); ++i) {
+        out[i] = x[i] + projected[i];
+    }
+}
 
-    const std::size_t initial_context_length = kConfig20B.initial_context_length;
-    const float rope_theta = static_cast<float>(kConfig20B.rope_theta);
-    const float rope_scaling_factor = static_cast<float>(kConfig20B.rope_scaling_factor);
-    const float rope_ntk_alpha = static_cast<float>(kConfig20B.rope_ntk_alpha);
-    const float rope_ntk_beta = static_cast<float>(kConfig20B.rope_ntk_beta);
+void AttentionBlock::forward(std::span<const float> x,
+                             std::span<float> out,
+                             std::size_t num_tokens,
+                             KVCache& kv_cache,
+                             ForwardBuffers& buf) const {
+    GPTOSS_TRACE_SCOPE("attention");
+    const std::size_t num_heads = config.num_attention_heads;
+    const std::size_t num_kv_heads = config.num_key_value_heads;
+    const std::size_t head_dim = config.head_dim;
+    const float sm_scale = 1.0f / std::sqrt(static_cast<float>(head_dim));
+
+    project_qkv(x, num_tokens, buf);
+    std::span<float> q = take(buf.q, num_tokens * num_heads * head_dim);
+    std::span<float> k = take(buf.k, num_tokens * num_kv_heads * head_dim);
+    std::span<float> v = take(buf.v, num_tokens * num_kv_heads * head_dim);
 
     // Read cache size BEFORE appending so RoPE positions start at kv_offset.
     const std::size_t kv_offset = kv_cache.seq_len;
     const std::size_t kv_len = kv_offset + num_tokens;
 
-    apply_rope(q, k, num_tokens, num_heads, num_kv_heads, head_dim,
-               initial_context_length, rope_theta, rope_scaling_factor,
-               rope_ntk_alpha, rope_ntk_beta, kv_offset);
+    rope(q, k, num_tokens, kv_offset);
 
-    kv_cache.append(layer_idx, k, v);
+    {
+        GPTOSS_TRACE_SCOPE("attn.kv_append");
+        kv_cache.append(layer_idx, k, v);
+    }
 
     const auto& k_full = kv_cache.k_cache[layer_idx];
     const auto& v_full = kv_cache.v_cache[layer_idx];
 
-    std::vector<float> attn(num_tokens * num_heads * head_dim, 0.0f);
-    sdpa_with_sinks(std::span<const float>(q),
+    std::span<float> attn = take(buf.attn, num_tokens * num_heads * head_dim);
+    kernels.sdpa(q,
                     std::span<const float>(k_full.data(), k_full.size()),
                     std::span<const float>(v_full.data(), v_full.size()),
                     std::span<const std::uint16_t>(sinks, sinks_count),
                     num_tokens, kv_len, num_heads, num_kv_heads, head_dim,
                     sm_scale, sliding_window, attn);
 
-    std::vector<float> projected(num_tokens * hidden, 0.0f);
-    linear_bf16(out_weight, out_bias, num_heads * head_dim, hidden, attn, projected);
+    project_out(x, out, num_tokens, buf);
+}
 
-    for (std::size_t i = 0; i < out.size(); ++i) {
-        out[i] = x[i] + projected[i];
+void AttentionBlock::forward_batch(std::span<const float> x,
+                                   std::span<float> out,
+                                   std::span<PagedKVCache* const> caches,
+                                   ForwardBuffers& buf) const {
+    GPTOSS_TRACE_SCOPE("attention");
+    const std::size_t num_tokens = caches.size();
+    const std::size_t num_heads = config.num_attention_heads;
+    const std::size_t num_kv_heads = config.num_key_value_heads;
+    const std::size_t head_dim = config.head_dim;
+    const std::size_t q_dim = num_heads * head_dim;
+    const std::size_t kv_dim = num_kv_heads * head_dim;
+    const float sm_scale = 1.0f / std::sqrt(static_cast<float>(head_dim));
+
+    project_qkv(x, num_tokens, buf);
+    std::span<float> q = take(buf.q, num_tokens * q_dim);
+    std::span<float> k = take(buf.k, num_tokens * kv_dim);
+    std::span<float> v = take(buf.v, num_tokens * kv_dim);
+    std::span<float> attn = take(buf.attn, num_tokens * q_dim);
+
+    // the projections are shared, each row then attends over its own sequence
+    for (std::size_t t = 0; t < num_tokens; ++t) {
+        PagedKVCache& cache = *caches[t];
+        const std::size_t pos = cache.seq_len;
+        std::span<float> q_row = q.subspan(t * q_dim, q_dim);
+        std::span<float> k_row = k.subspan(t * kv_dim, kv_dim);
+        rope(q_row, k_row, 1, pos);
+        std::copy(k_row.begin(), k_row.end(), cache.k_row(layer_idx, pos));
+        std::copy(v.begin() + t * kv_dim, v.begin() + (t + 1) * kv_dim, cache.v_row(layer_idx, pos));
+
+        cache.layer_blocks(layer_idx, buf.k_blocks, buf.v_blocks);
+        sdpa_paged(q_row, buf.k_blocks, buf.v_blocks, cache.pool().block_tokens(),
+                   std::span<const std::uint16_t>(sinks, sinks_count), pos + 1, num_heads, num_kv_heads, head_dim,
+                   sm_scale, sliding_window, attn.subspan(t * q_dim, q_dim));
     }
+
+    project_out(x, out, num_tokens, buf);
 }
 
 
-MLPBlock::MLPBlock(Checkpoint& checkpoint, int layer_idx) {
-    std::string prefix = "block." + std::to_string(layer_idx) + ".mlp.";
-    norm_scale = checkpoint.get_bf16_ptr(prefix + "norm.scale");
-    norm_scale_count = checkpoint.get_bf16_count(prefix + "norm.scale");
-    gate_weight = checkpoint.get_bf16_ptr(prefix + "gate.weight");
-    gate_weight_count = checkpoint.get_bf16_count(prefix + "gate.weight");
-    gate_bias = checkpoint.get_bf16_ptr(prefix + "gate.bias");
-    gate_bias_count = checkpoint.get_bf16_count(prefix + "gate.bias");
-    mlp1_bias = checkpoint.get_bf16_ptr(prefix + "mlp1_bias");
-    mlp1_bias_count = checkpoint.get_bf16_count(prefix + "mlp1_bias");
-    mlp2_bias = checkpoint.get_bf16_ptr(prefix + "mlp2_bias");
-    mlp2_bias_count = checkpoint.get_bf16_count(prefix + "mlp2_bias");
-    mlp1_weight_blocks = checkpoint.get_u8_ptr(prefix + "mlp1_weight.blocks");
-    mlp1_weight_blocks_count = checkpoint.get_u8_count(prefix + "mlp1_weight.blocks");
-    mlp1_weight_scales = checkpoint.get_u8_ptr(prefix + "mlp1_weight.scales");
-    mlp1_weight_scales_count = checkpoint.get_u8_count(prefix + "mlp1_weight.scales");
-    mlp2_weight_blocks = checkpoint.get_u8_ptr(prefix + "mlp2_weight.blocks");
-    mlp2_weight_blocks_count = checkpoint.get_u8_count(prefix + "mlp2_weight.blocks");
-    mlp2_weight_scales = checkpoint.get_u8_ptr(prefix + "mlp2_weight.scales");
-    mlp2_weight_scales_count = checkpoint.get_u8_count(prefix + "mlp2_weight.scales");
-    hidden_size = kConfig20B.hidden_size;
+MLPBlock::MLPBlock(Checkpoint& checkpoint,
+                   int layer_idx,
+                   const ModelConfig& config,
+                   const KernelTable& kernels,
+                   const ModelOptions& options)
+    : layer_idx(layer_idx), config(config), kernels(kernels) {
+    norm_scale = checkpoint.get_bf16_ptr(TensorKind::MlpNorm, layer_idx);
+    norm_scale_count = checkpoint.get_bf16_count(TensorKind::MlpNorm, layer_idx);
+    gate_weight = checkpoint.get_bf16_ptr(TensorKind::MlpGateWeight, layer_idx);
+    gate_weight_count = checkpoint.get_bf16_count(TensorKind::MlpGateWeight, layer_idx);
+    gate_bias = checkpoint.get_bf16_ptr(TensorKind::MlpGateBias, layer_idx);
+    gate_bias_count = checkpoint.get_bf16_count(TensorKind::MlpGateBias, layer_idx);
+    mlp1_bias = checkpoint.get_bf16_ptr(TensorKind::Mlp1Bias, layer_idx);
+    mlp1_bias_count = checkpoint.get_bf16_count(TensorKind::Mlp1Bias, layer_idx);
+    mlp2_bias = checkpoint.get_bf16_ptr(TensorKind::Mlp2Bias, layer_idx);
+    mlp2_bias_count = checkpoint.get_bf16_count(TensorKind::Mlp2Bias, layer_idx);
+    mlp1_weight_blocks = checkpoint.get_u8_ptr(TensorKind::Mlp1Blocks, layer_idx);
+    mlp1_weight_blocks_count = checkpoint.get_u8_count(TensorKind::Mlp1Blocks, layer_idx);
+    mlp1_weight_scales = checkpoint.get_u8_ptr(TensorKind::Mlp1Scales, layer_idx);
+    mlp1_weight_scales_count = checkpoint.get_u8_count(TensorKind::Mlp1Scales, layer_idx);
+    mlp2_weight_blocks = checkpoint.get_u8_ptr(TensorKind::Mlp2Blocks, layer_idx);
+    mlp2_weight_blocks_count = checkpoint.get_u8_count(TensorKind::Mlp2Blocks, layer_idx);
+    mlp2_weight_scales = checkpoint.get_u8_ptr(TensorKind::Mlp2Scales, layer_idx);
+    mlp2_weight_scales_count = checkpoint.get_u8_count(TensorKind::Mlp2Scales, layer_idx);
+    hidden_size = config.hidden_size;
+
+    const std::size_t num_experts = config.num_experts;
+    const std::size_t mlp1_out_features = config.intermediate_size * 2;
+    require_count("mlp.norm.scale", norm_scale_count, hidden_size);
+    require_count("mlp.gate.weight", gate_weight_count, num_experts * hidden_size);
+    require_count("mlp.gate.bias", gate_bias_count, num_experts);
+    require_count("mlp.mlp1_bias", mlp1_bias_count, num_experts * mlp1_out_features);
+    require_count("mlp.mlp2_bias", mlp2_bias_count, num_experts * hidden_size);
+    require_count("mlp.mlp1_weight.blocks", mlp1_weight_blocks_count,
+                  num_experts * mlp1_out_features * hidden_size / 2);
+    require_count("mlp.mlp1_weight.scales", mlp1_weight_scales_count,
+                  num_experts * mlp1_out_features * hidden_size / 32);
+    require_count("mlp.mlp2_weight.blocks", mlp2_weight_blocks_count,
+                  num_experts * hidden_size * config.intermediate_size / 2);
+    require_count("mlp.mlp2_weight.scales", mlp2_weight_scales_count,
+                  num_experts * hidden_size * config.intermediate_size / 32);
+
+    if (options.int8_weights) gate_int8 = quantize_int8_rows(gate_weight, num_experts, hidden_size);
 }
 
 void MLPBlock::forward(std::span<const float> x,
                        std::span<float> out,
-                       std::size_t num_tokens) const {
+                       std::size_t num_tokens,
+                       ForwardBuffers& buf) const {
+    GPTOSS_TRACE_SCOPE("mlp");
     const std::size_t hidden = hidden_size;
-    const std::size_t num_experts = kConfig20B.num_experts;
-    const std::size_t experts_per_token = kConfig20B.experts_per_token;
-    const std::size_t intermediate = kConfig20B.intermediate_size;
+    const std::size_t num_experts = config.num_experts;
+    const std::size_t experts_per_token = config.experts_per_token;
     const float eps = 1e-5f;
 
-    // require_count("mlp.norm.scale", norm_scale_count, hidden);
-    // require_count("mlp.gate.weight", gate_weight_count, num_experts * hidden);
-    // require_count("mlp.gate.bias", gate_bias_count, num_experts);
+    std::span<float> norm_out = take(buf.norm_out, num_tokens * hidden);
+    kernels.rmsnorm(x, std::span<const std::uint16_t>(norm_scale, norm_scale_count), eps, hidden, norm_out);
+
+    std::span<float> gate_logits = take(buf.gate_logits, num_tokens * num_experts);
+    {
+        GPTOSS_TRACE_SCOPE("mlp.router");
+        if (gate_int8.empty()) {
+            kernels.linear_hidden(gate_weight, gate_bias, hidden, num_experts, norm_out, gate_logits);
+        } else {
+            linear_int8(gate_int8, gate_bias, norm_out, gate_logits);
+        }
+    }
 
-    std::vector<float> norm_out(num_tokens * hidden, 0.0f);
-    rmsnorm(x, std::span<const std::uint16_t>(norm_scale, norm_scale_count), eps, hidden, norm_out);
+    // route every token first, so the experts can run here or be shipped off as one batch
+    std::span<std::int32_t> topk_indices = take(buf.topk_indices, num_tokens * experts_per_token);
+    std::span<float> topk_weights = take(buf.topk_weights, num_tokens * experts_per_token);
+    std::span<std::uint32_t> expert_load;
+    if (routing_stats) {
+        expert_load = take(buf.expert_load, num_experts);
+        std::fill(expert_load.begin(), expert_load.end(), 0u);
+    }
+    for (std::size_t t = 0; t < num_tokens; ++t) {
+        const float* gate_row = gate_logits.data() + t * num_experts;
+        const auto token_experts = topk_indices.subspan(t * experts_per_token, experts_per_token);
+        const auto token_weights = topk_weights.subspan(t * experts_per_token, experts_per_token);
+        moe_topk_gating(std::span<const float>(gate_row, num_experts), num_experts,
+                        experts_per_token, token_experts, token_weights);
+        if (routing_stats) {
+            routing_stats->record(static_cast<std::size_t>(layer_idx), token_experts, token_weights);
+            for (std::int32_t e : token_experts) expert_load[static_cast<std::size_t>(e)]++;
+        }
+    }
+
+    if (expert_backend) {
+        expert_backend->run(static_cast<std::size_t>(layer_idx), norm_out, topk_indices, topk_weights, num_tokens,
+                            out.first(num_tokens * hidden));
+        for (std::size_t i = 0; i < num_tokens * hidden; ++i) {
+            out[i] += x[i];
+        }
+    } else {
+        std::span<float> expert_outputs = take(buf.expert_outputs, experts_per_token * hidden);
+        for (std::size_t t = 0; t < num_tokens; ++t) {
+            const std::span<const float> x_row(norm_out.data() + t * hidden, hidden);
+            for (std::size_t e = 0; e < experts_per_token; ++e) {
+                const auto expert_idx = static_cast<std::size_t>(topk_indices[t * experts_per_token + e]);
+                expert_forward(expert_idx, x_row, expert_outputs.subspan(e * hidden, hidden), buf);
+            }
 
-    std::vector<float> gate_logits(num_tokens * num_experts, 0.0f);
-    linear_bf16(gate_weight, gate_bias, hidden, num_experts, norm_out, gate_logits);
+            float* out_row = out.data() + t * hidden;
+            moe_combine(expert_outputs, topk_weights.subspan(t * experts_per_token, experts_per_token),
+                        experts_per_token, hidden, std::span<float>(out_row, hidden));
+            for (std::size_t i = 0; i < hidden; ++i) {
+                out_row[i] += x[t * hidden + i];
+            }
+        }
+    }
+    if (routing_stats) routing_stats->record_batch(expert_load, num_tokens);
+}
 
+void MLPBlock::expert_forward(std::size_t expert,
+                              std::span<const float> x,
+                              std::span<float> out,
+                              ForwardBuffers& buf) const {
+    GPTOSS_TRACE_SCOPE("mlp.expert");
+    const std::size_t hidden = hidden_size;
+    const std::size_t intermediate = config.intermediate_size;
     const std::size_t mlp1_out_features = intermediate * 2;
     const std::size_t mlp2_out_features = hidden;
     const std::size_t blocks_per_row_mlp1 = hidden / 32;
@@ -235,131 +380,262 @@ void MLPBlock::forward(std::span<const float> x,
     const std::size_t mlp1_row_blocks = blocks_per_row_mlp1 * 16;
     const std::size_t mlp2_row_blocks = blocks_per_row_mlp2 * 16;
 
-    // require_count("mlp.mlp1_bias", mlp1_bias_count, num_experts * mlp1_out_features);
-    // require_count("mlp.mlp2_bias", mlp2_bias_count, num_experts * mlp2_out_features);
-    // require_count("mlp.mlp1_weight.blocks", mlp1_weight_blocks_count,
-    //               num_experts * mlp1_out_features * mlp1_row_blocks);
-    // require_count("mlp.mlp1_weight.scales", mlp1_weight_scales_count,
-    //               num_experts * mlp1_out_features * blocks_per_row_mlp1);
-    // require_count("mlp.mlp2_weight.blocks", mlp2_weight_blocks_count,
-    //               num_experts * mlp2_out_features * mlp2_row_blocks);
-    // require_count("mlp.mlp2_weight.scales", mlp2_weight_scales_count,
-    //               num_experts * mlp2_out_features * blocks_per_row_mlp2);
-
-    std::vector<std::int32_t> topk_indices(experts_per_token);
-    std::vector<float> topk_weights(experts_per_token);
-    std::vector<float> expert_outputs(experts_per_token * hidden, 0.0f);
-    std::vector<float> mlp1_out(mlp1_out_features, 0.0f);
-    std::vector<float> swiglu_out(intermediate, 0.0f);
-    std::vector<float> mlp2_out(hidden, 0.0f);
+    std::span<float> mlp1_out = take(buf.mlp1_out, mlp1_out_features);
+    std::span<float> swiglu_out = take(buf.swiglu_out, intermediate);
 
-    for (std::size_t t = 0; t < num_tokens; ++t) {
-        const float* gate_row = gate_logits.data() + t * num_experts;
-        moe_topk_gating(std::span<const float>(gate_row, num_experts), num_experts,
-                        experts_per_token, topk_indices, topk_weights);
-
-        for (std::size_t e = 0; e < experts_per_token; ++e) {
-            const std::size_t expert_idx = static_cast<std::size_t>(topk_indices[e]);
-
-            const std::uint8_t* mlp1_blocks = mlp1_weight_blocks +
-                                             expert_idx * mlp1_out_features * mlp1_row_blocks;
-            const std::uint8_t* mlp1_scales = mlp1_weight_scales +
-                                             expert_idx * mlp1_out_features * blocks_per_row_mlp1;
-            const std::uint16_t* mlp1_bias_row = mlp1_bias + expert_idx * mlp1_out_features;
-
-            const float* x_row = norm_out.data() + t * hidden;
-            mxfp4_gemm(mlp1_blocks, mlp1_scales, mlp1_out_features, hidden,
-                      std::span<const float>(x_row, hidden), mlp1_out);
-            for (std::size_t i = 0; i < mlp1_out_features; ++i) {
-                mlp1_out[i] += bf16_to_float(mlp1_bias_row[i]);
-            }
-
-            swiglu(mlp1_out, 1.702f, static_cast<float>(kConfig20B.swiglu_limit), swiglu_out);
+    const std::uint8_t* mlp1_blocks = mlp1_weight_blocks + expert * mlp1_out_features * mlp1_row_blocks;
+    const std::uint8_t* mlp1_scales = mlp1_weight_scales + expert * mlp1_out_features * blocks_per_row_mlp1;
+    const std::uint16_t* mlp1_bias_row = mlp1_bias + expert * mlp1_out_features;
 
-            const std::uint8_t* mlp2_blocks = mlp2_weight_blocks +
-                                             expert_idx * mlp2_out_features * mlp2_row_blocks;
-            const std::uint8_t* mlp2_scales = mlp2_weight_scales +
-                                             expert_idx * mlp2_out_features * blocks_per_row_mlp2;
-            const std::uint16_t* mlp2_bias_row = mlp2_bias + expert_idx * mlp2_out_features;
+    kernels.mxfp4_mlp1(mlp1_blocks, mlp1_scales, mlp1_out_features, hidden, x, mlp1_out);
+    for (std::size_t i = 0; i < mlp1_out_features; ++i) {
+        mlp1_out[i] += bf16_to_float(mlp1_bias_row[i]);
+    }
 
-            mxfp4_gemm(mlp2_blocks, mlp2_scales, mlp2_out_features, intermediate,
-                      swiglu_out, mlp2_out);
-            for (std::size_t i = 0; i < mlp2_out_features; ++i) {
-                mlp2_out[i] += bf16_to_float(mlp2_bias_row[i]);
-            }
+    swiglu(mlp1_out, 1.702f, config.swiglu_limit, swiglu_out);
 
-            float* expert_out = expert_outputs.data() + e * hidden;
-            std::copy(mlp2_out.begin(), mlp2_out.end(), expert_out);
-        }
+    const std::uint8_t* mlp2_blocks = mlp2_weight_blocks + expert * mlp2_out_features * mlp2_row_blocks;
+    const std::uint8_t* mlp2_scales = mlp2_weight_scales + expert * mlp2_out_features * blocks_per_row_mlp2;
+    const std::uint16_t* mlp2_bias_row = mlp2_bias + expert * mlp2_out_features;
 
-        float* out_row = out.data() + t * hidden;
-        moe_combine(expert_outputs, topk_weights, experts_per_token, hidden,
-                    std::span<float>(out_row, hidden));
-        for (std::size_t i = 0; i < hidden; ++i) {
-            out_row[i] += x[t * hidden + i];
-        }
+    kernels.mxfp4_mlp2(mlp2_blocks, mlp2_scales, mlp2_out_features, intermediate, swiglu_out, out);
+    for (std::size_t i = 0; i < mlp2_out_features; ++i) {
+        out[i] += bf16_to_float(mlp2_bias_row[i]);
     }
 }
 
 
-TransformerBlock::TransformerBlock(Checkpoint& checkpoint, int layer_idx)
-    : attn(checkpoint, layer_idx), mlp(checkpoint, layer_idx) {
-    hidden_size = kConfig20B.hidden_size;
+TransformerBlock::TransformerBlock(Checkpoint& checkpoint,
+                                   int layer_idx,
+                                   const ModelConfig& config,
+                                   const KernelTable& kernels,
+                                   const ModelOptions& options)
+    : attn(checkpoint, layer_idx, config, kernels, options),
+      mlp(checkpoint, layer_idx, config, kernels, options) {
+    hidden_size = config.hidden_size;
 }
 
 void TransformerBlock::forward(std::span<const float> x,
                                std::span<float> out,
                                std::size_t num_tokens,
-                               KVCache& kv_cache) const {
-    std::vector<float> attn_out(num_tokens * hidden_size, 0.0f);
-    attn.forward(x, attn_out, num_tokens, kv_cache);
-    mlp.forward(attn_out, out, num_tokens);
+                               KVCache& kv_cache,
+                               ForwardBuffers& buf) const {
+    std::span<float> attn_out = take(buf.attn_out, num_tokens * hidden_size);
+    attn.forward(x, attn_out, num_tokens, kv_cache, buf);
+    mlp.forward(attn_out, out, num_tokens, buf);
+}
+
+void TransformerBlock::forward_batch(std::span<const float> x,
+                                     std::span<float> out,
+                                     std::span<PagedKVCache* const> caches,
+                                     ForwardBuffers& buf) const {
+    std::span<float> attn_out = take(buf.attn_out, caches.size() * hidden_size);
+    attn.forward_batch(x, attn_out, caches, buf);
+    mlp.forward(attn_out, out, caches.size(), buf);
 }
 
 
-UnEmbedding::UnEmbedding(Checkpoint& checkpoint) {
-    weight = checkpoint.get_bf16_ptr("unembedding.weight");
-    weight_count = checkpoint.get_bf16_count("unembedding.weight");
-    hidden_size = kConfig20B.hidden_size;
-    vocab_size = kConfig20B.vocab_size;
+UnEmbedding::UnEmbedding(Checkpoint& checkpoint, const ModelConfig& config, const ModelOptions& options) {
+    weight = checkpoint.get_bf16_ptr(TensorKind::Unembedding);
+    weight_count = checkpoint.get_bf16_count(TensorKind::Unembedding);
+    hidden_size = config.hidden_size;
+    vocab_size = config.vocab_size;
+    require_count("unembedding.weight", weight_count, vocab_size * hidden_size);
+    if (options.int8_weights) weight_int8 = quantize_int8_rows(weight, vocab_size, hidden_size);
 }
 
 void UnEmbedding::forward(std::span<const float> x,
                           std::span<float> out,
                           std::size_t num_tokens) const {
-    unembedding_logits(weight, vocab_size, hidden_size, x, out);
+    if (weight_int8.empty()) {
+        unembedding_logits(weight, vocab_size, hidden_size, x, out);
+    } else {
+        linear_int8(weight_int8, nullptr, x, out);
+    }
 }
 
 
-GPTOSSModel::GPTOSSModel(Checkpoint& checkpoint) : embedding(checkpoint), unembedding(checkpoint) {
-    norm_scale = checkpoint.get_bf16_ptr("norm.scale");
-    norm_scale_count = checkpoint.get_bf16_count("norm.scale");
-    blocks.reserve(kConfig20B.num_hidden_layers);
-    for (int layer_idx = 0; layer_idx < kConfig20B.num_hidden_layers; ++layer_idx) {
-        blocks.emplace_back(checkpoint, layer_idx);
+GPTOSSModel::GPTOSSModel(Checkpoint& checkpoint)
+    : GPTOSSModel(checkpoint, ModelConfig::preset(checkpoint.num_layers())) {}
+
+GPTOSSModel::GPTOSSModel(Checkpoint& checkpoint, const ModelConfig& config, const ModelOptions& options)
+    : config_(config),
+      kernels_(select_kernels(config.hidden_size, config.intermediate_size, config.head_dim,
+                              config.num_attention_heads, config.num_key_value_heads)),
+      options_(options),
+      layer_begin_(options.layer_begin) {
+    if (checkpoint.num_layers() != config_.num_hidden_layers) {
+        throw std::runtime_error("checkpoint has " + std::to_string(checkpoint.num_layers()) +
+                                 " layers, config says " + std::to_string(config_.num_hidden_layers));
+    }
+    const std::size_t layer_end = options_.layer_end ? options_.layer_end : config_.num_hidden_layers;
+    if (layer_begin_ >= layer_end || layer_end > config_.num_hidden_layers) {
+        throw std::runtime_error("bad layer range [" + std::to_string(layer_begin_) + ", " +
+                                 std::to_string(layer_end) + ") for " +
+                                 std::to_string(config_.num_hidden_layers) + " layers");
+    }
+    if (layer_begin_ == 0) embedding.emplace(checkpoint, config_);
+    if (layer_end == config_.num_hidden_layers) {
+        unembedding.emplace(checkpoint, config_, options_);
+        norm_scale = checkpoint.get_bf16_ptr(TensorKind::Norm);
+        norm_scale_count = checkpoint.get_bf16_count(TensorKind::Norm);
+        require_count("norm.scale", norm_scale_count, config_.hidden_size);
+    }
+    if (options_.int8_experts) {
+        kernels_.mxfp4_mlp1 = mxfp4_gemm_int8;
+        kernels_.mxfp4_mlp2 = mxfp4_gemm_int8;
+    }
+    blocks.reserve(layer_end - layer_begin_);
+    for (std::size_t layer_idx = layer_begin_; layer_idx < layer_end; ++layer_idx) {
+        blocks.emplace_back(checkpoint, static_cast<int>(layer_idx), config_, kernels_, options_);
     }
 }
 
 GPTOSSModel::~GPTOSSModel() = default;
 
+void GPTOSSModel::set_routing_stats(RoutingStats* stats) {
+    if (stats && (stats->num_layers() != config_.num_hidden_layers || stats->num_experts() != config_.num_experts)) {
+        throw std::runtime_error("routing stats shape doesn't match the model");
+    }
+    if (stats) stats->add_first_layer(layer_begin_);
+    for (auto& block : blocks) block.set_routing_stats(stats);
+}
+
+void GPTOSSModel::set_expert_backend(ExpertBackend* backend) {
+    for (auto& block : blocks) block.set_expert_backend(backend);
+}
+
+void GPTOSSModel::expert_forward(std::size_t layer,
+                                 std::size_t expert,
+                                 std::span<const float> x,
+                                 std::span<float> out,
+                                 ForwardBuffers& buf) const {
+    if (layer < layer_begin_ || layer >= layer_end()) {
+        throw std::runtime_error("layer " + std::to_string(layer) + " isn't in this model's range");
+    }
+    blocks[layer - layer_begin_].mlp_block().expert_forward(expert, x, out, buf);
+}
+
 void GPTOSSModel::forward(std::span<const std::int32_t> token_ids,
                           std::span<float> logits,
                           KVCache& kv_cache) const {
-    const std::size_t hidden = kConfig20B.hidden_size;
-    const float eps = 1e-5f;
+    ForwardBuffers buf;
+    forward(token_ids, logits, kv_cache, buf);
+}
+
+void GPTOSSModel::forward(std::span<const std::int32_t> token_ids,
+                          std::span<float> logits,
+                          KVCache& kv_cache,
+                          ForwardBuffers& buf) const {
+    if (!embedding || !unembedding) throw std::runtime_error("forward() needs every layer of the model");
     const std::size_t num_tokens = token_ids.size();
-    std::vector<float> x(num_tokens * hidden, 0.0f);
-    std::vector<float> tmp(num_tokens * hidden, 0.0f);
+    // checked before the cache grows, so a bad span doesn't leave it half-advanced
+    require_logits_rows(logits.size(), config_.vocab_size, num_tokens);
+    GPTOSS_TRACE_SCOPE("forward");
+
+    std::span<float> x = take(buf.x, num_tokens * config_.hidden_size);
+    embed(token_ids, x);
+    forward_layers(x, num_tokens, kv_cache, buf);
+    if (logits.empty()) return;
+    unembed(x, num_tokens, logits, buf);
+}
 
-    embedding.forward(token_ids, x, num_tokens);
+void GPTOSSModel::forward_batch(std::span<const std::int32_t> tokens,
+                                std::span<float> logits,
+                                std::span<PagedKVCache* const> caches,
+                                ForwardBuffers& buf) const {
+    if (!embedding || !unembedding) throw std::runtime_error("forward_batch() needs every layer of the model");
+    if (tokens.size() != caches.size() || logits.size() != tokens.size() * config_.vocab_size) {
+        throw std::runtime_error("forward_batch() needs one token and one logits row per cache");
+    }
+    const std::size_t num_tokens = tokens.size();
+    if (num_tokens == 0) return;
+    GPTOSS_TRACE_SCOPE("forward_batch");
+    for (PagedKVCache* cache : caches) cache->reserve_append(1);
+
+    std::span<float> x = take(buf.x, num_tokens * config_.hidden_size);
+    embed(tokens, x);
+    std::span<float> src = x;
+    std::span<float> dst = take(buf.tmp, x.size());
     for (std::size_t i = 0; i < blocks.size(); ++i) {
-        blocks[i].forward(x, tmp, num_tokens, kv_cache);
-        std::swap(x, tmp);
+        if (streamer_) streamer_->wait_layer(layer_begin_ + i);
+        blocks[i].forward_batch(src, dst, caches, buf);
+        std::swap(src, dst);
+    }
+    if (src.data() != x.data()) std::copy(src.begin(), src.end(), x.begin());
+    for (PagedKVCache* cache : caches) cache->seq_len++;
+    unembed(x, num_tokens, logits, buf);
+}
+
+void GPTOSSModel::embed(std::span<const std::int32_t> token_ids, std::span<float> hidden) const {
+    if (!embedding) throw std::runtime_error("this layer range has no embedding");
+    for (std::int32_t id : token_ids) {
+        if (id < 0 || static_cast<std::size_t>(id) >= config_.vocab_size) {
+            throw std::runtime_error("token id " + std::to_string(id) + " outside vocab " +
+                                     std::to_string(config_.vocab_size));
+        }
     }
+    if (streamer_) streamer_->wait_embedding();
+    embedding->forward(token_ids, hidden, token_ids.size());
+}
 
-    rmsnorm(x, std::span<const std::uint16_t>(norm_scale, norm_scale_count), eps, hidden, tmp);
-    unembedding.forward(tmp, logits, num_tokens);
+void GPTOSSModel::forward_layers(std::span<float> hidden,
+                                 std::size_t num_tokens,
+                                 KVCache& kv_cache,
+                                 ForwardBuffers& buf) const {
+    const std::size_t n = num_tokens * config_.hidden_size;
+    // blocks ping-pong between the caller's rows and buf.tmp, at most one copy at the end
+    std::span<float> src = hidden.first(n);
+    std::span<float> dst = take(buf.tmp, n);
+    for (std::size_t i = 0; i < blocks.size(); ++i) {
+        const std::size_t layer = layer_begin_ + i;
+        if (streamer_) streamer_->wait_layer(layer);
+        if (kv_cache.before_layer) kv_cache.before_layer(layer);
+        blocks[i].forward(src, dst, num_tokens, kv_cache, buf);
+        if (kv_cache.after_layer) kv_cache.after_layer(layer);
+        std::swap(src, dst);
+    }
+    if (src.data() != hidden.data()) std::copy(src.begin(), src.end(), hidden.begin());
 
     // Advance cache at the end for offset correctness
     kv_cache.seq_len += num_tokens;
 }
+
+void GPTOSSModel::unembed(std::span<const float> hidden,
+                          std::size_t num_tokens,
+                          std::span<float> logits,
+                          ForwardBuffers& buf) const {
+    if (!unembedding) throw std::runtime_error("this layer range has no unembedding");
+    const std::size_t hidden_size = config_.hidden_size;
+    const float eps = 1e-5f;
+
+    // Only the rows we return logits for need the final norm + unembedding.
+    const std::size_t out_rows = logits.size() / config_.vocab_size;
+    require_logits_rows(logits.size(), config_.vocab_size, num_tokens);
+    const std::size_t first_row = num_tokens - out_rows;
+    std::span<const float> x = hidden.subspan(first_row * hidden_size, out_rows * hidden_size);
+    std::span<float> normed = take(buf.tmp, out_rows * hidden_size);
+    if (streamer_) streamer_->wait_unembedding();
+    kernels_.rmsnorm(x, std::span<const std::uint16_t>(norm_scale, norm_scale_count), eps, hidden_size, normed);
+    unembedding->forward(normed, logits, out_rows);
+}
+
+
+ChunkedPrefill::ChunkedPrefill(const GPTOSSModel& model,
+                               std::span<const std::int32_t> tokens,
+                               KVCache& kv_cache,
+                               ForwardBuffers& buf,
+                               std::size_t chunk_size)
+    : model_(model), tokens_(tokens), kv_cache_(kv_cache), buf_(buf),
+      chunk_size_(std::max<std::size_t>(chunk_size, 1)) {}
+
+bool ChunkedPrefill::step(std::span<float> last_logits) {
+    if (done()) return true;
+    const std::size_t len = std::min(chunk_size_, tokens_.size() - next_);
+    const bool last_chunk = next_ + len == tokens_.size();
+    // intermediate chunks only extend the cache, skip the unembedding
+    model_.forward(tokens_.subspan(next_, len),
+                   last_chunk ? last_logits : std::span<float>(), kv_cache_, buf_);
+    next_ += len;
+    return done();
+}
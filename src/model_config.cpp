@@ -0,0 +1,152 @@
+#include "model_config.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <initializer_list>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+namespace {
+
+// Every "key": number pair in the file, at any nesting depth. Configs are small and flat
+// enough that this beats pulling in a real JSON parser.
+std::unordered_map<std::string, double> numeric_fields(const std::string& text) {
+    std::unordered_map<std::string, double> fields;
+    std::size_t i = 0;
+    while ((i = text.find('"', i)) != std::string::npos) {
+        const std::size_t end = text.find('"', i + 1);
+        if (end == std::string::npos) break;
+        std::string key = text.substr(i + 1, end - i - 1);
+        std::size_t j = end + 1;
+        while (j < text.size() && std::isspace(static_cast<unsigned char>(text[j]))) j++;
+        if (j < text.size() && text[j] == ':') {
+            j++;
+            while (j < text.size() && std::isspace(static_cast<unsigned char>(text[j]))) j++;
+            const char* begin = text.c_str() + j;
+            char* parsed_end = nullptr;
+            const double value = std::strtod(begin, &parsed_end);
+            if (parsed_end != begin) fields.emplace(std::move(key), value);
+        }
+        // string values are skipped over as the next "key" and never followed by ':'
+        i = end + 1;
+    }
+    return fields;
+}
+
+double field(const std::unordered_map<std::string, double>& fields, std::initializer_list<const char*> names) {
+    for (const char* name : names) {
+        auto it = fields.find(name);
+        if (it != fields.end()) return it->second;
+    }
+    throw std::runtime_error(std::string("config.json is missing ") + *names.begin());
+}
+
+}  // namespace
+
+ModelConfig ModelConfig::load(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) throw std::runtime_error("failed to open model config: " + path);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    const auto f = numeric_fields(ss.str());
+
+    auto count = [&](std::initializer_list<const char*> names) {
+        return static_cast<std::size_t>(field(f, names));
+    };
+    auto real = [&](std::initializer_list<const char*> names) { return static_cast<float>(field(f, names)); };
+
+    ModelConfig c;
+    c.num_hidden_layers = count({"num_hidden_layers"});
+    c.num_experts = count({"num_experts", "num_local_experts"});
+    c.experts_per_token = count({"experts_per_token", "num_experts_per_tok"});
+    c.vocab_size = count({"vocab_size"});
+    c.hidden_size = count({"hidden_size"});
+    c.intermediate_size = count({"intermediate_size"});
+    c.swiglu_limit = real({"swiglu_limit"});
+    c.head_dim = count({"head_dim"});
+    c.num_attention_heads = count({"num_attention_heads"});
+    c.num_key_value_heads = count({"num_key_value_heads"});
+    c.sliding_window = count({"sliding_window"});
+    c.initial_context_length = count({"initial_context_length", "original_max_position_embeddings"});
+    c.rope_theta = real({"rope_theta"});
+    c.rope_scaling_factor = real({"rope_scaling_factor", "factor"});
+    c.rope_ntk_alpha = real({"rope_ntk_alpha", "beta_slow"});
+    c.rope_ntk_beta = real({"rope_ntk_beta", "beta_fast"});
+
+    if (c.num_key_value_heads == 0 || c.num_attention_heads % c.num_key_value_heads != 0 ||
+        c.hidden_size % 32 != 0 || c.intermediate_size % 32 != 0 || c.experts_per_token > c.num_experts) {
+        throw std::runtime_error("unsupported model config: " + path);
+    }
+    return c;
+}
+
+void ModelConfig::save(const std::string& path) const {
+    std::ofstream out(path);
+    if (!out) throw std::runtime_error("failed to write model config: " + path);
+    out << "{\n"
+        << "  \"num_hidden_layers\": " << num_hidden_layers << ",\n"
+        << "  \"num_experts\": " << num_experts << ",\n"
+        << "  \"experts_per_token\": " << experts_per_token << ",\n"
+        << "  \"vocab_size\": " << vocab_size << ",\n"
+        << "  \"hidden_size\": " << hidden_size << ",\n"
+        << "  \"intermediate_size\": " << intermediate_size << ",\n"
+        << "  \"swiglu_limit\": " << swiglu_limit << ",\n"
+        << "  \"head_dim\": " << head_dim << ",\n"
+        << "  \"num_attention_heads\": " << num_attention_heads << ",\n"
+        << "  \"num_key_value_heads\": " << num_key_value_heads << ",\n"
+        << "  \"sliding_window\": " << sliding_window << ",\n"
+        << "  \"initial_context_length\": " << initial_context_length << ",\n"
+        << "  \"rope_theta\": " << rope_theta << ",\n"
+        << "  \"rope_scaling_factor\": " << rope_scaling_factor << ",\n"
+        << "  \"rope_ntk_alpha\": " << rope_ntk_alpha << ",\n"
+        << "  \"rope_ntk_beta\": " << rope_ntk_beta << "\n"
+        << "}\n";
+}
+
+ModelConfig ModelConfig::gpt_oss_20b() {
+    ModelConfig c;
+    c.num_hidden_layers = 24;
+    c.num_experts = 32;
+    c.experts_per_token = 4;
+    c.vocab_size = 201088;
+    c.hidden_size = 2880;
+    c.intermediate_size = 2880;
+    c.swiglu_limit = 7.0f;
+    c.head_dim = 64;
+    c.num_attention_heads = 64;
+    c.num_key_value_heads = 8;
+    c.sliding_window = 128;
+    c.initial_context_length = 4096;
+    c.rope_theta = 150000.0f;
+    c.rope_scaling_factor = 32.0f;
+    c.rope_ntk_alpha = 1.0f;
+    c.rope_ntk_beta = 32.0f;
+    return c;
+}
+
+ModelConfig ModelConfig::gpt_oss_120b() {
+    ModelConfig c = gpt_oss_20b();
+    c.num_hidden_layers = 36;
+    c.num_experts = 128;
+    return c;
+}
+
+ModelConfig ModelConfig::preset(std::size_t num_layers) {
+    if (num_layers == 24) return gpt_oss_20b();
+    if (num_layers == 36) return gpt_oss_120b();
+    throw std::runtime_error("no config.json and no preset for " + std::to_string(num_layers) + " layers");
+}
+
+ModelConfig ModelConfig::locate(const std::string& config_path, const std::string& model_path,
+                                std::size_t num_layers) {
+    if (!config_path.empty()) return load(config_path);
+    const std::filesystem::path model_dir = std::filesystem::is_directory(model_path)
+                                                ? std::filesystem::path(model_path)
+                                                : std::filesystem::path(model_path).parent_path();
+    const std::filesystem::path next_to_weights = model_dir / "config.json";
+    return std::filesystem::exists(next_to_weights) ? load(next_to_weights.string()) : preset(num_layers);
+}
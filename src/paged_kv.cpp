@@ -0,0 +1,124 @@
+#include "paged_kv.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "kv_cache.h"
+
+KVBlockPool::KVBlockPool(std::size_t num_layers, std::size_t row_floats, std::size_t block_tokens)
+    : num_layers_(num_layers), row_floats_(row_floats), block_tokens_(block_tokens) {
+    if (num_layers == 0 || row_floats == 0 || block_tokens == 0) {
+        throw std::runtime_error("kv block pool needs layers, a row width and block_tokens above zero");
+    }
+}
+
+std::uint32_t KVBlockPool::allocate() {
+    std::uint32_t block;
+    if (!free_.empty()) {
+        block = free_.back();
+        free_.pop_back();
+    } else {
+        block = static_cast<std::uint32_t>(blocks_.size());
+        blocks_.push_back(std::make_unique<float[]>(block_floats()));
+        refs_.push_back(0);
+    }
+    refs_[block] = 1;
+    return block;
+}
+
+void KVBlockPool::release(std::uint32_t block) {
+    if (refs_[block] == 0) throw std::runtime_error("kv block " + std::to_string(block) + " released twice");
+    if (--refs_[block] == 0) free_.push_back(block);
+}
+
+PagedKVCache::PagedKVCache(PagedKVCache&& other) noexcept
+    : seq_len(std::exchange(other.seq_len, 0)), pool_(other.pool_), blocks_(std::move(other.blocks_)) {
+    other.blocks_.clear();
+}
+
+PagedKVCache& PagedKVCache::operator=(PagedKVCache&& other) noexcept {
+    if (this == &other) return *this;
+    clear();
+    pool_ = other.pool_;
+    blocks_ = std::move(other.blocks_);
+    other.blocks_.clear();
+    seq_len = std::exchange(other.seq_len, 0);
+    return *this;
+}
+
+PagedKVCache PagedKVCache::fork() const {
+    PagedKVCache child(*pool_);
+    child.blocks_ = blocks_;
+    child.seq_len = seq_len;
+    for (std::uint32_t block : blocks_) pool_->retain(block);
+    return child;
+}
+
+void PagedKVCache::clear() {
+    for (std::uint32_t block : blocks_) pool_->release(block);
+    blocks_.clear();
+    seq_len = 0;
+}
+
+void PagedKVCache::assign(const KVCache& cache) {
+    if (cache.k_cache.size() != pool_->num_layers()) {
+        throw std::runtime_error("paged kv: cache has the wrong number of layers");
+    }
+    clear();
+    reserve_append(cache.seq_len);
+    const std::size_t row = pool_->row_floats();
+    const std::size_t bt = pool_->block_tokens();
+    for (std::size_t l = 0; l < pool_->num_layers(); ++l) {
+        if (cache.k_cache[l].size() != cache.seq_len * row) {
+            throw std::runtime_error("paged kv: layer " + std::to_string(l) + " doesn't match the row width");
+        }
+        for (std::size_t b = 0; b * bt < cache.seq_len; ++b) {
+            const std::size_t rows = std::min(bt, cache.seq_len - b * bt);
+            const float* k = cache.k_cache[l].data() + b * bt * row;
+            const float* v = cache.v_cache[l].data() + b * bt * row;
+            std::copy(k, k + rows * row, pool_->k(blocks_[b], l));
+            std::copy(v, v + rows * row, pool_->v(blocks_[b], l));
+        }
+    }
+    seq_len = cache.seq_len;
+}
+
+void PagedKVCache::reserve_append(std::size_t n) {
+    if (n == 0) return;
+    const std::size_t bt = pool_->block_tokens();
+    // the partly filled last block is the only one an append can land in while shared
+    if (seq_len % bt != 0) {
+        std::uint32_t& last = blocks_[seq_len / bt];
+        if (pool_->refcount(last) > 1) {
+            const std::uint32_t copy = pool_->allocate();
+            const std::size_t floats = pool_->block_floats();
+            std::copy(pool_->data(last), pool_->data(last) + floats, pool_->data(copy));
+            pool_->release(last);
+            last = copy;
+            pool_->copies_++;
+        }
+    }
+    const std::size_t needed = (seq_len + n + bt - 1) / bt;
+    while (blocks_.size() < needed) blocks_.push_back(pool_->allocate());
+}
+
+float* PagedKVCache::k_row(std::size_t layer, std::size_t pos) {
+    const std::size_t bt = pool_->block_tokens();
+    return pool_->k(blocks_[pos / bt], layer) + (pos % bt) * pool_->row_floats();
+}
+
+float* PagedKVCache::v_row(std::size_t layer, std::size_t pos) {
+    const std::size_t bt = pool_->block_tokens();
+    return pool_->v(blocks_[pos / bt], layer) + (pos % bt) * pool_->row_floats();
+}
+
+void PagedKVCache::layer_blocks(std::size_t layer, std::vector<const float*>& k, std::vector<const float*>& v) const {
+    k.resize(blocks_.size());
+    v.resize(blocks_.size());
+    for (std::size_t b = 0; b < blocks_.size(); ++b) {
+        k[b] = pool_->k(blocks_[b], layer);
+        v[b] = pool_->v(blocks_[b], layer);
+    }
+}
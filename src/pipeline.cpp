@@ -0,0 +1,338 @@
+#include "pipeline.h"
+
+#include <omp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "trace.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+enum : std::uint32_t { kRun = 1, kRelease = 2, kStats = 3, kShutdown = 4 };
+
+constexpr std::size_t kMaxStages = 16;
+
+// Every message down the chain starts with this. Run is followed by num_tokens hidden rows
+// (logit_rows x vocab logits on the way back from the last stage); per_stage collects each
+// stage's busy time for a Run and its RSS for a Stats.
+struct StageHeader {
+    std::uint32_t op;
+    std::uint32_t seq;
+    std::uint32_t num_tokens;
+    std::uint32_t logit_rows;
+    std::uint64_t per_stage[kMaxStages];
+};
+
+std::uint64_t elapsed_ns(Clock::time_point start) {
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+}
+
+std::size_t rss_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    std::size_t size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+}
+
+template <typename T>
+std::span<const std::byte> bytes_of(std::span<const T> v) {
+    return std::as_bytes(v);
+}
+
+StageHeader read_header(const std::vector<std::byte>& msg) {
+    if (msg.size() < sizeof(StageHeader)) throw std::runtime_error("pipeline message too short");
+    StageHeader header;
+    std::memcpy(&header, msg.data(), sizeof(header));
+    return header;
+}
+
+// everything of the checkpoint outside [begin, end) goes, so the stage only keeps its slice
+void drop_other_layers(Checkpoint& checkpoint, std::size_t begin, std::size_t end, std::size_t num_layers) {
+    if (begin != 0) checkpoint.drop_pages(TensorKind::Embedding);
+    if (end != num_layers) {
+        checkpoint.drop_pages(TensorKind::Norm);
+        checkpoint.drop_pages(TensorKind::Unembedding);
+    }
+    for (std::size_t layer = 0; layer < num_layers; ++layer) {
+        if (layer >= begin && layer < end) continue;
+        for (std::size_t k = kNumGlobalTensorKinds; k < static_cast<std::size_t>(TensorKind::Count); ++k) {
+            checkpoint.drop_pages(static_cast<TensorKind>(k), static_cast<int>(layer));
+        }
+    }
+}
+
+[[noreturn]] void stage_main(Checkpoint& checkpoint, const ModelConfig& config, ModelOptions options,
+                             std::size_t stage, std::size_t begin, std::size_t end, bool last, Transport& in,
+                             Transport& out) {
+    try {
+        options.layer_begin = begin;
+        options.layer_end = end;
+        const GPTOSSModel model(checkpoint, config, options);
+        drop_other_layers(checkpoint, begin, end, config.num_hidden_layers);
+
+        const std::size_t hidden = config.hidden_size, vocab = config.vocab_size;
+        std::unordered_map<std::uint32_t, KVCache> caches;
+        ForwardBuffers buf;
+        std::vector<std::byte> msg;
+        std::vector<float> logits;
+        while (true) {
+            in.recv(msg);
+            StageHeader header = read_header(msg);
+            if (header.op == kRun) {
+                const auto start = Clock::now();
+                const std::size_t n = header.num_tokens;
+                if (msg.size() != sizeof(header) + n * hidden * sizeof(float)) {
+                    throw std::runtime_error("pipeline stage got a malformed hidden state");
+                }
+                const std::span<float> x(reinterpret_cast<float*>(msg.data() + sizeof(header)), n * hidden);
+                KVCache& cache = caches.try_emplace(header.seq, config.num_hidden_layers).first->second;
+                model.forward_layers(x, n, cache, buf);
+                if (last) {
+                    logits.resize(header.logit_rows * vocab);
+                    if (!logits.empty()) model.unembed(x, n, logits, buf);
+                    header.per_stage[stage] = elapsed_ns(start);
+                    const std::span<const std::byte> parts[] = {bytes_of(std::span<const StageHeader>(&header, 1)),
+                                                                bytes_of(std::span<const float>(logits))};
+                    out.sendv(parts);
+                } else {
+                    header.per_stage[stage] = elapsed_ns(start);
+                    std::memcpy(msg.data(), &header, sizeof(header));
+                    out.send(msg);
+                }
+            } else if (header.op == kRelease) {
+                caches.erase(header.seq);
+                if (!last) out.send(msg);
+            } else if (header.op == kStats) {
+                header.per_stage[stage] = rss_bytes();
+                out.send(bytes_of(std::span<const StageHeader>(&header, 1)));
+            } else {
+                if (!last) out.send(msg);
+                break;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "pipeline stage " << stage << " failed: " << e.what() << std::endl;
+        _exit(1);
+    }
+    _exit(0);
+}
+
+}  // namespace
+
+double PipelineStats::bubble_fraction() const {
+    if (wall_ns == 0 || busy_ns.empty()) return 0.0;
+    std::uint64_t busy = 0;
+    for (std::uint64_t b : busy_ns) busy += b;
+    return std::max(0.0, 1.0 - static_cast<double>(busy) / (static_cast<double>(wall_ns) * busy_ns.size()));
+}
+
+PipelineParallel::PipelineParallel(Checkpoint& checkpoint,
+                                   const ModelConfig& config,
+                                   const ModelOptions& model_options,
+                                   const PipelineOptions& options)
+    : config_(config) {
+    const std::size_t stages = options.num_stages, layers = config.num_hidden_layers;
+    if (stages == 0 || stages > layers || stages > kMaxStages) {
+        throw std::runtime_error("pipeline needs between 1 and " + std::to_string(std::min(layers, kMaxStages)) +
+                                 " stages, got " + std::to_string(stages));
+    }
+    for (std::size_t s = 0; s < stages; ++s) ranges_.emplace_back(s * layers / stages, (s + 1) * layers / stages);
+    stats_.busy_ns.assign(stages, 0);
+
+    const std::size_t threads = options.threads_per_stage
+                                    ? options.threads_per_stage
+                                    : std::max<std::size_t>(1, static_cast<std::size_t>(omp_get_max_threads()) / stages);
+    // link s carries stage s -> stage s + 1, the last one back to us
+    std::vector<std::pair<std::unique_ptr<Transport>, std::unique_ptr<Transport>>> links;
+    if (stages > 1) {
+        for (std::size_t s = 0; s < stages; ++s) links.push_back(make_transport_pair(options.transport, options.ring_bytes));
+    }
+    const pid_t parent = getpid();
+    try {
+        // fork before building our own stage, so the children inherit nothing of it
+        for (std::size_t s = 1; s < stages; ++s) {
+            const pid_t pid = fork_peer();
+            if (pid == 0) {
+                std::unique_ptr<Transport> in = std::move(links[s - 1].second);
+                std::unique_ptr<Transport> out = std::move(links[s].first);
+                links.clear();
+                pids_.clear();
+                omp_set_num_threads(static_cast<int>(threads));
+                for (Transport* t : {in.get(), out.get()}) t->set_peer_check([parent] { return getppid() == parent; });
+                stage_main(checkpoint, config, model_options, s, ranges_[s].first, ranges_[s].second,
+                           s + 1 == stages, *in, *out);
+            }
+            pids_.push_back(pid);
+        }
+        if (stages > 1) {
+            downstream_ = std::move(links[0].first);
+            upstream_ = std::move(links[stages - 1].second);
+            links.clear();
+            // a stage that died mid-chain would otherwise leave us waiting on the ones after it
+            auto all_alive = [pids = pids_] {
+                for (pid_t pid : pids) {
+                    if (waitpid(pid, nullptr, WNOHANG) != 0) return false;
+                }
+                return true;
+            };
+            downstream_->set_peer_check(all_alive);
+            upstream_->set_peer_check(all_alive);
+        }
+
+        ModelOptions first = model_options;
+        first.layer_begin = ranges_[0].first;
+        first.layer_end = ranges_[0].second;
+        first_stage_ = std::make_unique<GPTOSSModel>(checkpoint, config_, first);
+        // a round trip through every stage: they're built and the chain is connected
+        stage_rss_bytes();
+    } catch (...) {
+        shutdown(false);
+        throw;
+    }
+}
+
+PipelineParallel::~PipelineParallel() { shutdown(true); }
+
+void PipelineParallel::shutdown(bool graceful) {
+    if (graceful && downstream_) {
+        StageHeader header{};
+        header.op = kShutdown;
+        try {
+            downstream_->send(bytes_of(std::span<const StageHeader>(&header, 1)));
+        } catch (const std::exception&) {
+            graceful = false;
+        }
+    }
+    if (!graceful) {
+        for (pid_t pid : pids_) kill(pid, SIGKILL);
+    }
+    downstream_.reset();
+    upstream_.reset();
+    for (pid_t pid : pids_) waitpid(pid, nullptr, 0);
+    pids_.clear();
+}
+
+void PipelineParallel::reset_stats() {
+    stats_.wall_ns = 0;
+    stats_.micro_batches = 0;
+    std::fill(stats_.busy_ns.begin(), stats_.busy_ns.end(), 0);
+}
+
+std::vector<std::size_t> PipelineParallel::stage_rss_bytes() {
+    std::vector<std::size_t> rss(num_stages());
+    rss[0] = rss_bytes();
+    if (num_stages() == 1) return rss;
+    if (!downstream_) throw std::runtime_error("pipeline is shut down");
+    StageHeader header{};
+    header.op = kStats;
+    downstream_->send(bytes_of(std::span<const StageHeader>(&header, 1)));
+    std::vector<std::byte> msg;
+    upstream_->recv(msg);
+    header = read_header(msg);
+    for (std::size_t s = 1; s < num_stages(); ++s) rss[s] = header.per_stage[s];
+    return rss;
+}
+
+void PipelineParallel::release(std::uint32_t seq) {
+    caches_.erase(seq);
+    if (!downstream_) return;
+    StageHeader header{};
+    header.op = kRelease;
+    header.seq = seq;
+    downstream_->send(bytes_of(std::span<const StageHeader>(&header, 1)));
+}
+
+void PipelineParallel::forward(std::span<const MicroBatch> batches) {
+    GPTOSS_TRACE_SCOPE("pipeline.forward");
+    const std::size_t hidden = config_.hidden_size, vocab = config_.vocab_size;
+    const auto start = Clock::now();
+    auto run_first_stage = [&](const MicroBatch& mb) {
+        const std::size_t n = mb.tokens.size();
+        if (hidden_.size() < n * hidden) hidden_.resize(n * hidden);
+        const std::span<float> x(hidden_.data(), n * hidden);
+        KVCache& cache = caches_.try_emplace(mb.seq, config_.num_hidden_layers).first->second;
+        first_stage_->embed(mb.tokens, x);
+        first_stage_->forward_layers(x, n, cache, buf_);
+        return x;
+    };
+
+    if (num_stages() == 1) {
+        for (const MicroBatch& mb : batches) {
+            const std::span<float> x = run_first_stage(mb);
+            if (!mb.logits.empty()) first_stage_->unembed(x, mb.tokens.size(), mb.logits, buf_);
+        }
+        stats_.busy_ns[0] += elapsed_ns(start);
+    } else {
+        if (!downstream_) throw std::runtime_error("pipeline is shut down");
+        // results come back while we're still feeding the first stage; draining them on a
+        // second thread keeps the last link from filling up and stalling the whole chain
+        std::vector<std::uint64_t> busy(num_stages(), 0);
+        std::exception_ptr collect_error;
+        std::thread collector([&] {
+            try {
+                std::vector<std::byte> msg;
+                for (const MicroBatch& mb : batches) {
+                    upstream_->recv(msg);
+                    const StageHeader header = read_header(msg);
+                    if (header.op != kRun || header.seq != mb.seq ||
+                        msg.size() != sizeof(header) + mb.logits.size() * sizeof(float)) {
+                        throw std::runtime_error("pipeline result out of order");
+                    }
+                    std::memcpy(mb.logits.data(), msg.data() + sizeof(header), mb.logits.size() * sizeof(float));
+                    for (std::size_t s = 1; s < busy.size(); ++s) busy[s] += header.per_stage[s];
+                }
+            } catch (...) {
+                collect_error = std::current_exception();
+            }
+        });
+        try {
+            for (const MicroBatch& mb : batches) {
+                if (mb.logits.size() % vocab != 0 || mb.logits.size() / vocab > mb.tokens.size()) {
+                    throw std::runtime_error("micro-batch logits must be whole vocab rows");
+                }
+                const auto mb_start = Clock::now();
+                const std::span<float> x = run_first_stage(mb);
+                StageHeader header{};
+                header.op = kRun;
+                header.seq = mb.seq;
+                header.num_tokens = static_cast<std::uint32_t>(mb.tokens.size());
+                header.logit_rows = static_cast<std::uint32_t>(mb.logits.size() / vocab);
+                header.per_stage[0] = elapsed_ns(mb_start);
+                busy[0] += header.per_stage[0];
+                const std::span<const std::byte> parts[] = {bytes_of(std::span<const StageHeader>(&header, 1)),
+                                                            bytes_of(std::span<const float>(x))};
+                downstream_->sendv(parts);
+            }
+        } catch (...) {
+            // nothing in flight can be trusted now; killing the stages unblocks the collector
+            for (pid_t pid : pids_) kill(pid, SIGKILL);
+            collector.join();
+            shutdown(false);
+            throw;
+        }
+        collector.join();
+        if (collect_error) {
+            shutdown(false);
+            std::rethrow_exception(collect_error);
+        }
+        for (std::size_t s = 0; s < busy.size(); ++s) stats_.busy_ns[s] += busy[s];
+    }
+    stats_.wall_ns += elapsed_ns(start);
+    stats_.micro_batches += batches.size();
+}
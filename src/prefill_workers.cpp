@@ -0,0 +1,166 @@
+#include "prefill_workers.h"
+
+#include <omp.h>
+
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "kernels.h"
+#include "kv_cache.h"
+
+namespace {
+
+enum : std::uint32_t { kPrefill = 1, kShutdown = 2 };
+
+// Request: header, the handoff path, num_tokens tokens. No reply, the handoff is the answer.
+struct PrefillHeader {
+    std::uint32_t op;
+    std::uint32_t path_len;
+    std::uint32_t num_tokens;
+};
+
+void run_prefill(const GPTOSSModel& model, const std::string& path, std::span<const std::int32_t> tokens,
+                 std::size_t chunk, ForwardBuffers& buf, std::vector<float>& logits) {
+    KVHandoff handoff = KVHandoff::open(path);
+    try {
+        if (handoff.seq_len() != tokens.size() || handoff.num_layers() != model.config().num_hidden_layers) {
+            throw std::runtime_error("handoff " + path + " doesn't fit the prompt");
+        }
+        KVCache cache(model.config().num_hidden_layers);
+        handoff.attach_writer(cache);
+        ChunkedPrefill prefill(model, tokens, cache, buf, chunk);
+        while (!prefill.step(logits)) {
+        }
+        handoff.publish_first_token(argmax(logits));
+    } catch (...) {
+        handoff.fail();
+        throw;
+    }
+}
+
+[[noreturn]] void worker_main(const GPTOSSModel& model, Transport& transport, std::size_t chunk) {
+    ForwardBuffers buf;
+    std::vector<float> logits(model.config().vocab_size);
+    std::vector<std::byte> msg;
+    try {
+        while (true) {
+            transport.recv(msg);
+            PrefillHeader header{};
+            if (msg.size() < sizeof(header)) throw std::runtime_error("short prefill request");
+            std::memcpy(&header, msg.data(), sizeof(header));
+            if (header.op == kShutdown) break;
+            // 64-bit so a garbage num_tokens can't wrap around to the right size
+            const std::uint64_t expected = sizeof(header) + std::uint64_t{header.path_len} +
+                                           std::uint64_t{header.num_tokens} * sizeof(std::int32_t);
+            if (header.op != kPrefill || msg.size() != expected) {
+                throw std::runtime_error("malformed prefill request (op " + std::to_string(header.op) + ", " +
+                                         std::to_string(msg.size()) + " bytes)");
+            }
+            const std::string path(reinterpret_cast<const char*>(msg.data() + sizeof(header)), header.path_len);
+            std::vector<std::int32_t> tokens(header.num_tokens);
+            std::memcpy(tokens.data(), msg.data() + sizeof(header) + header.path_len,
+                        tokens.size() * sizeof(std::int32_t));
+            try {
+                run_prefill(model, path, tokens, chunk, buf, logits);
+            } catch (const std::exception& e) {
+                // the handoff carries the failure to whoever waits on it; keep serving
+                std::cerr << "prefill worker " << getpid() << ": " << e.what() << std::endl;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "prefill worker " << getpid() << " failed: " << e.what() << std::endl;
+        _exit(1);
+    }
+    _exit(0);
+}
+
+}  // namespace
+
+PrefillWorkers::PrefillWorkers(Checkpoint& checkpoint,
+                               const ModelConfig& config,
+                               const ModelOptions& model_options,
+                               const PrefillWorkerOptions& options)
+    : config_(config), options_(options) {
+    if (options_.num_workers == 0) throw std::runtime_error("prefill workers need at least one worker");
+    if (options_.handoff_dir.empty() || !std::filesystem::is_directory(options_.handoff_dir)) {
+        options_.handoff_dir = std::filesystem::temp_directory_path().string();
+    }
+    workers_.reserve(options_.num_workers);
+    try {
+        for (std::size_t w = 0; w < options_.num_workers; ++w) {
+            // requests are tiny, the KV goes through the handoff files
+            auto [mine, theirs] = make_transport_pair(options_.transport, std::size_t{1} << 20);
+            const pid_t parent = getpid();
+            const pid_t pid = fork_peer();
+            if (pid == 0) {
+                mine.reset();
+                workers_.clear();
+                if (options_.threads_per_worker) omp_set_num_threads(static_cast<int>(options_.threads_per_worker));
+                theirs->set_peer_check([parent] { return getppid() == parent; });
+                try {
+                    const GPTOSSModel model(checkpoint, config, model_options);
+                    worker_main(model, *theirs, options_.prefill_chunk);
+                } catch (const std::exception& e) {
+                    std::cerr << "prefill worker " << getpid() << " failed: " << e.what() << std::endl;
+                    _exit(1);
+                }
+            }
+            theirs.reset();
+            mine->set_peer_check([pid] { return waitpid(pid, nullptr, WNOHANG) == 0; });
+            workers_.push_back({pid, std::move(mine)});
+        }
+    } catch (...) {
+        shutdown();
+        throw;
+    }
+}
+
+PrefillWorkers::~PrefillWorkers() { shutdown(); }
+
+void PrefillWorkers::shutdown() {
+    const PrefillHeader header{kShutdown, 0, 0};
+    for (Worker& worker : workers_) {
+        try {
+            worker.transport->send(std::as_bytes(std::span<const PrefillHeader>(&header, 1)));
+        } catch (const std::exception&) {
+            // already gone, waitpid below still reaps it
+        }
+    }
+    for (Worker& worker : workers_) {
+        worker.transport.reset();
+        waitpid(worker.pid, nullptr, 0);
+    }
+    workers_.clear();
+}
+
+std::unique_ptr<KVHandoff> PrefillWorkers::submit(std::span<const std::int32_t> prompt) {
+    if (prompt.empty()) throw std::runtime_error("prefill workers got an empty prompt");
+    std::lock_guard<std::mutex> lock(mutex_);
+    Worker& worker = workers_[next_worker_];
+    next_worker_ = (next_worker_ + 1) % workers_.size();
+
+    const std::string path = (std::filesystem::path(options_.handoff_dir) /
+                              ("gptoss-kv-" + std::to_string(getpid()) + "-" + std::to_string(next_id_++)))
+                                 .string();
+    auto handoff = std::make_unique<KVHandoff>(KVHandoff::create(
+        path, config_.num_hidden_layers, config_.num_key_value_heads * config_.head_dim, prompt.size()));
+    const pid_t pid = worker.pid;
+    handoff->set_peer_check([pid] { return waitpid(pid, nullptr, WNOHANG) == 0; });
+
+    const PrefillHeader header{kPrefill, static_cast<std::uint32_t>(path.size()),
+                               static_cast<std::uint32_t>(prompt.size())};
+    const std::span<const std::byte> parts[] = {
+        std::as_bytes(std::span<const PrefillHeader>(&header, 1)),
+        std::as_bytes(std::span<const char>(path)),
+        std::as_bytes(prompt),
+    };
+    worker.transport->sendv(parts);
+    return handoff;
+}
@@ -0,0 +1,313 @@
+#include "pretokenizer.h"
+
+#include "unicode_classes.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#ifdef GPTOSS_HAVE_ICU
+// regex engine that supports unicode cuz std::regex is only ECMAScript
+#include <unicode/regex.h>
+#include <unicode/unistr.h>
+#endif
+
+const char* const kO200kPattern =
+    "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+(?i:'s|'t|'re|'ve|'m|'ll|'d)?"
+    "|[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*(?i:'s|'t|'re|'ve|'m|'ll|'d)?"
+    "|\\p{N}{1,3}"
+    "| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*"
+    "|\\s*[\\r\\n]+"
+    "|\\s+(?!\\S)"
+    "|\\s+";
+
+namespace {
+
+#include "unicode_tables.inc"
+
+constexpr std::size_t kNoMatch = static_cast<std::size_t>(-1);
+
+inline std::uint8_t class_of(std::uint32_t cp) {
+    if (cp < kUnicodeTableLimit) {
+        const std::uint32_t block = kUnicodeStage1[cp >> kUnicodeBlockShift];
+        return kUnicodeStage2[(block << kUnicodeBlockShift) | (cp & ((1u << kUnicodeBlockShift) - 1))];
+    }
+    for (const auto& r : kUnicodeHighRanges) {
+        if (cp >= r.first && cp <= r.last) return r.bits;
+    }
+    return 0;
+}
+
+// Length of the pure-ASCII prefix of [p, end).
+inline std::size_t ascii_prefix(const unsigned char* p, const unsigned char* end) {
+    const unsigned char* start = p;
+#if defined(__AVX2__)
+    while (end - p >= 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(v));
+        if (mask) return static_cast<std::size_t>(p - start) + __builtin_ctz(mask);
+        p += 32;
+    }
+#elif defined(__SSE2__)
+    while (end - p >= 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(v));
+        if (mask) return static_cast<std::size_t>(p - start) + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && *p < 0x80) ++p;
+    return static_cast<std::size_t>(p - start);
+}
+
+// Walks the o200k alternatives at each position in the same order (and with the same
+// backtracking outcome) as the regex engine would.
+class O200kSplitter {
+public:
+    explicit O200kSplitter(std::string_view text)
+        : s_(reinterpret_cast<const unsigned char*>(text.data())), n_(text.size()) {}
+
+    std::size_t match(std::size_t pos) {
+        std::size_t end;
+        if ((end = letters(pos, true)) != kNoMatch) return end;
+        if ((end = letters(pos, false)) != kNoMatch) return end;
+        if ((end = digits(pos)) != kNoMatch) return end;
+        if ((end = punctuation(pos)) != kNoMatch) return end;
+        if ((end = whitespace(pos)) != kNoMatch) return end;
+        // unreachable for well-formed input, every class is covered above
+        return pos + len(pos);
+    }
+
+private:
+    const unsigned char* s_;
+    std::size_t n_;
+    // [ascii_begin_, ascii_end_) is known to be pure ASCII
+    std::size_t ascii_begin_{0};
+    std::size_t ascii_end_{0};
+    // decoded length of the last character classified
+    std::size_t last_len_{1};
+
+    // Class bits of the character at pos (0 past the end); sets last_len_.
+    std::uint8_t cls(std::size_t pos) {
+        if (pos >= n_) {
+            last_len_ = 0;
+            return 0;
+        }
+        const bool in_run = pos >= ascii_begin_ && pos < ascii_end_;
+        if (!in_run && s_[pos] < 0x80) {
+            ascii_begin_ = pos;
+            ascii_end_ = pos + ascii_prefix(s_ + pos, s_ + n_);
+        }
+        if (pos >= ascii_begin_ && pos < ascii_end_) {
+            last_len_ = 1;
+            return kUnicodeStage2[s_[pos]];  // block 0 covers ASCII
+        }
+        return class_of(decode(pos));
+    }
+
+    std::size_t len(std::size_t pos) {
+        cls(pos);
+        return last_len_;
+    }
+
+    std::uint32_t decode(std::size_t pos) {
+        const unsigned char c = s_[pos];
+        std::size_t need;
+        std::uint32_t cp;
+        if (c >= 0xF0 && c <= 0xF4) {
+            need = 4;
+            cp = c & 0x07;
+        } else if (c >= 0xE0) {
+            need = c <= 0xEF ? 3 : 0;
+            cp = c & 0x0F;
+        } else if (c >= 0xC2) {
+            need = 2;
+            cp = c & 0x1F;
+        } else {
+            need = 0;
+            cp = 0;
+        }
+        if (need == 0 || pos + need > n_) {
+            last_len_ = 1;
+            return 0xFFFD;
+        }
+        for (std::size_t i = 1; i < need; ++i) {
+            const unsigned char cc = s_[pos + i];
+            if ((cc & 0xC0) != 0x80) {
+                last_len_ = 1;
+                return 0xFFFD;
+            }
+            cp = (cp << 6) | (cc & 0x3F);
+        }
+        // reject overlong forms, surrogates and out of range values
+        if ((need == 3 && cp < 0x800) || (need == 4 && (cp < 0x10000 || cp > 0x10FFFF)) ||
+            (cp >= 0xD800 && cp <= 0xDFFF)) {
+            last_len_ = 1;
+            return 0xFFFD;
+        }
+        last_len_ = need;
+        return cp;
+    }
+
+    static bool is_prefix(std::uint8_t c) { return !(c & (kUcLetter | kUcNumber | kUcNewline)); }
+    static bool is_punct(std::uint8_t c) { return !(c & (kUcSpace | kUcLetter | kUcNumber)); }
+
+    // (?i:'s|'t|'re|'ve|'m|'ll|'d)?
+    std::size_t contraction(std::size_t pos) const {
+        if (pos + 1 >= n_ || s_[pos] != '\'') return pos;
+        const unsigned char a = s_[pos + 1] | 0x20;
+        if (a == 's' || a == 't' || a == 'm' || a == 'd') return pos + 2;
+        // U+017F LATIN SMALL LETTER LONG S case-folds to 's'
+        if (s_[pos + 1] == 0xC5 && pos + 2 < n_ && s_[pos + 2] == 0xBF) return pos + 3;
+        if (pos + 2 >= n_) return pos;
+        const unsigned char b = s_[pos + 2] | 0x20;
+        if ((a == 'r' && b == 'e') || (a == 'v' && b == 'e') || (a == 'l' && b == 'l')) return pos + 3;
+        return pos;
+    }
+
+    // [\p{Lu}\p{Lt}\p{Lm}\p{Lo}\p{M}]*[\p{Ll}\p{Lm}\p{Lo}\p{M}]+  (lower_required)
+    // [\p{Lu}\p{Lt}\p{Lm}\p{Lo}\p{M}]+[\p{Ll}\p{Lm}\p{Lo}\p{M}]*  (otherwise)
+    std::size_t letter_body(std::size_t pos, bool lower_required) {
+        std::size_t e = pos;
+        std::size_t last_lower = kNoMatch;
+        std::size_t last_lower_len = 0;
+        std::uint8_t c;
+        while ((c = cls(e)) & kUcUpperSet) {
+            if (c & kUcLowerSet) {
+                last_lower = e;
+                last_lower_len = last_len_;
+            }
+            e += last_len_;
+        }
+        if (!lower_required && e == pos) return kNoMatch;
+        if (c & kUcLowerSet) {
+            while (cls(e) & kUcLowerSet) e += last_len_;
+            return e;
+        }
+        if (!lower_required) return e;
+        // backtrack the greedy upper run to its last char that also fits the lower set
+        if (last_lower == kNoMatch) return kNoMatch;
+        return last_lower + last_lower_len;
+    }
+
+    std::size_t letters(std::size_t pos, bool lower_required) {
+        const std::uint8_t c = cls(pos);
+        if (pos < n_ && is_prefix(c)) {
+            const std::size_t end = letter_body(pos + last_len_, lower_required);
+            if (end != kNoMatch) return contraction(end);
+        }
+        const std::size_t end = letter_body(pos, lower_required);
+        return end == kNoMatch ? kNoMatch : contraction(end);
+    }
+
+    // \p{N}{1,3}
+    std::size_t digits(std::size_t pos) {
+        std::size_t e = pos;
+        for (int i = 0; i < 3 && (cls(e) & kUcNumber); ++i) e += last_len_;
+        return e == pos ? kNoMatch : e;
+    }
+
+    //  ?[^\s\p{L}\p{N}]+[\r\n/]*
+    std::size_t punctuation(std::size_t pos) {
+        std::size_t e = pos;
+        if (s_[e] == ' ') e++;
+        std::uint8_t c = cls(e);
+        if (e >= n_ || !is_punct(c)) return kNoMatch;
+        while (e < n_ && is_punct(c)) {
+            e += last_len_;
+            c = cls(e);
+        }
+        while (e < n_ && (s_[e] == '\r' || s_[e] == '\n' || s_[e] == '/')) e++;
+        return e;
+    }
+
+    // \s*[\r\n]+  |  \s+(?!\S)  |  \s+
+    std::size_t whitespace(std::size_t pos) {
+        std::size_t e = pos;
+        std::size_t last_newline = kNoMatch;
+        std::size_t last_start = pos;
+        std::size_t count = 0;
+        std::uint8_t c;
+        while ((c = cls(e)) & kUcSpace) {
+            if (c & kUcNewline) last_newline = e;
+            last_start = e;
+            e += last_len_;
+            count++;
+        }
+        if (count == 0) return kNoMatch;
+        if (last_newline != kNoMatch) return last_newline + 1;
+        if (e >= n_ || count == 1) return e;
+        // leave the last space to prefix the following word
+        return last_start;
+    }
+};
+
+}  // namespace
+
+void o200k_pretokenize(std::string_view text, std::vector<std::string_view>& out) {
+    O200kSplitter splitter(text);
+    std::size_t pos = 0;
+    while (pos < text.size()) {
+        const std::size_t end = splitter.match(pos);
+        out.push_back(text.substr(pos, end - pos));
+        pos = end;
+    }
+}
+
+std::size_t o200k_next_boundary(std::string_view text, std::size_t from) {
+    auto printable = [](char c) { return c > ' ' && c < 0x7F; };
+    auto alpha = [](char c) { return (c | 0x20) >= 'a' && (c | 0x20) <= 'z'; };
+    for (std::size_t i = std::max<std::size_t>(from, 1); i + 1 < text.size(); ++i) {
+        const char prev = text[i - 1];
+        const char cur = text[i];
+        // no piece spans "\n" + visible char, except punctuation runs absorbing '/'
+        if ((prev == '\n' || prev == '\r') && printable(cur) && cur != '/') return i;
+        // " word" after a visible char: the space can only be the next piece's prefix
+        if (cur == ' ' && printable(prev) && alpha(text[i + 1])) return i;
+    }
+    return text.size();
+}
+
+std::vector<std::string_view> o200k_pretokenize(std::string_view text) {
+    std::vector<std::string_view> out;
+    o200k_pretokenize(text, out);
+    return out;
+}
+
+#ifdef GPTOSS_HAVE_ICU
+std::vector<std::string> icu_regex_split(const std::string& text, const std::string& pattern) {
+    UErrorCode status = U_ZERO_ERROR;
+    icu::UnicodeString pattern_u = icu::UnicodeString::fromUTF8(pattern);
+    std::unique_ptr<icu::RegexPattern> re(icu::RegexPattern::compile(pattern_u, 0, status));
+    if (U_FAILURE(status)) {
+        throw std::runtime_error("tokenizer: failed to compile ICU regex");
+    }
+
+    icu::UnicodeString text_u = icu::UnicodeString::fromUTF8(text);
+    std::unique_ptr<icu::RegexMatcher> matcher(re->matcher(text_u, status));
+    if (U_FAILURE(status)) {
+        throw std::runtime_error("tokenizer: failed to create ICU matcher");
+    }
+
+    std::vector<std::string> pieces;
+    while (matcher->find(status)) {
+        if (U_FAILURE(status)) {
+            throw std::runtime_error("tokenizer: ICU regex match failed");
+        }
+        icu::UnicodeString match = matcher->group(status);
+        if (U_FAILURE(status)) {
+            throw std::runtime_error("tokenizer: ICU regex group failed");
+        }
+        std::string out;
+        match.toUTF8String(out);
+        pieces.push_back(out);
+    }
+    return pieces;
+}
+#endif
@@ -0,0 +1,273 @@
+#include "quant.h"
+
+#include "trace.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+#include <ostream>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+constexpr std::size_t kInt8RowAlign = 64;
+// u8 activation = int8 activation + kActivationOffset, so 128 encodes zero
+constexpr std::int32_t kActivationOffset = 128;
+
+inline float bf16_to_float(std::uint16_t v) {
+    std::uint32_t tmp = static_cast<std::uint32_t>(v) << 16;
+    float out = 0.0f;
+    std::memcpy(&out, &tmp, sizeof(out));
+    return out;
+}
+
+// n is a multiple of 64
+inline std::int32_t dot_u8s8(const std::uint8_t* a, const std::int8_t* b, std::size_t n) {
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+    __m512i acc = _mm512_setzero_si512();
+    for (std::size_t i = 0; i < n; i += 64) {
+        acc = _mm512_dpbusd_epi32(acc, _mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+    }
+    return _mm512_reduce_add_epi32(acc);
+#elif defined(__AVXVNNI__)
+    __m256i acc = _mm256_setzero_si256();
+    for (std::size_t i = 0; i < n; i += 32) {
+        acc = _mm256_dpbusd_avx_epi32(acc, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+                                      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+#else
+    std::int32_t acc = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        acc += static_cast<std::int32_t>(a[i]) * static_cast<std::int32_t>(b[i]);
+    }
+    return acc;
+#endif
+}
+
+// symmetric per-row quantization, returns the scale
+float quantize_row(const float* x, std::size_t n, std::uint8_t* out, std::size_t stride) {
+    float amax = 0.0f;
+    for (std::size_t i = 0; i < n; ++i) amax = std::max(amax, std::fabs(x[i]));
+    const float scale = amax > 0.0f ? amax / 127.0f : 1.0f;
+    const float inv = 1.0f / scale;
+    for (std::size_t i = 0; i < n; ++i) {
+        const int q = static_cast<int>(std::lrint(x[i] * inv));
+        out[i] = static_cast<std::uint8_t>(std::clamp(q, -127, 127) + kActivationOffset);
+    }
+    std::fill(out + n, out + stride, static_cast<std::uint8_t>(kActivationOffset));
+    return scale;
+}
+
+constexpr std::size_t kMxFp4BytesPerBlock = 16;
+constexpr std::size_t kMxFp4ValuesPerBlock = 32;
+// kFp4Values * 2, the sign bit picks the negative half
+constexpr std::int8_t kFp4Doubled[16] = {0, 1, 2, 3, 4, 6, 8, 12, 0, -1, -2, -3, -4, -6, -8, -12};
+
+// 2^(e - 127) / 2 for every E8M0 exponent, the / 2 undoes kFp4Doubled
+const std::array<float, 256> kE8M0HalfScale = [] {
+    std::array<float, 256> t{};
+    for (int e = 0; e < 256; ++e) t[e] = std::ldexp(1.0f, e - 128);
+    return t;
+}();
+
+// One activation row quantized per 32-value block. Each block is stored deinterleaved
+// (even elements, then odd) to line up with the low/high nibbles of a weight block.
+void quantize_blocks(const float* x, std::size_t in_features, std::int8_t* xq, float* x_scales) {
+    for (std::size_t b = 0; b < in_features / kMxFp4ValuesPerBlock; ++b) {
+        const float* xb = x + b * kMxFp4ValuesPerBlock;
+        std::int8_t* qb = xq + b * kMxFp4ValuesPerBlock;
+        float amax = 0.0f;
+        for (std::size_t i = 0; i < kMxFp4ValuesPerBlock; ++i) amax = std::max(amax, std::fabs(xb[i]));
+        const float scale = amax > 0.0f ? amax / 127.0f : 1.0f;
+        const float inv = 1.0f / scale;
+        for (std::size_t i = 0; i < kMxFp4BytesPerBlock; ++i) {
+            qb[i] = static_cast<std::int8_t>(std::clamp(static_cast<int>(std::lrint(xb[2 * i] * inv)), -127, 127));
+            qb[i + kMxFp4BytesPerBlock] =
+                static_cast<std::int8_t>(std::clamp(static_cast<int>(std::lrint(xb[2 * i + 1] * inv)), -127, 127));
+        }
+        x_scales[b] = scale;
+    }
+}
+
+}  // namespace
+
+Int8Matrix quantize_int8_rows(const std::uint16_t* weight_bf16, std::size_t rows, std::size_t cols) {
+    Int8Matrix m;
+    m.rows = rows;
+    m.cols = cols;
+    m.stride = (cols + kInt8RowAlign - 1) / kInt8RowAlign * kInt8RowAlign;
+    m.values.assign(rows * m.stride, 0);
+    m.scales.resize(rows);
+    m.row_sums.resize(rows);
+#pragma omp parallel for schedule(static)
+    for (std::size_t r = 0; r < rows; ++r) {
+        const std::uint16_t* w = weight_bf16 + r * cols;
+        float amax = 0.0f;
+        for (std::size_t c = 0; c < cols; ++c) amax = std::max(amax, std::fabs(bf16_to_float(w[c])));
+        const float scale = amax > 0.0f ? amax / 127.0f : 1.0f;
+        const float inv = 1.0f / scale;
+        std::int8_t* q = m.values.data() + r * m.stride;
+        std::int32_t sum = 0;
+        for (std::size_t c = 0; c < cols; ++c) {
+            const int v = std::clamp(static_cast<int>(std::lrint(bf16_to_float(w[c]) * inv)), -127, 127);
+            q[c] = static_cast<std::int8_t>(v);
+            sum += v;
+        }
+        m.scales[r] = scale;
+        m.row_sums[r] = sum;
+    }
+    return m;
+}
+
+void linear_int8(const Int8Matrix& w,
+                 const std::uint16_t* bias_bf16,
+                 std::span<const float> x,
+                 std::span<float> out) {
+    GPTOSS_TRACE_SCOPE("linear_int8");
+    const std::size_t seq_len = x.size() / w.cols;
+    thread_local std::vector<std::uint8_t> xq;
+    xq.resize(w.stride);
+    for (std::size_t t = 0; t < seq_len; ++t) {
+        const float x_scale = quantize_row(x.data() + t * w.cols, w.cols, xq.data(), w.stride);
+        const std::uint8_t* xq_row = xq.data();
+        float* out_row = out.data() + t * w.rows;
+#pragma omp parallel for schedule(static)
+        for (std::size_t r = 0; r < w.rows; ++r) {
+            const std::int32_t acc = dot_u8s8(xq_row, w.values.data() + r * w.stride, w.stride) -
+                                     kActivationOffset * w.row_sums[r];
+            const float v = static_cast<float>(acc) * x_scale * w.scales[r];
+            out_row[r] = bias_bf16 ? v + bf16_to_float(bias_bf16[r]) : v;
+        }
+    }
+}
+
+void mxfp4_gemm_int8(const std::uint8_t* blocks,
+                     const std::uint8_t* scales,
+                     std::size_t out_features,
+                     std::size_t in_features,
+                     std::span<const float> x,
+                     std::span<float> out) {
+    GPTOSS_TRACE_SCOPE("mxfp4_gemm_int8");
+    const std::size_t blocks_per_row = in_features / kMxFp4ValuesPerBlock;
+    thread_local std::vector<std::int8_t> xq;
+    thread_local std::vector<float> x_scales;
+    xq.resize(in_features);
+    x_scales.resize(blocks_per_row);
+    quantize_blocks(x.data(), in_features, xq.data(), x_scales.data());
+    const std::int8_t* xq_data = xq.data();
+    const float* xs_data = x_scales.data();
+
+#pragma omp parallel for schedule(static)
+    for (std::size_t o = 0; o < out_features; ++o) {
+        const std::uint8_t* row_blocks = blocks + o * blocks_per_row * kMxFp4BytesPerBlock;
+        const std::uint8_t* row_scales = scales + o * blocks_per_row;
+#if defined(__AVX2__)
+        const __m256i lut = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(kFp4Doubled)));
+        const __m128i nibble = _mm_set1_epi8(0x0F);
+        __m256 acc = _mm256_setzero_ps();
+        for (std::size_t b = 0; b < blocks_per_row; ++b) {
+            const __m128i packed =
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(row_blocks + b * kMxFp4BytesPerBlock));
+            const __m256i idx = _mm256_set_m128i(_mm_and_si128(_mm_srli_epi16(packed, 4), nibble),
+                                                 _mm_and_si128(packed, nibble));
+            const __m256i w = _mm256_shuffle_epi8(lut, idx);
+            const __m256i xb =
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(xq_data + b * kMxFp4ValuesPerBlock));
+            // u8 x s8 products: |w| as the unsigned side, w's sign moved onto x
+            const __m256i w_abs = _mm256_abs_epi8(w);
+            const __m256i x_signed = _mm256_sign_epi8(xb, w);
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+            const __m256i dot = _mm256_dpbusd_epi32(_mm256_setzero_si256(), w_abs, x_signed);
+#elif defined(__AVXVNNI__)
+            const __m256i dot = _mm256_dpbusd_avx_epi32(_mm256_setzero_si256(), w_abs, x_signed);
+#else
+            // |w| <= 12 and |x| <= 127, so the i16 pair sums cannot saturate
+            const __m256i dot = _mm256_madd_epi16(_mm256_maddubs_epi16(w_abs, x_signed), _mm256_set1_epi16(1));
+#endif
+            const float scale = xs_data[b] * kE8M0HalfScale[row_scales[b]];
+            acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(dot), _mm256_set1_ps(scale), acc);
+        }
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+        out[o] = _mm_cvtss_f32(sum);
+#else
+        float acc = 0.0f;
+        for (std::size_t b = 0; b < blocks_per_row; ++b) {
+            const std::uint8_t* blk = row_blocks + b * kMxFp4BytesPerBlock;
+            const std::int8_t* xb = xq_data + b * kMxFp4ValuesPerBlock;
+            std::int32_t dot = 0;
+            for (std::size_t i = 0; i < kMxFp4BytesPerBlock; ++i) {
+                dot += kFp4Doubled[blk[i] & 0x0F] * xb[i];
+                dot += kFp4Doubled[blk[i] >> 4] * xb[i + kMxFp4BytesPerBlock];
+            }
+            acc += static_cast<float>(dot) * xs_data[b] * kE8M0HalfScale[row_scales[b]];
+        }
+        out[o] = acc;
+#endif
+    }
+}
+
+LogitParity logit_parity(std::span<const float> reference, std::span<const float> test, std::size_t top_k) {
+    LogitParity p;
+    const std::size_t n = std::min(reference.size(), test.size());
+    if (n == 0) return p;
+    double sq = 0.0, dot = 0.0, ref_sq = 0.0, test_sq = 0.0;
+    for (std::size_t i = 0; i < n; ++i) {
+        const double d = static_cast<double>(reference[i]) - test[i];
+        p.max_abs_diff = std::max(p.max_abs_diff, static_cast<float>(std::fabs(d)));
+        sq += d * d;
+        dot += static_cast<double>(reference[i]) * test[i];
+        ref_sq += static_cast<double>(reference[i]) * reference[i];
+        test_sq += static_cast<double>(test[i]) * test[i];
+    }
+    p.rms_diff = static_cast<float>(std::sqrt(sq / static_cast<double>(n)));
+    p.cosine = static_cast<float>(dot / std::max(std::sqrt(ref_sq * test_sq), 1e-30));
+
+    auto log_softmax = [n](std::span<const float> v) {
+        const float max_v = *std::max_element(v.begin(), v.begin() + n);
+        double sum = 0.0;
+        for (std::size_t i = 0; i < n; ++i) sum += std::exp(static_cast<double>(v[i]) - max_v);
+        std::vector<double> out(n);
+        for (std::size_t i = 0; i < n; ++i) out[i] = v[i] - max_v - std::log(sum);
+        return out;
+    };
+    const auto lp = log_softmax(reference);
+    const auto lq = log_softmax(test);
+    double kl = 0.0;
+    for (std::size_t i = 0; i < n; ++i) kl += std::exp(lp[i]) * (lp[i] - lq[i]);
+    p.kl = static_cast<float>(kl);
+
+    p.top_k = std::min(top_k, n);
+    auto topk = [&](std::span<const float> v) {
+        std::vector<std::size_t> idx(n);
+        std::iota(idx.begin(), idx.end(), 0);
+        std::partial_sort(idx.begin(), idx.begin() + p.top_k, idx.end(),
+                          [&](std::size_t a, std::size_t b) { return v[a] > v[b]; });
+        idx.resize(p.top_k);
+        return idx;
+    };
+    const auto ref_top = topk(reference);
+    const auto test_top = topk(test);
+    p.top1_match = p.top_k > 0 && ref_top[0] == test_top[0];
+    for (std::size_t i : ref_top) {
+        p.topk_overlap += std::count(test_top.begin(), test_top.end(), i);
+    }
+    return p;
+}
+
+std::ostream& operator<<(std::ostream& os, const LogitParity& p) {
+    return os << "max_abs_diff=" << p.max_abs_diff << " rms_diff=" << p.rms_diff << " cosine=" << p.cosine
+              << " kl=" << p.kl << " top1=" << (p.top1_match ? "match" : "MISMATCH") << " top" << p.top_k
+              << "_overlap=" << p.topk_overlap << "/" << p.top_k;
+}
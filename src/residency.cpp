@@ -0,0 +1,199 @@
+#include "checkpoint.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr std::size_t kHugePage = 2ull << 20;
+constexpr std::size_t kGiganticPage = 1ull << 30;
+// unit of work for the copy and prefault loops
+constexpr std::size_t kChunkBytes = 2ull << 20;
+constexpr std::size_t kTouchStride = 4096;
+
+std::size_t round_up(std::size_t n, std::size_t align) { return (n + align - 1) / align * align; }
+
+// expert weights are streamed per token from whichever experts were picked, everything else
+// is read on every decode step
+bool is_hot(TensorKind kind) {
+    switch (kind) {
+        case TensorKind::Mlp1Blocks:
+        case TensorKind::Mlp1Scales:
+        case TensorKind::Mlp2Blocks:
+        case TensorKind::Mlp2Scales:
+            return false;
+        default:
+            return true;
+    }
+}
+
+// hugetlb pages if the admin reserved some, else a 2 MB aligned anonymous mapping with THP
+void* map_hugepages(std::size_t bytes, bool gigantic, std::size_t& length, bool& hugetlb) {
+    const std::size_t page = gigantic ? kGiganticPage : kHugePage;
+    const int page_bits = gigantic ? 30 : 21;
+    length = round_up(bytes, page);
+#ifdef MAP_HUGETLB
+    void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (page_bits << MAP_HUGE_SHIFT), -1, 0);
+    if (p != MAP_FAILED) {
+        hugetlb = true;
+        return p;
+    }
+#else
+    void* p = nullptr;
+    (void)page_bits;
+#endif
+
+    hugetlb = false;
+    length = round_up(bytes, kHugePage);
+    const std::size_t padded = length + kHugePage;
+    p = mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) throw std::runtime_error("failed to allocate resident weight memory");
+    const auto base = reinterpret_cast<std::uintptr_t>(p);
+    const auto aligned = round_up(base, kHugePage);
+    if (aligned > base) munmap(p, aligned - base);
+    const std::size_t tail = base + padded - (aligned + length);
+    if (tail > 0) munmap(reinterpret_cast<void*>(aligned + length), tail);
+#ifdef MADV_HUGEPAGE
+    madvise(reinterpret_cast<void*>(aligned), length, MADV_HUGEPAGE);
+#endif
+    return reinterpret_cast<void*>(aligned);
+}
+
+struct Chunk {
+    const std::byte* src;
+    std::byte* dst;  // null for prefault-only chunks
+    std::size_t bytes;
+};
+
+void split(std::vector<Chunk>& chunks, const std::byte* src, std::byte* dst, std::size_t bytes) {
+    for (std::size_t off = 0; off < bytes; off += kChunkBytes) {
+        chunks.push_back({src + off, dst ? dst + off : nullptr, std::min(kChunkBytes, bytes - off)});
+    }
+}
+
+// prints every 10% from whichever thread crosses the line
+class Progress {
+public:
+    Progress(const char* label, std::size_t total, bool enabled) : label_(label), total_(total), enabled_(enabled) {}
+
+    void add(std::size_t bytes) {
+        if (!enabled_ || total_ == 0) return;
+        const std::size_t before = done_.fetch_add(bytes);
+        const std::size_t decile = (before + bytes) * 10 / total_;
+        if (decile != before * 10 / total_) {
+#pragma omp critical(gptoss_residency_progress)
+            std::cerr << label_ << ": " << decile * 10 << "% (" << (before + bytes) / (1 << 20) << " / "
+                      << total_ / (1 << 20) << " MB)" << std::endl;
+        }
+    }
+
+private:
+    const char* label_;
+    std::size_t total_;
+    bool enabled_;
+    std::atomic<std::size_t> done_{0};
+};
+
+void run_chunks(const std::vector<Chunk>& chunks, Progress& progress) {
+#pragma omp parallel for schedule(dynamic)
+    for (std::size_t i = 0; i < chunks.size(); i++) {
+        const Chunk& c = chunks[i];
+        if (c.dst) {
+            std::memcpy(c.dst, c.src, c.bytes);
+        } else {
+            // one read per page is enough to pull it into the page cache and our page table
+            const volatile std::byte* p = c.src;
+            std::uint8_t sink = 0;
+            for (std::size_t off = 0; off < c.bytes; off += kTouchStride) {
+                sink ^= static_cast<std::uint8_t>(p[off]);
+            }
+            (void)sink;
+        }
+        progress.add(c.bytes);
+    }
+}
+
+}  // namespace
+
+ResidencyReport Checkpoint::make_resident(const ResidencyOptions& options) {
+    if (resident_base_) throw std::runtime_error("checkpoint is already resident");
+    const auto start = std::chrono::steady_clock::now();
+    ResidencyReport report;
+
+    std::vector<TensorMeta_*> hot;
+    std::vector<const TensorMeta_*> cold;
+    for (std::size_t i = 0; i < directory_.size(); i++) {
+        TensorMeta_* meta = directory_[i];
+        if (!meta) continue;
+        const std::size_t k =
+            i < kNumGlobalTensorKinds ? i : kNumGlobalTensorKinds + (i - kNumGlobalTensorKinds) % kNumLayerTensorKinds;
+        if (is_hot(static_cast<TensorKind>(k))) {
+            hot.push_back(meta);
+            report.resident_bytes += round_up(meta->byte_size, 64);
+        } else {
+            cold.push_back(meta);
+            report.prefaulted_bytes += meta->byte_size;
+        }
+    }
+    if (!options.prefault_experts) report.prefaulted_bytes = 0;
+
+    auto* dst = static_cast<std::byte*>(
+        map_hugepages(report.resident_bytes, options.gigantic_pages, resident_length_, report.hugetlb));
+    resident_base_ = dst;
+
+    std::vector<Chunk> chunks;
+    for (TensorMeta_* meta : hot) {
+        split(chunks, meta->data, dst, meta->byte_size);
+        dst += round_up(meta->byte_size, 64);
+    }
+    Progress copy_progress("resident", report.resident_bytes, options.progress);
+    run_chunks(chunks, copy_progress);
+
+    // only repoint once everything is copied
+    dst = static_cast<std::byte*>(resident_base_);
+    for (TensorMeta_* meta : hot) {
+        meta->data = dst;
+        dst += round_up(meta->byte_size, 64);
+    }
+
+    if (options.prefault_experts) {
+        chunks.clear();
+        for (const TensorMeta_* meta : cold) {
+            const std::size_t misalign = reinterpret_cast<std::uintptr_t>(meta->data) % kTouchStride;
+            madvise(const_cast<std::byte*>(meta->data) - misalign, meta->byte_size + misalign, MADV_WILLNEED);
+            split(chunks, meta->data, nullptr, meta->byte_size);
+        }
+        Progress fault_progress("prefault", report.prefaulted_bytes, options.progress);
+        run_chunks(chunks, fault_progress);
+    }
+
+    report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (options.progress) {
+        std::cerr << std::fixed << std::setprecision(2) << "weights ready in " << report.seconds << " s: "
+                  << report.resident_bytes / (1 << 20) << " MB resident on "
+                  << (report.hugetlb ? (options.gigantic_pages ? "1 GB hugetlb" : "2 MB hugetlb") : "THP")
+                  << " pages, " << report.prefaulted_bytes / (1 << 20) << " MB prefaulted" << std::endl;
+    }
+    return report;
+}
+
+void Checkpoint::drop_pages(TensorKind kind, int layer) {
+    const TensorMeta_* meta = find(kind, layer);
+    if (!meta || meta->byte_size == 0) return;
+    const auto page = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+    const auto begin = (reinterpret_cast<std::uintptr_t>(meta->data) + page - 1) / page * page;
+    const auto end = (reinterpret_cast<std::uintptr_t>(meta->data) + meta->byte_size) / page * page;
+    if (end > begin) madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+}
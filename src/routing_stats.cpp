@@ -0,0 +1,211 @@
+#include "routing_stats.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <fstream>
+#include <ostream>
+#include <stdexcept>
+
+namespace {
+
+std::atomic<std::uint64_t> g_next_id{1};
+
+void bump(std::atomic<std::uint64_t>& counter, std::uint64_t n = 1) {
+    // single writer per shard, so load + store is enough and avoids a locked RMW
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+}  // namespace
+
+std::uint64_t RoutingSnapshot::pair(std::size_t layer, std::size_t a, std::size_t b) const {
+    if (a > b) std::swap(a, b);
+    return coactivation[(layer * num_experts + a) * num_experts + b];
+}
+
+struct RoutingStats::Shard {
+    explicit Shard(std::size_t layers, std::size_t experts)
+        : hits(layers * experts),
+          weight_histogram(layers * kWeightBins),
+          coactivation(layers * experts * experts) {}
+
+    std::vector<std::atomic<std::uint64_t>> hits;
+    std::vector<std::atomic<std::uint64_t>> weight_histogram;
+    std::vector<std::atomic<std::uint64_t>> coactivation;
+    std::atomic<std::uint64_t> tokens{0};
+    std::atomic<std::uint64_t> batches{0};
+    std::atomic<double> imbalance_sum{0.0};
+    std::atomic<double> imbalance_max{0.0};
+};
+
+RoutingStats::RoutingStats(std::size_t num_layers, std::size_t num_experts, std::size_t experts_per_token)
+    : num_layers_(num_layers),
+      num_experts_(num_experts),
+      experts_per_token_(experts_per_token),
+      id_(g_next_id.fetch_add(1)),
+      token_layer_(0) {}
+
+RoutingStats::~RoutingStats() { stop_periodic_dump(); }
+
+RoutingStats::Shard& RoutingStats::local_shard() {
+    // a thread rarely feeds more than one or two instances, a linear scan is fine
+    thread_local std::vector<std::pair<std::uint64_t, Shard*>> cached;
+    for (const auto& [id, shard] : cached) {
+        if (id == id_) return *shard;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    shards_.push_back(std::make_unique<Shard>(num_layers_, num_experts_));
+    cached.emplace_back(id_, shards_.back().get());
+    return *shards_.back();
+}
+
+void RoutingStats::record(std::size_t layer, std::span<const std::int32_t> experts, std::span<const float> weights) {
+    if (layer >= num_layers_) return;
+    Shard& s = local_shard();
+    if (layer == token_layer_.load(std::memory_order_relaxed)) bump(s.tokens);
+    const std::size_t k = experts.size();
+    for (std::size_t i = 0; i < k; ++i) {
+        const auto e = static_cast<std::size_t>(experts[i]);
+        bump(s.hits[layer * num_experts_ + e]);
+        const float w = std::clamp(weights[i], 0.0f, 1.0f);
+        const auto bin = std::min(kWeightBins - 1, static_cast<std::size_t>(w * kWeightBins));
+        bump(s.weight_histogram[layer * kWeightBins + bin]);
+        for (std::size_t j = i + 1; j < k; ++j) {
+            const auto f = static_cast<std::size_t>(experts[j]);
+            const std::size_t a = std::min(e, f), b = std::max(e, f);
+            bump(s.coactivation[(layer * num_experts_ + a) * num_experts_ + b]);
+        }
+    }
+}
+
+void RoutingStats::add_first_layer(std::size_t layer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!attached_ || layer < token_layer_.load(std::memory_order_relaxed)) token_layer_.store(layer);
+    attached_ = true;
+}
+
+void RoutingStats::record_batch(std::span<const std::uint32_t> expert_load, std::size_t num_tokens) {
+    if (num_tokens == 0 || expert_load.empty()) return;
+    Shard& s = local_shard();
+    const double even = static_cast<double>(num_tokens * experts_per_token_) / static_cast<double>(expert_load.size());
+    const double imbalance = *std::max_element(expert_load.begin(), expert_load.end()) / even;
+    bump(s.batches);
+    s.imbalance_sum.store(s.imbalance_sum.load(std::memory_order_relaxed) + imbalance, std::memory_order_relaxed);
+    if (imbalance > s.imbalance_max.load(std::memory_order_relaxed)) {
+        s.imbalance_max.store(imbalance, std::memory_order_relaxed);
+    }
+}
+
+RoutingSnapshot RoutingStats::snapshot() const {
+    RoutingSnapshot snap;
+    snap.num_layers = num_layers_;
+    snap.num_experts = num_experts_;
+    snap.experts_per_token = experts_per_token_;
+    snap.hits.assign(num_layers_ * num_experts_, 0);
+    snap.weight_histogram.assign(num_layers_ * kWeightBins, 0);
+    snap.coactivation.assign(num_layers_ * num_experts_ * num_experts_, 0);
+    double imbalance_sum = 0.0;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& s : shards_) {
+        auto add = [](std::vector<std::uint64_t>& dst, const std::vector<std::atomic<std::uint64_t>>& src) {
+            for (std::size_t i = 0; i < src.size(); ++i) dst[i] += src[i].load(std::memory_order_relaxed);
+        };
+        add(snap.hits, s->hits);
+        add(snap.weight_histogram, s->weight_histogram);
+        add(snap.coactivation, s->coactivation);
+        snap.tokens += s->tokens.load(std::memory_order_relaxed);
+        snap.batches += s->batches.load(std::memory_order_relaxed);
+        imbalance_sum += s->imbalance_sum.load(std::memory_order_relaxed);
+        snap.max_imbalance = std::max(snap.max_imbalance, s->imbalance_max.load(std::memory_order_relaxed));
+    }
+    snap.mean_imbalance = snap.batches ? imbalance_sum / static_cast<double>(snap.batches) : 0.0;
+    return snap;
+}
+
+void RoutingStats::reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // shards stay registered with their threads, only the counts go
+    for (auto& s : shards_) {
+        for (auto& c : s->hits) c.store(0, std::memory_order_relaxed);
+        for (auto& c : s->weight_histogram) c.store(0, std::memory_order_relaxed);
+        for (auto& c : s->coactivation) c.store(0, std::memory_order_relaxed);
+        s->tokens.store(0, std::memory_order_relaxed);
+        s->batches.store(0, std::memory_order_relaxed);
+        s->imbalance_sum.store(0.0, std::memory_order_relaxed);
+        s->imbalance_max.store(0.0, std::memory_order_relaxed);
+    }
+}
+
+void RoutingStats::write_json(const std::string& path) const {
+    const RoutingSnapshot snap = snapshot();
+    std::ofstream out(path);
+    if (!out) throw std::runtime_error("failed to write routing stats: " + path);
+    out << "{\n  \"num_layers\": " << snap.num_layers << ",\n  \"num_experts\": " << snap.num_experts
+        << ",\n  \"experts_per_token\": " << snap.experts_per_token << ",\n  \"tokens\": " << snap.tokens
+        << ",\n  \"batches\": " << snap.batches << ",\n  \"mean_imbalance\": " << snap.mean_imbalance
+        << ",\n  \"max_imbalance\": " << snap.max_imbalance << ",\n  \"layers\": [\n";
+    for (std::size_t l = 0; l < snap.num_layers; ++l) {
+        out << "    {\"layer\": " << l << ", \"hits\": [";
+        for (std::size_t e = 0; e < snap.num_experts; ++e) out << (e ? ", " : "") << snap.hit(l, e);
+        out << "], \"weight_histogram\": [";
+        for (std::size_t b = 0; b < kWeightBins; ++b) {
+            out << (b ? ", " : "") << snap.weight_histogram[l * kWeightBins + b];
+        }
+        // sparse [a, b, count] triples, most frequent first
+        std::vector<std::array<std::uint64_t, 3>> pairs;
+        for (std::size_t a = 0; a < snap.num_experts; ++a) {
+            for (std::size_t b = a + 1; b < snap.num_experts; ++b) {
+                if (const std::uint64_t n = snap.pair(l, a, b)) pairs.push_back({a, b, n});
+            }
+        }
+        std::sort(pairs.begin(), pairs.end(), [](const auto& x, const auto& y) { return x[2] > y[2]; });
+        out << "], \"coactivation\": [";
+        for (std::size_t i = 0; i < pairs.size(); ++i) {
+            out << (i ? ", " : "") << "[" << pairs[i][0] << ", " << pairs[i][1] << ", " << pairs[i][2] << "]";
+        }
+        out << "]}" << (l + 1 < snap.num_layers ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+void RoutingStats::write_prometheus(std::ostream& os) const {
+    const RoutingSnapshot snap = snapshot();
+    os << "# TYPE gptoss_moe_routed_tokens_total counter\ngptoss_moe_routed_tokens_total " << snap.tokens << "\n";
+    os << "# TYPE gptoss_moe_expert_hits_total counter\n";
+    for (std::size_t l = 0; l < snap.num_layers; ++l) {
+        for (std::size_t e = 0; e < snap.num_experts; ++e) {
+            os << "gptoss_moe_expert_hits_total{layer=\"" << l << "\",expert=\"" << e << "\"} " << snap.hit(l, e)
+               << "\n";
+        }
+    }
+    os << "# TYPE gptoss_moe_batch_imbalance gauge\n"
+       << "gptoss_moe_batch_imbalance{stat=\"mean\"} " << snap.mean_imbalance << "\n"
+       << "gptoss_moe_batch_imbalance{stat=\"max\"} " << snap.max_imbalance << "\n";
+}
+
+void RoutingStats::start_periodic_dump(const std::string& path, std::chrono::milliseconds interval) {
+    stop_periodic_dump();
+    dump_stop_ = false;
+    dump_thread_ = std::thread([this, path, interval] {
+        std::unique_lock<std::mutex> lock(dump_mutex_);
+        while (!dump_cv_.wait_for(lock, interval, [this] { return dump_stop_; })) {
+            const std::string tmp = path + ".tmp";
+            try {
+                write_json(tmp);
+                std::rename(tmp.c_str(), path.c_str());
+            } catch (const std::exception&) {
+                // a failed dump shouldn't take the process down, the next tick retries
+            }
+        }
+    });
+}
+
+void RoutingStats::stop_periodic_dump() {
+    if (!dump_thread_.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(dump_mutex_);
+        dump_stop_ = true;
+    }
+    dump_cv_.notify_all();
+    dump_thread_.join();
+}
@@ -0,0 +1,372 @@
+#include "scheduler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "kernels.h"
+
+namespace {
+
+// weight of a new measurement in the cost model's running averages
+constexpr double kCostAlpha = 0.3;
+
+double seconds_since(Scheduler::Clock::time_point start) {
+    return std::chrono::duration<double>(Scheduler::Clock::now() - start).count();
+}
+
+void update_rate(double& rate, double amount, double seconds) {
+    if (seconds <= 0.0 || amount <= 0.0) return;
+    rate = (1.0 - kCostAlpha) * rate + kCostAlpha * (amount / seconds);
+}
+
+void write_all(int fd, const void* data, std::size_t bytes, std::uint64_t offset) {
+    const auto* p = static_cast<const char*>(data);
+    while (bytes > 0) {
+        const ssize_t n = pwrite(fd, p, bytes, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) throw std::runtime_error(std::string("swap write failed: ") + std::strerror(errno));
+        p += n;
+        bytes -= static_cast<std::size_t>(n);
+        offset += static_cast<std::uint64_t>(n);
+    }
+}
+
+void read_all(int fd, void* data, std::size_t bytes, std::uint64_t offset) {
+    auto* p = static_cast<char*>(data);
+    while (bytes > 0) {
+        const ssize_t n = pread(fd, p, bytes, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) throw std::runtime_error(std::string("swap read failed: ") + std::strerror(errno));
+        p += n;
+        bytes -= static_cast<std::size_t>(n);
+        offset += static_cast<std::uint64_t>(n);
+    }
+}
+
+// A file only this scheduler can reach, gone as soon as it's closed. Never opens an existing
+// name, so nothing planted there (a symlink, another scheduler's file) gets written through.
+int open_swap_file(const std::string& swap_path) {
+    if (!swap_path.empty()) {
+        const int fd = open(swap_path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (fd < 0) throw std::runtime_error("failed to create swap file " + swap_path + ": " + std::strerror(errno));
+        unlink(swap_path.c_str());
+        return fd;
+    }
+    const std::string dir = std::filesystem::temp_directory_path().string();
+#if defined(O_TMPFILE)
+    const int fd = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) return fd;
+#endif
+    // no O_TMPFILE support in this kernel or filesystem
+    std::string path = (std::filesystem::path(dir) / "gptoss-swap-XXXXXX").string();
+    const int tmp = mkostemp(path.data(), O_CLOEXEC);
+    if (tmp < 0) throw std::runtime_error("failed to create a swap file in " + dir + ": " + std::strerror(errno));
+    unlink(path.c_str());
+    return tmp;
+}
+
+}  // namespace
+
+EvictionPolicy parse_eviction_policy(const std::string& name) {
+    if (name == "auto") return EvictionPolicy::Auto;
+    if (name == "swap") return EvictionPolicy::Swap;
+    if (name == "recompute") return EvictionPolicy::Recompute;
+    throw std::runtime_error("unknown eviction policy " + name + " (auto, swap or recompute)");
+}
+
+Scheduler::Scheduler(const GPTOSSModel& model, const SchedulerOptions& options)
+    : model_(model),
+      options_(options),
+      num_layers_(model.config().num_hidden_layers),
+      row_floats_(model.config().num_key_value_heads * model.config().head_dim),
+      bytes_per_token_(num_layers_ * 2 * row_floats_ * sizeof(float)),
+      swap_bytes_per_s_(options.swap_bytes_per_s),
+      prefill_tokens_per_s_(options.prefill_tokens_per_s),
+      logits_(model.config().vocab_size) {
+    if (options_.max_running == 0 || options_.prefill_chunk == 0) {
+        throw std::runtime_error("scheduler needs max_running and prefill_chunk above zero");
+    }
+    swap_fd_ = open_swap_file(options_.swap_path);
+}
+
+Scheduler::~Scheduler() {
+    if (swap_fd_ >= 0) {
+        if (ftruncate(swap_fd_, 0) != 0) {
+            // nothing to do about it on the way out
+        }
+        close(swap_fd_);
+    }
+}
+
+std::uint64_t Scheduler::submit(SequenceRequest request) {
+    if (request.prompt.empty() || request.max_new_tokens == 0) {
+        throw std::runtime_error("scheduler needs a prompt and at least one token to generate");
+    }
+    const Clock::time_point now = Clock::now();
+    Sequence seq;
+    seq.id = next_id_++;
+    seq.tokens = request.prompt;
+    seq.request = std::move(request);
+    seq.arrival = now;
+    seq.last_run = now;
+    seq.kv = KVCache(num_layers_);
+
+    if (kv_bytes(seq.request.prompt.size() + seq.request.max_new_tokens) > options_.kv_budget_bytes) {
+        seq.state = SequenceState::Rejected;
+    } else if (seq.request.deadline != Clock::time_point::max()) {
+        // prefill still owed by everything that goes first, then our own
+        std::size_t queued = seq.tokens.size();
+        for (const auto& [id, other] : sequences_) {
+            if (other.generated > 0 || other.state == SequenceState::Finished ||
+                other.state == SequenceState::Rejected || !more_urgent(other, seq)) {
+                continue;
+            }
+            queued += other.tokens.size() - (other.state == SequenceState::Running ? other.kv.seq_len : 0);
+        }
+        const auto eta = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(static_cast<double>(queued) / prefill_tokens_per_s_));
+        if (seq.request.deadline - now < eta) seq.state = SequenceState::Rejected;
+    }
+    if (seq.state == SequenceState::Rejected) {
+        stats_.rejected++;
+    } else {
+        stats_.admitted++;
+    }
+    const std::uint64_t id = seq.id;
+    sequences_.emplace(id, std::move(seq));
+    return id;
+}
+
+const Scheduler::Sequence& Scheduler::sequence(std::uint64_t id) const {
+    const auto it = sequences_.find(id);
+    if (it == sequences_.end()) throw std::runtime_error("no sequence " + std::to_string(id));
+    return it->second;
+}
+
+void Scheduler::release(std::uint64_t id) {
+    const Sequence& seq = sequence(id);
+    if (seq.state != SequenceState::Finished && seq.state != SequenceState::Rejected) {
+        throw std::runtime_error("sequence " + std::to_string(id) + " is still live");
+    }
+    sequences_.erase(id);
+}
+
+std::size_t Scheduler::resident_bytes() const {
+    std::size_t bytes = 0;
+    for (const auto& [id, seq] : sequences_) {
+        if (seq.state != SequenceState::Running) continue;
+        for (std::size_t l = 0; l < seq.kv.k_cache.size(); ++l) {
+            bytes += (seq.kv.k_cache[l].capacity() + seq.kv.v_cache[l].capacity()) * sizeof(float);
+        }
+    }
+    return bytes;
+}
+
+bool Scheduler::more_urgent(const Sequence& a, const Sequence& b) const {
+    if (a.request.priority != b.request.priority) return a.request.priority > b.request.priority;
+    if (a.request.deadline != b.request.deadline) return a.request.deadline < b.request.deadline;
+    return a.id < b.id;
+}
+
+std::size_t Scheduler::pending(const Sequence& seq) const {
+    if (seq.state == SequenceState::Running) return seq.tokens.size() - seq.kv.seq_len;
+    if (seq.state == SequenceState::Swapped) return seq.tokens.size() - seq.swapped_len;
+    return seq.tokens.size();
+}
+
+bool Scheduler::step() {
+    std::vector<Sequence*> live;
+    for (auto& [id, seq] : sequences_) {
+        if (seq.state == SequenceState::Waiting || seq.state == SequenceState::Running ||
+            seq.state == SequenceState::Swapped) {
+            live.push_back(&seq);
+        }
+    }
+    if (live.empty()) return false;
+    std::sort(live.begin(), live.end(), [this](const Sequence* a, const Sequence* b) { return more_urgent(*a, *b); });
+
+    // the most urgent ones, as many as the token cap and the budget allow on their own
+    std::vector<std::pair<Sequence*, std::size_t>> picked;
+    std::size_t need = 0;
+    std::size_t tokens_left = options_.max_step_tokens ? options_.max_step_tokens : SIZE_MAX;
+    for (Sequence* seq : live) {
+        if (picked.size() == options_.max_running || tokens_left == 0) break;
+        const std::size_t feed = std::min({options_.prefill_chunk, pending(*seq), tokens_left});
+        const std::size_t bytes = reserved_bytes(*seq);
+        if (!picked.empty() && need + bytes > options_.kv_budget_bytes) break;
+        picked.emplace_back(seq, feed);
+        need += bytes;
+        tokens_left -= feed;
+    }
+
+    // make room among everyone else, least urgent and then longest idle first
+    std::vector<Sequence*> victims;
+    std::size_t others = 0;
+    for (Sequence* seq : live) {
+        const bool is_picked = std::any_of(picked.begin(), picked.end(), [seq](const auto& p) { return p.first == seq; });
+        if (seq->state == SequenceState::Running && !is_picked) {
+            victims.push_back(seq);
+            others += reserved_bytes(*seq);
+        }
+    }
+    std::sort(victims.begin(), victims.end(), [](const Sequence* a, const Sequence* b) {
+        if (a->request.priority != b->request.priority) return a->request.priority < b->request.priority;
+        return a->last_run < b->last_run;
+    });
+    for (Sequence* victim : victims) {
+        if (need + others <= options_.kv_budget_bytes) break;
+        others -= reserved_bytes(*victim);
+        preempt(*victim);
+    }
+
+    for (const auto& [seq, feed] : picked) advance(*seq, feed);
+    stats_.peak_resident_bytes = std::max(stats_.peak_resident_bytes, resident_bytes());
+
+    return std::any_of(sequences_.begin(), sequences_.end(), [](const auto& entry) {
+        const SequenceState state = entry.second.state;
+        return state != SequenceState::Finished && state != SequenceState::Rejected;
+    });
+}
+
+void Scheduler::run_until_idle() {
+    while (step()) {
+    }
+}
+
+void Scheduler::preempt(Sequence& seq) {
+    seq.preemptions++;
+    const std::size_t len = seq.kv.seq_len;
+    bool swap = options_.eviction == EvictionPolicy::Swap;
+    if (options_.eviction == EvictionPolicy::Auto) {
+        // out and back in again, against running the tokens through prefill once more
+        const double swap_s = 2.0 * static_cast<double>(kv_bytes(len)) / swap_bytes_per_s_;
+        const double recompute_s = static_cast<double>(len) / prefill_tokens_per_s_;
+        swap = swap_s < recompute_s;
+    }
+    if (swap) {
+        swap_out(seq);
+        return;
+    }
+    seq.kv = KVCache(num_layers_);
+    seq.state = SequenceState::Waiting;
+    stats_.recomputes++;
+    stats_.recomputed_tokens += len;
+}
+
+void Scheduler::swap_out(Sequence& seq) {
+    const auto start = Clock::now();
+    const std::size_t layer_bytes = seq.kv.seq_len * row_floats_ * sizeof(float);
+    const std::uint64_t bytes = kv_bytes(seq.kv.seq_len);
+    const std::uint64_t offset = allocate_swap(bytes);
+    for (std::size_t l = 0; l < num_layers_; ++l) {
+        write_all(swap_fd_, seq.kv.k_cache[l].data(), layer_bytes, offset + 2 * l * layer_bytes);
+        write_all(swap_fd_, seq.kv.v_cache[l].data(), layer_bytes, offset + (2 * l + 1) * layer_bytes);
+    }
+    update_rate(swap_bytes_per_s_, static_cast<double>(bytes), seconds_since(start));
+    seq.swap_offset = offset;
+    seq.swap_bytes = bytes;
+    seq.swapped_len = seq.kv.seq_len;
+    // a fresh cache, so the vectors' memory really goes back
+    seq.kv = KVCache(num_layers_);
+    seq.state = SequenceState::Swapped;
+    stats_.swap_outs++;
+    stats_.swap_bytes += bytes;
+}
+
+void Scheduler::swap_in(Sequence& seq) {
+    const auto start = Clock::now();
+    const std::size_t floats = seq.swapped_len * row_floats_;
+    const std::size_t layer_bytes = floats * sizeof(float);
+    for (std::size_t l = 0; l < num_layers_; ++l) {
+        seq.kv.k_cache[l].resize(floats);
+        seq.kv.v_cache[l].resize(floats);
+        read_all(swap_fd_, seq.kv.k_cache[l].data(), layer_bytes, seq.swap_offset + 2 * l * layer_bytes);
+        read_all(swap_fd_, seq.kv.v_cache[l].data(), layer_bytes, seq.swap_offset + (2 * l + 1) * layer_bytes);
+    }
+    update_rate(swap_bytes_per_s_, static_cast<double>(seq.swap_bytes), seconds_since(start));
+    seq.kv.seq_len = seq.swapped_len;
+    free_swap(seq.swap_offset, seq.swap_bytes);
+    seq.swap_bytes = 0;
+    seq.state = SequenceState::Running;
+    stats_.swap_ins++;
+}
+
+// The whole request's rows at once: growing by append would double the vectors and let
+// resident memory run up to twice what the budget counted.
+void Scheduler::reserve_kv(Sequence& seq) const {
+    const std::size_t floats = (seq.request.prompt.size() + seq.request.max_new_tokens) * row_floats_;
+    for (std::size_t l = 0; l < num_layers_; ++l) {
+        seq.kv.k_cache[l].reserve(floats);
+        seq.kv.v_cache[l].reserve(floats);
+    }
+}
+
+void Scheduler::advance(Sequence& seq, std::size_t feed) {
+    if (seq.state != SequenceState::Running) reserve_kv(seq);
+    if (seq.state == SequenceState::Swapped) swap_in(seq);
+    seq.state = SequenceState::Running;
+
+    // prefill, recompute after a preemption and decode are all just the tokens the cache
+    // hasn't seen yet, a chunk at a time
+    const std::size_t base = seq.kv.seq_len;
+    const bool last = feed == seq.tokens.size() - base;
+    const auto start = Clock::now();
+    model_.forward(std::span<const std::int32_t>(seq.tokens).subspan(base, feed),
+                   last ? std::span<float>(logits_) : std::span<float>(), seq.kv, buf_);
+    const Clock::time_point now = Clock::now();
+    if (feed > 1) update_rate(prefill_tokens_per_s_, static_cast<double>(feed), seconds_since(start));
+    seq.last_run = now;
+    if (!last) return;
+
+    const std::int32_t token = argmax(logits_);
+    seq.tokens.push_back(token);
+    seq.generated++;
+    seq.token_times.push_back(now);
+    if (seq.generated == 1 && now > seq.request.deadline) stats_.deadline_misses++;
+    if (seq.generated >= seq.request.max_new_tokens || token == seq.request.stop_token) {
+        seq.kv = KVCache(0);
+        seq.state = SequenceState::Finished;
+        stats_.finished++;
+    }
+}
+
+std::uint64_t Scheduler::allocate_swap(std::uint64_t bytes) {
+    // first fit, else grow the file
+    for (auto it = swap_free_.begin(); it != swap_free_.end(); ++it) {
+        if (it->second < bytes) continue;
+        const auto [offset, len] = *it;
+        swap_free_.erase(it);
+        if (len > bytes) swap_free_.emplace(offset + bytes, len - bytes);
+        return offset;
+    }
+    const std::uint64_t offset = swap_end_;
+    swap_end_ += bytes;
+    return offset;
+}
+
+void Scheduler::free_swap(std::uint64_t offset, std::uint64_t bytes) {
+    if (bytes == 0) return;
+    auto it = swap_free_.emplace(offset, bytes).first;
+    const auto next = std::next(it);
+    if (next != swap_free_.end() && it->first + it->second == next->first) {
+        it->second += next->second;
+        swap_free_.erase(next);
+    }
+    if (it != swap_free_.begin()) {
+        const auto prev = std::prev(it);
+        if (prev->first + prev->second == it->first) {
+            prev->second += it->second;
+            swap_free_.erase(it);
+        }
+    }
+}
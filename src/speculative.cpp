@@ -0,0 +1,74 @@
+#include "speculative.h"
+
+#include "kernels.h"
+#include "kv_cache.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+std::vector<std::int32_t> prompt_lookup_draft(std::span<const std::int32_t> context,
+                                              std::size_t max_ngram,
+                                              std::size_t min_ngram,
+                                              std::size_t num_draft) {
+    const std::size_t n = context.size();
+    min_ngram = std::max<std::size_t>(min_ngram, 1);
+    for (std::size_t ngram = std::min(max_ngram, n > 0 ? n - 1 : 0); ngram >= min_ngram; --ngram) {
+        const auto tail = context.subspan(n - ngram);
+        // scan backwards so the most recent match wins, it is the likeliest to be copied
+        for (std::size_t start = n - ngram; start-- > 0;) {
+            if (!std::equal(tail.begin(), tail.end(), context.begin() + start)) continue;
+            const std::size_t follow = start + ngram;
+            const std::size_t count = std::min(num_draft, n - follow);
+            return std::vector<std::int32_t>(context.begin() + follow,
+                                             context.begin() + follow + count);
+        }
+    }
+    return {};
+}
+
+double SpeculativeStats::acceptance_rate() const {
+    return drafted ? static_cast<double>(accepted) / static_cast<double>(drafted) : 0.0;
+}
+
+double SpeculativeStats::tokens_per_forward() const {
+    return forwards ? static_cast<double>(generated) / static_cast<double>(forwards) : 0.0;
+}
+
+PromptLookupDecoder::PromptLookupDecoder(const GPTOSSModel& model, KVCache& kv_cache,
+                                         std::size_t vocab_size, Options options)
+    : model_(model), kv_cache_(kv_cache), vocab_size_(vocab_size), options_(options) {}
+
+std::vector<std::int32_t> PromptLookupDecoder::step(std::span<const std::int32_t> context) {
+    if (context.empty()) {
+        throw std::runtime_error("speculative: empty context");
+    }
+    const std::vector<std::int32_t> draft =
+        prompt_lookup_draft(context, options_.max_ngram, options_.min_ngram, options_.num_draft);
+
+    input_.assign(1, context.back());
+    input_.insert(input_.end(), draft.begin(), draft.end());
+    logits_.resize(input_.size() * vocab_size_);
+
+    const std::size_t base_len = kv_cache_.seq_len;
+    model_.forward(input_, logits_, kv_cache_, buf_);
+
+    // row i holds the prediction for the token after input_[i]
+    std::vector<std::int32_t> out;
+    std::size_t accepted = 0;
+    for (;;) {
+        const std::int32_t predicted = argmax(
+            std::span<const float>(logits_.data() + accepted * vocab_size_, vocab_size_));
+        out.push_back(predicted);
+        if (accepted == draft.size() || predicted != draft[accepted]) break;
+        accepted++;
+    }
+
+    // keep [last, accepted drafts]; the bonus token is fed on the next step
+    kv_cache_.truncate(base_len + 1 + accepted);
+
+    stats_.forwards++;
+    stats_.drafted += draft.size();
+    stats_.accepted += accepted;
+    stats_.generated += out.size();
+    return out;
+}
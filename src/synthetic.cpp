@@ -0,0 +1,220 @@
+#include "synthetic.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "checkpoint.h"
+
+namespace {
+
+struct SyntheticTensor {
+    TensorKind kind;
+    int layer;
+    DType dtype;
+    std::vector<std::uint64_t> shape;
+    // bf16: values are uniform in [center - scale, center + scale]; u8 scales: E8M0 exponent
+    // around `center`; u8 blocks: random bytes
+    float center;
+    float scale;
+
+    std::uint64_t byte_size() const {
+        std::uint64_t n = dtype == DType::BF16 ? 2 : 1;
+        for (std::uint64_t d : shape) n *= d;
+        return n;
+    }
+};
+
+std::uint16_t to_bf16(float f) {
+    std::uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    return static_cast<std::uint16_t>(bits >> 16);
+}
+
+// 1/sqrt(fan_in) keeps each projection's output on the scale of its input
+float fan_in_scale(std::size_t fan_in) { return 1.0f / std::sqrt(static_cast<float>(fan_in)); }
+
+// E8M0 exponent whose block scale times the FP4 magnitudes (up to 6) is about fan_in_scale
+float mxfp4_exponent(std::size_t fan_in) {
+    return 127.0f + std::round(std::log2(fan_in_scale(fan_in) / 3.0f));
+}
+
+std::vector<SyntheticTensor> synthetic_tensors(const ModelConfig& c) {
+    const std::uint64_t hidden = c.hidden_size, inter = c.intermediate_size, experts = c.num_experts;
+    const std::uint64_t q_dim = c.num_attention_heads * c.head_dim;
+    const std::uint64_t qkv_dim = q_dim + 2 * c.num_key_value_heads * c.head_dim;
+    std::vector<SyntheticTensor> t;
+    t.push_back({TensorKind::Embedding, -1, DType::BF16, {c.vocab_size, hidden}, 0.0f, 1.0f});
+    for (int l = 0; l < static_cast<int>(c.num_hidden_layers); ++l) {
+        t.push_back({TensorKind::AttnNorm, l, DType::BF16, {hidden}, 1.0f, 0.1f});
+        t.push_back({TensorKind::AttnQkvWeight, l, DType::BF16, {qkv_dim, hidden}, 0.0f, fan_in_scale(hidden)});
+        t.push_back({TensorKind::AttnQkvBias, l, DType::BF16, {qkv_dim}, 0.0f, 0.02f});
+        t.push_back({TensorKind::AttnSinks, l, DType::BF16, {c.num_attention_heads}, 0.0f, 1.0f});
+        t.push_back({TensorKind::AttnOutWeight, l, DType::BF16, {hidden, q_dim}, 0.0f, fan_in_scale(q_dim)});
+        t.push_back({TensorKind::AttnOutBias, l, DType::BF16, {hidden}, 0.0f, 0.02f});
+        t.push_back({TensorKind::MlpNorm, l, DType::BF16, {hidden}, 1.0f, 0.1f});
+        t.push_back({TensorKind::MlpGateWeight, l, DType::BF16, {experts, hidden}, 0.0f, fan_in_scale(hidden)});
+        t.push_back({TensorKind::MlpGateBias, l, DType::BF16, {experts}, 0.0f, 0.02f});
+        t.push_back({TensorKind::Mlp1Blocks, l, DType::U8, {experts, 2 * inter, hidden / 32, 16}, 0.0f, 0.0f});
+        t.push_back({TensorKind::Mlp1Scales, l, DType::U8, {experts, 2 * inter, hidden / 32},
+                     mxfp4_exponent(hidden), 0.0f});
+        t.push_back({TensorKind::Mlp1Bias, l, DType::BF16, {experts, 2 * inter}, 0.0f, 0.02f});
+        t.push_back({TensorKind::Mlp2Blocks, l, DType::U8, {experts, hidden, inter / 32, 16}, 0.0f, 0.0f});
+        t.push_back({TensorKind::Mlp2Scales, l, DType::U8, {experts, hidden, inter / 32},
+                     mxfp4_exponent(inter), 0.0f});
+        t.push_back({TensorKind::Mlp2Bias, l, DType::BF16, {experts, hidden}, 0.0f, 0.02f});
+    }
+    t.push_back({TensorKind::Norm, -1, DType::BF16, {hidden}, 1.0f, 0.1f});
+    t.push_back({TensorKind::Unembedding, -1, DType::BF16, {c.vocab_size, hidden}, 0.0f, fan_in_scale(hidden)});
+    return t;
+}
+
+void write_tensor(std::ofstream& out, const SyntheticTensor& t, SyntheticRng& rng) {
+    constexpr std::size_t kChunk = std::size_t{1} << 20;
+    std::vector<char> buf;
+    std::uint64_t remaining = t.byte_size();
+    while (remaining > 0) {
+        const std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(remaining, kChunk));
+        buf.resize(n);
+        if (t.dtype == DType::BF16) {
+            for (std::size_t i = 0; i + 1 < n; i += 2) {
+                const std::uint16_t v = to_bf16(t.center + t.scale * rng.uniform());
+                std::memcpy(buf.data() + i, &v, 2);
+            }
+        } else if (t.center > 0.0f) {
+            // block scales jitter by one step around the target exponent
+            for (std::size_t i = 0; i < n; ++i) {
+                buf[i] = static_cast<char>(static_cast<int>(t.center) - 1 + static_cast<int>(rng.next() % 3));
+            }
+        } else {
+            for (std::size_t i = 0; i < n; ++i) buf[i] = static_cast<char>(rng.next());
+        }
+        out.write(buf.data(), static_cast<std::streamsize>(n));
+        remaining -= n;
+    }
+}
+
+}  // namespace
+
+std::vector<float> random_floats(SyntheticRng& rng, std::size_t n, float scale) {
+    std::vector<float> v(n);
+    for (float& x : v) x = scale * rng.uniform();
+    return v;
+}
+
+std::vector<std::uint16_t> random_bf16(SyntheticRng& rng, std::size_t n, float scale) {
+    std::vector<std::uint16_t> v(n);
+    for (auto& x : v) x = to_bf16(scale * rng.uniform());
+    return v;
+}
+
+std::vector<std::uint8_t> random_bytes(SyntheticRng& rng, std::size_t n, int lo, int hi) {
+    std::vector<std::uint8_t> v(n);
+    const auto range = static_cast<std::uint64_t>(hi - lo + 1);
+    for (auto& x : v) x = static_cast<std::uint8_t>(lo + static_cast<int>(rng.next() % range));
+    return v;
+}
+
+std::vector<std::int32_t> synthetic_tokens(std::size_t n, std::size_t vocab, std::size_t seed) {
+    std::vector<std::int32_t> tokens(n);
+    for (std::size_t i = 0; i < n; i++) tokens[i] = static_cast<std::int32_t>(((i + seed * 7) * 2654435761u) % vocab);
+    return tokens;
+}
+
+ModelConfig synthetic_config() {
+    ModelConfig c = ModelConfig::gpt_oss_20b();
+    c.num_hidden_layers = 2;
+    c.num_experts = 4;
+    c.experts_per_token = 2;
+    c.vocab_size = 4096;
+    c.hidden_size = 256;
+    c.intermediate_size = 256;
+    c.head_dim = 64;
+    c.num_attention_heads = 8;
+    c.num_key_value_heads = 2;
+    return c;
+}
+
+void write_synthetic_checkpoint(const std::string& dir, const ModelConfig& config, std::uint64_t seed) {
+    if (config.hidden_size % 32 != 0 || config.intermediate_size % 32 != 0) {
+        throw std::runtime_error("synthetic checkpoint: hidden and intermediate sizes must be multiples of 32");
+    }
+    std::filesystem::create_directories(dir);
+    const auto tensors = synthetic_tensors(config);
+
+    std::string header = "{\"__metadata__\": {\"format\": \"pt\"}";
+    std::uint64_t offset = 0;
+    for (const auto& t : tensors) {
+        header += ", \"" + tensor_name(t.kind, t.layer) + "\": {\"dtype\": \"" +
+                  (t.dtype == DType::BF16 ? "BF16" : "U8") + "\", \"shape\": [";
+        for (std::size_t i = 0; i < t.shape.size(); ++i) {
+            header += (i ? ", " : "") + std::to_string(t.shape[i]);
+        }
+        header += "], \"data_offsets\": [" + std::to_string(offset) + ", " +
+                  std::to_string(offset + t.byte_size()) + "]}";
+        offset += t.byte_size();
+    }
+    header += "}";
+    // the data section starts 8-byte aligned, same as the reference writer
+    header.append((8 - header.size() % 8) % 8, ' ');
+
+    const std::string path = (std::filesystem::path(dir) / "model.safetensors").string();
+    std::ofstream out(path, std::ios::binary);
+    if (!out) throw std::runtime_error("failed to write " + path);
+    const std::uint64_t header_len = header.size();
+    out.write(reinterpret_cast<const char*>(&header_len), 8);
+    out.write(header.data(), static_cast<std::streamsize>(header.size()));
+    SyntheticRng rng{seed};
+    for (const auto& t : tensors) write_tensor(out, t, rng);
+    if (!out) throw std::runtime_error("failed to write " + path);
+
+    config.save((std::filesystem::path(dir) / "config.json").string());
+}
+
+SyntheticModel::SyntheticModel(const std::string& model_path, const std::string& config_path,
+                               std::string owned_dir, const ModelOptions& options)
+    : path_(model_path), owned_dir_(std::move(owned_dir)) {
+    try {
+        checkpoint_ = std::make_unique<Checkpoint>(path_);
+        config_ = ModelConfig::locate(config_path, path_, checkpoint_->num_layers());
+        model_ = std::make_unique<GPTOSSModel>(*checkpoint_, config_, options);
+    } catch (...) {
+        checkpoint_.reset();
+        if (!owned_dir_.empty()) std::filesystem::remove_all(owned_dir_);
+        throw;
+    }
+}
+
+SyntheticModel::~SyntheticModel() {
+    // the model holds views into the checkpoint's mapping
+    model_.reset();
+    checkpoint_.reset();
+    if (!owned_dir_.empty()) {
+        std::error_code ec;
+        std::filesystem::remove_all(owned_dir_, ec);
+    }
+}
+
+SyntheticModel make_synthetic_model(const std::string& name, std::size_t layers, std::uint64_t seed) {
+    ModelConfig shape = synthetic_config();
+    shape.num_hidden_layers = layers;
+    const std::string dir = (std::filesystem::temp_directory_path() / name).string();
+    write_synthetic_checkpoint(dir, shape, seed);
+    return SyntheticModel(dir, "", dir);
+}
+
+SyntheticModel open_model_or_synthetic(const std::string& model_path, const std::string& config_path,
+                                       const std::string& name, const ModelConfig& shape,
+                                       const ModelOptions& options) {
+    if (!model_path.empty()) return SyntheticModel(model_path, config_path, "", options);
+    const std::string dir = (std::filesystem::temp_directory_path() / name).string();
+    write_synthetic_checkpoint(dir, shape);
+    return SyntheticModel(dir, "", dir, options);
+}
@@ -1,180 +1,351 @@
 #include "tokenizer.h"
 
-#include <array>
+#include "harmony.h"
+#include "pretokenizer.h"
+
+#include <algorithm>
 #include <cstdint>
-#include <fstream>
 #include <limits>
 #include <memory>
 #include <stdexcept>
 #include <string_view>
 
-// regex engine that supports unicode cuz std::regex is only ECMAScript
-#include <unicode/regex.h>
-#include <unicode/unistr.h>
-
 namespace {
 
-// this is taken from the tiktoken repo
-constexpr const char* kO200kPatStr =
-    "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+(?i:'s|'t|'re|'ve|'m|'ll|'d)?"
-    "|[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*(?i:'s|'t|'re|'ve|'m|'ll|'d)?"
-    "|\\p{N}{1,3}"
-    "| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*"
-    "|\\s*[\\r\\n]+"
-    "|\\s+(?!\\S)"
-    "|\\s+";
-
-std::string base64_decode(std::string_view input) {
-    static const std::array<int8_t, 256> table = [] {
-        std::array<int8_t, 256> t{};
-        t.fill(-1);
-        for (int i = 0; i < 26; ++i) t[static_cast<uint8_t>('A' + i)] = static_cast<int8_t>(i);
-        for (int i = 0; i < 26; ++i) t[static_cast<uint8_t>('a' + i)] = static_cast<int8_t>(26 + i);
-        for (int i = 0; i < 10; ++i) t[static_cast<uint8_t>('0' + i)] = static_cast<int8_t>(52 + i);
-        t[static_cast<uint8_t>('+')] = 62;
-        t[static_cast<uint8_t>('/')] = 63;
-        return t;
-    }();
-
-    std::string output;
-    unsigned int buffer = 0;
-    int bits_collected = 0;
-    output.reserve(input.size() * 3 / 4);
-    for (char c : input) {
-        if (c == '=') break;
-        int8_t val = table[c];
-        if (val == -1) {
-            throw std::invalid_argument("base64: invalid input character");
-        }
-        buffer = (buffer << 6) | val;
-        bits_collected += 6;
-        if (bits_collected >= 8) {
-            bits_collected -= 8;
-            output.push_back(static_cast<char>((buffer >> bits_collected) & 0xFF));
-        }
+// only short pieces are worth caching, long whitespace/number runs rarely repeat
+constexpr std::size_t kMaxCachedPieceBytes = 32;
+constexpr std::uint32_t kDead = std::numeric_limits<std::uint32_t>::max();
+
+struct MergeCandidate {
+    std::int32_t rank;
+    std::uint32_t left;  // byte offset of the left symbol
+    std::uint32_t end;   // byte offset one past the right symbol
+};
+
+// min-heap on (rank, left): lowest rank first, leftmost among equal ranks
+struct MergeCandidateGreater {
+    bool operator()(const MergeCandidate& a, const MergeCandidate& b) const {
+        return a.rank != b.rank ? a.rank > b.rank : a.left > b.left;
+    }
+};
+
+// Length of the longest prefix of s that doesn't end inside a UTF-8 sequence. Only a
+// trailing lead byte still waiting for its continuation bytes is held back; stray
+// continuation bytes are invalid anyway and are released as-is.
+std::size_t utf8_complete_prefix(std::string_view s) {
+    const std::size_t n = s.size();
+    for (std::size_t back = 1; back <= 4 && back <= n; ++back) {
+        const auto c = static_cast<unsigned char>(s[n - back]);
+        if ((c & 0xC0) == 0x80) continue;
+        const std::size_t need = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+        return need > back ? n - back : n;
     }
-    return output;
+    return n;
 }
 
+// per-thread merge state, reused across pieces:
+// symbol starting at offset i spans [i, t_next[i]); t_next[i] == kDead once merged away
+thread_local std::vector<std::uint32_t> t_next;
+thread_local std::vector<std::uint32_t> t_prev;
+thread_local std::vector<MergeCandidate> t_heap;
+thread_local std::vector<std::string_view> t_pieces;
+
 }  // namespace
 
-Tokenizer::Tokenizer(const std::string& path) : path_(path) {
-    std::ifstream file(path_);
-    std::string line;
-    while (std::getline(file, line)) {
-        if (line.empty()) break;
-        int space_idx = line.find(' ');
-        std::string_view b64_token(line.data(), space_idx);
-        const std::int32_t token_id = std::stoi(line.substr(space_idx + 1));
-        std::string token = base64_decode(b64_token);
-        token_to_id_[token] = token_id;
-        id_to_token_.push_back(std::move(token));
+bool BpeCache::lookup(std::string_view piece, std::vector<std::int32_t>& out) {
+    Shard& shard = shard_for(piece);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(piece);
+    if (it == shard.index.end()) return false;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    const auto& ids = it->second->second;
+    out.insert(out.end(), ids.begin(), ids.end());
+    return true;
+}
+
+void BpeCache::insert(std::string_view piece, const std::int32_t* ids, std::size_t count) {
+    Shard& shard = shard_for(piece);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard_capacity_ == 0 || shard.index.count(piece)) return;
+    if (shard.lru.size() >= shard_capacity_) {
+        shard.index.erase(shard.lru.back().first);
+        shard.lru.pop_back();
     }
+    shard.lru.emplace_front(std::string(piece), std::vector<std::int32_t>(ids, ids + count));
+    shard.index.emplace(shard.lru.front().first, shard.lru.begin());
 }
 
-Tokenizer::~Tokenizer() = default;
+Tokenizer::Tokenizer(const std::string& path) : path_(path), vocab_(path) {
+    for (std::int32_t id = harmony::kFirstSpecial; id <= harmony::kLastSpecial; ++id) {
+        special_names_.push_back(harmony::special_token_name(id));
+    }
+    for (std::size_t i = 0; i < special_names_.size(); ++i) {
+        special_to_id_.emplace(special_names_[i], harmony::kFirstSpecial + static_cast<std::int32_t>(i));
+        max_special_len_ = std::max(max_special_len_, special_names_[i].size());
+    }
+}
 
-std::vector<std::int32_t> Tokenizer::encode(std::string text) const {
-    if (text.empty()) return {};
+Tokenizer::~Tokenizer() = default;
 
-    // throw error if special token found for now
-    auto start = text.find("<|");
-    if (start != std::string::npos) {
-        auto end = text.find("|>", start + 2);
-        if (end != std::string::npos) {
-            throw std::runtime_error("special token handling to be implemneted");
+std::vector<std::int32_t> Tokenizer::encode(std::string_view text, bool allow_special) const {
+    std::vector<std::int32_t> token_ids;
+    for (const Segment& seg : segment(text, allow_special)) {
+        if (seg.special >= 0) {
+            token_ids.push_back(seg.special);
+        } else {
+            encode_ordinary(seg.text, token_ids);
         }
     }
+    return token_ids;
+}
+
+std::vector<std::vector<std::int32_t>> Tokenizer::encode_batch(
+    std::span<const std::string_view> texts, bool allow_special) const {
+    std::vector<std::vector<std::int32_t>> results(texts.size());
+#pragma omp parallel for schedule(dynamic, 1)
+    for (std::size_t i = 0; i < texts.size(); ++i) {
+        results[i] = encode(texts[i], allow_special);
+    }
+    return results;
+}
 
+std::vector<std::int32_t> Tokenizer::encode_large(std::string_view text, std::size_t chunk_bytes,
+                                                  bool allow_special) const {
+    const std::vector<Segment> segs = segment(text, allow_special, chunk_bytes);
+    std::vector<std::vector<std::int32_t>> parts(segs.size());
+#pragma omp parallel for schedule(dynamic, 1) if (segs.size() > 1)
+    for (std::size_t i = 0; i < segs.size(); ++i) {
+        if (segs[i].special >= 0) {
+            parts[i].push_back(segs[i].special);
+        } else {
+            encode_ordinary(segs[i].text, parts[i]);
+        }
+    }
 
+    std::size_t total = 0;
+    for (const auto& part : parts) total += part.size();
     std::vector<std::int32_t> token_ids;
-    auto pieces = regex_split(text, kO200kPatStr);
-    for (const auto& piece : pieces) {
-        auto piece_tokens = bpe_encode_piece(piece);
-        token_ids.insert(token_ids.end(), piece_tokens.begin(), piece_tokens.end());
-    }
+    token_ids.reserve(total);
+    for (const auto& part : parts) token_ids.insert(token_ids.end(), part.begin(), part.end());
     return token_ids;
 }
 
+std::size_t Tokenizer::count_tokens(std::string_view text, bool allow_special) const {
+    const std::vector<Segment> segs = segment(text, allow_special, kLargeChunkBytes);
+    std::size_t total = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+ : total) if (segs.size() > 1)
+    for (std::size_t i = 0; i < segs.size(); ++i) {
+        total += segs[i].special >= 0 ? 1 : count_ordinary(segs[i].text);
+    }
+    return total;
+}
+
+std::vector<std::size_t> Tokenizer::count_tokens_batch(std::span<const std::string_view> texts,
+                                                       bool allow_special) const {
+    std::vector<std::size_t> counts(texts.size());
+#pragma omp parallel for schedule(dynamic, 1)
+    for (std::size_t i = 0; i < texts.size(); ++i) {
+        counts[i] = count_tokens(texts[i], allow_special);
+    }
+    return counts;
+}
+
+std::vector<Tokenizer::Segment> Tokenizer::segment(std::string_view text, bool allow_special,
+                                                   std::size_t split_chunk_bytes) const {
+    std::vector<Segment> segs;
+    auto add_ordinary = [&](std::string_view run) {
+        if (split_chunk_bytes == 0) {
+            if (!run.empty()) segs.push_back({run, -1});
+            return;
+        }
+        std::size_t start = 0;
+        while (start < run.size()) {
+            std::size_t end = run.size();
+            if (run.size() - start > split_chunk_bytes) {
+                end = o200k_next_boundary(run, start + split_chunk_bytes);
+            }
+            segs.push_back({run.substr(start, end - start), -1});
+            start = end;
+        }
+    };
+
+    // find() on '<' is a memchr, so ordinary text is skipped at SIMD speed and only
+    // "<|" ... "|>" candidates are looked up in the special table. The closing "|>" is
+    // only looked for within the longest special name, so runs of "<|" stay linear.
+    std::size_t run_start = 0;
+    std::size_t pos = 0;
+    while ((pos = text.find("<|", pos)) != std::string_view::npos) {
+        const std::size_t close = text.substr(0, pos + max_special_len_).find("|>", pos + 2);
+        if (close == std::string_view::npos) {
+            pos += 2;
+            continue;
+        }
+        auto it = special_to_id_.find(text.substr(pos, close + 2 - pos));
+        if (it == special_to_id_.end()) {
+            pos += 2;
+            continue;
+        }
+        if (!allow_special) {
+            throw std::runtime_error("tokenizer: text contains special token " + std::string(it->first) +
+                                     " (encode with allow_special to use it)");
+        }
+        add_ordinary(text.substr(run_start, pos - run_start));
+        segs.push_back({text.substr(pos, close + 2 - pos), it->second});
+        pos = run_start = close + 2;
+    }
+    add_ordinary(text.substr(run_start));
+    return segs;
+}
+
+void Tokenizer::encode_ordinary(std::string_view text, std::vector<std::int32_t>& out) const {
+    t_pieces.clear();
+    o200k_pretokenize(text, t_pieces);
+    for (std::string_view piece : t_pieces) {
+        bpe_encode_piece(piece, out);
+    }
+}
+
+std::size_t Tokenizer::count_ordinary(std::string_view text) const {
+    t_pieces.clear();
+    o200k_pretokenize(text, t_pieces);
+    std::size_t count = 0;
+    for (std::string_view piece : t_pieces) {
+        count += bpe_count_piece(piece);
+    }
+    return count;
+}
+
 std::string Tokenizer::decode(std::int32_t token) const {
-    if (token < 0 || static_cast<std::size_t>(token) >= id_to_token_.size()) {
+    return std::string(token_bytes(token));
+}
+
+std::string Tokenizer::decode(std::span<const std::int32_t> tokens) const {
+    std::size_t total = 0;
+    for (std::int32_t token : tokens) total += token_bytes(token).size();
+    std::string out;
+    out.reserve(total);
+    for (std::int32_t token : tokens) out += token_bytes(token);
+    return out;
+}
+
+std::string_view Tokenizer::token_bytes(std::int32_t token) const {
+    if (token >= harmony::kFirstSpecial && token <= harmony::kLastSpecial) {
+        return special_names_[token - harmony::kFirstSpecial];
+    }
+    if (token < 0 || static_cast<std::size_t>(token) >= vocab_.size()) {
         return "<unk>";
     }
-    return id_to_token_[token];
+    return vocab_.token(token);
 }
 
+std::vector<std::string_view> Tokenizer::ordinary_tokens() const {
+    std::vector<std::string_view> out(vocab_.size());
+    for (std::size_t id = 0; id < out.size(); ++id) out[id] = vocab_.token(static_cast<std::int32_t>(id));
+    return out;
+}
+
+#ifdef GPTOSS_HAVE_ICU
 std::vector<std::string> Tokenizer::regex_split(
     const std::string& text,
     const std::string& pattern) const {
-    UErrorCode status = U_ZERO_ERROR;
-    icu::UnicodeString pattern_u = icu::UnicodeString::fromUTF8(pattern);
-    std::unique_ptr<icu::RegexPattern> re(icu::RegexPattern::compile(pattern_u, 0, status));
-    if (U_FAILURE(status)) {
-        throw std::runtime_error("tokenizer: failed to compile ICU regex");
+    return icu_regex_split(text, pattern);
+}
+#endif
+
+// Byte-pair merge over a linked list of symbols keyed by byte offset. Candidate pairs
+// sit in a min-heap by rank and are lazily invalidated, so a piece of n bytes costs
+// O(n log n) with no per-pair string allocations.
+void Tokenizer::bpe_merge(std::string_view piece) const {
+    const auto n = static_cast<std::uint32_t>(piece.size());
+    auto& next = t_next;
+    auto& prev = t_prev;
+    auto& heap = t_heap;
+    next.resize(n);
+    prev.resize(n);
+    heap.clear();
+    for (std::uint32_t i = 0; i < n; ++i) {
+        next[i] = i + 1;
+        prev[i] = i == 0 ? kDead : i - 1;
     }
 
-    icu::UnicodeString text_u = icu::UnicodeString::fromUTF8(text);
-    std::unique_ptr<icu::RegexMatcher> matcher(re->matcher(text_u, status));
-    if (U_FAILURE(status)) {
-        throw std::runtime_error("tokenizer: failed to create ICU matcher");
+    auto push_pair = [&](std::uint32_t left) {
+        const std::uint32_t mid = next[left];
+        if (mid >= n) return;
+        const std::uint32_t end = next[mid];
+        const std::int32_t rank = vocab_.rank(piece.substr(left, end - left));
+        // pair does not exist
+        if (rank < 0) return;
+        heap.push_back({rank, left, end});
+        std::push_heap(heap.begin(), heap.end(), MergeCandidateGreater{});
+    };
+
+    for (std::uint32_t i = 0; i + 1 < n; ++i) push_pair(i);
+
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), MergeCandidateGreater{});
+        const MergeCandidate best = heap.back();
+        heap.pop_back();
+
+        // stale if either side was merged into something else since it was pushed
+        if (next[best.left] == kDead) continue;
+        const std::uint32_t mid = next[best.left];
+        if (mid >= n || next[mid] != best.end) continue;
+
+        next[best.left] = best.end;
+        next[mid] = kDead;
+        if (best.end < n) prev[best.end] = best.left;
+
+        if (prev[best.left] != kDead) push_pair(prev[best.left]);
+        push_pair(best.left);
     }
+}
 
-    std::vector<std::string> pieces;
-    while (matcher->find(status)) {
-        if (U_FAILURE(status)) {
-            throw std::runtime_error("tokenizer: ICU regex match failed");
-        }
-        icu::UnicodeString match = matcher->group(status);
-        if (U_FAILURE(status)) {
-            throw std::runtime_error("tokenizer: ICU regex group failed");
-        }
-        std::string out;
-        match.toUTF8String(out);
-        pieces.push_back(out);
-    }
-    return pieces;
-}
-
-std::vector<std::int32_t> Tokenizer::bpe_encode_piece(const std::string& piece) const {
-    if (piece.empty()) return {};
-    std::vector<std::string> symbols;
-    symbols.reserve(piece.size());
-    for (unsigned char c : piece) {
-        // fill constructor works best here
-        // allows for converting char to string whilst perfect forwarding
-        symbols.emplace_back(1, static_cast<char>(c));
-    }
-
-    while (symbols.size() > 1) {
-        std::int32_t best_rank = std::numeric_limits<std::int32_t>::max();
-        size_t best_idx = 0;
-
-        for (size_t i = 0; i + 1 < symbols.size(); ++i) {
-            std::string merged = symbols[i] + symbols[i + 1];
-            auto it = token_to_id_.find(merged);
-            // pair does not exist
-            if (it == token_to_id_.end()) continue;
-            // greedily merge the lowest rank
-            if (it->second < best_rank) {
-                best_rank = it->second;
-                best_idx = i;
-            }
-        }
-        
-        // no pairs found
-        if (best_rank == std::numeric_limits<std::int32_t>::max()) break;
-        symbols[best_idx] += symbols[best_idx + 1];
-        symbols.erase(symbols.begin() + best_idx + 1);
+void Tokenizer::bpe_encode_piece(std::string_view piece, std::vector<std::int32_t>& out) const {
+    if (piece.empty()) return;
+    // most pieces are whole tokens already
+    if (const std::int32_t id = vocab_.rank(piece); id >= 0) {
+        out.push_back(id);
+        return;
     }
+    const bool cacheable = piece.size() <= kMaxCachedPieceBytes;
+    if (cacheable && cache_.lookup(piece, out)) return;
 
-    std::vector<std::int32_t> token_ids;
-    token_ids.reserve(symbols.size());
-    for (const auto& sym : symbols) {
-        auto it = token_to_id_.find(sym);
-        if (it == token_to_id_.end()) {
+    bpe_merge(piece);
+    const std::size_t first = out.size();
+    for (std::uint32_t i = 0; i < piece.size(); i = t_next[i]) {
+        const std::int32_t id = vocab_.rank(piece.substr(i, t_next[i] - i));
+        if (id < 0) {
             throw std::runtime_error("tokenizer: missing token for symbol");
         }
-        token_ids.push_back(it->second);
+        out.push_back(id);
     }
-    return token_ids;
+    if (cacheable) cache_.insert(piece, out.data() + first, out.size() - first);
+}
+
+std::size_t Tokenizer::bpe_count_piece(std::string_view piece) const {
+    if (piece.empty()) return 0;
+    if (vocab_.rank(piece) >= 0) return 1;
+    bpe_merge(piece);
+    std::size_t count = 0;
+    for (std::uint32_t i = 0; i < piece.size(); i = t_next[i]) count++;
+    return count;
+}
+
+std::string_view DetokenizerState::push(std::int32_t token) {
+    // everything before emitted_ was handed out last call, at most 3 bytes remain
+    buffer_.erase(0, emitted_);
+    buffer_ += tokenizer_.token_bytes(token);
+    emitted_ = utf8_complete_prefix(buffer_);
+    return std::string_view(buffer_).substr(0, emitted_);
+}
+
+std::string_view DetokenizerState::flush() {
+    buffer_.erase(0, emitted_);
+    emitted_ = buffer_.size();
+    return buffer_;
+}
+
+void DetokenizerState::reset() {
+    buffer_.clear();
+    emitted_ = 0;
 }
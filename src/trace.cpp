@@ -0,0 +1,281 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace trace {
+namespace {
+
+constexpr int kNumCounters = 3;  // cycles, instructions, LLC misses
+
+struct Event {
+    const char* name;
+    std::uint64_t start_ns;
+    std::uint64_t dur_ns;
+    std::uint64_t counters[kNumCounters];
+};
+
+// Written only by its owning thread; dumps read it after stop().
+struct Ring {
+    std::vector<Event> events;
+    std::atomic<std::size_t> written{0};
+    std::uint32_t tid{0};
+    // group leader (cycles) first; closed when the owning thread exits
+    int perf_fds[kNumCounters]{-1, -1, -1};
+    bool counters{false};
+};
+
+std::atomic<bool> g_active{false};
+std::atomic<bool> g_counters_active{false};
+Options g_options;
+std::chrono::steady_clock::time_point g_epoch = std::chrono::steady_clock::now();
+std::mutex g_mutex;
+std::vector<std::unique_ptr<Ring>> g_rings;
+thread_local Ring* t_ring = nullptr;
+
+std::uint64_t now_ns() {
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - g_epoch).count());
+}
+
+#if defined(__linux__)
+int open_counter(std::uint64_t config, int group_fd) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group_fd == -1 ? 1 : 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0));
+}
+
+void close_counter_group(int* fds) {
+    for (int i = 0; i < kNumCounters; ++i) {
+        if (fds[i] >= 0) close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+// one group per thread so a single read() returns all three. Every member is its own
+// fd, so a partial group gets all of them closed, not just the leader.
+bool open_counter_group(int* fds) {
+    constexpr std::uint64_t kConfigs[kNumCounters] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES};
+    for (int i = 0; i < kNumCounters; ++i) {
+        fds[i] = open_counter(kConfigs[i], i == 0 ? -1 : fds[0]);
+        if (fds[i] < 0) {
+            close_counter_group(fds);
+            return false;
+        }
+    }
+    ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+}
+
+void read_counters(const Ring* ring, std::uint64_t* out) {
+    if (ring->perf_fds[0] < 0) return;
+    struct {
+        std::uint64_t nr;
+        std::uint64_t values[kNumCounters];
+    } group{};
+    if (read(ring->perf_fds[0], &group, sizeof(group)) == static_cast<ssize_t>(sizeof(group))) {
+        std::copy(group.values, group.values + kNumCounters, out);
+    }
+}
+#else
+void close_counter_group(int*) {}
+bool open_counter_group(int*) { return false; }
+void read_counters(const Ring*, std::uint64_t*) {}
+#endif
+
+// the ring itself outlives its thread so dumps still see the events; the counter fds don't
+struct CounterCloser {
+    ~CounterCloser() {
+        if (t_ring) close_counter_group(t_ring->perf_fds);
+    }
+};
+
+Ring* thread_ring() {
+    if (t_ring) return t_ring;
+    auto ring = std::make_unique<Ring>();
+    ring->events.resize(std::max<std::size_t>(g_options.ring_capacity, 1));
+    if (g_options.hardware_counters && open_counter_group(ring->perf_fds)) {
+        thread_local CounterCloser closer;
+        ring->counters = true;
+        g_counters_active.store(true, std::memory_order_relaxed);
+    }
+    std::lock_guard<std::mutex> lock(g_mutex);
+    ring->tid = static_cast<std::uint32_t>(g_rings.size() + 1);
+    t_ring = ring.get();
+    g_rings.push_back(std::move(ring));
+    return t_ring;
+}
+
+// events of one ring in recording order
+std::vector<const Event*> ring_events(const Ring& ring) {
+    const std::size_t written = ring.written.load(std::memory_order_acquire);
+    const std::size_t cap = ring.events.size();
+    const std::size_t n = std::min(written, cap);
+    std::vector<const Event*> out;
+    out.reserve(n);
+    for (std::size_t i = written - n; i < written; ++i) out.push_back(&ring.events[i % cap]);
+    return out;
+}
+
+void write_json_string(std::ostream& os, const char* s) {
+    os << '"';
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') os << '\\';
+        os << *s;
+    }
+    os << '"';
+}
+
+}  // namespace
+
+void start(const Options& options) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    // rings already handed out keep their size; a new capacity applies to new threads
+    g_options = options;
+    g_active.store(true, std::memory_order_release);
+}
+
+void stop() { g_active.store(false, std::memory_order_release); }
+
+bool active() { return g_active.load(std::memory_order_relaxed); }
+
+bool hardware_counters_active() { return g_counters_active.load(std::memory_order_relaxed); }
+
+void clear() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    for (auto& ring : g_rings) ring->written.store(0, std::memory_order_release);
+}
+
+std::size_t event_count() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    std::size_t n = 0;
+    for (const auto& ring : g_rings) n += std::min(ring->written.load(), ring->events.size());
+    return n;
+}
+
+Zone::Zone(const char* name) : name_(name) {
+    if (!g_active.load(std::memory_order_relaxed)) return;
+    recording_ = true;
+    read_counters(thread_ring(), start_counters_);
+    start_ns_ = now_ns();
+}
+
+Zone::~Zone() {
+    if (!recording_) return;
+    const std::uint64_t end_ns = now_ns();
+    Ring* ring = t_ring;
+    std::uint64_t end_counters[kNumCounters]{};
+    read_counters(ring, end_counters);
+    const std::size_t slot = ring->written.load(std::memory_order_relaxed);
+    Event& e = ring->events[slot % ring->events.size()];
+    e.name = name_;
+    e.start_ns = start_ns_;
+    e.dur_ns = end_ns - start_ns_;
+    for (int i = 0; i < kNumCounters; ++i) e.counters[i] = end_counters[i] - start_counters_[i];
+    ring->written.store(slot + 1, std::memory_order_release);
+}
+
+void write_chrome_json(const std::string& path) {
+    std::ofstream out(path);
+    if (!out) throw std::runtime_error("failed to write trace: " + path);
+    const bool counters = hardware_counters_active();
+    std::lock_guard<std::mutex> lock(g_mutex);
+    out << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+    bool first = true;
+    for (const auto& ring : g_rings) {
+        out << (first ? "" : ",\n") << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": " << ring->tid
+            << ", \"args\": {\"name\": \"thread " << ring->tid << "\"}}";
+        first = false;
+        for (const Event* e : ring_events(*ring)) {
+            out << ",\n{\"ph\": \"X\", \"cat\": \"gptoss\", \"name\": ";
+            write_json_string(out, e->name);
+            out << ", \"pid\": 1, \"tid\": " << ring->tid << ", \"ts\": " << static_cast<double>(e->start_ns) / 1e3
+                << ", \"dur\": " << static_cast<double>(e->dur_ns) / 1e3;
+            if (counters && ring->counters) {
+                out << ", \"args\": {\"cycles\": " << e->counters[0] << ", \"instructions\": " << e->counters[1]
+                    << ", \"llc_misses\": " << e->counters[2] << "}";
+            }
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+}
+
+void write_summary(std::ostream& os) {
+    struct Stats {
+        std::size_t calls{0};
+        std::uint64_t total_ns{0};
+        std::uint64_t max_ns{0};
+        std::uint64_t counters[kNumCounters]{};
+    };
+    std::map<std::string, Stats> by_name;
+    std::uint64_t first_ns = ~std::uint64_t{0}, last_ns = 0;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        for (const auto& ring : g_rings) {
+            for (const Event* e : ring_events(*ring)) {
+                Stats& s = by_name[e->name];
+                s.calls++;
+                s.total_ns += e->dur_ns;
+                s.max_ns = std::max(s.max_ns, e->dur_ns);
+                for (int i = 0; i < kNumCounters; ++i) s.counters[i] += e->counters[i];
+                first_ns = std::min(first_ns, e->start_ns);
+                last_ns = std::max(last_ns, e->start_ns + e->dur_ns);
+            }
+        }
+    }
+    if (by_name.empty()) {
+        os << "trace: no events recorded" << (kCompiledIn ? "" : " (built without GPTOSS_TRACE)") << "\n";
+        return;
+    }
+    std::vector<std::pair<std::string, Stats>> rows(by_name.begin(), by_name.end());
+    std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) { return a.second.total_ns > b.second.total_ns; });
+    const double wall_ns = static_cast<double>(last_ns - first_ns);
+    const bool counters = hardware_counters_active();
+
+    // zones nest, so the wall column adds up to more than 100%
+    os << "trace summary over " << std::fixed << std::setprecision(2) << wall_ns / 1e6 << " ms\n"
+       << std::left << std::setw(28) << "zone" << std::right << std::setw(9) << "calls" << std::setw(12) << "total_ms"
+       << std::setw(11) << "mean_us" << std::setw(11) << "max_us" << std::setw(8) << "wall%";
+    if (counters) os << std::setw(7) << "ipc" << std::setw(14) << "llc_miss/call";
+    os << "\n";
+    for (const auto& [name, s] : rows) {
+        os << std::left << std::setw(28) << name << std::right << std::setw(9) << s.calls << std::setprecision(3)
+           << std::setw(12) << static_cast<double>(s.total_ns) / 1e6 << std::setprecision(1) << std::setw(11)
+           << static_cast<double>(s.total_ns) / 1e3 / static_cast<double>(s.calls) << std::setw(11)
+           << static_cast<double>(s.max_ns) / 1e3 << std::setw(8) << 100.0 * static_cast<double>(s.total_ns) / wall_ns;
+        if (counters) {
+            const double ipc = s.counters[0] ? static_cast<double>(s.counters[1]) / static_cast<double>(s.counters[0]) : 0.0;
+            os << std::setprecision(2) << std::setw(7) << ipc << std::setprecision(0) << std::setw(14)
+               << static_cast<double>(s.counters[2]) / static_cast<double>(s.calls);
+        }
+        os << "\n";
+    }
+}
+
+}  // namespace trace
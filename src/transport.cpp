@@ -0,0 +1,275 @@
+#include "transport.h"
+
+#include <omp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Control block of one direction. Counters only grow, so head - tail is the fill level
+// and nothing needs a wrap flag; each sits on its own line so producer and consumer
+// don't bounce a cache line per chunk.
+struct RingHeader {
+    alignas(64) std::atomic<std::uint64_t> head{0};  // bytes written
+    alignas(64) std::atomic<std::uint64_t> tail{0};  // bytes read
+    // bumped after every publish; the futex words a blocked reader / writer sleeps on
+    alignas(64) std::atomic<std::uint32_t> data_seq{0};
+    std::atomic<std::uint32_t> data_waiters{0};
+    alignas(64) std::atomic<std::uint32_t> space_seq{0};
+    std::atomic<std::uint32_t> space_waiters{0};
+    alignas(64) std::atomic<std::uint32_t> closed{0};
+};
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "ring counters must be address-free");
+
+constexpr std::size_t kHeaderBytes = 4096;
+// pause-spins before sleeping; a decode step's reply is usually back within this window
+constexpr int kSpins = 2000;
+constexpr long kWaitTimeoutNs = 100'000'000;
+
+void cpu_relax() {
+#if defined(__x86_64__)
+    _mm_pause();
+#endif
+}
+
+void futex_wait(std::atomic<std::uint32_t>& word, std::uint32_t expected) {
+    timespec timeout{0, kWaitTimeoutNs};
+    // not FUTEX_PRIVATE: the word lives in a mapping shared between processes
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAIT, expected, &timeout, nullptr, 0);
+}
+
+void futex_wake(std::atomic<std::uint32_t>& word) {
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+void notify(std::atomic<std::uint32_t>& seq, std::atomic<std::uint32_t>& waiters) {
+    seq.fetch_add(1);
+    if (waiters.load() != 0) futex_wake(seq);
+}
+
+struct Mapping {
+    Mapping(void* base, std::size_t bytes) : base(base), bytes(bytes) {}
+    ~Mapping() { munmap(base, bytes); }
+    void* base;
+    std::size_t bytes;
+};
+
+class ShmTransport final : public Transport {
+public:
+    ShmTransport(std::shared_ptr<Mapping> mapping, std::byte* tx, std::byte* rx, std::size_t capacity)
+        : mapping_(std::move(mapping)),
+          tx_(reinterpret_cast<RingHeader*>(tx)),
+          tx_data_(tx + kHeaderBytes),
+          rx_(reinterpret_cast<RingHeader*>(rx)),
+          rx_data_(rx + kHeaderBytes),
+          capacity_(capacity) {}
+
+    ~ShmTransport() override {
+        // both ends exist in the process that made the pair; only the one actually used
+        // here may tell the peer it's gone
+        if (owner_ != getpid()) return;
+        for (RingHeader* ring : {tx_, rx_}) {
+            ring->closed.store(1);
+            notify(ring->data_seq, ring->data_waiters);
+            notify(ring->space_seq, ring->space_waiters);
+        }
+    }
+
+    void sendv(std::span<const std::span<const std::byte>> parts) override {
+        owner_ = getpid();
+        std::uint64_t size = 0;
+        for (const auto& part : parts) size += part.size();
+        write(reinterpret_cast<const std::byte*>(&size), sizeof(size));
+        for (const auto& part : parts) write(part.data(), part.size());
+    }
+
+    void recv(std::vector<std::byte>& msg) override {
+        owner_ = getpid();
+        std::uint64_t size = 0;
+        read(reinterpret_cast<std::byte*>(&size), sizeof(size));
+        msg.resize(size);
+        read(msg.data(), size);
+    }
+
+private:
+    template <typename Ready>
+    void wait(std::atomic<std::uint32_t>& seq, std::atomic<std::uint32_t>& waiters, const RingHeader& ring,
+              Ready ready) {
+        for (int i = 0; i < kSpins; ++i) {
+            if (ready()) return;
+            cpu_relax();
+        }
+        while (true) {
+            waiters.fetch_add(1);
+            const std::uint32_t s = seq.load();
+            if (ready()) {
+                waiters.fetch_sub(1);
+                return;
+            }
+            if (!ring.closed.load()) futex_wait(seq, s);
+            waiters.fetch_sub(1);
+            if (ready()) return;
+            if (ring.closed.load() || (peer_alive_ && !peer_alive_())) {
+                throw std::runtime_error("transport peer went away");
+            }
+        }
+    }
+
+    void write(const std::byte* src, std::size_t n) {
+        while (n > 0) {
+            const std::uint64_t head = tx_->head.load(std::memory_order_relaxed);
+            const auto free_bytes = [&] { return capacity_ - (head - tx_->tail.load(std::memory_order_acquire)); };
+            if (free_bytes() == 0) {
+                wait(tx_->space_seq, tx_->space_waiters, *tx_, [&] { return free_bytes() != 0; });
+            }
+            const std::size_t offset = head % capacity_;
+            const std::size_t chunk = std::min({n, static_cast<std::size_t>(free_bytes()), capacity_ - offset});
+            std::memcpy(tx_data_ + offset, src, chunk);
+            tx_->head.store(head + chunk, std::memory_order_release);
+            notify(tx_->data_seq, tx_->data_waiters);
+            src += chunk;
+            n -= chunk;
+        }
+    }
+
+    void read(std::byte* dst, std::size_t n) {
+        while (n > 0) {
+            const std::uint64_t tail = rx_->tail.load(std::memory_order_relaxed);
+            const auto available = [&] { return rx_->head.load(std::memory_order_acquire) - tail; };
+            if (available() == 0) {
+                wait(rx_->data_seq, rx_->data_waiters, *rx_, [&] { return available() != 0; });
+            }
+            const std::size_t offset = tail % capacity_;
+            const std::size_t chunk = std::min({n, static_cast<std::size_t>(available()), capacity_ - offset});
+            std::memcpy(dst, rx_data_ + offset, chunk);
+            rx_->tail.store(tail + chunk, std::memory_order_release);
+            notify(rx_->space_seq, rx_->space_waiters);
+            dst += chunk;
+            n -= chunk;
+        }
+    }
+
+    std::shared_ptr<Mapping> mapping_;
+    RingHeader* tx_;
+    std::byte* tx_data_;
+    RingHeader* rx_;
+    std::byte* rx_data_;
+    std::size_t capacity_;
+    pid_t owner_{0};
+};
+
+class SocketTransport final : public Transport {
+public:
+    explicit SocketTransport(int fd) : fd_(fd) {}
+    ~SocketTransport() override { close(fd_); }
+
+    void sendv(std::span<const std::span<const std::byte>> parts) override {
+        std::uint64_t size = 0;
+        for (const auto& part : parts) size += part.size();
+        write(reinterpret_cast<const std::byte*>(&size), sizeof(size));
+        for (const auto& part : parts) write(part.data(), part.size());
+    }
+
+    void recv(std::vector<std::byte>& msg) override {
+        std::uint64_t size = 0;
+        read(reinterpret_cast<std::byte*>(&size), sizeof(size));
+        msg.resize(size);
+        read(msg.data(), size);
+    }
+
+private:
+    void write(const std::byte* src, std::size_t n) {
+        while (n > 0) {
+            // MSG_NOSIGNAL: a dead peer should be an exception, not SIGPIPE
+            const ssize_t sent = ::send(fd_, src, n, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) throw std::runtime_error(std::string("transport send failed: ") + std::strerror(errno));
+            src += sent;
+            n -= static_cast<std::size_t>(sent);
+        }
+    }
+
+    void read(std::byte* dst, std::size_t n) {
+        while (n > 0) {
+            const ssize_t got = ::recv(fd_, dst, n, 0);
+            if (got < 0 && errno == EINTR) continue;
+            if (got == 0) throw std::runtime_error("transport peer went away");
+            if (got < 0) throw std::runtime_error(std::string("transport recv failed: ") + std::strerror(errno));
+            dst += got;
+            n -= static_cast<std::size_t>(got);
+        }
+    }
+
+    int fd_;
+};
+
+std::pair<std::unique_ptr<Transport>, std::unique_ptr<Transport>> make_socket_pair() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        throw std::runtime_error(std::string("socketpair failed: ") + std::strerror(errno));
+    }
+    return {socket_transport(fds[0]), socket_transport(fds[1])};
+}
+
+}  // namespace
+
+std::pair<std::unique_ptr<Transport>, std::unique_ptr<Transport>> make_transport_pair(TransportKind kind,
+                                                                                      std::size_t ring_bytes) {
+    if (kind == TransportKind::Socket) return make_socket_pair();
+
+    const std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    const std::size_t capacity = std::max(page, (ring_bytes + page - 1) / page * page);
+    const std::size_t ring_span = kHeaderBytes + capacity;
+    void* base = mmap(nullptr, 2 * ring_span, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        // no shared memory to spare (locked-down container, tiny /dev/shm): sockets still work
+        return make_socket_pair();
+    }
+    auto mapping = std::make_shared<Mapping>(base, 2 * ring_span);
+    auto* a = static_cast<std::byte*>(base);
+    auto* b = a + ring_span;
+    new (a) RingHeader();
+    new (b) RingHeader();
+    return {std::make_unique<ShmTransport>(mapping, a, b, capacity),
+            std::make_unique<ShmTransport>(mapping, b, a, capacity)};
+}
+
+std::unique_ptr<Transport> socket_transport(int fd) { return std::make_unique<SocketTransport>(fd); }
+
+TransportKind parse_transport_kind(const std::string& name) {
+    if (name == "shm") return TransportKind::SharedMemory;
+    if (name == "socket") return TransportKind::Socket;
+    throw std::runtime_error("unknown transport: " + name + " (expected shm or socket)");
+}
+
+pid_t fork_peer() {
+    std::cout.flush();
+    std::cerr.flush();
+    std::fflush(nullptr);
+    // the parent's pool comes back on its next parallel region
+    omp_pause_resource_all(omp_pause_hard);
+    const pid_t pid = fork();
+    if (pid < 0) throw std::runtime_error(std::string("fork failed: ") + std::strerror(errno));
+    return pid;
+}
@@ -0,0 +1,208 @@
+#include "vocab.h"
+
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr char kVocabMagic[8] = {'G', 'P', 'T', 'V', 'O', 'C', 'A', 'B'};
+constexpr std::uint32_t kVocabVersion = 1;
+
+struct VocabFileHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t count;
+    std::uint32_t num_slots;
+    std::uint32_t reserved;
+    std::uint64_t arena_bytes;
+};
+static_assert(sizeof(VocabFileHeader) == 32);
+
+// FNV-1a, plenty for ~200k short keys at load factor <= 0.5
+inline std::uint64_t hash_bytes(std::string_view s) {
+    std::uint64_t h = 0xcbf29ce484222325ull;
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+std::string base64_decode(std::string_view input) {
+    static const std::array<int8_t, 256> table = [] {
+        std::array<int8_t, 256> t{};
+        t.fill(-1);
+        for (int i = 0; i < 26; ++i) t[static_cast<uint8_t>('A' + i)] = static_cast<int8_t>(i);
+        for (int i = 0; i < 26; ++i) t[static_cast<uint8_t>('a' + i)] = static_cast<int8_t>(26 + i);
+        for (int i = 0; i < 10; ++i) t[static_cast<uint8_t>('0' + i)] = static_cast<int8_t>(52 + i);
+        t[static_cast<uint8_t>('+')] = 62;
+        t[static_cast<uint8_t>('/')] = 63;
+        return t;
+    }();
+
+    std::string output;
+    unsigned int buffer = 0;
+    int bits_collected = 0;
+    output.reserve(input.size() * 3 / 4);
+    for (char c : input) {
+        if (c == '=') break;
+        int8_t val = table[static_cast<unsigned char>(c)];
+        if (val == -1) {
+            throw std::invalid_argument("base64: invalid input character");
+        }
+        buffer = (buffer << 6) | val;
+        bits_collected += 6;
+        if (bits_collected >= 8) {
+            bits_collected -= 8;
+            output.push_back(static_cast<char>((buffer >> bits_collected) & 0xFF));
+        }
+    }
+    return output;
+}
+
+}  // namespace
+
+Vocab::Vocab(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) throw std::runtime_error("vocab: cannot open " + path);
+    char magic[sizeof(kVocabMagic)] = {};
+    file.read(magic, sizeof(magic));
+    file.close();
+    if (std::memcmp(magic, kVocabMagic, sizeof(kVocabMagic)) == 0) {
+        try {
+            map_binary(path);
+        } catch (...) {
+            // no destructor runs for a constructor that throws
+            if (map_base_) munmap(map_base_, map_length_);
+            throw;
+        }
+    } else {
+        load_tiktoken(path);
+    }
+}
+
+Vocab::~Vocab() {
+    if (map_base_) munmap(map_base_, map_length_);
+}
+
+std::int32_t Vocab::rank(std::string_view bytes) const {
+    for (std::uint64_t i = hash_bytes(bytes) & slot_mask_;; i = (i + 1) & slot_mask_) {
+        const std::uint32_t slot = slots_[i];
+        if (slot == 0) return -1;
+        if (token(static_cast<std::int32_t>(slot - 1)) == bytes) return static_cast<std::int32_t>(slot - 1);
+    }
+}
+
+void Vocab::load_tiktoken(const std::string& path) {
+    std::ifstream file(path);
+    std::vector<std::string> tokens;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty()) break;
+        const std::size_t space_idx = line.find(' ');
+        if (space_idx == std::string::npos) throw std::runtime_error("vocab: malformed line in " + path);
+        const std::int32_t token_id = std::stoi(line.substr(space_idx + 1));
+        if (token_id != static_cast<std::int32_t>(tokens.size())) {
+            throw std::runtime_error("vocab: token ids must be dense and in order");
+        }
+        tokens.push_back(base64_decode(std::string_view(line.data(), space_idx)));
+    }
+
+    count_ = static_cast<std::uint32_t>(tokens.size());
+    std::uint32_t num_slots = 1;
+    while (num_slots < 2 * count_) num_slots <<= 1;
+    slot_mask_ = num_slots - 1;
+    for (const auto& t : tokens) arena_bytes_ += t.size();
+
+    // same layout as the binary file minus the header so save() is a straight dump
+    owned_.resize((count_ + 1 + num_slots) * sizeof(std::uint32_t) + arena_bytes_);
+    auto* offsets = reinterpret_cast<std::uint32_t*>(owned_.data());
+    auto* slots = offsets + count_ + 1;
+    char* arena = reinterpret_cast<char*>(slots + num_slots);
+    std::uint32_t offset = 0;
+    for (std::uint32_t id = 0; id < count_; ++id) {
+        offsets[id] = offset;
+        std::memcpy(arena + offset, tokens[id].data(), tokens[id].size());
+        offset += static_cast<std::uint32_t>(tokens[id].size());
+    }
+    offsets[count_] = offset;
+    offsets_ = offsets;
+    slots_ = slots;
+    arena_ = arena;
+
+    for (std::uint32_t id = 0; id < count_; ++id) {
+        std::uint64_t i = hash_bytes(tokens[id]) & slot_mask_;
+        while (slots[i] != 0) i = (i + 1) & slot_mask_;
+        slots[i] = id + 1;
+    }
+}
+
+void Vocab::map_binary(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("vocab: cannot open " + path);
+    struct stat st {};
+    fstat(fd, &st);
+    map_length_ = static_cast<std::size_t>(st.st_size);
+    // shared read-only mapping: every worker on the host reuses the same page cache pages
+    map_base_ = mmap(nullptr, map_length_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map_base_ == MAP_FAILED) {
+        map_base_ = nullptr;
+        throw std::runtime_error("vocab: mmap failed for " + path);
+    }
+
+    VocabFileHeader header;
+    if (map_length_ < sizeof(header)) throw std::runtime_error("vocab: truncated file " + path);
+    std::memcpy(&header, map_base_, sizeof(header));
+    // the probe in rank() needs a power-of-two table with free slots left to stop on
+    if (header.version != kVocabVersion || header.num_slots == 0 ||
+        (header.num_slots & (header.num_slots - 1)) != 0 || header.num_slots < 2 * std::uint64_t{header.count} ||
+        header.arena_bytes > map_length_) {
+        throw std::runtime_error("vocab: invalid binary vocab " + path);
+    }
+    const std::uint64_t expected = sizeof(header) +
+                                   (std::uint64_t{header.count} + 1 + header.num_slots) * sizeof(std::uint32_t) +
+                                   header.arena_bytes;
+    if (map_length_ < expected) throw std::runtime_error("vocab: truncated file " + path);
+
+    count_ = header.count;
+    slot_mask_ = header.num_slots - 1;
+    arena_bytes_ = header.arena_bytes;
+    offsets_ = reinterpret_cast<const std::uint32_t*>(static_cast<const char*>(map_base_) + sizeof(header));
+    slots_ = offsets_ + count_ + 1;
+    arena_ = reinterpret_cast<const char*>(slots_ + header.num_slots);
+
+    // token() and rank() trust these without bounds checks
+    if (offsets_[0] != 0 || offsets_[count_] != arena_bytes_) {
+        throw std::runtime_error("vocab: offsets don't cover the arena in " + path);
+    }
+    for (std::uint32_t id = 0; id < count_; ++id) {
+        if (offsets_[id] > offsets_[id + 1]) throw std::runtime_error("vocab: offsets not monotonic in " + path);
+    }
+    for (std::uint32_t i = 0; i < header.num_slots; ++i) {
+        if (slots_[i] > count_) throw std::runtime_error("vocab: slot out of range in " + path);
+    }
+}
+
+void Vocab::save(const std::string& path) const {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) throw std::runtime_error("vocab: cannot write " + path);
+    VocabFileHeader header{};
+    std::memcpy(header.magic, kVocabMagic, sizeof(kVocabMagic));
+    header.version = kVocabVersion;
+    header.count = count_;
+    header.num_slots = slot_mask_ + 1;
+    header.arena_bytes = arena_bytes_;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(offsets_), (count_ + 1) * sizeof(std::uint32_t));
+    out.write(reinterpret_cast<const char*>(slots_), (slot_mask_ + 1) * sizeof(std::uint32_t));
+    out.write(arena_, static_cast<std::streamsize>(arena_bytes_));
+    if (!out) throw std::runtime_error("vocab: write failed for " + path);
+}
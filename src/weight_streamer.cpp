@@ -0,0 +1,343 @@
+#include "weight_streamer.h"
+
+#include "checkpoint.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+namespace {
+
+constexpr std::size_t kPageBytes = 4096;
+// tensors closer than this in the file are read as one range
+constexpr std::uint64_t kMergeGap = 64 * 1024;
+
+}  // namespace
+
+#ifdef __linux__
+// Just enough of io_uring to queue buffered reads and reap their completions, over the raw
+// syscalls so we don't need liburing.
+struct WeightStreamer::Ring {
+    int fd{-1};
+    void* sq_ptr{MAP_FAILED};
+    std::size_t sq_len{0};
+    void* cq_ptr{MAP_FAILED};
+    std::size_t cq_len{0};
+    io_uring_sqe* sqes{static_cast<io_uring_sqe*>(MAP_FAILED)};
+    std::size_t sqes_len{0};
+    unsigned* sq_head{nullptr};
+    unsigned* sq_tail{nullptr};
+    unsigned* sq_array{nullptr};
+    unsigned sq_mask{0};
+    unsigned* cq_head{nullptr};
+    unsigned* cq_tail{nullptr};
+    unsigned cq_mask{0};
+    io_uring_cqe* cqes{nullptr};
+    unsigned pending{0};
+    // taken by the kernel but not reaped yet
+    unsigned submitted{0};
+    // Read targets. The ring owns them so they outlive every read the kernel may still be
+    // doing: ~Ring drains first, and the members go after the ring is unmapped and closed.
+    std::unique_ptr<std::byte[]> buffers;
+
+    static std::unique_ptr<Ring> create(unsigned entries) {
+        io_uring_params params{};
+        const int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0) return nullptr;
+        auto ring = std::make_unique<Ring>();
+        ring->fd = fd;
+
+        ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) ring->sq_len = ring->cq_len = std::max(ring->sq_len, ring->cq_len);
+
+        ring->sq_ptr = mmap(nullptr, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                            IORING_OFF_SQ_RING);
+        if (ring->sq_ptr == MAP_FAILED) return nullptr;
+        ring->cq_ptr = single_mmap ? ring->sq_ptr
+                                   : mmap(nullptr, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                          fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) return nullptr;
+        ring->sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+        ring->sqes = static_cast<io_uring_sqe*>(mmap(nullptr, ring->sqes_len, PROT_READ | PROT_WRITE,
+                                                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (ring->sqes == MAP_FAILED) return nullptr;
+
+        auto* sq = static_cast<char*>(ring->sq_ptr);
+        auto* cq = static_cast<char*>(ring->cq_ptr);
+        ring->sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        ring->sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        ring->sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        ring->sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        ring->cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        ring->cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        ring->cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        ring->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return ring;
+    }
+
+    ~Ring() {
+        drain();
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_len);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_len);
+        if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_len);
+        if (fd >= 0) close(fd);
+    }
+
+    // false when the submission queue is full
+    bool push_read(int file, void* buf, unsigned len, std::uint64_t offset, std::uint64_t user_data) {
+        const unsigned tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > sq_mask) return false;
+        const unsigned idx = tail & sq_mask;
+        io_uring_sqe& sqe = sqes[idx];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = file;
+        sqe.off = offset;
+        sqe.addr = reinterpret_cast<std::uint64_t>(buf);
+        sqe.len = len;
+        sqe.user_data = user_data;
+        sq_array[idx] = idx;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        pending++;
+        return true;
+    }
+
+    // submits everything queued and waits for at least one completion, -errno on failure
+    int enter() {
+        const long ret = syscall(__NR_io_uring_enter, fd, pending, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (ret < 0) return -errno;
+        pending -= static_cast<unsigned>(ret);
+        submitted += static_cast<unsigned>(ret);
+        return static_cast<int>(ret);
+    }
+
+    bool pop(std::uint64_t& user_data, std::int32_t& res) {
+        const unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return false;
+        const io_uring_cqe& cqe = cqes[head & cq_mask];
+        user_data = cqe.user_data;
+        res = cqe.res;
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        submitted--;
+        return true;
+    }
+
+    // reaps (and drops) completions until nothing submitted is outstanding; false if the
+    // ring can't even wait any more
+    bool drain() {
+        std::uint64_t user_data = 0;
+        std::int32_t res = 0;
+        while (submitted > 0) {
+            if (pop(user_data, res)) continue;
+            if (syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+#else
+struct WeightStreamer::Ring {
+    static std::unique_ptr<Ring> create(unsigned) { return nullptr; }
+};
+#endif
+
+WeightStreamer::WeightStreamer(const Checkpoint& checkpoint) : WeightStreamer(checkpoint, Options{}) {}
+
+WeightStreamer::WeightStreamer(const Checkpoint& checkpoint, Options options)
+    : checkpoint_(checkpoint), options_(options), start_(std::chrono::steady_clock::now()) {
+    options_.read_bytes = std::max<std::size_t>(options_.read_bytes, kPageBytes);
+    options_.queue_depth = std::clamp(options_.queue_depth, 1u, 1u << 12);
+    plan();
+
+    if (!options_.force_fallback) ring_ = Ring::create(options_.queue_depth);
+    using_io_uring_ = ring_ != nullptr;
+    if (using_io_uring_) {
+        threads_.emplace_back([this] { run_io_uring(); });
+    } else {
+        for (unsigned i = 0; i < std::max(options_.fallback_threads, 1u); i++) {
+            threads_.emplace_back([this] { run_fallback(); });
+        }
+    }
+}
+
+WeightStreamer::~WeightStreamer() {
+    stop_ = true;
+    for (auto& t : threads_) t.join();
+}
+
+void WeightStreamer::plan() {
+    const std::size_t num_layers = checkpoint_.num_layers();
+    num_stages_ = num_layers + 2;
+    std::vector<std::vector<const TensorMeta_*>> stages(num_stages_);
+    for (std::size_t k = 0; k < static_cast<std::size_t>(TensorKind::Count); k++) {
+        const auto kind = static_cast<TensorKind>(k);
+        const bool global = k < kNumGlobalTensorKinds;
+        for (std::size_t layer = 0; layer < (global ? 1 : num_layers); layer++) {
+            const TensorMeta_* meta = checkpoint_.find(kind, global ? -1 : static_cast<int>(layer));
+            // missing, or already copied out of the file by make_resident
+            if (!meta || checkpoint_.file_offset(*meta) == Checkpoint::kNotInFile) continue;
+            const std::size_t stage =
+                kind == TensorKind::Embedding ? 0 : global ? num_stages_ - 1 : layer + 1;
+            stages[stage].push_back(meta);
+        }
+    }
+
+    remaining_ = std::make_unique<std::atomic<std::size_t>[]>(num_stages_);
+    for (std::size_t stage = 0; stage < num_stages_; stage++) {
+        auto& tensors = stages[stage];
+        std::sort(tensors.begin(), tensors.end(), [&](const TensorMeta_* a, const TensorMeta_* b) {
+            if (a->shard != b->shard) return a->shard < b->shard;
+            return checkpoint_.file_offset(*a) < checkpoint_.file_offset(*b);
+        });
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < tensors.size();) {
+            // merge neighbours within a shard into one span of its mapping
+            const std::byte* addr = tensors[i]->data;
+            const std::uint32_t shard = tensors[i]->shard;
+            const std::uint64_t begin = checkpoint_.file_offset(*tensors[i]);
+            std::uint64_t end = begin + tensors[i]->byte_size;
+            for (i++; i < tensors.size() && tensors[i]->shard == shard &&
+                      checkpoint_.file_offset(*tensors[i]) <= end + kMergeGap;
+                 i++) {
+                end = std::max(end, checkpoint_.file_offset(*tensors[i]) + tensors[i]->byte_size);
+            }
+            total_bytes_ += end - begin;
+            for (std::uint64_t off = begin; off < end; off += options_.read_bytes) {
+                const std::uint64_t bytes = std::min<std::uint64_t>(options_.read_bytes, end - off);
+                ranges_.push_back({off, bytes, addr + (off - begin), stage, shard});
+                count++;
+            }
+        }
+        remaining_[stage].store(count);
+        if (count == 0) stages_done_++;
+    }
+    if (stages_done_ == num_stages_) ready_ = start_;
+}
+
+void WeightStreamer::complete(const Range& range) {
+    if (remaining_[range.stage].fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (++stages_done_ == num_stages_) ready_ = std::chrono::steady_clock::now();
+    cv_.notify_all();
+}
+
+void WeightStreamer::wait_stage(std::size_t stage) const {
+    if (stage >= num_stages_) throw std::runtime_error("weight stage out of range");
+    if (remaining_[stage].load(std::memory_order_acquire) == 0) return;
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&] { return remaining_[stage].load(std::memory_order_acquire) == 0; });
+}
+
+void WeightStreamer::wait_all() const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&] { return stages_done_ == num_stages_; });
+}
+
+double WeightStreamer::seconds_to_ready() const {
+    wait_all();
+    std::lock_guard<std::mutex> lock(mutex_);
+    return std::chrono::duration<double>(ready_ - start_).count();
+}
+
+void WeightStreamer::populate(const Range& range) const {
+    const std::size_t misalign = reinterpret_cast<std::uintptr_t>(range.addr) % kPageBytes;
+    auto* begin = const_cast<std::byte*>(range.addr) - misalign;
+#ifdef MADV_POPULATE_READ
+    if (madvise(begin, range.bytes + misalign, MADV_POPULATE_READ) == 0) return;
+#endif
+    // older kernels: fault it in by hand
+    const volatile std::byte* p = begin;
+    std::uint8_t sink = 0;
+    for (std::size_t off = 0; off < range.bytes + misalign; off += kPageBytes) {
+        sink ^= static_cast<std::uint8_t>(p[off]);
+    }
+    (void)sink;
+}
+
+void WeightStreamer::run_fallback() {
+    while (!stop_) {
+        const std::size_t i = next_range_.fetch_add(1);
+        if (i >= ranges_.size()) break;
+        populate(ranges_[i]);
+        complete(ranges_[i]);
+    }
+}
+
+void WeightStreamer::run_io_uring() {
+#ifdef __linux__
+    std::vector<int> files(checkpoint_.num_shards(), -1);
+    bool opened = true;
+    for (std::size_t i = 0; i < files.size(); i++) {
+        files[i] = ::open(checkpoint_.shard_path(i).c_str(), O_RDONLY | O_CLOEXEC);
+        opened = opened && files[i] >= 0;
+        if (files[i] >= 0) posix_fadvise(files[i], 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    std::size_t next = 0;
+    if (opened) {
+        // the reads only exist to fill the page cache, so the buffers are scratch
+        const std::size_t depth = options_.queue_depth;
+        ring_->buffers.reset(new std::byte[depth * options_.read_bytes]);
+        std::byte* buffers = ring_->buffers.get();
+        std::vector<std::size_t> free_slots(depth);
+        std::iota(free_slots.begin(), free_slots.end(), 0);
+        std::vector<std::size_t> slot_range(depth);
+        std::size_t inflight = 0;
+
+        while (true) {
+            while (!stop_ && !free_slots.empty() && next < ranges_.size()) {
+                const std::size_t slot = free_slots.back();
+                const Range& r = ranges_[next];
+                if (!ring_->push_read(files[r.shard], buffers + slot * options_.read_bytes,
+                                      static_cast<unsigned>(r.bytes), r.offset, slot)) {
+                    break;
+                }
+                free_slots.pop_back();
+                slot_range[slot] = next++;
+                inflight++;
+            }
+            if (inflight == 0) break;
+            const int ret = ring_->enter();
+            if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+                // ring is unusable (e.g. READ not supported), finish through the mapping;
+                // reads already submitted are reaped here or by ~Ring before the buffers go
+                ring_->drain();
+                for (std::size_t slot = 0; slot < depth; slot++) {
+                    if (std::find(free_slots.begin(), free_slots.end(), slot) != free_slots.end()) continue;
+                    populate(ranges_[slot_range[slot]]);
+                    complete(ranges_[slot_range[slot]]);
+                }
+                break;
+            }
+            std::uint64_t slot = 0;
+            std::int32_t res = 0;
+            while (ring_->pop(slot, res)) {
+                const Range& r = ranges_[slot_range[slot]];
+                // errors and short reads fall back to faulting the range in
+                if (res < static_cast<std::int64_t>(r.bytes)) populate(r);
+                complete(r);
+                free_slots.push_back(slot);
+                inflight--;
+            }
+        }
+    }
+    for (int file : files) {
+        if (file >= 0) close(file);
+    }
+    next_range_.store(next);
+#endif
+    run_fallback();
+}
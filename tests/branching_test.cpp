@@ -0,0 +1,212 @@
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "branch_decoder.h"
+#include "kernels.h"
+#include "kv_cache.h"
+#include "model.h"
+#include "model_config.h"
+#include "paged_kv.h"
+#include "synthetic.h"
+#include "test_util.h"
+
+namespace {
+
+// log-probability of continuation after prompt, from one plain forward over both
+double replay_logprob(const GPTOSSModel& model, std::vector<std::int32_t> tokens,
+                      const std::vector<std::int32_t>& continuation) {
+    const std::size_t vocab = model.config().vocab_size, start = tokens.size();
+    tokens.insert(tokens.end(), continuation.begin(), continuation.end());
+    std::vector<float> logits(tokens.size() * vocab);
+    KVCache cache(model.config().num_hidden_layers);
+    model.forward(tokens, logits, cache);
+    double sum = 0.0;
+    for (std::size_t i = 0; i < continuation.size(); i++) {
+        const float* row = logits.data() + (start + i - 1) * vocab;
+        double z = 0.0;
+        float max_val = row[0];
+        for (std::size_t v = 0; v < vocab; v++) max_val = std::max(max_val, row[v]);
+        for (std::size_t v = 0; v < vocab; v++) z += std::exp(static_cast<double>(row[v] - max_val));
+        sum += row[continuation[i]] - max_val - std::log(z);
+    }
+    return sum;
+}
+
+void test_fork_copy_on_write() {
+    KVBlockPool pool(2, 4, 4);
+    PagedKVCache a(pool);
+    a.reserve_append(6);
+    for (std::size_t pos = 0; pos < 6; pos++) {
+        for (std::size_t l = 0; l < 2; l++) {
+            for (std::size_t i = 0; i < 4; i++) a.k_row(l, pos)[i] = static_cast<float>(pos * 10 + l);
+        }
+    }
+    a.seq_len = 6;
+    assert(pool.blocks_in_use() == 2);
+
+    PagedKVCache b = a.fork();
+    assert(pool.blocks_in_use() == 2 && pool.refcount(a.blocks()[0]) == 2);
+    // b writes into the shared, partly filled block: it gets its own copy of that one only
+    b.reserve_append(1);
+    b.k_row(1, 6)[0] = -1.0f;
+    b.seq_len = 7;
+    assert(pool.copies() == 1 && pool.blocks_in_use() == 3);
+    assert(a.blocks()[0] == b.blocks()[0] && a.blocks()[1] != b.blocks()[1]);
+    assert(b.k_row(1, 5)[0] == 51.0f && a.k_row(1, 5)[0] == 51.0f);
+    // a holds the original alone now, so its append writes in place
+    a.reserve_append(1);
+    assert(pool.copies() == 1 && pool.blocks_in_use() == 3);
+
+    b.clear();
+    assert(pool.blocks_in_use() == 2 && pool.refcount(a.blocks()[0]) == 1);
+    PagedKVCache c = std::move(a);
+    assert(a.blocks().empty() && c.seq_len == 6);
+    c.clear();
+    assert(pool.blocks_in_use() == 0);
+}
+
+// sequences of different lengths decoded as one batch give what each gives on its own
+void test_forward_batch(const GPTOSSModel& model, const ModelConfig& c) {
+    const std::size_t vocab = c.vocab_size, layers = c.num_hidden_layers, steps = 3;
+    KVBlockPool pool(layers, c.num_key_value_heads * c.head_dim, 4);
+    std::vector<std::vector<std::int32_t>> seqs;
+    std::vector<std::vector<float>> expected;
+    std::vector<PagedKVCache> paged;
+    const std::size_t lengths[] = {3, 8, 5};
+    for (std::size_t s = 0; s < 3; s++) {
+        seqs.push_back(synthetic_tokens(lengths[s] + steps, vocab, s));
+        expected.emplace_back(seqs[s].size() * vocab);
+        KVCache full(layers);
+        model.forward(seqs[s], expected[s], full);
+        KVCache prefix(layers);
+        std::vector<float> logits(vocab);
+        model.forward(std::span<const std::int32_t>(seqs[s]).first(lengths[s]), logits, prefix);
+        paged.emplace_back(pool);
+        paged.back().assign(prefix);
+    }
+    // the third one continues from a fork of the second, sharing its blocks
+    paged[2] = paged[1].fork();
+    seqs[2] = seqs[1];
+    expected[2] = expected[1];
+    seqs[2][lengths[1]] = (seqs[2][lengths[1]] + 1) % static_cast<std::int32_t>(vocab);
+    {
+        KVCache full(layers);
+        model.forward(seqs[2], expected[2], full);
+    }
+
+    ForwardBuffers buf;
+    std::vector<float> logits(3 * vocab);
+    for (std::size_t step = 0; step < steps; step++) {
+        std::vector<std::int32_t> tokens;
+        std::vector<PagedKVCache*> caches;
+        for (std::size_t s = 0; s < 3; s++) {
+            tokens.push_back(seqs[s][paged[s].seq_len]);
+            caches.push_back(&paged[s]);
+        }
+        model.forward_batch(tokens, logits, caches, buf);
+        for (std::size_t s = 0; s < 3; s++) {
+            const std::size_t pos = paged[s].seq_len - 1;
+            expect_close(std::span<const float>(logits).subspan(s * vocab, vocab),
+                         std::span<const float>(expected[s]).subspan(pos * vocab, vocab), 1e-3f, "forward_batch");
+        }
+    }
+    assert(paged[1].blocks()[0] == paged[2].blocks()[0]);
+}
+
+void test_sampling(const GPTOSSModel& model, const ModelConfig& c) {
+    const auto p = synthetic_tokens(9, c.vocab_size, 5);
+    BranchDecoder decoder(model, 4);
+
+    // greedy branches all follow the plain greedy decode
+    const auto greedy = decoder.sample(p, 3, 5, {.temperature = 0.0f});
+    std::vector<std::int32_t> expected;
+    {
+        KVCache cache(c.num_hidden_layers);
+        std::vector<float> logits(c.vocab_size);
+        model.forward(p, logits, cache);
+        for (std::size_t i = 0; i < 5; i++) {
+            expected.push_back(argmax(logits));
+            model.forward(std::span<const std::int32_t>(&expected.back(), 1), logits, cache);
+        }
+    }
+    for (const Completion& completion : greedy) assert(completion.tokens == expected);
+    assert(decoder.stats().prefill_tokens == p.size());
+    assert(decoder.stats().decode_steps == 4 && decoder.stats().decode_rows == 12);
+
+    // random branches: the prompt is still prefilled once, and every branch scores the same
+    // as replaying it without any sharing
+    const auto sampled = decoder.sample(p, 4, 6, {.temperature = 1.0f, .seed = 3});
+    assert(decoder.stats().prefill_tokens == 2 * p.size());
+    bool differ = false;
+    for (const Completion& completion : sampled) {
+        assert(completion.tokens.size() == 6);
+        differ = differ || completion.tokens != sampled[0].tokens;
+        const double replayed = replay_logprob(model, p, completion.tokens);
+        if (std::fabs(replayed - completion.logprob) > 1e-2 * (1.0 + std::fabs(replayed))) {
+            throw std::runtime_error("sampled branch logprob " + std::to_string(completion.logprob) + " vs replayed " +
+                                     std::to_string(replayed));
+        }
+    }
+    assert(differ);
+    // 15 tokens each is 4 blocks per branch unshared; the 2 full prompt blocks are shared
+    assert(decoder.stats().peak_blocks <= 2 + 4 * 2);
+    assert(decoder.pool().blocks_in_use() == 0);
+
+    // stop token ends a branch early
+    const auto stopped = decoder.sample(p, 2, 5, {.temperature = 0.0f}, expected[1]);
+    for (const Completion& completion : stopped) {
+        assert(completion.tokens.size() <= 2 && completion.tokens.back() == expected[1]);
+    }
+}
+
+void test_beam_search(const GPTOSSModel& model, const ModelConfig& c) {
+    const auto p = synthetic_tokens(6, c.vocab_size, 8);
+    BranchDecoder decoder(model, 4);
+
+    const auto one = decoder.beam_search(p, 1, 4);
+    const auto greedy = decoder.sample(p, 1, 4, {.temperature = 0.0f});
+    assert(one.size() == 1 && one[0].tokens == greedy[0].tokens);
+
+    const auto beams = decoder.beam_search(p, 3, 4);
+    assert(beams.size() == 3);
+    for (std::size_t i = 0; i < beams.size(); i++) {
+        assert(beams[i].tokens.size() == 4);
+        if (i > 0) assert(beams[i].logprob <= beams[i - 1].logprob && beams[i].tokens != beams[i - 1].tokens);
+        const double replayed = replay_logprob(model, p, beams[i].tokens);
+        if (std::fabs(replayed - beams[i].logprob) > 1e-2 * (1.0 + std::fabs(replayed))) {
+            throw std::runtime_error("beam logprob " + std::to_string(beams[i].logprob) + " vs replayed " +
+                                     std::to_string(replayed));
+        }
+    }
+    // the best beam is at least as likely as the greedy path
+    assert(beams[0].logprob >= one[0].logprob - 1e-6);
+    assert(decoder.pool().blocks_in_use() == 0);
+}
+
+void test_synthetic_model() {
+    const auto synth = make_synthetic_model("gptoss_branching_test", 2, 13);
+    const GPTOSSModel& model = synth.model();
+    const ModelConfig& config = synth.config();
+
+    test_fork_copy_on_write();
+    test_forward_batch(model, config);
+    test_sampling(model, config);
+    test_beam_search(model, config);
+}
+
+}  // namespace
+
+int main() {
+    try {
+        test_synthetic_model();
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "branching tests failed: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -1,16 +1,272 @@
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
 #include "checkpoint.h"
+#include "weight_streamer.h"
+
+namespace {
+
+struct TestTensor {
+    std::string name;
+    std::string dtype;
+    std::vector<std::uint64_t> shape;
+    std::vector<std::uint8_t> bytes;
+};
+
+void write_safetensors(const std::string& path, const std::vector<TestTensor>& tensors) {
+    std::string header = "{\"__metadata__\": {\"format\": \"pt\"}";
+    std::uint64_t offset = 0;
+    for (const auto& t : tensors) {
+        header += ", \"" + t.name + "\": {\"dtype\": \"" + t.dtype + "\", \"shape\": [";
+        for (std::size_t i = 0; i < t.shape.size(); i++) {
+            header += (i ? ", " : "") + std::to_string(t.shape[i]);
+        }
+        header += "], \"data_offsets\": [" + std::to_string(offset) + ", " +
+                  std::to_string(offset + t.bytes.size()) + "]}";
+        offset += t.bytes.size();
+    }
+    header += "}";
+    std::ofstream out(path, std::ios::binary);
+    const std::uint64_t header_len = header.size();
+    out.write(reinterpret_cast<const char*>(&header_len), 8);
+    out.write(header.data(), static_cast<std::streamsize>(header.size()));
+    for (const auto& t : tensors) {
+        out.write(reinterpret_cast<const char*>(t.bytes.data()), static_cast<std::streamsize>(t.bytes.size()));
+    }
+}
+
+std::vector<std::uint8_t> pattern(std::size_t n, std::uint8_t seed) {
+    std::vector<std::uint8_t> v(n);
+    for (std::size_t i = 0; i < n; i++) v[i] = static_cast<std::uint8_t>(seed + i * 7);
+    return v;
+}
+
+void check_same(const Checkpoint& a, const Checkpoint& b, TensorKind kind, int layer) {
+    const auto& x = a.get(kind, layer);
+    const auto& y = b.get(kind, layer);
+    assert(x.dtype == y.dtype);
+    assert(x.shape == y.shape);
+    assert(x.byte_size == y.byte_size);
+    assert(std::memcmp(x.data, y.data, x.byte_size) == 0);
+}
+
+void test_pack_roundtrip() {
+    const auto dir = std::filesystem::temp_directory_path();
+    const std::string st_path = (dir / "gptoss_checkpoint_test.safetensors").string();
+    const std::string packed_path = (dir / "gptoss_checkpoint_test.gptoss").string();
+
+    write_safetensors(st_path, {
+        {"embedding.weight", "BF16", {4, 2}, pattern(16, 1)},
+        {"norm.scale", "BF16", {2}, pattern(4, 2)},
+        {"block.0.attn.qkv.weight", "BF16", {6, 2}, pattern(24, 3)},
+        {"block.1.attn.sinks", "BF16", {3}, pattern(6, 4)},
+        {"block.1.mlp.mlp1_weight.blocks", "U8", {4, 1024, 640}, pattern(4 * 1024 * 640, 5)},
+        {"block.1.mlp.mlp1_weight.scales", "U8", {4, 1024}, pattern(4 * 1024, 6)},
+    });
+
+    Checkpoint source(st_path);
+    assert(!source.is_packed());
+    assert(source.num_layers() == 2);
+    assert(source.get_bf16_ptr(TensorKind::AttnQkvWeight, 0) == source.get_bf16_ptr("block.0.attn.qkv.weight"));
+
+    pack_checkpoint(source, packed_path);
+    Checkpoint packed(packed_path);
+    assert(packed.is_packed());
+    assert(packed.num_layers() == 2);
+    check_same(source, packed, TensorKind::Embedding, -1);
+    check_same(source, packed, TensorKind::Norm, -1);
+    check_same(source, packed, TensorKind::AttnQkvWeight, 0);
+    check_same(source, packed, TensorKind::AttnSinks, 1);
+    check_same(source, packed, TensorKind::Mlp1Blocks, 1);
+    check_same(source, packed, TensorKind::Mlp1Scales, 1);
+
+    // the big tensor sits on a 2 MB boundary, the rest on cache lines
+    const auto& embedding = packed.get(TensorKind::Embedding);
+    const auto* base = reinterpret_cast<const std::uint8_t*>(embedding.data) - embedding.offset[0];
+    assert((packed.get_u8_ptr(TensorKind::Mlp1Blocks, 1) - base) % kPackedHugeAlign == 0);
+    assert((packed.get_u8_ptr(TensorKind::Mlp1Scales, 1) - base) % kPackedSmallAlign == 0);
+
+    // name lookups still work, missing tensors still throw
+    assert(packed.get_bf16_ptr("block.1.attn.sinks") == packed.get_bf16_ptr(TensorKind::AttnSinks, 1));
+    bool threw = false;
+    try {
+        packed.get(TensorKind::AttnQkvWeight, 1);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+
+    // a damaged directory is refused at open, not read through later
+    std::string bytes;
+    {
+        std::ifstream in(packed_path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    const std::string bad_path = (dir / "gptoss_checkpoint_test_bad.gptoss").string();
+    const auto corrupt = [&](std::size_t entry, std::size_t field, std::uint32_t value, const char* what) {
+        std::string copy = bytes;
+        std::memcpy(copy.data() + sizeof(PackedHeader) + entry * sizeof(PackedEntry) + field, &value, sizeof(value));
+        std::ofstream(bad_path, std::ios::binary | std::ios::trunc).write(copy.data(), copy.size());
+        try {
+            Checkpoint bad(bad_path);
+        } catch (const std::runtime_error&) {
+            return;
+        }
+        throw std::runtime_error(std::string("packed model with ") + what + " accepted");
+    };
+    const std::size_t qkv0 = Checkpoint::directory_index(TensorKind::AttnQkvWeight, 0);
+    corrupt(0, offsetof(PackedEntry, dtype), 7, "an unknown dtype");
+    corrupt(0, offsetof(PackedEntry, kind), 99, "an unknown kind");
+    corrupt(0, offsetof(PackedEntry, layer), 0, "a layer on a global tensor");
+    corrupt(qkv0, offsetof(PackedEntry, layer), 9, "a layer past the last block");
+    corrupt(qkv0, offsetof(PackedEntry, byte_size), 8, "a size that doesn't match the shape");
+    std::filesystem::remove(bad_path);
+
+    std::filesystem::remove(st_path);
+    std::filesystem::remove(packed_path);
+}
+
+void test_make_resident() {
+    const auto dir = std::filesystem::temp_directory_path();
+    const std::string st_path = (dir / "gptoss_resident_test.safetensors").string();
+    write_safetensors(st_path, {
+        {"embedding.weight", "BF16", {1024, 1024}, pattern(2 << 20, 1)},
+        {"block.0.attn.sinks", "BF16", {3}, pattern(6, 2)},
+        {"block.0.mlp.mlp1_weight.blocks", "U8", {4, 1024, 640}, pattern(4 * 1024 * 640, 3)},
+    });
+    Checkpoint reference(st_path);
+    Checkpoint checkpoint(st_path);
+    const auto* expert_before = checkpoint.get_u8_ptr(TensorKind::Mlp1Blocks, 0);
+    const ResidencyReport report = checkpoint.make_resident({.progress = false});
+
+    // hot tensors moved, expert weights stay in the file mapping
+    assert(report.resident_bytes >= (2u << 20) + 6);
+    assert(report.prefaulted_bytes == 4 * 1024 * 640);
+    assert(checkpoint.get(TensorKind::Embedding).data != reference.get(TensorKind::Embedding).data);
+    assert(checkpoint.get_u8_ptr(TensorKind::Mlp1Blocks, 0) == expert_before);
+    assert(reinterpret_cast<std::uintptr_t>(checkpoint.get(TensorKind::Embedding).data) % 64 == 0);
+    check_same(reference, checkpoint, TensorKind::Embedding, -1);
+    check_same(reference, checkpoint, TensorKind::AttnSinks, 0);
+    check_same(reference, checkpoint, TensorKind::Mlp1Blocks, 0);
+
+    std::filesystem::remove(st_path);
+}
+
+void test_weight_streamer() {
+    const auto dir = std::filesystem::temp_directory_path();
+    const std::string st_path = (dir / "gptoss_streamer_test.safetensors").string();
+    write_safetensors(st_path, {
+        {"embedding.weight", "BF16", {1024, 1024}, pattern(2 << 20, 1)},
+        {"block.0.attn.sinks", "BF16", {3}, pattern(6, 2)},
+        {"block.1.mlp.mlp1_weight.blocks", "U8", {4, 1024, 1280}, pattern(4 * 1024 * 1280, 3)},
+        {"unembedding.weight", "BF16", {1024, 8}, pattern(16 * 1024, 4)},
+    });
+    Checkpoint checkpoint(st_path);
+    const std::uint64_t expected = (2 << 20) + 6 + 4 * 1024 * 1280 + 16 * 1024;
+
+    for (bool fallback : {false, true}) {
+        WeightStreamer::Options options;
+        options.read_bytes = 1 << 20;
+        options.force_fallback = fallback;
+        WeightStreamer streamer(checkpoint, options);
+        assert(streamer.num_stages() == 4);
+        assert(!fallback || !streamer.using_io_uring());
+        // per-layer waits return once that layer is in, the rest may still be streaming
+        streamer.wait_layer(1);
+        streamer.wait_embedding();
+        streamer.wait_all();
+        assert(streamer.seconds_to_ready() >= 0.0);
+        // ranges within a stage may be merged across small gaps, never shrink below the tensors
+        assert(streamer.total_bytes() >= expected);
+    }
+
+    // resident tensors are no longer read from the file
+    checkpoint.make_resident({.prefault_experts = false, .progress = false});
+    WeightStreamer streamer(checkpoint);
+    streamer.wait_all();
+    assert(streamer.total_bytes() == 4 * 1024 * 1280);
+
+    std::filesystem::remove(st_path);
+}
+
+void test_sharded() {
+    const auto dir = std::filesystem::temp_directory_path() / "gptoss_sharded_test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    const std::vector<TestTensor> shard1 = {
+        {"embedding.weight", "BF16", {4, 2}, pattern(16, 1)},
+        {"block.0.attn.qkv.weight", "BF16", {6, 2}, pattern(24, 2)},
+    };
+    const std::vector<TestTensor> shard2 = {
+        {"block.1.attn.sinks", "BF16", {3}, pattern(6, 3)},
+        {"block.1.mlp.mlp1_weight.blocks", "U8", {4, 64, 80}, pattern(4 * 64 * 80, 4)},
+        {"unembedding.weight", "BF16", {4, 2}, pattern(16, 5)},
+    };
+    write_safetensors((dir / "model-00001-of-00002.safetensors").string(), shard1);
+    write_safetensors((dir / "model-00002-of-00002.safetensors").string(), shard2);
+
+    auto check = [&](const Checkpoint& c) {
+        assert(c.num_shards() == 2);
+        assert(c.num_layers() == 2);
+        const auto& emb = c.get(TensorKind::Embedding);
+        const auto& blocks = c.get(TensorKind::Mlp1Blocks, 1);
+        assert(emb.shard == 0 && blocks.shard == 1);
+        assert(std::memcmp(emb.data, shard1[0].bytes.data(), 16) == 0);
+        assert(std::memcmp(c.get_bf16_ptr("block.1.attn.sinks"), shard2[0].bytes.data(), 6) == 0);
+        assert(std::memcmp(blocks.data, shard2[1].bytes.data(), shard2[1].bytes.size()) == 0);
+        assert(std::memcmp(c.get_bf16_ptr(TensorKind::Unembedding), shard2[2].bytes.data(), 16) == 0);
+        // file offsets are per shard, the streamer reads each from its own file
+        assert(c.file_offset(emb) < 4096 && c.file_offset(blocks) < 4096);
+        WeightStreamer streamer(c);
+        streamer.wait_all();
+    };
+
+    // no index: every *.safetensors in the directory
+    check(Checkpoint(dir.string()));
+
+    std::ofstream(dir / "model.safetensors.index.json") << R"({
+  "metadata": {"total_size": 20526},
+  "weight_map": {
+    "block.0.attn.qkv.weight": "model-00001-of-00002.safetensors",
+    "block.1.attn.sinks": "model-00002-of-00002.safetensors",
+    "block.1.mlp.mlp1_weight.blocks": "model-00002-of-00002.safetensors",
+    "embedding.weight": "model-00001-of-00002.safetensors",
+    "unembedding.weight": "model-00002-of-00002.safetensors"
+  }
+})";
+    check(Checkpoint(dir.string()));
+    check(Checkpoint((dir / "model.safetensors.index.json").string()));
+
+    // the same tensor in two shards is an error
+    write_safetensors((dir / "model-00002-of-00002.safetensors").string(), shard1);
+    bool threw = false;
+    try {
+        Checkpoint duplicate(dir.string());
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+
+    std::filesystem::remove_all(dir);
+}
+
+}  // namespace
 
 int main() {
     try {
+        test_pack_roundtrip();
+        test_make_resident();
+        test_weight_streamer();
+        test_sharded();
         return 0;
     } catch (const std::exception& e) {
         std::cerr << "checkpoint tests failed: " << e.what() << std::endl;
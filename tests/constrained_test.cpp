@@ -0,0 +1,280 @@
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "constrained.h"
+#include "kernels.h"
+#include "kv_cache.h"
+#include "model.h"
+#include "model_config.h"
+#include "synthetic.h"
+
+namespace {
+
+void expect_matches(const ByteAutomaton& a, std::string_view text, bool expected) {
+    if (a.matches(text) != expected) {
+        throw std::runtime_error("\"" + std::string(text) + "\" should " + (expected ? "" : "not ") + "match");
+    }
+}
+
+void expect_throws(const auto& fn, const char* what) {
+    try {
+        fn();
+    } catch (const std::runtime_error&) {
+        return;
+    }
+    throw std::runtime_error(std::string("expected an error for ") + what);
+}
+
+void test_regex() {
+    const auto a = ByteAutomaton::from_regex("(ab|cd)*e");
+    expect_matches(a, "e", true);
+    expect_matches(a, "abcdabe", true);
+    expect_matches(a, "abc", false);
+    expect_matches(a, "", false);
+    // "abc" is a dead end: no continuation reaches an accepting state
+    assert(a.advance(a.start(), "ab") != ByteAutomaton::kDead);
+    assert(a.advance(a.start(), "abce") == ByteAutomaton::kDead);
+
+    const auto num = ByteAutomaton::from_regex(R"(-?\d{1,3}(\.[0-9]+)?)");
+    expect_matches(num, "-12.5", true);
+    expect_matches(num, "1234", false);
+    expect_matches(num, "7.", false);
+
+    const auto cls = ByteAutomaton::from_regex(R"([^a-c\n]x|\x41\.)");
+    expect_matches(cls, "dx", true);
+    expect_matches(cls, "bx", false);
+    expect_matches(cls, "A.", true);
+    expect_matches(cls, "AB", false);
+
+    // minimized: these are all one or two states however they're written
+    assert(ByteAutomaton::from_regex("(a|b)*").num_states() == 1);
+    assert(ByteAutomaton::from_regex("(?:a*|b*)*").num_states() == 1);
+    assert(ByteAutomaton::from_regex("x(a|a|aa*)").num_states() == 3);
+    // accepting with nothing left to add
+    const auto lit = ByteAutomaton::from_regex("ok");
+    assert(!lit.has_exits(lit.advance(lit.start(), "ok")) && lit.has_exits(lit.start()));
+
+    expect_throws([] { ByteAutomaton::from_regex("^abc"); }, "anchor");
+    expect_throws([] { ByteAutomaton::from_regex("(ab"); }, "unbalanced group");
+    expect_throws([] { ByteAutomaton::from_regex("[a-"); }, "unterminated class");
+    expect_throws([] { ByteAutomaton::from_regex("[ab]{5000}", 64); }, "state limit");
+}
+
+void test_json_schema() {
+    const std::string schema = R"({
+        "type": "object",
+        "properties": {
+            "name": {"type": "string", "maxLength": 8},
+            "age": {"type": "integer"},
+            "tags": {"type": "array", "items": {"type": "string"}, "maxItems": 2},
+            "kind": {"enum": ["a\"b", 3, null]},
+            "extra": {"$ref": "#/$defs/point"}
+        },
+        "required": ["name", "age"],
+        "$defs": {"point": {"type": "object", "properties": {"x": {"type": "number"}}, "required": ["x"]}}
+    })";
+    const auto a = ByteAutomaton::from_regex(json_schema_to_regex(schema));
+    expect_matches(a, R"({"name": "bob", "age": 42})", true);
+    expect_matches(a, R"({"name":"bob","age":-1,"tags":["x", "y"],"kind":3})", true);
+    expect_matches(a, R"({"name": "bé\n", "age": 0, "kind": "a\"b", "extra": {"x": 1.5e3}})", true);
+    expect_matches(a, "{\"name\": \"h\xc3\xa9\", \"age\": 1}", true);
+    expect_matches(a, R"({"age": 42, "name": "bob"})", false);          // schema order
+    expect_matches(a, R"({"name": "bob"})", false);                     // age is required
+    expect_matches(a, R"({"name": "bob", "age": 4.5})", false);         // integer
+    expect_matches(a, R"({"name": "bob", "age": 1, "tags": ["a", "b", "c"]})", false);
+    expect_matches(a, R"({"name": "toolongname", "age": 1})", false);
+    expect_matches(a, R"({"name": "bob", "age": 01})", false);
+    expect_matches(a, R"({"name": "bob", "age": 1,})", false);
+    expect_matches(a, "{\"name\": \"\xff\", \"age\": 1}", false);      // not UTF-8
+
+    // patterns only ever produce a well-formed string; unanchored ones may sit anywhere in it
+    const auto dotted = ByteAutomaton::from_regex(json_schema_to_regex(R"({"type": "string", "pattern": "a.*"})"));
+    expect_matches(dotted, R"("a")", true);
+    expect_matches(dotted, R"("xa\"y\\z")", true);
+    expect_matches(dotted, "\"a\xc3\xa9\"", true);
+    expect_matches(dotted, R"("a"x")", false);
+    expect_matches(dotted, "\"a\x01\"", false);
+    expect_matches(dotted, "\"a\xff\"", false);
+    expect_matches(dotted, R"("b")", false);
+    const auto anchored =
+        ByteAutomaton::from_regex(json_schema_to_regex(R"({"type": "string", "pattern": "^[a-z]+$"})"));
+    expect_matches(anchored, R"("abc")", true);
+    expect_matches(anchored, R"("")", false);
+    expect_matches(anchored, R"("abc1")", false);
+    expect_matches(anchored, R"("1abc")", false);
+    // a quote or newline the pattern asks for comes out escaped
+    const auto quoted =
+        ByteAutomaton::from_regex(json_schema_to_regex(R"({"type": "string", "pattern": "^a[\"\n]$"})"));
+    expect_matches(quoted, R"("a\"")", true);
+    expect_matches(quoted, R"("a\n")", true);
+    expect_matches(quoted, "\"a\n\"", false);
+
+    // open values: any JSON, nested up to max_depth
+    const auto any = ByteAutomaton::from_regex(json_schema_to_regex("{}", {.whitespace = "", .max_depth = 2}));
+    expect_matches(any, R"({"a":[1,{"b":null}]})", false);
+    expect_matches(any, R"({"a":[1,true,"x"],"b":{}})", true);
+    expect_matches(any, R"([[]])", true);
+
+    expect_throws([] { json_schema_to_regex(R"({"type": "object", "properties": {"a": {"$ref": "#"}}})"); },
+                  "recursive $ref");
+    expect_throws([] { json_schema_to_regex(R"({"type": "strin"})"); }, "unknown type");
+    expect_throws([] { json_schema_to_regex(R"({"type": )"); }, "bad json");
+    expect_throws([] { json_schema_to_regex(R"({"type": 5})"); }, "numeric type");
+    expect_throws([] { json_schema_to_regex(R"({"type": []})"); }, "empty type list");
+    expect_throws([] { json_schema_to_regex(R"({"type": ["string", 5]})"); }, "numeric type in a list");
+    for (const char* bad : {R"({"type": "string", "maxLength": -1})", R"({"type": "string", "minLength": 1.5})",
+                            R"({"type": "array", "maxItems": "3"})", R"({"type": "array", "minItems": 1e3})"}) {
+        expect_throws([bad] { json_schema_to_regex(bad); }, "non-integer count");
+    }
+}
+
+// ordinary pieces a JSON-ish BPE would have, after the 256 single bytes
+std::vector<std::string> test_vocab(std::size_t size) {
+    std::vector<std::string> tokens;
+    for (int b = 0; b < 256; ++b) tokens.emplace_back(1, static_cast<char>(b));
+    const char* pieces[] = {"{\"", "\":", "\": ", "\",", "\", \"", "\"}", "}", "true", "false", "null", "ok", "\"ok",
+                            "tag", "\"tag\":", "12", "3,", " \"", "abc", "ab", "a", "ed", "é", ",\"n\":"};
+    for (const char* p : pieces) tokens.emplace_back(p);
+    std::mt19937 rng(5);
+    const std::string alphabet = "abcdefghijklmnopqrstuvwxyz0123456789\"{}[]:, ._-";
+    while (tokens.size() < size) {
+        std::string t;
+        const std::size_t len = 2 + rng() % 6;
+        for (std::size_t i = 0; i < len; ++i) t += alphabet[rng() % alphabet.size()];
+        tokens.push_back(t);
+    }
+    return tokens;
+}
+
+std::shared_ptr<TokenTrie> make_trie(const std::vector<std::string>& tokens) {
+    std::vector<std::string_view> views(tokens.begin(), tokens.end());
+    // a hole, as unused / special ids are
+    views[300] = {};
+    return std::make_shared<TokenTrie>(views);
+}
+
+void test_masks_match_brute_force() {
+    const auto tokens = test_vocab(1500);
+    const std::size_t vocab = 1600;
+    const std::int32_t end = 1599;
+    TokenMasks masks(ByteAutomaton::from_regex(json_schema_to_regex(
+                         R"({"type":"object","properties":{"ok":{"type":"boolean"},"n":{"enum":[12,3]},
+                             "tag":{"type":"string","maxLength":3}},"required":["ok"]})")),
+                     make_trie(tokens), vocab, {end});
+    const ByteAutomaton& a = masks.automaton();
+    for (std::int32_t s = 0; s < static_cast<std::int32_t>(a.num_states()); ++s) {
+        const auto bits = masks.mask(s);
+        for (std::int32_t t = 0; t < static_cast<std::int32_t>(vocab); ++t) {
+            bool expected = false;
+            if (t == end) {
+                expected = a.accepting(s);
+            } else if (static_cast<std::size_t>(t) < tokens.size() && t != 300) {
+                expected = a.advance(s, tokens[t]) != ByteAutomaton::kDead;
+            }
+            const bool got = (bits[t / 64] >> (t % 64)) & 1;
+            if (got != expected) {
+                throw std::runtime_error("state " + std::to_string(s) + " token " + std::to_string(t) +
+                                         (expected ? " should be allowed" : " shouldn't be allowed"));
+            }
+            assert((masks.next(s, t) != ByteAutomaton::kDead) == expected);
+        }
+    }
+    assert(masks.states_computed() == a.num_states());
+    // states inside the same kind of string/number share their mask
+    assert(masks.distinct_masks() < a.num_states());
+
+    // precompute agrees with lazy construction
+    TokenMasks eager(ByteAutomaton::from_regex("(true|false|[0-9]+)"), make_trie(tokens), vocab, {end});
+    eager.precompute();
+    TokenMasks lazy(ByteAutomaton::from_regex("(true|false|[0-9]+)"), make_trie(tokens), vocab, {end});
+    for (std::int32_t s = 0; s < static_cast<std::int32_t>(eager.automaton().num_states()); ++s) {
+        const auto x = eager.mask(s), y = lazy.mask(s);
+        assert(std::equal(x.begin(), x.end(), y.begin(), y.end()));
+    }
+}
+
+void test_apply_token_mask() {
+    std::mt19937_64 rng(3);
+    for (std::size_t n : {1u, 63u, 64u, 200u, 1000u, 4096u}) {
+        std::vector<std::uint64_t> mask((n + 63) / 64);
+        for (std::uint64_t& w : mask) w = rng() & rng();
+        mask[0] |= ~0ull >> 32;
+        std::vector<float> logits(n);
+        for (std::size_t i = 0; i < n; ++i) logits[i] = static_cast<float>(i) * 0.5f - 3.0f;
+        apply_token_mask(logits, mask);
+        for (std::size_t i = 0; i < n; ++i) {
+            const bool allowed = (mask[i / 64] >> (i % 64)) & 1;
+            if (allowed ? logits[i] != static_cast<float>(i) * 0.5f - 3.0f
+                        : logits[i] != -std::numeric_limits<float>::infinity()) {
+                throw std::runtime_error("apply_token_mask wrong at " + std::to_string(i) + " of " + std::to_string(n));
+            }
+        }
+    }
+}
+
+// greedy decoding on a random model: whatever it likes, the output parses
+void test_constrained_decode() {
+    const auto synth = make_synthetic_model("gptoss_constrained_test", 2, 21);
+    const GPTOSSModel& model = synth.model();
+    const ModelConfig& config = synth.config();
+
+    const auto tokens = test_vocab(config.vocab_size - 1);
+    const std::int32_t end = static_cast<std::int32_t>(config.vocab_size - 1);
+    const std::string schema =
+        R"({"type":"object","properties":{"ok":{"type":"boolean"},"n":{"enum":[1,2,3]},
+            "tag":{"type":"string","maxLength":4}},"required":["ok","n","tag"]})";
+    TokenMasks masks(ByteAutomaton::from_regex(json_schema_to_regex(schema, {.whitespace = ""})), make_trie(tokens),
+                     config.vocab_size, {end});
+
+    for (std::int32_t first : {7, 1234, 3000}) {
+        TokenConstraint constraint(masks);
+        KVCache cache(config.num_hidden_layers);
+        std::vector<float> logits(config.vocab_size);
+        std::vector<std::int32_t> prompt{first, first + 1};
+        model.forward(prompt, logits, cache);
+        std::string text;
+        // once the document is complete only the end token is left
+        for (std::size_t step = 0; step < 64; ++step) {
+            constraint.apply(logits);
+            const std::int32_t token = argmax(logits);
+            constraint.accept(token);
+            if (token == end) break;
+            text += tokens[token];
+            model.forward(std::span<const std::int32_t>(&token, 1), logits, cache);
+        }
+        if (!constraint.done() || !masks.automaton().matches(text)) {
+            throw std::runtime_error("constrained output isn't a complete document: " + text);
+        }
+        expect_throws([&] { constraint.accept(end); }, "token after the end");
+    }
+
+    TokenConstraint constraint(masks);
+    expect_throws([&] { constraint.accept(static_cast<std::int32_t>('x')); }, "disallowed token");
+    expect_throws([&] { constraint.accept(end); }, "end before the document is complete");
+}
+
+}  // namespace
+
+int main() {
+    try {
+        test_regex();
+        test_json_schema();
+        test_masks_match_brute_force();
+        test_apply_token_mask();
+        test_constrained_decode();
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "constrained tests failed: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,218 @@
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "checkpoint.h"
+#include "kernels.h"
+#include "kv_cache.h"
+#include "kv_handoff.h"
+#include "model.h"
+#include "model_config.h"
+#include "prefill_workers.h"
+#include "synthetic.h"
+#include "test_util.h"
+
+namespace {
+
+std::string handoff_path(const char* name) {
+    return (std::filesystem::temp_directory_path() / name).string();
+}
+
+// prefill into one cache with a writer attached, decode from another that only saw the handoff
+void test_handoff_roundtrip(const GPTOSSModel& model, const ModelConfig& c) {
+    const std::size_t prompt_len = 7, decode = 3, vocab = c.vocab_size, layers = c.num_hidden_layers;
+    const auto seq = synthetic_tokens(prompt_len + decode, vocab, 1);
+    std::vector<float> expected((prompt_len + decode) * vocab);
+    KVCache reference(layers);
+    model.forward(seq, expected, reference);
+
+    KVHandoff handoff =
+        KVHandoff::create(handoff_path("gptoss_kv_roundtrip"), layers, c.num_key_value_heads * c.head_dim, prompt_len);
+    KVHandoff other = KVHandoff::open(handoff.path());
+    assert(other.num_layers() == layers && other.seq_len() == prompt_len);
+    assert(!other.layer_ready(0) && !other.first_token_ready());
+
+    KVCache prefill_cache(layers);
+    ForwardBuffers buf;
+    std::vector<float> logits(vocab);
+    handoff.attach_writer(prefill_cache);
+    // two chunks: layers only go out once the second one completes them
+    ChunkedPrefill prefill(model, std::span<const std::int32_t>(seq).first(prompt_len), prefill_cache, buf, 4);
+    prefill.step(logits);
+    assert(!other.layer_ready(0));
+    prefill.step(logits);
+    for (std::size_t l = 0; l < layers; l++) assert(other.layer_ready(l));
+    handoff.publish_first_token(argmax(logits));
+    assert(other.wait_first_token() == argmax(std::span<const float>(expected).subspan((prompt_len - 1) * vocab, vocab)));
+
+    KVCache decode_cache(layers);
+    other.attach_reader(decode_cache);
+    assert(decode_cache.seq_len == prompt_len);
+    assert(other.poll(decode_cache) == layers);
+    other.finish(decode_cache);
+    assert(!decode_cache.before_layer);
+    for (std::size_t step = 0; step < decode; step++) {
+        const std::size_t pos = prompt_len + step;
+        model.forward(std::span<const std::int32_t>(&seq[pos], 1), logits, decode_cache, buf);
+        expect_close(logits, std::span<const float>(expected).subspan(pos * vocab, vocab), 1e-4f, "handoff decode");
+    }
+}
+
+// layers are picked up as they land, and a failed prefill fails the waiter instead of hanging
+void test_partial_and_failed(const ModelConfig& c) {
+    const std::size_t layers = c.num_hidden_layers, row = c.num_key_value_heads * c.head_dim, len = 3;
+    KVHandoff handoff = KVHandoff::create(handoff_path("gptoss_kv_partial"), layers, row, len);
+    KVHandoff reader = KVHandoff::open(handoff.path());
+    KVCache cache(layers);
+    reader.attach_reader(cache);
+    assert(reader.poll(cache) == 0);
+
+    std::vector<float> k(len * row, 1.5f), v(len * row, -2.0f);
+    handoff.publish_layer(0, k, v);
+    assert(reader.poll(cache) == 1 && reader.poll(cache) == 0);
+    assert(cache.k_cache[0] == k && cache.v_cache[0] == v && cache.k_cache[1].empty());
+
+    bool threw = false;
+    try {
+        handoff.publish_layer(1, std::span<const float>(k).first(row), v);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+
+    handoff.fail();
+    threw = false;
+    try {
+        reader.finish(cache);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+
+    // the creator takes the file with it
+    const std::string path = handoff.path();
+    { KVHandoff gone = std::move(handoff); }
+    assert(!std::filesystem::exists(path));
+}
+
+// The decode side keeps stepping a running sequence while another prompt's prefill is
+// still landing layer by layer; each poll between steps picks up exactly the layer that
+// came in, and neither sequence's logits notice the other.
+void test_decode_overlaps_prefill(const GPTOSSModel& model, const ModelConfig& c) {
+    const std::size_t vocab = c.vocab_size, layers = c.num_hidden_layers, decode = layers + 2;
+    const auto running = synthetic_tokens(5 + decode, vocab, 3);
+    const auto incoming = synthetic_tokens(9 + 2, vocab, 4);
+    const std::size_t running_len = running.size() - decode, incoming_len = incoming.size() - 2;
+    std::vector<float> running_expected(running.size() * vocab), incoming_expected(incoming.size() * vocab);
+    KVCache ref_a(layers), ref_b(layers);
+    model.forward(running, running_expected, ref_a);
+    model.forward(incoming, incoming_expected, ref_b);
+
+    // the prefill being handed over, done up front so its layers can be published one at a time
+    KVCache prefilled(layers);
+    std::vector<float> logits(vocab);
+    model.forward(std::span<const std::int32_t>(incoming).first(incoming_len), logits, prefilled);
+    const std::int32_t first = argmax(logits);
+
+    KVHandoff handoff = KVHandoff::create(handoff_path("gptoss_kv_overlap"), layers,
+                                          c.num_key_value_heads * c.head_dim, incoming_len);
+    KVHandoff reader = KVHandoff::open(handoff.path());
+    KVCache incoming_cache(layers);
+    reader.attach_reader(incoming_cache);
+
+    ForwardBuffers buf;
+    KVCache running_cache(layers);
+    model.forward(std::span<const std::int32_t>(running).first(running_len), logits, running_cache, buf);
+    for (std::size_t step = 0; step < decode; step++) {
+        if (step < layers) handoff.publish_layer(step, prefilled.k_cache[step], prefilled.v_cache[step]);
+        const std::size_t pos = running_len + step;
+        model.forward(std::span<const std::int32_t>(&running[pos], 1), logits, running_cache, buf);
+        expect_close(logits, std::span<const float>(running_expected).subspan(pos * vocab, vocab), 1e-4f,
+                     "decode during prefill");
+        if (reader.poll(incoming_cache) != (step < layers ? 1u : 0u)) {
+            throw std::runtime_error("poll after step " + std::to_string(step) + " picked up the wrong layers");
+        }
+    }
+    assert(!reader.first_token_ready());
+    handoff.publish_first_token(first);
+    assert(reader.wait_first_token() == first);
+    reader.finish(incoming_cache);
+    for (std::size_t step = 0; step < 2; step++) {
+        const std::size_t pos = incoming_len + step;
+        model.forward(std::span<const std::int32_t>(&incoming[pos], 1), logits, incoming_cache, buf);
+        expect_close(logits, std::span<const float>(incoming_expected).subspan(pos * vocab, vocab), 1e-4f,
+                     "decode after overlapped handoff");
+    }
+}
+
+// Prompts prefilled by forked workers decode to the same logits as the whole thing run
+// locally. Decoding starts right after attach_reader, so the layers come in through the
+// cache hook rather than finish().
+void test_prefill_workers(Checkpoint& checkpoint, const GPTOSSModel& model, const ModelConfig& c,
+                          const PrefillWorkerOptions& options) {
+    const std::size_t num_seqs = 3, decode = 2, vocab = c.vocab_size, layers = c.num_hidden_layers;
+    PrefillWorkers workers(checkpoint, c, {}, options);
+    assert(workers.num_workers() == options.num_workers);
+
+    std::vector<std::vector<std::int32_t>> seqs;
+    std::vector<std::unique_ptr<KVHandoff>> handoffs;
+    for (std::size_t s = 0; s < num_seqs; s++) {
+        seqs.push_back(synthetic_tokens(4 + 3 * s + decode, vocab, s + 2));
+        handoffs.push_back(workers.submit(std::span<const std::int32_t>(seqs[s]).first(seqs[s].size() - decode)));
+    }
+
+    ForwardBuffers buf;
+    std::vector<float> logits(vocab);
+    for (std::size_t s = 0; s < num_seqs; s++) {
+        const std::size_t prompt_len = seqs[s].size() - decode;
+        std::vector<float> expected(seqs[s].size() * vocab);
+        KVCache reference(layers);
+        model.forward(seqs[s], expected, reference);
+
+        KVCache cache(layers);
+        handoffs[s]->attach_reader(cache);
+        const std::int32_t first = handoffs[s]->wait_first_token();
+        assert(first == argmax(std::span<const float>(expected).subspan((prompt_len - 1) * vocab, vocab)));
+        for (std::size_t step = 0; step < decode; step++) {
+            const std::size_t pos = prompt_len + step;
+            model.forward(std::span<const std::int32_t>(&seqs[s][pos], 1), logits, cache, buf);
+            expect_close(logits, std::span<const float>(expected).subspan(pos * vocab, vocab), 1e-3f,
+                         "disaggregated decode");
+            if (step == 0) handoffs[s]->finish(cache);
+        }
+        assert(cache.seq_len == seqs[s].size());
+    }
+}
+
+void test_synthetic_model() {
+    const auto synth = make_synthetic_model("gptoss_disaggregation_test", 3, 9);
+    Checkpoint& checkpoint = synth.checkpoint();
+    const GPTOSSModel& model = synth.model();
+    const ModelConfig& config = synth.config();
+
+    test_handoff_roundtrip(model, config);
+    test_partial_and_failed(config);
+    test_decode_overlaps_prefill(model, config);
+    test_prefill_workers(checkpoint, model, config, {.num_workers = 1});
+    test_prefill_workers(checkpoint, model, config,
+                         {.num_workers = 2, .transport = TransportKind::Socket, .prefill_chunk = 3});
+}
+
+}  // namespace
+
+int main() {
+    try {
+        test_synthetic_model();
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "disaggregation tests failed: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,142 @@
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "expert_parallel.h"
+#include "kv_cache.h"
+#include "model.h"
+#include "model_config.h"
+#include "synthetic.h"
+#include "test_util.h"
+#include "transport.h"
+
+namespace {
+
+std::vector<std::byte> pattern(std::size_t n, std::size_t seed) {
+    std::vector<std::byte> out(n);
+    for (std::size_t i = 0; i < n; i++) out[i] = static_cast<std::byte>((i * 31 + seed) & 0xFF);
+    return out;
+}
+
+// A child echoes every message back until it gets an empty one. The ring is a single page,
+// so the bigger messages have to stream through it and wrap several times.
+void test_transport(TransportKind kind) {
+    auto [parent_end, child_end] = make_transport_pair(kind, 4096);
+    const pid_t pid = fork();
+    if (pid == 0) {
+        parent_end.reset();
+        std::vector<std::byte> msg;
+        do {
+            child_end->recv(msg);
+            child_end->send(msg);
+        } while (!msg.empty());
+        child_end.reset();
+        _exit(0);
+    }
+    child_end.reset();
+    parent_end->set_peer_check([pid] { return waitpid(pid, nullptr, WNOHANG) == 0; });
+
+    std::vector<std::byte> reply;
+    for (std::size_t size : {std::size_t{1}, std::size_t{100}, std::size_t{4095}, std::size_t{4096}, std::size_t{50000}}) {
+        const auto a = pattern(size / 2, size), b = pattern(size - size / 2, size + 1);
+        const std::span<const std::byte> parts[] = {a, b};
+        parent_end->sendv(parts);
+        parent_end->recv(reply);
+        assert(reply.size() == size);
+        assert(std::equal(a.begin(), a.end(), reply.begin()));
+        assert(std::equal(b.begin(), b.end(), reply.begin() + static_cast<std::ptrdiff_t>(a.size())));
+    }
+    parent_end->send({});
+    parent_end->recv(reply);
+    assert(reply.empty());
+
+    // the child is gone now, so waiting on it has to fail instead of hanging
+    bool threw = false;
+    try {
+        parent_end->recv(reply);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    waitpid(pid, nullptr, 0);
+}
+
+// Expert-parallel logits match the in-process experts for a prefill and a few decode steps.
+void test_matches_local(GPTOSSModel& model, TransportKind kind, std::size_t workers) {
+    const ModelConfig& c = model.config();
+    const std::size_t n = 9, vocab = c.vocab_size, layers = c.num_hidden_layers;
+    const auto tokens = synthetic_tokens(n, vocab);
+
+    KVCache local_cache(layers);
+    std::vector<float> local(n * vocab);
+    model.forward(tokens, local, local_cache);
+
+    ExpertParallel ep(model, {.num_workers = workers, .transport = kind, .ring_bytes = 8192});
+    assert(ep.num_workers() == workers);
+    assert(ep.first_expert(0) == 0 && ep.first_expert(workers) == c.num_experts);
+    model.set_expert_backend(&ep);
+    KVCache cache(layers);
+    std::vector<float> logits(n * vocab);
+    model.forward(std::span<const std::int32_t>(tokens).first(n - 2), std::span<float>(logits).first((n - 2) * vocab),
+                  cache);
+    for (std::size_t i = n - 2; i < n; i++) {
+        model.forward(std::span<const std::int32_t>(&tokens[i], 1), std::span<float>(logits).subspan(i * vocab, vocab),
+                      cache);
+    }
+    model.set_expert_backend(nullptr);
+    expect_close(logits, local, 1e-3f, "expert parallel logits");
+}
+
+// A run the workers can't serve (a layer past the model) kills them mid-run. That run throws,
+// and so does every later one instead of picking up whatever reply is still queued.
+void test_failed_run(GPTOSSModel& model) {
+    const ModelConfig& c = model.config();
+    ExpertParallel ep(model, {.num_workers = 2, .ring_bytes = 8192});
+    const std::size_t k = c.experts_per_token;
+    std::vector<float> x(c.hidden_size, 0.5f), out(c.hidden_size);
+    std::vector<std::int32_t> experts(k);
+    std::vector<float> weights(k, 1.0f / static_cast<float>(k));
+    // one expert per worker, so both get a batch
+    for (std::size_t j = 0; j < k; j++) experts[j] = static_cast<std::int32_t>(j * c.num_experts / k);
+    ep.run(0, x, experts, weights, 1, out);
+    for (const std::size_t layer : {c.num_hidden_layers, std::size_t{0}}) {
+        std::string error;
+        try {
+            ep.run(layer, x, experts, weights, 1, out);
+        } catch (const std::runtime_error& e) {
+            error = e.what();
+        }
+        assert(!error.empty());
+        assert(layer != 0 || error.find("out of step") != std::string::npos);
+    }
+}
+
+void test_synthetic_model() {
+    const auto synth = make_synthetic_model("gptoss_expert_parallel_test", 2, 11);
+    GPTOSSModel& model = synth.model();
+    test_matches_local(model, TransportKind::SharedMemory, 2);
+    // uneven split, 4 experts over 3 workers
+    test_matches_local(model, TransportKind::Socket, 3);
+    test_failed_run(model);
+}
+
+}  // namespace
+
+int main() {
+    try {
+        test_transport(TransportKind::SharedMemory);
+        test_transport(TransportKind::Socket);
+        test_synthetic_model();
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "expert parallel tests failed: " << e.what() << std::endl;
+        return 1;
+    }
+}
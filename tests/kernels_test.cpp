@@ -0,0 +1,161 @@
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "kernels.h"
+#include "model_config.h"
+#include "quant.h"
+#include "synthetic.h"
+#include "test_util.h"
+
+namespace {
+
+SyntheticRng rng{1234};
+
+// the 20b/120b shapes hit every specialization, check each against the generic kernel
+void test_specialized_parity() {
+    const std::size_t hidden = 2880, head_dim = 64, heads = 64, kv_heads = 8, tokens = 3;
+    const KernelTable fixed = select_kernels(hidden, hidden, head_dim, heads, kv_heads);
+    assert(fixed.specialized == 6);
+    const KernelTable generic = select_kernels(2048, 1024, 128, 32, 8);
+    assert(generic.specialized == 0);
+
+    const auto x = random_floats(rng, tokens * hidden);
+    const auto scale = random_bf16(rng, hidden);
+    std::vector<float> a(tokens * hidden), b(tokens * hidden);
+    fixed.rmsnorm(x, scale, 1e-5f, hidden, a);
+    rmsnorm(x, scale, 1e-5f, hidden, b);
+    expect_close(a, b, 1e-4f, "rmsnorm");
+
+    const std::size_t out_features = 96;
+    const auto w = random_bf16(rng, out_features * heads * head_dim, 0.05f);
+    const auto bias = random_bf16(rng, out_features);
+    const auto xa = random_floats(rng, tokens * heads * head_dim);
+    a.assign(tokens * out_features, 0.0f);
+    b.assign(tokens * out_features, 0.0f);
+    fixed.linear_attn_out(w.data(), bias.data(), heads * head_dim, out_features, xa, a);
+    linear_bf16(w.data(), bias.data(), heads * head_dim, out_features, xa, b);
+    expect_close(a, b, 1e-3f, "linear");
+
+    // prefill a few tokens on top of a short cache, with and without a sliding window
+    const std::size_t kv_len = 150;
+    const auto q = random_floats(rng, tokens * heads * head_dim);
+    const auto k = random_floats(rng, kv_len * kv_heads * head_dim);
+    const auto v = random_floats(rng, kv_len * kv_heads * head_dim);
+    const auto sinks = random_bf16(rng, heads);
+    for (std::size_t window : {std::size_t{0}, std::size_t{128}}) {
+        a.assign(tokens * heads * head_dim, 0.0f);
+        b.assign(tokens * heads * head_dim, 0.0f);
+        fixed.sdpa(q, k, v, sinks, tokens, kv_len, heads, kv_heads, head_dim, 0.125f, window, a);
+        sdpa_with_sinks(q, k, v, sinks, tokens, kv_len, heads, kv_heads, head_dim, 0.125f, window, b);
+        expect_close(a, b, 1e-4f, "sdpa");
+    }
+
+    const auto blocks = random_bytes(rng, out_features * hidden / 2);
+    const auto scales = random_bytes(rng, out_features * hidden / 32, 120, 130);
+    const auto xm = random_floats(rng, hidden);
+    a.assign(out_features, 0.0f);
+    b.assign(out_features, 0.0f);
+    fixed.mxfp4_mlp1(blocks.data(), scales.data(), out_features, hidden, xm, a);
+    mxfp4_gemm(blocks.data(), scales.data(), out_features, hidden, xm, b);
+    expect_close(a, b, 1e-3f, "mxfp4");
+}
+
+void test_config_load() {
+    const auto path = std::filesystem::temp_directory_path() / "gptoss_config_test.json";
+    // HF-style config: nested rope_scaling and the num_local_experts spelling
+    std::ofstream(path) << R"({
+  "architectures": ["GptOssForCausalLM"],
+  "experts_per_token": 4,
+  "head_dim": 64,
+  "hidden_size": 2880,
+  "initial_context_length": 4096,
+  "intermediate_size": 2880,
+  "num_attention_heads": 64,
+  "num_hidden_layers": 36,
+  "num_key_value_heads": 8,
+  "num_local_experts": 128,
+  "rope_scaling": {"beta_fast": 32.0, "beta_slow": 1.0, "factor": 32.0, "rope_type": "yarn"},
+  "rope_theta": 150000,
+  "sliding_window": 128,
+  "swiglu_limit": 7.0,
+  "vocab_size": 201088
+})";
+    const ModelConfig c = ModelConfig::load(path.string());
+    const ModelConfig ref = ModelConfig::gpt_oss_120b();
+    assert(c.num_hidden_layers == ref.num_hidden_layers);
+    assert(c.num_experts == ref.num_experts);
+    assert(c.experts_per_token == ref.experts_per_token);
+    assert(c.vocab_size == ref.vocab_size);
+    assert(c.head_dim == ref.head_dim);
+    assert(c.rope_scaling_factor == ref.rope_scaling_factor);
+    assert(c.rope_ntk_alpha == ref.rope_ntk_alpha);
+    assert(c.rope_ntk_beta == ref.rope_ntk_beta);
+    assert(c.swiglu_limit == ref.swiglu_limit);
+    std::filesystem::remove(path);
+
+    assert(ModelConfig::preset(24).num_experts == 32);
+}
+
+// int8 weights + int8 activations should track the bf16 kernel closely; 2900 columns
+// exercises the zero padding up to the 64-byte stride
+void test_int8_linear() {
+    const std::size_t rows = 301, cols = 2900, tokens = 3;
+    const auto w = random_bf16(rng, rows * cols, 0.02f);
+    const auto bias = random_bf16(rng, rows);
+    const auto x = random_floats(rng, tokens * cols);
+    const Int8Matrix q = quantize_int8_rows(w.data(), rows, cols);
+    assert(q.stride % 64 == 0 && q.stride >= cols);
+
+    std::vector<float> ref(tokens * rows), got(tokens * rows);
+    linear_bf16(w.data(), bias.data(), cols, rows, x, ref);
+    linear_int8(q, bias.data(), x, got);
+    for (std::size_t t = 0; t < tokens; t++) {
+        const LogitParity p = logit_parity(std::span<const float>(ref).subspan(t * rows, rows),
+                                           std::span<const float>(got).subspan(t * rows, rows));
+        if (p.cosine < 0.999f || !p.top1_match) {
+            throw std::runtime_error("int8 linear drifted: cosine=" + std::to_string(p.cosine));
+        }
+    }
+
+    const LogitParity same = logit_parity(ref, ref, 5);
+    if (same.max_abs_diff != 0.0f || std::fabs(same.kl) > 1e-6f || same.topk_overlap != 5) {
+        throw std::runtime_error("logit_parity of identical logits is not exact");
+    }
+}
+
+// integer-domain MXFP4: per-block int8 activations against the exact doubled FP4 values
+void test_mxfp4_int8() {
+    const std::size_t out_features = 257, in_features = 2880;
+    const auto blocks = random_bytes(rng, out_features * in_features / 2);
+    const auto scales = random_bytes(rng, out_features * in_features / 32, 120, 130);
+    const auto x = random_floats(rng, in_features);
+
+    std::vector<float> ref(out_features), got(out_features);
+    mxfp4_gemm(blocks.data(), scales.data(), out_features, in_features, x, ref);
+    mxfp4_gemm_int8(blocks.data(), scales.data(), out_features, in_features, x, got);
+    const LogitParity p = logit_parity(ref, got);
+    if (p.cosine < 0.9995f) {
+        throw std::runtime_error("mxfp4 int8 drifted: cosine=" + std::to_string(p.cosine));
+    }
+}
+
+}  // namespace
+
+int main() {
+    try {
+        test_specialized_parity();
+        test_config_load();
+        test_int8_linear();
+        test_mxfp4_int8();
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "kernels tests failed: " << e.what() << std::endl;
+        return 1;
+    }
+}
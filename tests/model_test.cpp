@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "checkpoint.h"
+#include "kv_cache.h"
+#include "model.h"
+#include "model_config.h"
+#include "routing_stats.h"
+#include "synthetic.h"
+#include "test_util.h"
+
+namespace {
+
+// Chunked prefill, token-by-token decode and truncate-then-recompute must all land on the
+// logits of one full forward over the same tokens.
+void test_forward_consistency(const GPTOSSModel& model) {
+    const ModelConfig& c = model.config();
+    const std::size_t n = 11, vocab = c.vocab_size, layers = c.num_hidden_layers;
+    const auto tokens = synthetic_tokens(n, vocab);
+
+    KVCache full_cache(layers);
+    std::vector<float> all_logits(n * vocab);
+    model.forward(tokens, all_logits, full_cache);
+    assert(full_cache.seq_len == n);
+    const std::span<const float> last(all_logits.data() + (n - 1) * vocab, vocab);
+    // random weights still have to give logits that depend on the token
+    assert(*std::max_element(last.begin(), last.end()) > *std::min_element(last.begin(), last.end()));
+
+    KVCache chunked_cache(layers);
+    ForwardBuffers buf;
+    std::vector<float> logits(vocab);
+    ChunkedPrefill prefill(model, tokens, chunked_cache, buf, 4);
+    std::size_t steps = 1;
+    while (!prefill.step(logits)) steps++;
+    assert(steps == 3);
+    expect_close(logits, last, 1e-3f, "chunked prefill");
+
+    KVCache step_cache(layers);
+    for (std::size_t i = 0; i < n; i++) {
+        model.forward(std::span<const std::int32_t>(&tokens[i], 1), logits, step_cache, buf);
+        expect_close(logits, std::span<const float>(all_logits.data() + i * vocab, vocab), 1e-3f, "decode step");
+    }
+
+    step_cache.truncate(n - 3);
+    model.forward(std::span<const std::int32_t>(tokens).subspan(n - 3), logits, step_cache, buf);
+    expect_close(logits, last, 1e-3f, "truncate + recompute");
+}
+
+// every token routed at every layer lands in the hit counts, histogram and pair counts
+void test_routing_stats(GPTOSSModel& model) {
+    const ModelConfig& c = model.config();
+    const std::size_t n = 9, k = c.experts_per_token, layers = c.num_hidden_layers;
+    RoutingStats stats(layers, c.num_experts, k);
+    model.set_routing_stats(&stats);
+    KVCache cache(layers);
+    std::vector<float> logits(c.vocab_size);
+    const auto tokens = synthetic_tokens(n, c.vocab_size);
+    model.forward(std::span<const std::int32_t>(tokens).first(n - 1), logits, cache);
+    model.forward(std::span<const std::int32_t>(tokens).last(1), logits, cache);
+    model.set_routing_stats(nullptr);
+    model.forward(std::span<const std::int32_t>(tokens).last(1), logits, cache);
+
+    const RoutingSnapshot snap = stats.snapshot();
+    assert(snap.tokens == n);
+    assert(snap.batches == 2 * layers);
+    // a single token puts k experts at load 1 against an even share of k / E
+    assert(snap.max_imbalance >= static_cast<double>(c.num_experts) / static_cast<double>(k) - 1e-9);
+    std::uint64_t hits = 0, binned = 0, pairs = 0;
+    for (auto h : snap.hits) hits += h;
+    for (auto b : snap.weight_histogram) binned += b;
+    for (auto p : snap.coactivation) pairs += p;
+    assert(hits == n * layers * k);
+    assert(binned == hits);
+    assert(pairs == n * layers * k * (k - 1) / 2);
+
+    const auto path = std::filesystem::temp_directory_path() / "gptoss_routing_stats.json";
+    stats.write_json(path.string());
+    assert(std::filesystem::file_size(path) > 0);
+    std::filesystem::remove(path);
+    stats.reset();
+    assert(stats.snapshot().tokens == 0);
+}
+
+// ids past the embedding table are an error, not an out-of-bounds read
+void test_token_range(const GPTOSSModel& model) {
+    const std::int32_t vocab = static_cast<std::int32_t>(model.config().vocab_size);
+    std::vector<float> hidden(model.config().hidden_size);
+    for (std::int32_t id : {vocab, -1}) {
+        bool threw = false;
+        try {
+            model.embed(std::span<const std::int32_t>(&id, 1), hidden);
+        } catch (const std::runtime_error& e) {
+            threw = std::string(e.what()).find("outside vocab") != std::string::npos;
+        }
+        assert(threw);
+    }
+}
+
+// logits must be whole vocab rows and no more of them than tokens, and forward() checks before
+// touching the cache
+void test_logits_shape(const GPTOSSModel& model) {
+    const std::size_t vocab = model.config().vocab_size;
+    const auto tokens = synthetic_tokens(2, vocab);
+    for (std::size_t size : {vocab + 1, 3 * vocab, vocab - 1}) {
+        KVCache cache(model.config().num_hidden_layers);
+        std::vector<float> logits(size);
+        bool threw = false;
+        try {
+            model.forward(tokens, logits, cache);
+        } catch (const std::runtime_error& e) {
+            threw = std::string(e.what()).find("rows of") != std::string::npos;
+        }
+        assert(threw && cache.seq_len == 0);
+    }
+
+    ForwardBuffers buf;
+    std::vector<float> hidden(2 * model.config().hidden_size), logits(3 * vocab);
+    bool threw = false;
+    try {
+        model.unembed(hidden, 2, logits, buf);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    model.unembed(hidden, 2, std::span<float>(), buf);
+}
+
+void test_synthetic_model() {
+    const auto synth = make_synthetic_model("gptoss_model_test", 2, 7);
+    const ModelConfig& config = synth.config();
+    const ModelConfig written = synthetic_config();
+    assert(config.num_hidden_layers == written.num_hidden_layers);
+    assert(config.hidden_size == written.hidden_size);
+    assert(config.rope_theta == written.rope_theta);
+    assert(synth.checkpoint().num_layers() == config.num_hidden_layers);
+
+    test_forward_consistency(synth.model());
+    test_routing_stats(synth.model());
+    test_token_range(synth.model());
+    test_logits_shape(synth.model());
+}
+
+}  // namespace
+
+int main() {
+    try {
+        test_synthetic_model();
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "model tests failed: " << e.what() << std::endl;
+        return 1;
+    }
+}
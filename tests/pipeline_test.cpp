@@ -0,0 +1,140 @@
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "checkpoint.h"
+#include "kv_cache.h"
+#include "model.h"
+#include "model_config.h"
+#include "pipeline.h"
+#include "routing_stats.h"
+#include "synthetic.h"
+#include "test_util.h"
+
+namespace {
+
+// a layer range model chained by hand gives the full model's logits
+void test_layer_ranges(Checkpoint& checkpoint, const ModelConfig& c) {
+    const GPTOSSModel full(checkpoint, c);
+    const GPTOSSModel head(checkpoint, c, {.layer_end = 1});
+    const GPTOSSModel tail(checkpoint, c, {.layer_begin = 1});
+    assert(head.has_embedding() && !head.has_unembedding() && head.layer_end() == 1);
+    assert(!tail.has_embedding() && tail.has_unembedding() && tail.layer_begin() == 1);
+
+    const auto tokens = synthetic_tokens(6, c.vocab_size, 0);
+    KVCache full_cache(c.num_hidden_layers), head_cache(c.num_hidden_layers), tail_cache(c.num_hidden_layers);
+    std::vector<float> expected(c.vocab_size), logits(c.vocab_size), hidden(tokens.size() * c.hidden_size);
+    full.forward(tokens, expected, full_cache);
+    ForwardBuffers buf;
+    head.embed(tokens, hidden);
+    head.forward_layers(hidden, tokens.size(), head_cache, buf);
+    tail.forward_layers(hidden, tokens.size(), tail_cache, buf);
+    tail.unembed(hidden, tokens.size(), logits, buf);
+    expect_close(logits, expected, 1e-4f, "layer ranges");
+    assert(head_cache.seq_len == tokens.size() && tail_cache.seq_len == tokens.size());
+}
+
+// a stage without layer 0 still counts the tokens it routes, and stages sharing one stats
+// object count them once
+void test_stage_routing_stats(Checkpoint& checkpoint, const ModelConfig& c) {
+    GPTOSSModel head(checkpoint, c, {.layer_end = 1});
+    GPTOSSModel tail(checkpoint, c, {.layer_begin = 1});
+    const auto tokens = synthetic_tokens(5, c.vocab_size, 2);
+    for (const bool shared : {false, true}) {
+        RoutingStats stats(c.num_hidden_layers, c.num_experts, c.experts_per_token);
+        tail.set_routing_stats(&stats);
+        if (shared) head.set_routing_stats(&stats);
+        KVCache head_cache(c.num_hidden_layers), tail_cache(c.num_hidden_layers);
+        std::vector<float> hidden(tokens.size() * c.hidden_size);
+        ForwardBuffers buf;
+        head.embed(tokens, hidden);
+        head.forward_layers(hidden, tokens.size(), head_cache, buf);
+        tail.forward_layers(hidden, tokens.size(), tail_cache, buf);
+        assert(stats.snapshot().tokens == tokens.size());
+        head.set_routing_stats(nullptr);
+        tail.set_routing_stats(nullptr);
+    }
+}
+
+// Three sequences go through the pipeline as micro-batches, a prefill round then a few
+// decode rounds, and land on what the whole model gives for each of them.
+void test_matches_model(Checkpoint& checkpoint, const ModelConfig& c, const PipelineOptions& options) {
+    const std::size_t num_seqs = 3, prompt_len = 5, decode = 3, vocab = c.vocab_size;
+    const GPTOSSModel model(checkpoint, c);
+    PipelineParallel pipeline(checkpoint, c, {}, options);
+    assert(pipeline.num_stages() == options.num_stages);
+    assert(pipeline.stage_layers(0).first == 0 &&
+           pipeline.stage_layers(options.num_stages - 1).second == c.num_hidden_layers);
+
+    std::vector<std::vector<std::int32_t>> seqs;
+    for (std::size_t s = 0; s < num_seqs; s++) seqs.push_back(synthetic_tokens(prompt_len + decode, vocab, s));
+    std::vector<std::vector<float>> expected(num_seqs, std::vector<float>((prompt_len + decode) * vocab));
+    for (std::size_t s = 0; s < num_seqs; s++) {
+        KVCache cache(c.num_hidden_layers);
+        model.forward(seqs[s], expected[s], cache);
+    }
+
+    std::vector<std::vector<float>> logits(num_seqs, std::vector<float>(vocab));
+    std::vector<PipelineParallel::MicroBatch> batches;
+    for (std::size_t s = 0; s < num_seqs; s++) {
+        batches.push_back({static_cast<std::uint32_t>(s), std::span<const std::int32_t>(seqs[s]).first(prompt_len),
+                           logits[s]});
+    }
+    pipeline.forward(batches);
+    for (std::size_t s = 0; s < num_seqs; s++) {
+        expect_close(logits[s], std::span<const float>(expected[s]).subspan((prompt_len - 1) * vocab, vocab), 1e-3f,
+                     "pipeline prefill");
+    }
+    for (std::size_t step = 0; step < decode; step++) {
+        const std::size_t pos = prompt_len + step;
+        for (std::size_t s = 0; s < num_seqs; s++) batches[s].tokens = std::span<const std::int32_t>(&seqs[s][pos], 1);
+        pipeline.forward(batches);
+        for (std::size_t s = 0; s < num_seqs; s++) {
+            expect_close(logits[s], std::span<const float>(expected[s]).subspan(pos * vocab, vocab), 1e-3f,
+                         "pipeline decode");
+        }
+    }
+
+    const PipelineStats& stats = pipeline.stats();
+    assert(stats.micro_batches == num_seqs * (decode + 1));
+    for (std::uint64_t busy : stats.busy_ns) assert(busy > 0);
+    assert(stats.bubble_fraction() >= 0.0 && stats.bubble_fraction() < 1.0);
+    for (std::size_t rss : pipeline.stage_rss_bytes()) assert(rss > 0);
+
+    // a released sequence starts over from an empty cache
+    pipeline.release(0);
+    batches.resize(1);
+    batches[0].tokens = std::span<const std::int32_t>(seqs[0]).first(prompt_len);
+    pipeline.forward(batches);
+    expect_close(logits[0], std::span<const float>(expected[0]).subspan((prompt_len - 1) * vocab, vocab), 1e-3f,
+                 "pipeline after release");
+}
+
+void test_synthetic_model() {
+    const auto synth = make_synthetic_model("gptoss_pipeline_test", 4, 5);
+    Checkpoint& checkpoint = synth.checkpoint();
+    const ModelConfig& config = synth.config();
+
+    test_layer_ranges(checkpoint, config);
+    test_stage_routing_stats(checkpoint, config);
+    test_matches_model(checkpoint, config, {.num_stages = 1});
+    test_matches_model(checkpoint, config, {.num_stages = 2, .ring_bytes = 8192});
+    // uneven 1/1/2 split over sockets
+    test_matches_model(checkpoint, config, {.num_stages = 3, .transport = TransportKind::Socket});
+}
+
+}  // namespace
+
+int main() {
+    try {
+        test_synthetic_model();
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "pipeline tests failed: " << e.what() << std::endl;
+        return 1;
+    }
+}
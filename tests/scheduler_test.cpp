@@ -0,0 +1,183 @@
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "kernels.h"
+#include "kv_cache.h"
+#include "model.h"
+#include "scheduler.h"
+#include "synthetic.h"
+
+namespace {
+
+// plain greedy decode of one sequence on its own
+std::vector<std::int32_t> reference(const GPTOSSModel& model, std::vector<std::int32_t> tokens, std::size_t n) {
+    KVCache cache(model.config().num_hidden_layers);
+    std::vector<float> logits(model.config().vocab_size);
+    model.forward(tokens, logits, cache);
+    for (std::size_t i = 0; i < n; i++) {
+        tokens.push_back(argmax(logits));
+        if (i + 1 < n) model.forward(std::span<const std::int32_t>(&tokens.back(), 1), logits, cache);
+    }
+    return tokens;
+}
+
+void expect_tokens(const Scheduler::Sequence& seq, const std::vector<std::int32_t>& expected) {
+    if (seq.state != SequenceState::Finished || seq.tokens != expected) {
+        throw std::runtime_error("sequence " + std::to_string(seq.id) + " doesn't match its solo decode");
+    }
+}
+
+// more sequences than the budget holds, each arrival more urgent than the last so it
+// pushes a running one out: they all finish with the tokens they'd get alone, and the
+// KV actually resident (vector capacity included) never goes over
+void test_budget(const GPTOSSModel& model, EvictionPolicy policy, std::size_t step_tokens = 0) {
+    const std::size_t vocab = model.config().vocab_size, new_tokens = 6;
+    std::vector<std::vector<std::int32_t>> prompts, expected;
+    for (std::size_t s = 0; s < 5; s++) {
+        prompts.push_back(synthetic_tokens(6 + s, vocab, s));
+        expected.push_back(reference(model, prompts.back(), new_tokens));
+    }
+    SchedulerOptions options{.max_running = 4, .prefill_chunk = 4, .max_step_tokens = step_tokens, .eviction = policy};
+    Scheduler probe(model);
+    options.kv_budget_bytes = probe.kv_bytes(2 * (10 + new_tokens) + 4);
+    Scheduler scheduler(model, options);
+
+    std::vector<std::uint64_t> ids;
+    for (std::size_t s = 0; s < prompts.size(); s++) {
+        ids.push_back(scheduler.submit(
+            {.prompt = prompts[s], .max_new_tokens = new_tokens, .priority = static_cast<int>(s)}));
+        scheduler.step();
+        scheduler.step();
+    }
+    scheduler.run_until_idle();
+    for (std::size_t s = 0; s < ids.size(); s++) expect_tokens(scheduler.sequence(ids[s]), expected[s]);
+
+    const SchedulerStats& stats = scheduler.stats();
+    assert(stats.admitted == 5 && stats.finished == 5 && stats.rejected == 0);
+    assert(stats.peak_resident_bytes <= options.kv_budget_bytes);
+    assert(scheduler.resident_bytes() == 0);
+    if (policy == EvictionPolicy::Swap) {
+        assert(stats.swap_outs > 0 && stats.swap_ins == stats.swap_outs && stats.recomputes == 0);
+        assert(stats.swap_bytes > 0);
+    }
+    if (policy == EvictionPolicy::Recompute) {
+        assert(stats.recomputes > 0 && stats.recomputed_tokens > 0 && stats.swap_outs == 0);
+    }
+    assert(!scheduler.step());
+}
+
+// a high-priority arrival preempts the low-priority sequence holding the memory and
+// finishes first
+void test_priority(const GPTOSSModel& model) {
+    const std::size_t vocab = model.config().vocab_size;
+    const auto low_prompt = synthetic_tokens(10, vocab, 3), high_prompt = synthetic_tokens(9, vocab, 4);
+    Scheduler probe(model);
+    Scheduler scheduler(model, {.kv_budget_bytes = probe.kv_bytes(20), .eviction = EvictionPolicy::Swap});
+
+    const auto low = scheduler.submit({.prompt = low_prompt, .max_new_tokens = 10});
+    for (int i = 0; i < 3; i++) scheduler.step();
+    assert(scheduler.sequence(low).state == SequenceState::Running && scheduler.sequence(low).generated == 3);
+    const auto high = scheduler.submit({.prompt = high_prompt, .max_new_tokens = 4, .priority = 1});
+    scheduler.step();
+    assert(scheduler.sequence(low).state == SequenceState::Swapped);
+    scheduler.run_until_idle();
+
+    expect_tokens(scheduler.sequence(low), reference(model, low_prompt, 10));
+    expect_tokens(scheduler.sequence(high), reference(model, high_prompt, 4));
+    assert(scheduler.sequence(high).token_times.back() < scheduler.sequence(low).token_times.back());
+    assert(scheduler.sequence(low).preemptions == 1 && scheduler.sequence(high).preemptions == 0);
+    assert(scheduler.stats().peak_resident_bytes <= probe.kv_bytes(20));
+}
+
+void test_admission(const GPTOSSModel& model) {
+    const std::size_t vocab = model.config().vocab_size;
+    Scheduler probe(model);
+    Scheduler scheduler(model, {.kv_budget_bytes = probe.kv_bytes(16), .prefill_tokens_per_s = 100.0});
+    const auto now = Scheduler::Clock::now();
+
+    // can never fit
+    const auto big = scheduler.submit({.prompt = synthetic_tokens(12, vocab, 0), .max_new_tokens = 8});
+    // 10 tokens of prefill at 100 tok/s can't be done within a millisecond
+    const auto late = scheduler.submit({.prompt = synthetic_tokens(10, vocab, 1),
+                                        .max_new_tokens = 2,
+                                        .deadline = now + std::chrono::milliseconds(1)});
+    const auto fine = scheduler.submit(
+        {.prompt = synthetic_tokens(10, vocab, 1), .max_new_tokens = 2, .deadline = now + std::chrono::hours(1)});
+    if (scheduler.sequence(big).state != SequenceState::Rejected ||
+        scheduler.sequence(late).state != SequenceState::Rejected ||
+        scheduler.sequence(fine).state != SequenceState::Waiting) {
+        throw std::runtime_error("admission should turn down the oversized and the late request only");
+    }
+    assert(scheduler.stats().rejected == 2 && scheduler.stats().admitted == 1);
+
+    bool threw = false;
+    try {
+        scheduler.release(fine);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    scheduler.run_until_idle();
+    assert(scheduler.stats().deadline_misses == 0);
+    scheduler.release(fine);
+    scheduler.release(big);
+    threw = false;
+    try {
+        scheduler.sequence(fine);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    assert(parse_eviction_policy("recompute") == EvictionPolicy::Recompute);
+}
+
+// a named swap file is always created fresh, never written through an existing one
+void test_swap_file(const GPTOSSModel& model) {
+    const auto path = std::filesystem::temp_directory_path() / "gptoss_scheduler_test_swap";
+    std::filesystem::remove(path);
+    { Scheduler scheduler(model, {.swap_path = path.string()}); }
+    assert(!std::filesystem::exists(path));
+    std::ofstream(path) << "keep";
+    bool threw = false;
+    try {
+        Scheduler scheduler(model, {.swap_path = path.string()});
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw && std::filesystem::file_size(path) == 4);
+    std::filesystem::remove(path);
+}
+
+void test_synthetic_model() {
+    const auto synth = make_synthetic_model("gptoss_scheduler_test", 2, 11);
+    const GPTOSSModel& model = synth.model();
+
+    test_budget(model, EvictionPolicy::Swap);
+    test_budget(model, EvictionPolicy::Recompute);
+    test_budget(model, EvictionPolicy::Auto);
+    // chunks cut short by the per-step cap
+    test_budget(model, EvictionPolicy::Auto, 5);
+    test_priority(model);
+    test_admission(model);
+    test_swap_file(model);
+}
+
+}  // namespace
+
+int main() {
+    try {
+        test_synthetic_model();
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "scheduler tests failed: " << e.what() << std::endl;
+        return 1;
+    }
+}
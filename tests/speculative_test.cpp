@@ -0,0 +1,89 @@
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "kernels.h"
+#include "kv_cache.h"
+#include "model.h"
+#include "speculative.h"
+#include "synthetic.h"
+
+namespace {
+
+// the most recent match of the longest trailing n-gram wins
+void test_draft() {
+    const std::vector<std::int32_t> context{1, 2, 3, 9, 1, 2, 3, 7, 5, 1, 2, 3};
+    assert((prompt_lookup_draft(context, 3, 1, 3) == std::vector<std::int32_t>{7, 5, 1}));
+    assert((prompt_lookup_draft(context, 3, 1, 8) == std::vector<std::int32_t>{7, 5, 1, 2, 3}));
+    // 3-grams required, the trailing 2-gram 9,4 doesn't help
+    assert(prompt_lookup_draft(std::vector<std::int32_t>{4, 9, 4}, 3, 3, 4).empty());
+    assert((prompt_lookup_draft(std::vector<std::int32_t>{5, 6, 5}, 3, 1, 4) == std::vector<std::int32_t>{6, 5}));
+    assert(prompt_lookup_draft(std::vector<std::int32_t>{1, 2, 3}, 3, 1, 4).empty());
+}
+
+// plain greedy decode, one token per forward
+std::vector<std::int32_t> greedy(const GPTOSSModel& model, const std::vector<std::int32_t>& prompt, std::size_t n) {
+    KVCache cache(model.config().num_hidden_layers);
+    std::vector<float> logits(model.config().vocab_size);
+    model.forward(prompt, logits, cache);
+    std::vector<std::int32_t> out;
+    while (out.size() < n) {
+        out.push_back(argmax(logits));
+        model.forward(std::span<const std::int32_t>(&out.back(), 1), logits, cache);
+    }
+    return out;
+}
+
+// The prompt is a seed, the model's own greedy continuation of it, then the seed again, so
+// the drafter has something the model agrees with to copy. Whatever gets drafted, the
+// tokens that come out are the ones plain greedy decoding gives, and the cache never keeps
+// a rejected position.
+void test_matches_greedy(const GPTOSSModel& model) {
+    const std::size_t vocab = model.config().vocab_size, n = 32;
+    const std::vector<std::int32_t> seed = synthetic_tokens(12, vocab);
+    std::vector<std::int32_t> prompt = seed;
+    for (std::int32_t t : greedy(model, seed, n)) prompt.push_back(t);
+    prompt.insert(prompt.end(), seed.begin(), seed.end());
+    const std::vector<std::int32_t> expected = greedy(model, prompt, n);
+
+    KVCache cache(model.config().num_hidden_layers);
+    std::vector<float> logits(vocab);
+    model.forward(prompt, logits, cache);
+    std::vector<std::int32_t> context = prompt;
+    context.push_back(argmax(logits));
+    PromptLookupDecoder decoder(model, cache, vocab, {.num_draft = 4});
+    while (context.size() < prompt.size() + n) {
+        for (std::int32_t token : decoder.step(context)) context.push_back(token);
+        if (cache.seq_len != context.size() - 1) {
+            throw std::runtime_error("kv cache holds " + std::to_string(cache.seq_len) + " positions for a context of " +
+                                     std::to_string(context.size()));
+        }
+    }
+    const std::vector<std::int32_t> got(context.begin() + static_cast<std::ptrdiff_t>(prompt.size()),
+                                        context.begin() + static_cast<std::ptrdiff_t>(prompt.size() + n));
+    if (got != expected) throw std::runtime_error("prompt-lookup output differs from greedy decoding");
+
+    const SpeculativeStats& stats = decoder.stats();
+    if (stats.accepted == 0) throw std::runtime_error("no draft token was ever accepted");
+    assert(stats.drafted >= stats.accepted);
+    assert(stats.generated == stats.accepted + stats.forwards);
+    assert(stats.forwards < n);
+}
+
+}  // namespace
+
+int main() {
+    try {
+        test_draft();
+        const auto synth = make_synthetic_model("gptoss_speculative_test", 2, 17);
+        test_matches_greedy(synth.model());
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "speculative tests failed: " << e.what() << std::endl;
+        return 1;
+    }
+}
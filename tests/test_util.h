@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <span>
+#include <stdexcept>
+#include <string>
+
+// Helpers shared by the tests; inputs come from synthetic.h.
+
+// a and b agree elementwise within tol, relative to |b| past 1, and a is finite
+inline void expect_close(std::span<const float> a, std::span<const float> b, float tol, const char* what) {
+    assert(a.size() == b.size());
+    for (std::size_t i = 0; i < a.size(); i++) {
+        if (!std::isfinite(a[i]) || std::fabs(a[i] - b[i]) > tol * (1.0f + std::fabs(b[i]))) {
+            throw std::runtime_error(std::string(what) + " mismatch at " + std::to_string(i) + ": " +
+                                     std::to_string(a[i]) + " vs " + std::to_string(b[i]));
+        }
+    }
+}
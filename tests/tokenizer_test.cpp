@@ -0,0 +1,291 @@
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "harmony.h"
+#include "pretokenizer.h"
+#include "tokenizer.h"
+#include "vocab.h"
+
+namespace {
+
+void expect_split(std::string_view text, const std::vector<std::string>& expected) {
+    const auto pieces = o200k_pretokenize(text);
+    std::vector<std::string> got(pieces.begin(), pieces.end());
+    if (got != expected) {
+        throw std::runtime_error("unexpected split for \"" + std::string(text) + "\"");
+    }
+}
+
+void test_fixed_splits() {
+    expect_split("hello my name is bob", {"hello", " my", " name", " is", " bob"});
+    expect_split("I'm here, they'LL see", {"I'm", " here", ",", " they'LL", " see"});
+    expect_split("HTTPServer 12345", {"HTTPServer", " ", "123", "45"});
+    expect_split("a  b\n\n  c", {"a", " ", " b", "\n\n", " ", " c"});
+    expect_split("x = y;\r\n", {"x", " =", " y", ";\r\n"});
+    expect_split("trailing   ", {"trailing", "   "});
+    expect_split("déjà vu Ωμέγα", {"déjà", " vu", " Ωμέγα"});
+}
+
+std::string base64_encode(std::string_view in) {
+    static const char* kChars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    std::size_t i = 0;
+    for (; i + 2 < in.size(); i += 3) {
+        const std::uint32_t v = (std::uint8_t(in[i]) << 16) | (std::uint8_t(in[i + 1]) << 8) | std::uint8_t(in[i + 2]);
+        for (int s = 18; s >= 0; s -= 6) out.push_back(kChars[(v >> s) & 0x3F]);
+    }
+    if (i < in.size()) {
+        std::uint32_t v = std::uint8_t(in[i]) << 16;
+        if (i + 1 < in.size()) v |= std::uint8_t(in[i + 1]) << 8;
+        out.push_back(kChars[(v >> 18) & 0x3F]);
+        out.push_back(kChars[(v >> 12) & 0x3F]);
+        out.push_back(i + 1 < in.size() ? kChars[(v >> 6) & 0x3F] : '=');
+        out.push_back('=');
+    }
+    return out;
+}
+
+std::string write_test_vocab(const std::string& path) {
+    std::vector<std::string> tokens;
+    for (int b = 0; b < 256; ++b) tokens.emplace_back(1, static_cast<char>(b));
+    for (const char* t : {"he", "ll", "hell", "hello", " w", " wo", "rld", " world"}) tokens.emplace_back(t);
+    std::ofstream out(path);
+    for (std::size_t i = 0; i < tokens.size(); ++i) out << base64_encode(tokens[i]) << ' ' << i << '\n';
+    return path;
+}
+
+// Chunked (parallel) encoding has to reproduce the serial pre-token stream exactly.
+void test_large_document_split() {
+    const auto dir = std::filesystem::temp_directory_path();
+    const std::string vocab_path = write_test_vocab((dir / "gptoss_large_test.tiktoken").string());
+    Tokenizer tokenizer(vocab_path);
+
+    static const char* kWords[] = {"hello", " world", "\n", "\r\n", "  ", "//", "x/", "42", "!",
+                                   "don't", " HTTP", "\n\n", " ", "é", "\t", "a", "/\n"};
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<std::size_t> pick(0, std::size(kWords) - 1);
+    for (int iter = 0; iter < 50; ++iter) {
+        std::string doc;
+        while (doc.size() < 4000) doc += kWords[pick(rng)];
+
+        const auto serial = o200k_pretokenize(doc);
+        std::vector<std::string_view> stitched;
+        for (std::size_t start = 0; start < doc.size();) {
+            std::size_t end = o200k_next_boundary(doc, start + 37);
+            o200k_pretokenize(std::string_view(doc).substr(start, end - start), stitched);
+            start = end;
+        }
+        if (stitched != serial) throw std::runtime_error("chunk boundary changed the pre-token split");
+
+        const auto ids = tokenizer.encode(doc);
+        if (tokenizer.encode_large(doc, 64) != ids || tokenizer.count_tokens(doc) != ids.size()) {
+            throw std::runtime_error("encode_large/count_tokens disagree with encode");
+        }
+    }
+    std::filesystem::remove(vocab_path);
+}
+
+void test_special_tokens() {
+    const auto dir = std::filesystem::temp_directory_path();
+    const std::string vocab_path = write_test_vocab((dir / "gptoss_special_test.tiktoken").string());
+    Tokenizer tokenizer(vocab_path);
+
+    const std::string chat = "<|start|>user<|message|>hello world<|end|><|start|>assistant";
+    bool threw = false;
+    try {
+        tokenizer.encode(chat);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    if (!threw) throw std::runtime_error("special token accepted without allow_special");
+
+    std::vector<std::int32_t> expected;
+    auto append_text = [&](std::string_view text) {
+        const auto ids = tokenizer.encode(text);
+        expected.insert(expected.end(), ids.begin(), ids.end());
+    };
+    expected.push_back(harmony::kStart);
+    append_text("user");
+    expected.push_back(harmony::kMessage);
+    append_text("hello world");
+    expected.push_back(harmony::kEnd);
+    expected.push_back(harmony::kStart);
+    append_text("assistant");
+
+    if (tokenizer.encode(chat, true) != expected) throw std::runtime_error("special token split mismatch");
+    if (tokenizer.encode_large(chat + chat, 8, true).size() != 2 * expected.size() ||
+        tokenizer.count_tokens(chat, true) != expected.size()) {
+        throw std::runtime_error("large/count special token handling mismatch");
+    }
+    // unknown <|...|> sequences are ordinary text
+    if (tokenizer.encode("<|nope|>").empty()) throw std::runtime_error("unknown marker dropped");
+    // a special name split by an unclosed "<|" is still found, and a long run of "<|" with
+    // one "|>" at the very end doesn't rescan the rest of the text for every "<|"
+    std::string opens;
+    for (int i = 0; i < 200000; ++i) opens += "<|x ";
+    const auto ids = tokenizer.encode(opens + "<|<|end|>", true);
+    if (ids.back() != harmony::kEnd || tokenizer.count_tokens(opens + "|>", true) == 0) {
+        throw std::runtime_error("special token after unclosed markers missed");
+    }
+
+    HarmonyPrompt prompt(tokenizer);
+    prompt.user("hello world").start_assistant();
+    if (prompt.tokens() != expected) throw std::runtime_error("harmony prompt mismatch");
+
+    std::string decoded;
+    for (std::int32_t id : expected) decoded += tokenizer.decode(id);
+    if (decoded != chat) throw std::runtime_error("special token decode mismatch");
+    std::filesystem::remove(vocab_path);
+}
+
+// "é" is two bytes; the test vocab only has single-byte tokens for it, so it arrives
+// split across two tokens and must not be released half-written.
+void test_streaming_detokenizer() {
+    const auto dir = std::filesystem::temp_directory_path();
+    const std::string vocab_path = write_test_vocab((dir / "gptoss_detok_test.tiktoken").string());
+    Tokenizer tokenizer(vocab_path);
+
+    const std::string text = "hello\xC3\xA9 world\xE2\x82\xAC";
+    const auto ids = tokenizer.encode(text);
+    DetokenizerState detok(tokenizer);
+    std::string streamed;
+    for (std::int32_t id : ids) {
+        streamed += detok.push(id);
+        // released text has to end on a codepoint boundary of the original
+        if (streamed.size() < text.size() && (static_cast<unsigned char>(text[streamed.size()]) & 0xC0) == 0x80) {
+            throw std::runtime_error("detokenizer released a partial codepoint");
+        }
+    }
+    streamed += detok.flush();
+    if (streamed != text || tokenizer.decode(ids) != text) throw std::runtime_error("detokenizer mismatch");
+    std::filesystem::remove(vocab_path);
+}
+
+void test_vocab_roundtrip() {
+    const auto dir = std::filesystem::temp_directory_path();
+    const std::string tiktoken_path = write_test_vocab((dir / "gptoss_test.tiktoken").string());
+    const std::string binary_path = (dir / "gptoss_test.vocab").string();
+
+    Vocab text_vocab(tiktoken_path);
+    text_vocab.save(binary_path);
+    Vocab mapped(binary_path);
+    if (!mapped.is_mapped() || mapped.size() != text_vocab.size()) {
+        throw std::runtime_error("binary vocab did not load");
+    }
+    for (std::size_t i = 0; i < text_vocab.size(); ++i) {
+        const auto id = static_cast<std::int32_t>(i);
+        const std::string_view token = text_vocab.token(id);
+        if (mapped.token(id) != token || mapped.rank(token) != id || text_vocab.rank(token) != id) {
+            throw std::runtime_error("vocab round trip mismatch at id " + std::to_string(i));
+        }
+    }
+    if (mapped.rank("not a token") != -1) throw std::runtime_error("vocab found a missing token");
+
+    // corrupt tables are refused up front instead of read out of bounds later
+    std::string bytes;
+    {
+        std::ifstream in(binary_path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    const auto corrupt = [&](std::size_t offset, std::uint32_t value, const char* what) {
+        std::string copy = bytes;
+        std::memcpy(copy.data() + offset, &value, sizeof(value));
+        std::ofstream(binary_path, std::ios::binary | std::ios::trunc).write(copy.data(), copy.size());
+        try {
+            Vocab bad(binary_path);
+        } catch (const std::runtime_error&) {
+            return;
+        }
+        throw std::runtime_error(std::string("vocab accepted ") + what);
+    };
+    const std::size_t header = 32, count = text_vocab.size();
+    corrupt(16, 0, "zero slots");
+    corrupt(16, 64, "a table with less than 2 slots per token");
+    corrupt(header + 4, 1u << 30, "an offset past the arena");
+    corrupt(header + 8, 0, "decreasing offsets");
+    corrupt(header + 4 * count, 1, "offsets that end short of the arena");
+    corrupt(header + 4 * (count + 1), static_cast<std::uint32_t>(count + 1), "a slot past the last id");
+    std::filesystem::remove(tiktoken_path);
+    std::filesystem::remove(binary_path);
+}
+
+#ifdef GPTOSS_HAVE_ICU
+void append_utf8(std::string& out, std::uint32_t cp) {
+    if (cp < 0x80) {
+        out.push_back(static_cast<char>(cp));
+    } else if (cp < 0x800) {
+        out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else {
+        out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+}
+
+// Random strings biased towards the characters the pattern cares about.
+void test_icu_parity() {
+    static const std::uint32_t kInteresting[] = {
+        ' ', ' ', ' ', '\n', '\r', '\t', '\'', '/', 's', 'S', 'l', 'L', 'e', 'r', 'v', 'd', 'm', 't',
+        'a', 'Z', '0', '7', '!', '.', '-', 0xA0, 0x3000, 0x2028, 0x85, 0x17F, 0x1C5, 0x2B0, 0x5D0,
+        0x300, 0x301, 0x903, 0x488, 0x660, 0x2160, 0xB2, 0xE9, 0xC9, 0x4E2D, 0x1F600, 0xE0100,
+    };
+    std::mt19937 rng(1234);
+    // long strings keep the number of (slow) ICU pattern compiles down
+    std::uniform_int_distribution<int> len_dist(0, 2000);
+    std::uniform_int_distribution<int> kind_dist(0, 9);
+    std::uniform_int_distribution<std::size_t> pick(0, std::size(kInteresting) - 1);
+    std::uniform_int_distribution<std::uint32_t> any_cp(0, 0x10FFFF);
+    std::uniform_int_distribution<std::uint32_t> bmp(0x80, 0xFFFF);
+
+    for (int iter = 0; iter < 500; ++iter) {
+        std::string text;
+        const int len = len_dist(rng);
+        for (int i = 0; i < len; ++i) {
+            const int kind = kind_dist(rng);
+            std::uint32_t cp = kind < 6 ? kInteresting[pick(rng)] : kind < 8 ? bmp(rng) : any_cp(rng);
+            if (cp >= 0xD800 && cp <= 0xDFFF) cp = 'x';
+            append_utf8(text, cp);
+        }
+        const auto expected = icu_regex_split(text, kO200kPattern);
+        const auto pieces = o200k_pretokenize(text);
+        std::vector<std::string> got(pieces.begin(), pieces.end());
+        if (got != expected) {
+            throw std::runtime_error("ICU parity mismatch on fuzz case " + std::to_string(iter));
+        }
+    }
+}
+#endif
+
+}  // namespace
+
+int main() {
+    try {
+        test_fixed_splits();
+        test_vocab_roundtrip();
+        test_large_document_split();
+        test_special_tokens();
+        test_streaming_detokenizer();
+#ifdef GPTOSS_HAVE_ICU
+        test_icu_parity();
+#endif
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "tokenizer tests failed: " << e.what() << std::endl;
+        return 1;
+    }
+}
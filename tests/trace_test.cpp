@@ -0,0 +1,111 @@
+#include <cassert>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "kernels.h"
+#include "trace.h"
+
+namespace {
+
+std::size_t count(const std::string& haystack, const std::string& needle) {
+    std::size_t n = 0;
+    for (std::size_t pos = haystack.find(needle); pos != std::string::npos; pos = haystack.find(needle, pos + 1)) n++;
+    return n;
+}
+
+void test_zones() {
+    static_assert(trace::kCompiledIn);
+    trace::clear();
+    {
+        // not started yet, nothing is recorded
+        GPTOSS_TRACE_SCOPE("ignored");
+    }
+    assert(trace::event_count() == 0);
+
+    trace::start({.hardware_counters = true});
+    const std::size_t hidden = 64;
+    std::vector<float> x(2 * hidden, 1.0f), out(2 * hidden);
+    std::vector<std::uint16_t> scale(hidden, 0x3F80);  // bf16 1.0
+    for (int i = 0; i < 3; i++) {
+        GPTOSS_TRACE_SCOPE("outer");
+        rmsnorm(x, scale, 1e-5f, hidden, out);
+    }
+#pragma omp parallel
+    {
+        GPTOSS_TRACE_SCOPE("worker \"quoted\"");
+    }
+    trace::stop();
+    assert(trace::event_count() >= 7);
+
+    const auto path = std::filesystem::temp_directory_path() / "gptoss_trace_test.json";
+    trace::write_chrome_json(path.string());
+    std::stringstream json;
+    json << std::ifstream(path).rdbuf();
+    std::filesystem::remove(path);
+    assert(json.str().rfind("{\"displayTimeUnit\"", 0) == 0);
+    assert(count(json.str(), "\"name\": \"outer\"") == 3);
+    assert(count(json.str(), "\"name\": \"rmsnorm\"") == 3);
+    assert(count(json.str(), "worker \\\"quoted\\\"") >= 1);
+
+    std::ostringstream summary;
+    trace::write_summary(summary);
+    assert(summary.str().find("outer") != std::string::npos);
+    assert(summary.str().find("rmsnorm") != std::string::npos);
+}
+
+// a full ring keeps the newest events
+void test_ring_wraps() {
+    trace::clear();
+    trace::start({.ring_capacity = 4});
+    std::thread([] {
+        for (int i = 0; i < 10; i++) {
+            GPTOSS_TRACE_SCOPE("wrapped");
+        }
+    }).join();
+    trace::stop();
+    std::ostringstream summary;
+    trace::write_summary(summary);
+    assert(summary.str().find("wrapped") != std::string::npos);
+    assert(trace::event_count() == 4);
+}
+
+#if defined(__linux__)
+std::size_t open_fds() {
+    std::size_t n = 0;
+    for ([[maybe_unused]] const auto& entry : std::filesystem::directory_iterator("/proc/self/fd")) n++;
+    return n;
+}
+#endif
+
+// a thread that recorded with counters gives all of its perf fds back when it exits
+void test_counter_fds_closed() {
+#if defined(__linux__)
+    const std::size_t before = open_fds();
+    trace::start({.hardware_counters = true});
+    for (int i = 0; i < 3; i++) {
+        std::thread([] { GPTOSS_TRACE_SCOPE("counted"); }).join();
+    }
+    trace::stop();
+    assert(open_fds() == before);
+#endif
+}
+
+}  // namespace
+
+int main() {
+    try {
+        test_zones();
+        test_ring_wraps();
+        test_counter_fds_closed();
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "trace tests failed: " << e.what() << std::endl;
+        return 1;
+    }
+}
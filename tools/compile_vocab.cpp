@@ -0,0 +1,24 @@
+// One-time conversion of a .tiktoken vocabulary into the binary vocab the Tokenizer
+// can mmap at startup.
+//
+//   ./build/gptoss-vocab gpt-oss-20b-model/o200k_base.tiktoken gpt-oss-20b-model/o200k_base.vocab
+#include <iostream>
+#include <string>
+
+#include "vocab.h"
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        std::cerr << "usage: " << argv[0] << " <in.tiktoken> <out.vocab>" << std::endl;
+        return 1;
+    }
+    try {
+        Vocab vocab(argv[1]);
+        vocab.save(argv[2]);
+        std::cout << "wrote " << vocab.size() << " tokens to " << argv[2] << std::endl;
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "gptoss-vocab failed: " << e.what() << std::endl;
+        return 1;
+    }
+}
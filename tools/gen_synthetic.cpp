@@ -0,0 +1,61 @@
+// Writes a random checkpoint with the real gpt-oss tensor names and a matching config.json,
+// for running the model and benchmarks without the 13 GB download. Shape flags override
+// the small default; --preset 20b gives the full 20b shape (pair it with --layers).
+// The default vocab is only 4096, so pass --vocab 201088 when a real tokenizer drives it.
+//
+//   ./build/gptoss-synth synthetic-model --layers 4 --experts 8 --vocab 201088
+//   ./build/gptoss --model synthetic-model --tokenizer gpt-oss-20b-model/o200k_base.tiktoken
+#include <iostream>
+#include <string>
+
+#include "synthetic.h"
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0]
+                  << " <out_dir> [--preset 20b|120b] [--layers n] [--experts n] [--experts-per-token n]"
+                     " [--vocab n] [--hidden n] [--intermediate n] [--heads n] [--kv-heads n] [--seed n]"
+                  << std::endl;
+        return 1;
+    }
+    try {
+        const std::string dir = argv[1];
+        ModelConfig config = synthetic_config();
+        std::uint64_t seed = 1;
+        for (int i = 2; i < argc; ++i) {
+            const std::string arg = argv[i];
+            if (i + 1 >= argc) throw std::runtime_error("missing value for " + arg);
+            const std::string value = argv[++i];
+            if (arg == "--preset") {
+                config = value == "120b" ? ModelConfig::gpt_oss_120b() : ModelConfig::gpt_oss_20b();
+            } else if (arg == "--layers") {
+                config.num_hidden_layers = std::stoul(value);
+            } else if (arg == "--experts") {
+                config.num_experts = std::stoul(value);
+            } else if (arg == "--experts-per-token") {
+                config.experts_per_token = std::stoul(value);
+            } else if (arg == "--vocab") {
+                config.vocab_size = std::stoul(value);
+            } else if (arg == "--hidden") {
+                config.hidden_size = std::stoul(value);
+            } else if (arg == "--intermediate") {
+                config.intermediate_size = std::stoul(value);
+            } else if (arg == "--heads") {
+                config.num_attention_heads = std::stoul(value);
+            } else if (arg == "--kv-heads") {
+                config.num_key_value_heads = std::stoul(value);
+            } else if (arg == "--seed") {
+                seed = std::stoull(value);
+            } else {
+                throw std::runtime_error("unknown flag " + arg);
+            }
+        }
+        write_synthetic_checkpoint(dir, config, seed);
+        std::cout << "wrote " << config.num_hidden_layers << " layers, " << config.num_experts << " experts, hidden "
+                  << config.hidden_size << ", vocab " << config.vocab_size << " to " << dir << std::endl;
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "gptoss-synth failed: " << e.what() << std::endl;
+        return 1;
+    }
+}
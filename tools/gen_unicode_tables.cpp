@@ -0,0 +1,100 @@
+// Emits src/unicode_tables.inc: the character classes the o200k pre-tokenizer needs,
+// taken from ICU so the native splitter agrees with the ICU regex it replaces.
+//
+//   ./build/gptoss-unicode-tables > src/unicode_tables.inc
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <vector>
+
+#include <unicode/uchar.h>
+#include <unicode/uversion.h>
+
+#include "unicode_classes.h"
+
+namespace {
+
+constexpr std::uint32_t kTableLimit = 0x40000;
+constexpr std::uint32_t kBlockShift = 7;
+constexpr std::uint32_t kBlockSize = 1u << kBlockShift;
+
+std::uint8_t classify(UChar32 cp) {
+    std::uint8_t bits = 0;
+    if (u_isUWhiteSpace(cp)) bits |= kUcSpace;
+    if (cp == '\r' || cp == '\n') bits |= kUcNewline;
+    switch (u_charType(cp)) {
+        case U_UPPERCASE_LETTER:
+        case U_TITLECASE_LETTER:
+            bits |= kUcLetter | kUcUpperSet;
+            break;
+        case U_LOWERCASE_LETTER:
+            bits |= kUcLetter | kUcLowerSet;
+            break;
+        case U_MODIFIER_LETTER:
+        case U_OTHER_LETTER:
+            bits |= kUcLetter | kUcUpperSet | kUcLowerSet;
+            break;
+        case U_NON_SPACING_MARK:
+        case U_ENCLOSING_MARK:
+        case U_COMBINING_SPACING_MARK:
+            bits |= kUcUpperSet | kUcLowerSet;
+            break;
+        case U_DECIMAL_DIGIT_NUMBER:
+        case U_LETTER_NUMBER:
+        case U_OTHER_NUMBER:
+            bits |= kUcNumber;
+            break;
+        default:
+            break;
+    }
+    return bits;
+}
+
+}  // namespace
+
+int main() {
+    std::vector<std::uint16_t> stage1;
+    std::vector<std::uint8_t> stage2;
+    std::map<std::vector<std::uint8_t>, std::uint16_t> seen;
+    for (std::uint32_t base = 0; base < kTableLimit; base += kBlockSize) {
+        std::vector<std::uint8_t> block(kBlockSize);
+        for (std::uint32_t i = 0; i < kBlockSize; ++i) block[i] = classify(base + i);
+        auto [it, inserted] = seen.emplace(block, static_cast<std::uint16_t>(seen.size()));
+        if (inserted) stage2.insert(stage2.end(), block.begin(), block.end());
+        stage1.push_back(it->second);
+    }
+
+    struct Range {
+        std::uint32_t first, last;
+        std::uint8_t bits;
+    };
+    std::vector<Range> high;
+    for (std::uint32_t cp = kTableLimit; cp <= 0x10FFFF; ++cp) {
+        const std::uint8_t bits = classify(cp);
+        if (bits == 0) continue;
+        if (!high.empty() && high.back().last + 1 == cp && high.back().bits == bits) {
+            high.back().last = cp;
+        } else {
+            high.push_back({cp, cp, bits});
+        }
+    }
+
+    std::printf("// Generated by tools/gen_unicode_tables.cpp from ICU %s (Unicode %s). Do not edit.\n",
+                U_ICU_VERSION, U_UNICODE_VERSION);
+    std::printf("constexpr std::uint32_t kUnicodeTableLimit = 0x%X;\n", kTableLimit);
+    std::printf("constexpr std::uint32_t kUnicodeBlockShift = %u;\n\n", kBlockShift);
+    std::printf("constexpr std::uint16_t kUnicodeStage1[%zu] = {", stage1.size());
+    for (std::size_t i = 0; i < stage1.size(); ++i) {
+        std::printf("%s%u,", i % 24 ? "" : "\n   ", stage1[i]);
+    }
+    std::printf("\n};\n\nconstexpr std::uint8_t kUnicodeStage2[%zu] = {", stage2.size());
+    for (std::size_t i = 0; i < stage2.size(); ++i) {
+        std::printf("%s%u,", i % 32 ? "" : "\n   ", stage2[i]);
+    }
+    std::printf("\n};\n\nconstexpr UnicodeRange kUnicodeHighRanges[%zu] = {\n", high.size());
+    for (const auto& r : high) {
+        std::printf("    {0x%X, 0x%X, %u},\n", r.first, r.last, r.bits);
+    }
+    std::printf("};\n");
+    return 0;
+}
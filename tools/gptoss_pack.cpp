@@ -0,0 +1,24 @@
+// One-time conversion of the safetensors checkpoint into the packed model file the runtime
+// can open without parsing anything.
+//
+//   ./build/gptoss-pack gpt-oss-20b-model/original/model.safetensors gpt-oss-20b-model/model.gptoss
+#include <iostream>
+#include <string>
+
+#include "checkpoint.h"
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        std::cerr << "usage: " << argv[0] << " <in.safetensors> <out.gptoss>" << std::endl;
+        return 1;
+    }
+    try {
+        Checkpoint checkpoint(argv[1]);
+        pack_checkpoint(checkpoint, argv[2]);
+        std::cout << "packed " << checkpoint.num_layers() << " layers into " << argv[2] << std::endl;
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "gptoss-pack failed: " << e.what() << std::endl;
+        return 1;
+    }
+}